@@ -75,6 +75,8 @@
 #include <memory>
 #include <cmath>
 #include <cstring>
+#include <vector>
+#include <algorithm>
 #ifdef _WINDOWS
 #include <windows.h>
 #endif
@@ -101,7 +103,7 @@
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
 #define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
 
-#define kSupportsTiles 0 // Histogram must be computed on the whole image
+#define kSupportsTiles 1 // The histogram is computed once per frame on the whole image (see computeStatistics())
 #define kSupportsMultiResolution 1
 #define kSupportsRenderScale 1
 #define kRenderThreadSafety eRenderFullySafe
@@ -133,6 +135,20 @@ struct CImgEqualizeParams
     int nb_levels;
     double min_value;
     double max_value;
+    std::vector<unsigned long> histogram; //!< cumulative histogram of the whole image
+};
+
+struct CImgEqualizeStatisticsKey
+{
+    CImgStatisticsKey key;
+    int nb_levels;
+    double min_value;
+    double max_value;
+
+    bool operator==(const CImgEqualizeStatisticsKey& other) const
+    {
+        return key == other.key && nb_levels == other.nb_levels && min_value == other.min_value && max_value == other.max_value;
+    }
 };
 
 class CImgEqualizePlugin : public CImgFilterPluginHelper<CImgEqualizeParams,false>
@@ -170,7 +186,37 @@ public:
     {
         // PROCESSING.
         // This is the only place where the actual processing takes place
-        cimg.equalize(params.nb_levels, params.min_value, params.max_value);
+        // equivalent to cimg.equalize(params.nb_levels, params.min_value, params.max_value) on the whole image
+        cimgEqualize(cimg, params.histogram, std::min(params.min_value, params.max_value), std::max(params.min_value, params.max_value));
+    }
+
+    virtual bool needsStatistics(const CImgEqualizeParams& /*params*/) OVERRIDE FINAL
+    {
+        return true;
+    }
+
+    virtual bool getStatistics(const CImgStatisticsKey& key, CImgEqualizeParams& params) OVERRIDE FINAL
+    {
+        return _histogramCache.get(statisticsKey(key, params), &params.histogram);
+    }
+
+    virtual void computeStatistics(const CImgStatisticsKey& key, const cimg_library::CImg<float>& cimg, CImgEqualizeParams& params) OVERRIDE FINAL
+    {
+        cimgCumulativeHistogram(cimg, std::max(params.nb_levels, 0),
+                                std::min(params.min_value, params.max_value), std::max(params.min_value, params.max_value),
+                                &params.histogram);
+        _histogramCache.set(statisticsKey(key, params), params.histogram);
+    }
+
+    virtual void beginSequenceRender(const OFX::BeginSequenceRenderArguments &/*args*/) OVERRIDE FINAL
+    {
+        // the source may have changed
+        _histogramCache.clear();
+    }
+
+    virtual void purgeCaches() OVERRIDE FINAL
+    {
+        _histogramCache.clear();
     }
 
     //virtual bool isIdentity(const OFX::IsIdentityArguments &/*args*/, const CImgEqualizeParams& /*params*/) OVERRIDE FINAL
@@ -180,10 +226,23 @@ public:
 
 private:
 
+    static CImgEqualizeStatisticsKey
+    statisticsKey(const CImgStatisticsKey& key, const CImgEqualizeParams& params)
+    {
+        CImgEqualizeStatisticsKey ret;
+        ret.key = key;
+        ret.nb_levels = params.nb_levels;
+        ret.min_value = params.min_value;
+        ret.max_value = params.max_value;
+        return ret;
+    }
+
     // params
     OFX::IntParam *_nb_levels;
     OFX::DoubleParam *_min_value;
     OFX::DoubleParam *_max_value;
+
+    CImgStatisticsCache<CImgEqualizeStatisticsKey, std::vector<unsigned long> > _histogramCache;
 };
 
 
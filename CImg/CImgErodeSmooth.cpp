@@ -75,6 +75,7 @@
 #include <memory>
 #include <cmath>
 #include <cstring>
+#include <vector>
 #ifdef _WINDOWS
 #include <windows.h>
 #endif
@@ -165,6 +166,101 @@ using namespace OFX;
 #define ERODESMOOTH_MIN 1.e-8 // minimum value for the weight
 #define ERODESMOOTH_OFFSET 0.1 // offset to the image values to avoid divisions by zero
 
+// x^n for n >= 0, by binary exponentiation (much faster than std::pow for the small exponents used here)
+static inline float
+ipow(float x, int n)
+{
+    float ret = 1.f;
+    while (n > 0) {
+        if (n & 1) {
+            ret *= x;
+        }
+        x *= x;
+        n >>= 1;
+    }
+    return ret;
+}
+
+// Apply the 0-order Deriche recursive filter along the given axis ('x' or 'y') to two images of the same size,
+// in a single sweep: the filter coefficients are computed once, and each line of num and den is filtered
+// in the same loop iteration.
+// This gives the same result as num.deriche(sigma,0,axis,boundary_conditions); den.deriche(sigma,0,axis,boundary_conditions);
+static void
+derichePair(cimg_library::CImg<float>& num,
+            cimg_library::CImg<float>& den,
+            float sigma,
+            char axis,
+            bool boundary_conditions)
+{
+    assert(num.width() == den.width() && num.height() == den.height() && num.depth() == 1 && den.depth() == 1 && num.spectrum() == den.spectrum());
+    if (num.is_empty() || sigma < 0.1f) {
+        return;
+    }
+    const float alpha = 1.695f/sigma;
+    const float ema = (float)std::exp(-alpha);
+    const float ema2 = (float)std::exp(-2*alpha);
+    const float b1 = -2*ema;
+    const float b2 = ema2;
+    const float k = (1-ema)*(1-ema)/(1+2*alpha*ema-ema2);
+    const float a0 = k;
+    const float a1 = k*(alpha-1)*ema;
+    const float a2 = k*(alpha+1)*ema;
+    const float a3 = -k*ema2;
+    const float coefp = (a0+a1)/(1+b1+b2);
+    const float coefn = (a2+a3)/(1+b1+b2);
+
+    const int N = (axis == 'x') ? num.width() : num.height();
+    const int nlines = ((axis == 'x') ? num.height() : num.width()) * num.spectrum();
+    const long off = (axis == 'x') ? 1 : num.width();
+
+#ifdef cimg_use_openmp
+#pragma omp parallel for if (num.size()>=4096)
+#endif
+    for (int l = 0; l < nlines; ++l) {
+        const int c = (axis == 'x') ? (l / num.height()) : (l / num.width());
+        const int i = (axis == 'x') ? (l % num.height()) : (l % num.width());
+        float *ptrN = (axis == 'x') ? num.data(0, i, 0, c) : num.data(i, 0, 0, c);
+        float *ptrD = (axis == 'x') ? den.data(0, i, 0, c) : den.data(i, 0, 0, c);
+        std::vector<float> Y(2 * N);
+        float *ptrYN = &Y[0];
+        float *ptrYD = &Y[N];
+        // causal pass
+        float xpN = 0.f, ybN = 0.f, ypN = 0.f;
+        float xpD = 0.f, ybD = 0.f, ypD = 0.f;
+        if (boundary_conditions) {
+            xpN = *ptrN; ybN = ypN = coefp*xpN;
+            xpD = *ptrD; ybD = ypD = coefp*xpD;
+        }
+        for (int m = 0; m < N; ++m, ptrN += off, ptrD += off) {
+            const float xcN = *ptrN;
+            const float xcD = *ptrD;
+            const float ycN = *(ptrYN++) = a0*xcN + a1*xpN - b1*ypN - b2*ybN;
+            const float ycD = *(ptrYD++) = a0*xcD + a1*xpD - b1*ypD - b2*ybD;
+            xpN = xcN; ybN = ypN; ypN = ycN;
+            xpD = xcD; ybD = ypD; ypD = ycD;
+        }
+        // anti-causal pass
+        float xnN = 0.f, xaN = 0.f, ynN = 0.f, yaN = 0.f;
+        float xnD = 0.f, xaD = 0.f, ynD = 0.f, yaD = 0.f;
+        if (boundary_conditions) {
+            xnN = xaN = *(ptrN-off); ynN = yaN = coefn*xnN;
+            xnD = xaD = *(ptrD-off); ynD = yaD = coefn*xnD;
+        }
+        for (int n = N-1; n >= 0; --n) {
+            ptrN -= off;
+            ptrD -= off;
+            const float xcN = *ptrN;
+            const float xcD = *ptrD;
+            const float ycN = a2*xnN + a3*xaN - b1*ynN - b2*yaN;
+            const float ycD = a2*xnD + a3*xaD - b1*ynD - b2*yaD;
+            xaN = xnN; xnN = xcN; yaN = ynN; ynN = ycN;
+            xaD = xnD; xnD = xcD; yaD = ynD; ynD = ycD;
+            *ptrN = *(--ptrYN) + ycN;
+            *ptrD = *(--ptrYD) + ycD;
+        }
+    }
+}
+
 /// ErodeSmooth plugin
 struct CImgErodeSmoothParams
 {
@@ -230,43 +326,58 @@ public:
         if (rmax == rmin) {
             return;
         }
-        // scale to [0,1]
-#ifdef cimg_use_openmp
-#pragma omp parallel for if (denom.size()>=4096)
-#endif
-        cimg_rof(cimg,ptrd,float) *ptrd = (*ptrd-rmin)/(rmax-rmin) + ERODESMOOTH_OFFSET;
-
         // see "Robust local max-min filters by normalized power-weighted filtering" by L.J. van Vliet
         // http://dx.doi.org/10.1109/ICPR.2004.1334273
         // compute blur(x^(P+1))/blur(x^P)
+        // The numerator is computed in place in cimg, and only the denominator needs an extra buffer.
+        cimg_library::CImg<float> denom(cimg.width(), cimg.height(), cimg.depth(), cimg.spectrum());
+        const float vmin = (float)std::pow((double)ERODESMOOTH_MIN, (double)1./params.exponent);
+        const float scale = (float)(1./(rmax-rmin));
+        const long siz = (long)cimg.size();
         {
-            cimg_library::CImg<float> denom(cimg, false);
-            const double vmin = std::pow((double)ERODESMOOTH_MIN, (double)1./params.exponent);
-            //printf("%g\n",vmin);
+            float *ptrn = cimg.data();
+            float *ptrd = denom.data();
+            // scale to [0,1], and compute x^(P+1) and x^P in a single pass
 #ifdef cimg_use_openmp
-#pragma omp parallel for if (denom.size()>=4096)
+#pragma omp parallel for if (siz>=4096)
 #endif
-            cimg_rof(denom,ptrd,float) *ptrd = std::pow((double)((*ptrd<0.?0.:*ptrd)+vmin), params.exponent); // C++98 and C++11 both have std::pow(double,int)
-
-            cimg.mul(denom);
+            for (long i = 0; i < siz; ++i) {
+                const float v = (ptrn[i] - (float)rmin) * scale + (float)ERODESMOOTH_OFFSET;
+                const float w = ipow((v < 0.f ? 0.f : v) + vmin, params.exponent);
+                ptrd[i] = w;
+                ptrn[i] = v * w;
+            }
+        }
 
 #if cimg_version >= 153
-            cimg.blur(s, (bool)params.boundary_i, (bool)params.filter_i);
-            denom.blur(s, (bool)params.boundary_i, (bool)params.filter_i);
-#else
-            cimg.blur(s, (bool)params.boundary_i);
-            denom.blur(s, (bool)params.boundary_i);
+        if (params.filter_i == eFilterGaussian) {
+            cimg.blur(s, (bool)params.boundary_i, true);
+            denom.blur(s, (bool)params.boundary_i, true);
+        } else
 #endif
-            assert(cimg.width() == denom.width() && cimg.height() == denom.height() && cimg.depth() == denom.depth() && cimg.spectrum() == denom.spectrum());
-            cimg.div(denom);
+        {
+            // quasi-Gaussian: blur numerator and denominator in the same sweep
+            if (cimg.width() > 1) {
+                derichePair(cimg, denom, (float)s, 'x', (bool)params.boundary_i);
+            }
+            if (cimg.height() > 1) {
+                derichePair(cimg, denom, (float)s, 'y', (bool)params.boundary_i);
+            }
         }
+        assert(cimg.width() == denom.width() && cimg.height() == denom.height() && cimg.depth() == denom.depth() && cimg.spectrum() == denom.spectrum());
 
-        // scale to [rmin,rmax]
+        {
+            float *ptrn = cimg.data();
+            const float *ptrd = denom.data();
+            // divide, and scale back to [rmin,rmax]
 #ifdef cimg_use_openmp
-#pragma omp parallel for if (denom.size()>=4096)
+#pragma omp parallel for if (siz>=4096)
 #endif
-        cimg_rof(cimg,ptrd,float) *ptrd = (*ptrd-ERODESMOOTH_OFFSET)*(rmax-rmin)+rmin;
-}
+            for (long i = 0; i < siz; ++i) {
+                ptrn[i] = (ptrn[i] / ptrd[i] - (float)ERODESMOOTH_OFFSET) * (float)(rmax-rmin) + (float)rmin;
+            }
+        }
+    }
 
     virtual bool isIdentity(const OFX::IsIdentityArguments &/*args*/, const CImgErodeSmoothParams& params) OVERRIDE FINAL
     {
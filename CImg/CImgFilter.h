@@ -14,9 +14,15 @@
 #include "ofxsPixelProcessor.h"
 #include "ofxsCopier.h"
 #include "ofxsMerging.h"
+#include "ofxsMultiThread.h"
 
 #include <cassert>
+#include <cstddef>
 #include <memory>
+#include <string>
+#include <vector>
+#include <list>
+#include <algorithm>
 
 //#define CIMG_DEBUG
 
@@ -33,6 +39,14 @@ CLANG_DIAG_OFF(shorten-64-to-32)
 #include "CImg.h"
 CLANG_DIAG_ON(shorten-64-to-32)
 
+// Maximum size (in bytes) of the temporary buffers used to process a single strip.
+// If the whole srcRoI needs more memory than that, the processWindow is split into horizontal strips.
+#ifndef kCImgFilterStripMaxBytes
+#define kCImgFilterStripMaxBytes (256 * 1024 * 1024)
+#endif
+
+#define kCImgStatisticsCacheSize 4 // number of frames kept in the statistics cache
+
 #define kParamProcessR      "r"
 #define kParamProcessRLabel "R"
 #define kParamProcessRHint  "Process red component"
@@ -46,6 +60,217 @@ CLANG_DIAG_ON(shorten-64-to-32)
 #define kParamProcessALabel "A"
 #define kParamProcessAHint  "Process alpha component"
 
+/// the helper parameters which affect the image passed to computeStatistics()
+struct CImgStatisticsKey
+{
+    double time;
+    OfxPointD renderScale;
+    bool processR;
+    bool processG;
+    bool processB;
+    bool processA;
+    bool premult;
+    int premultChannel;
+    std::string srcUniqueIdentifier; // identifies the source image, if the host sets it
+    unsigned int srcHash; // identifies the source content if the host gives no identifier, see cimgImageHash()
+    OfxRectI srcRoD; // the pixel rectangle of the image passed to computeStatistics()
+
+    bool operator==(const CImgStatisticsKey& other) const
+    {
+        return (srcUniqueIdentifier == other.srcUniqueIdentifier &&
+                srcHash == other.srcHash &&
+                srcRoD.x1 == other.srcRoD.x1 && srcRoD.y1 == other.srcRoD.y1 &&
+                srcRoD.x2 == other.srcRoD.x2 && srcRoD.y2 == other.srcRoD.y2 &&
+                time == other.time &&
+                renderScale.x == other.renderScale.x &&
+                renderScale.y == other.renderScale.y &&
+                processR == other.processR &&
+                processG == other.processG &&
+                processB == other.processB &&
+                processA == other.processA &&
+                premult == other.premult &&
+                premultChannel == other.premultChannel);
+    }
+};
+
+/// Hash the pixels of an image (FNV-1a on 32-bit words), so that statistics computed on a previous
+/// version of the source image are not reused after an upstream change. Only used if the host
+/// does not give the image a unique identifier.
+inline unsigned int
+cimgImageHash(const void* pixelData,
+              const OfxRectI& bounds,
+              int rowBytes,
+              int pixelBytes)
+{
+    unsigned int h = 2166136261U;
+    const int coords[4] = { bounds.x1, bounds.y1, bounds.x2, bounds.y2 };
+    for (int i = 0; i < 4; ++i) {
+        h = (h ^ (unsigned int)coords[i]) * 16777619U;
+    }
+    if (!pixelData) {
+        return h;
+    }
+    const size_t lineBytes = (size_t)std::max(0, bounds.x2 - bounds.x1) * pixelBytes;
+    const size_t nWords = lineBytes / sizeof(unsigned int);
+    for (int y = bounds.y1; y < bounds.y2; ++y) {
+        const unsigned char* line = (const unsigned char*)pixelData + (ptrdiff_t)(y - bounds.y1) * rowBytes;
+        const unsigned int* words = (const unsigned int*)line;
+        for (size_t i = 0; i < nWords; ++i) {
+            h = (h ^ words[i]) * 16777619U;
+        }
+        for (size_t i = nWords * sizeof(unsigned int); i < lineBytes; ++i) {
+            h = (h ^ line[i]) * 16777619U;
+        }
+    }
+    return h;
+}
+
+/// A small thread-safe LRU cache for statistics computed on the whole image.
+/// Key must have an operator==, and typically contains a CImgStatisticsKey and the plugin parameters
+/// which affect the statistics.
+template <class Key, class Stats>
+class CImgStatisticsCache
+{
+public:
+    CImgStatisticsCache() {}
+
+    bool get(const Key& key, Stats* stats)
+    {
+        OFX::MultiThread::AutoMutex lock(_mutex);
+        for (typename std::list<std::pair<Key, Stats> >::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+            if (it->first == key) {
+                *stats = it->second;
+                // move to the front of the list
+                _entries.splice(_entries.begin(), _entries, it);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void set(const Key& key, const Stats& stats)
+    {
+        OFX::MultiThread::AutoMutex lock(_mutex);
+        for (typename std::list<std::pair<Key, Stats> >::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+            if (it->first == key) {
+                _entries.erase(it);
+                break;
+            }
+        }
+        _entries.push_front(std::make_pair(key, stats));
+        while (_entries.size() > kCImgStatisticsCacheSize) {
+            _entries.pop_back();
+        }
+    }
+
+    void clear()
+    {
+        OFX::MultiThread::AutoMutex lock(_mutex);
+        _entries.clear();
+    }
+
+private:
+    OFX::MultiThread::Mutex _mutex;
+    std::list<std::pair<Key, Stats> > _entries;
+};
+
+/// Normalization values of CImg<T>::sharpen(): the value range used to clamp the result, and the
+/// maximum absolute velocity. They are computed once per frame on the whole source image by
+/// computeStatistics(), so that all tiles are normalized the same way.
+struct CImgSharpenNormalization
+{
+    float val_min;
+    float val_max;
+    float veloc_max;
+};
+
+/// One iteration of CImg<T>::sharpen(), given the velocity of each pixel and the normalization values.
+inline void
+cimgSharpenApply(cimg_library::CImg<float>& cimg,
+                 const cimg_library::CImg<float>& velocity,
+                 float amplitude,
+                 const CImgSharpenNormalization& norm)
+{
+    assert(velocity.size() == cimg.size());
+    if (norm.veloc_max <= 0) {
+        return;
+    }
+    const float k = amplitude / norm.veloc_max;
+    const float *ptrv = velocity.data();
+    cimg_for(cimg, ptrd, float) {
+        const float val = *ptrd + k * *(ptrv++);
+        *ptrd = val < norm.val_min ? norm.val_min : (val > norm.val_max ? norm.val_max : val);
+    }
+}
+
+/// Compute the cumulative histogram of the values of cimg within [vmin,vmax], with the same
+/// binning as CImg<T>::equalize(). If OpenMP is enabled, each thread accumulates its own histogram.
+inline void
+cimgCumulativeHistogram(const cimg_library::CImg<float>& cimg,
+                        unsigned int nb_levels,
+                        float vmin,
+                        float vmax,
+                        std::vector<unsigned long>* cumul)
+{
+    cumul->assign(nb_levels, 0);
+    if (!nb_levels || cimg.is_empty()) {
+        return;
+    }
+    const long siz = (long)cimg.size();
+    const float *data = cimg.data();
+#ifdef cimg_use_openmp
+#pragma omp parallel if (siz >= 1048576)
+#endif
+    {
+        std::vector<unsigned long> hist(nb_levels, 0);
+#ifdef cimg_use_openmp
+#pragma omp for
+#endif
+        for (long i = 0; i < siz; ++i) {
+            const float val = data[i];
+            if (val >= vmin && val <= vmax) {
+                ++hist[val == vmax ? nb_levels - 1 : (unsigned int)((val - vmin) * nb_levels / (vmax - vmin))];
+            }
+        }
+#ifdef cimg_use_openmp
+#pragma omp critical
+#endif
+        for (unsigned int i = 0; i < nb_levels; ++i) {
+            (*cumul)[i] += hist[i];
+        }
+    }
+    for (unsigned int i = 1; i < nb_levels; ++i) {
+        (*cumul)[i] += (*cumul)[i-1];
+    }
+}
+
+/// Equalize cimg using a cumulative histogram computed by cimgCumulativeHistogram(),
+/// possibly on a larger image. Gives the same result as CImg<T>::equalize() on the whole image.
+inline void
+cimgEqualize(cimg_library::CImg<float>& cimg,
+             const std::vector<unsigned long>& cumul,
+             float vmin,
+             float vmax)
+{
+    const unsigned int nb_levels = (unsigned int)cumul.size();
+    if (!nb_levels || cimg.is_empty() || vmin >= vmax) {
+        return;
+    }
+    const double total = cumul[nb_levels - 1] ? (double)cumul[nb_levels - 1] : 1.;
+    const long siz = (long)cimg.size();
+    float *data = cimg.data();
+#ifdef cimg_use_openmp
+#pragma omp parallel for if (siz >= 1048576)
+#endif
+    for (long i = 0; i < siz; ++i) {
+        float& val = data[i];
+        const int pos = (int)((val - vmin) * (nb_levels - 1.) / (vmax - vmin));
+        if (pos >= 0 && pos < (int)nb_levels) {
+            val = (float)(vmin + (vmax - vmin) * cumul[pos] / total);
+        }
+    }
+}
+
 template <class Params, bool sourceIsOptional>
 class CImgFilterPluginHelper : public OFX::ImageEffect
 {
@@ -150,6 +375,19 @@ public:
     // 0: Black/Dirichlet, 1: Nearest/Neumann, 2: Repeat/Periodic
     virtual int getBoundary(const Params& /*params*/) { return 0; }
 
+    // Statistics computed on the whole image (e.g. a histogram).
+    // A filter which depends on such statistics may still support tiles: if needsStatistics() returns true,
+    // the whole source RoD is requested from the host, and before rendering each tile getStatistics() is called
+    // to fetch the statistics for this key from the plugin cache into params.
+    // If they are not available, computeStatistics() is called on the whole source image (with the same channels
+    // and unpremultiplication as the cimg passed to render()), and should store them into params and the cache.
+    // The plugin should clear its cache in beginSequenceRender() and purgeCaches(), since the source may have changed.
+    virtual bool needsStatistics(const Params& /*params*/) { return false; }
+
+    virtual bool getStatistics(const CImgStatisticsKey& /*key*/, Params& /*params*/) { return false; }
+
+    virtual void computeStatistics(const CImgStatisticsKey& /*key*/, const cimg_library::CImg<float>& /*cimg*/, Params& /*params*/) {}
+
     //static void describe(OFX::ImageEffectDescriptor &desc, bool supportsTiles);
 
     static OFX::PageParamDescriptor*
@@ -271,6 +509,42 @@ private:
     static void printRectI(const char*, const OfxRectI&) {}
 #endif
 
+    // split processWindow into horizontal strips of equal height, so that the buffers needed
+    // to process each strip (including its halo) fit within kCImgFilterStripMaxBytes.
+    // srcRoI is the RoI required to process the whole processWindow, and pixelBytes is the
+    // number of bytes allocated per pixel of the RoI.
+    void
+    getProcessStrips(const OfxRectI& processWindow,
+                     const OfxRectI& srcRoI,
+                     size_t pixelBytes,
+                     std::vector<OfxRectI>* strips) const
+    {
+        assert(!isEmpty(processWindow));
+        const size_t roiWidth = srcRoI.x2 - srcRoI.x1;
+        const size_t roiHeight = srcRoI.y2 - srcRoI.y1;
+        // If the plugin does not support tiles, the result depends on the whole image, and
+        // the image may not be split. The same holds if the whole RoI fits within the budget.
+        if (!_supportsTiles || roiWidth * roiHeight * pixelBytes <= kCImgFilterStripMaxBytes) {
+            strips->push_back(processWindow);
+            return;
+        }
+        const int height = processWindow.y2 - processWindow.y1;
+        // height of the top and bottom halos, which must be computed for each strip
+        const int halo = std::max(0, (int)roiHeight - height);
+        int stripHeight = (int)(kCImgFilterStripMaxBytes / (roiWidth * pixelBytes)) - halo;
+        // the halo should not represent more than half of the processed data, even if the budget is exceeded
+        stripHeight = std::max(stripHeight, std::max(halo, 1));
+        // balance the strip heights
+        const int nStrips = (height + stripHeight - 1) / stripHeight;
+        stripHeight = (height + nStrips - 1) / nStrips;
+        for (int y = processWindow.y1; y < processWindow.y2; y += stripHeight) {
+            OfxRectI strip = processWindow;
+            strip.y1 = y;
+            strip.y2 = std::min(y + stripHeight, processWindow.y2);
+            strips->push_back(strip);
+        }
+    }
+
 
     void
     setupAndFill(OFX::PixelProcessorFilterBase & processor,
@@ -281,6 +555,17 @@ private:
                  OFX::BitDepthEnum dstPixelDepth,
                  int dstRowBytes);
 
+    void
+    copyToCImg(double time,
+               const OfxRectI &window,
+               const OFX::Image* src,
+               int srcBoundary,
+               OFX::PixelComponentEnum srcPixelComponents,
+               const std::vector<int>& srcChannel,
+               bool premult,
+               int premultChannel,
+               cimg_library::CImg<float>& cimg);
+
     void
     setupAndCopy(OFX::PixelProcessorFilterBase & processor,
                  double time,
@@ -427,6 +712,7 @@ private:
     bool _supportsRenderScale;
     bool _defaultUnpremult; //!< unpremult by default
     bool _defaultProcessAlphaOnRGBA; //!< process alpha by default on RGBA images
+    OFX::MultiThread::Mutex _statisticsMutex; //!< so that concurrent renders do not compute the same statistics
 };
 
 
@@ -455,6 +741,78 @@ CImgFilterPluginHelper<Params,sourceIsOptional>::setupAndFill(OFX::PixelProcesso
 }
 
 
+/* copy & unpremult the channels to be processed from window to a cimg (steps 1-2 of render()) */
+template <class Params, bool sourceIsOptional>
+void
+CImgFilterPluginHelper<Params,sourceIsOptional>::copyToCImg(double time,
+                                                            const OfxRectI &window,
+                                                            const OFX::Image* src,
+                                                            int srcBoundary,
+                                                            OFX::PixelComponentEnum srcPixelComponents,
+                                                            const std::vector<int>& srcChannel,
+                                                            bool premult,
+                                                            int premultChannel,
+                                                            cimg_library::CImg<float>& cimg)
+{
+    const int srcNComponents = ((srcPixelComponents == OFX::ePixelComponentAlpha) ? 1 :
+                                ((srcPixelComponents == OFX::ePixelComponentRGB) ? 3 : 4));
+    const int width = window.x2 - window.x1;
+    const int height = window.y2 - window.y1;
+    const int cimgSpectrum = (int)srcChannel.size();
+
+    if (width <= 0 || height <= 0 || cimgSpectrum == 0) {
+        cimg.assign();
+        return;
+    }
+
+    const OFX::BitDepthEnum tmpBitDepth = OFX::eBitDepthFloat;
+    const int tmpRowBytes = getPixelBytes(srcPixelComponents, tmpBitDepth) * width;
+    std::auto_ptr<OFX::ImageMemory> tmpData(new OFX::ImageMemory((size_t)tmpRowBytes * height, this));
+    float *tmpPixelData = (float*)tmpData->lock();
+
+    {
+        std::auto_ptr<OFX::PixelProcessorFilterBase> fred;
+        if (!src) {
+            // no src, fill with black & transparent
+            if (srcPixelComponents == OFX::ePixelComponentRGBA) {
+                fred.reset(new OFX::BlackFiller<float, 4>(*this));
+            } else if (srcPixelComponents == OFX::ePixelComponentRGB) {
+                fred.reset(new OFX::BlackFiller<float, 3>(*this));
+            }  else if (srcPixelComponents == OFX::ePixelComponentAlpha) {
+                fred.reset(new OFX::BlackFiller<float, 1>(*this));
+            }
+        } else {
+            if (srcPixelComponents == OFX::ePixelComponentRGBA) {
+                fred.reset(new OFX::PixelCopierUnPremult<float, 4, 1, float, 4, 1>(*this));
+            } else if (srcPixelComponents == OFX::ePixelComponentRGB) {
+                // just copy, no premult
+                fred.reset(new OFX::PixelCopier<float, 3, 1>(*this));
+            }  else if (srcPixelComponents == OFX::ePixelComponentAlpha) {
+                // just copy, no premult
+                fred.reset(new OFX::PixelCopier<float, 1, 1>(*this));
+            }
+        }
+        setupAndCopy(*fred, time, window, src, NULL,
+                     src ? src->getPixelData() : NULL,
+                     src ? src->getBounds() : window,
+                     srcPixelComponents, tmpBitDepth,
+                     src ? src->getRowBytes() : 0,
+                     srcBoundary,
+                     tmpPixelData, window, srcPixelComponents, tmpBitDepth, tmpRowBytes,
+                     premult, premultChannel, 1., false);
+    }
+
+    cimg.assign(width, height, 1, cimgSpectrum);
+    for (int c=0; c < cimgSpectrum; ++c) {
+        float *dst = cimg.data(0,0,0,c);
+        const float *src = tmpPixelData + srcChannel[c];
+        for (size_t siz = (size_t)width * height; siz; --siz, src += srcNComponents, ++dst) {
+            *dst = *src;
+        }
+    }
+}
+
+
 /* set up and run a copy processor */
 template <class Params, bool sourceIsOptional>
 void
@@ -803,66 +1161,10 @@ CImgFilterPluginHelper<Params,sourceIsOptional>::render(const OFX::RenderArgumen
     int srcNComponents = ((srcPixelComponents == OFX::ePixelComponentAlpha) ? 1 :
                           ((srcPixelComponents == OFX::ePixelComponentRGB) ? 3 : 4));
 
-    // from here on, we do the following steps:
-    // 1- copy & unpremult all channels from srcRoI, from src to a tmp image of size srcRoI
-    // 2- extract channels to be processed from tmp to a cimg of size srcRoI (and do the interleaved to coplanar conversion)
-    // 3- process the cimg
-    // 4- copy back the processed channels from the cImg to tmp. only processWindow has to be copied
-    // 5- copy+premult+max+mix tmp to dst (only processWindow)
-
-    //////////////////////////////////////////////////////////////////////////////////////////
-    // 1- copy & unpremult all channels from srcRoI, from src to a tmp image of size srcRoI
-
-    const OfxRectI tmpBounds = srcRoI;
-    const OFX::PixelComponentEnum tmpPixelComponents = srcPixelComponents;
-    const OFX::BitDepthEnum tmpBitDepth = OFX::eBitDepthFloat;
-    const int tmpWidth = tmpBounds.x2 - tmpBounds.x1;
-    const int tmpHeight = tmpBounds.y2 - tmpBounds.y1;
-    const int tmpRowBytes = getPixelBytes(tmpPixelComponents, tmpBitDepth) * tmpWidth;
-    size_t tmpSize = tmpRowBytes * tmpHeight;
-
-    assert(tmpSize > 0);
-    std::auto_ptr<OFX::ImageMemory> tmpData(new OFX::ImageMemory(tmpSize, this));
-    float *tmpPixelData = (float*)tmpData->lock();
-
-    {
-        std::auto_ptr<OFX::PixelProcessorFilterBase> fred;
-        if (!src.get()) {
-            // no src, fill with black & transparent
-            if (dstPixelComponents == OFX::ePixelComponentRGBA) {
-                fred.reset(new OFX::BlackFiller<float, 4>(*this));
-            } else if (dstPixelComponents == OFX::ePixelComponentRGB) {
-                fred.reset(new OFX::BlackFiller<float, 3>(*this));
-            }  else if (dstPixelComponents == OFX::ePixelComponentAlpha) {
-                fred.reset(new OFX::BlackFiller<float, 1>(*this));
-            }
-        } else {
-            if (dstPixelComponents == OFX::ePixelComponentRGBA) {
-                fred.reset(new OFX::PixelCopierUnPremult<float, 4, 1, float, 4, 1>(*this));
-            } else if (dstPixelComponents == OFX::ePixelComponentRGB) {
-                // just copy, no premult
-                fred.reset(new OFX::PixelCopier<float, 3, 1>(*this));
-            }  else if (dstPixelComponents == OFX::ePixelComponentAlpha) {
-                // just copy, no premult
-                fred.reset(new OFX::PixelCopier<float, 1, 1>(*this));
-            }
-        }
-        setupAndCopy(*fred, time, srcRoI, src.get(), mask.get(),
-                     srcPixelData, srcBounds, srcPixelComponents, srcBitDepth, srcRowBytes, srcBoundary,
-                     tmpPixelData, tmpBounds, tmpPixelComponents, tmpBitDepth, tmpRowBytes,
-                     premult, premultChannel, mix, maskInvert);
-    }
-
-    //////////////////////////////////////////////////////////////////////////////////////////
-    // 2- extract channels to be processed from tmp to a cimg of size srcRoI (and do the interleaved to coplanar conversion)
-
-    // allocate the cimg data to hold the src ROI
+    // the channels to be processed
     const int cimgSpectrum = ((srcPixelComponents == OFX::ePixelComponentAlpha) ? (int)processA :
                               ((srcPixelComponents == OFX::ePixelComponentRGB) ? ((int)processR + (int)processG + (int) processB) :
                                ((int)processR + (int)processG + (int) processB + (int)processA)));
-    const int cimgWidth = srcRoI.x2 - srcRoI.x1;
-    const int cimgHeight = srcRoI.y2 - srcRoI.y1;
-    const size_t cimgSize = cimgWidth * cimgHeight * cimgSpectrum * sizeof(float);
     std::vector<int> srcChannel(cimgSpectrum, -1);
     std::vector<int> cimgChannel(srcNComponents, -1);
 
@@ -895,68 +1197,174 @@ CImgFilterPluginHelper<Params,sourceIsOptional>::render(const OFX::RenderArgumen
         assert(c == cimgSpectrum);
     }
 
-    if (cimgSize) { // may be zero if no channel is processed
-        std::auto_ptr<OFX::ImageMemory> cimgData(new OFX::ImageMemory(cimgSize, this));
-        float *cimgPixelData = (float*)cimgData->lock();
-        cimg_library::CImg<float> cimg(cimgPixelData, cimgWidth, cimgHeight, 1, cimgSpectrum, true);
+    if (needsStatistics(params) && cimgSpectrum > 0) {
+        CImgStatisticsKey key;
+        key.time = time;
+        key.renderScale = renderScale;
+        key.processR = processR;
+        key.processG = processG;
+        key.processB = processB;
+        key.processA = processA;
+        key.premult = premult;
+        key.premultChannel = premultChannel;
+        // an upstream change during interactive work must invalidate the statistics: the host identifies
+        // the source image, else the whole source image is hashed
+        key.srcUniqueIdentifier = src.get() ? src->getUniqueIdentifier() : std::string();
+        key.srcHash = key.srcUniqueIdentifier.empty() ? cimgImageHash(srcPixelData, srcBounds, srcRowBytes, getPixelBytes(srcPixelComponents, srcBitDepth)) : 0;
+        key.srcRoD = srcRoD;
+        // the statistics of a given frame are computed only once, even if several tiles are rendered concurrently
+        OFX::MultiThread::AutoMutex lock(_statisticsMutex);
+        if (!getStatistics(key, params)) {
+            // the whole source image was requested in getRegionsOfInterest()
+            cimg_library::CImg<float> cimg;
+            copyToCImg(time, srcRoD, src.get(), srcBoundary, srcPixelComponents, srcChannel, premult, premultChannel, cimg);
+            if (abort()) {
+                return;
+            }
+            computeStatistics(key, cimg, params);
+        }
+    }
 
+    // If the buffers for the whole srcRoI would be too large, split processWindow into horizontal strips,
+    // each with its own halo, and process them one after the other.
+    // Strips are processed sequentially, so that the memory used never exceeds the budget.
+    std::vector<OfxRectI> strips;
+    getProcessStrips(processWindow, srcRoI, (srcNComponents + cimgSpectrum) * sizeof(float), &strips);
 
-        for (int c=0; c < cimgSpectrum; ++c) {
-            float *dst = cimg.data(0,0,0,c);
-            const float *src = tmpPixelData + srcChannel[c];
-            for (unsigned int siz = cimgWidth * cimgHeight; siz; --siz, src += srcNComponents, ++dst) {
-                *dst = *src;
-            }
+    for (std::vector<OfxRectI>::const_iterator it = strips.begin(); it != strips.end(); ++it) {
+        if (abort()) {
+            return;
+        }
+        const OfxRectI& stripWindow = *it;
+        OfxRectI stripRoI;
+        if (strips.size() == 1) {
+            stripRoI = srcRoI;
+        } else {
+            getRoI(stripWindow, renderScale, params, &stripRoI);
+            OFX::MergeImages2D::rectIntersection(stripRoI, dstRoD, &stripRoI);
         }
 
-        //////////////////////////////////////////////////////////////////////////////////////////
+        // from here on, we do the following steps:
+        // 1- copy & unpremult all channels from stripRoI, from src to a tmp image of size stripRoI
+        // 2- extract channels to be processed from tmp to a cimg of size stripRoI (and do the interleaved to coplanar conversion)
         // 3- process the cimg
-        printRectI("render srcRoI", srcRoI);
-        render(args, params, srcRoI.x1, srcRoI.y1, cimg);
-        // check that the dimensions didn't change
-        assert(cimg.width() == cimgWidth && cimg.height() == cimgHeight && cimg.depth() == 1 && cimg.spectrum() == cimgSpectrum);
+        // 4- copy back the processed channels from the cImg to tmp. only stripWindow has to be copied
+        // 5- copy+premult+max+mix tmp to dst (only stripWindow)
 
         //////////////////////////////////////////////////////////////////////////////////////////
-        // 4- copy back the processed channels from the cImg to tmp. only processWindow has to be copied
-
-        // We copy the whole srcRoI. This could be optimized to copy only renderWindow
-        for (int c=0; c < cimgSpectrum; ++c) {
-            const float *src = cimg.data(0,0,0,c);
-            float *dst = tmpPixelData + srcChannel[c];
-            for (unsigned int siz = cimgWidth * cimgHeight; siz; --siz, ++src, dst += srcNComponents) {
-                *dst = *src;
+        // 1- copy & unpremult all channels from stripRoI, from src to a tmp image of size stripRoI
+
+        const OfxRectI tmpBounds = stripRoI;
+        const OFX::PixelComponentEnum tmpPixelComponents = srcPixelComponents;
+        const OFX::BitDepthEnum tmpBitDepth = OFX::eBitDepthFloat;
+        const int tmpWidth = tmpBounds.x2 - tmpBounds.x1;
+        const int tmpHeight = tmpBounds.y2 - tmpBounds.y1;
+        const int tmpRowBytes = getPixelBytes(tmpPixelComponents, tmpBitDepth) * tmpWidth;
+        size_t tmpSize = (size_t)tmpRowBytes * tmpHeight;
+
+        assert(tmpSize > 0);
+        std::auto_ptr<OFX::ImageMemory> tmpData(new OFX::ImageMemory(tmpSize, this));
+        float *tmpPixelData = (float*)tmpData->lock();
+
+        {
+            std::auto_ptr<OFX::PixelProcessorFilterBase> fred;
+            if (!src.get()) {
+                // no src, fill with black & transparent
+                if (dstPixelComponents == OFX::ePixelComponentRGBA) {
+                    fred.reset(new OFX::BlackFiller<float, 4>(*this));
+                } else if (dstPixelComponents == OFX::ePixelComponentRGB) {
+                    fred.reset(new OFX::BlackFiller<float, 3>(*this));
+                }  else if (dstPixelComponents == OFX::ePixelComponentAlpha) {
+                    fred.reset(new OFX::BlackFiller<float, 1>(*this));
+                }
+            } else {
+                if (dstPixelComponents == OFX::ePixelComponentRGBA) {
+                    fred.reset(new OFX::PixelCopierUnPremult<float, 4, 1, float, 4, 1>(*this));
+                } else if (dstPixelComponents == OFX::ePixelComponentRGB) {
+                    // just copy, no premult
+                    fred.reset(new OFX::PixelCopier<float, 3, 1>(*this));
+                }  else if (dstPixelComponents == OFX::ePixelComponentAlpha) {
+                    // just copy, no premult
+                    fred.reset(new OFX::PixelCopier<float, 1, 1>(*this));
+                }
             }
+            setupAndCopy(*fred, time, stripRoI, src.get(), mask.get(),
+                         srcPixelData, srcBounds, srcPixelComponents, srcBitDepth, srcRowBytes, srcBoundary,
+                         tmpPixelData, tmpBounds, tmpPixelComponents, tmpBitDepth, tmpRowBytes,
+                         premult, premultChannel, mix, maskInvert);
         }
 
-    }
+        //////////////////////////////////////////////////////////////////////////////////////////
+        // 2- extract channels to be processed from tmp to a cimg of size stripRoI (and do the interleaved to coplanar conversion)
 
-    //////////////////////////////////////////////////////////////////////////////////////////
-    // 5- copy+premult+max+mix tmp to dst (only processWindow)
+        // allocate the cimg data to hold the strip ROI
+        const int cimgWidth = stripRoI.x2 - stripRoI.x1;
+        const int cimgHeight = stripRoI.y2 - stripRoI.y1;
+        const size_t cimgSize = (size_t)cimgWidth * cimgHeight * cimgSpectrum * sizeof(float);
 
-    {
-        std::auto_ptr<OFX::PixelProcessorFilterBase> fred;
-        if (dstPixelComponents == OFX::ePixelComponentRGBA) {
-            fred.reset(new OFX::PixelCopierPremultMaskMix<float, 4, 1, float, 4, 1>(*this));
-        } else if (dstPixelComponents == OFX::ePixelComponentRGB) {
-            // just copy, no premult
-            if (doMasking) {
-                fred.reset(new OFX::PixelCopierMaskMix<float, 3, 1, true>(*this));
-            } else {
-                fred.reset(new OFX::PixelCopierMaskMix<float, 3, 1, false>(*this));
+        if (cimgSize) { // may be zero if no channel is processed
+            std::auto_ptr<OFX::ImageMemory> cimgData(new OFX::ImageMemory(cimgSize, this));
+            float *cimgPixelData = (float*)cimgData->lock();
+            cimg_library::CImg<float> cimg(cimgPixelData, cimgWidth, cimgHeight, 1, cimgSpectrum, true);
+
+
+            for (int c=0; c < cimgSpectrum; ++c) {
+                float *dst = cimg.data(0,0,0,c);
+                const float *src = tmpPixelData + srcChannel[c];
+                for (size_t siz = (size_t)cimgWidth * cimgHeight; siz; --siz, src += srcNComponents, ++dst) {
+                    *dst = *src;
+                }
             }
-        }  else if (dstPixelComponents == OFX::ePixelComponentAlpha) {
-            // just copy, no premult
-            assert(srcPixelComponents == OFX::ePixelComponentAlpha);
-            if (doMasking) {
-                fred.reset(new OFX::PixelCopierMaskMix<float, 1, 1, true>(*this));
-            } else {
-                fred.reset(new OFX::PixelCopierMaskMix<float, 1, 1, false>(*this));
+
+            //////////////////////////////////////////////////////////////////////////////////////////
+            // 3- process the cimg
+            printRectI("render stripRoI", stripRoI);
+            render(args, params, stripRoI.x1, stripRoI.y1, cimg);
+            // check that the dimensions didn't change
+            assert(cimg.width() == cimgWidth && cimg.height() == cimgHeight && cimg.depth() == 1 && cimg.spectrum() == cimgSpectrum);
+
+            //////////////////////////////////////////////////////////////////////////////////////////
+            // 4- copy back the processed channels from the cImg to tmp. only stripWindow has to be copied
+
+            // We copy the whole stripRoI. This could be optimized to copy only stripWindow
+            for (int c=0; c < cimgSpectrum; ++c) {
+                const float *src = cimg.data(0,0,0,c);
+                float *dst = tmpPixelData + srcChannel[c];
+                for (size_t siz = (size_t)cimgWidth * cimgHeight; siz; --siz, ++src, dst += srcNComponents) {
+                    *dst = *src;
+                }
             }
+
+        }
+
+        //////////////////////////////////////////////////////////////////////////////////////////
+        // 5- copy+premult+max+mix tmp to dst (only stripWindow)
+
+        {
+            std::auto_ptr<OFX::PixelProcessorFilterBase> fred;
+            if (dstPixelComponents == OFX::ePixelComponentRGBA) {
+                fred.reset(new OFX::PixelCopierPremultMaskMix<float, 4, 1, float, 4, 1>(*this));
+            } else if (dstPixelComponents == OFX::ePixelComponentRGB) {
+                // just copy, no premult
+                if (doMasking) {
+                    fred.reset(new OFX::PixelCopierMaskMix<float, 3, 1, true>(*this));
+                } else {
+                    fred.reset(new OFX::PixelCopierMaskMix<float, 3, 1, false>(*this));
+                }
+            }  else if (dstPixelComponents == OFX::ePixelComponentAlpha) {
+                // just copy, no premult
+                assert(srcPixelComponents == OFX::ePixelComponentAlpha);
+                if (doMasking) {
+                    fred.reset(new OFX::PixelCopierMaskMix<float, 1, 1, true>(*this));
+                } else {
+                    fred.reset(new OFX::PixelCopierMaskMix<float, 1, 1, false>(*this));
+                }
+            }
+            setupAndCopy(*fred, time, stripWindow, src.get(), mask.get(),
+                         tmpPixelData, tmpBounds, tmpPixelComponents, tmpBitDepth, tmpRowBytes, 0,
+                         dstPixelData, dstBounds, dstPixelComponents, dstBitDepth, dstRowBytes,
+                         premult, premultChannel, mix, maskInvert);
         }
-        setupAndCopy(*fred, time, processWindow, src.get(), mask.get(),
-                     tmpPixelData, tmpBounds, tmpPixelComponents, tmpBitDepth, tmpRowBytes, 0,
-                     dstPixelData, dstBounds, dstPixelComponents, dstBitDepth, dstRowBytes,
-                     premult, premultChannel, mix, maskInvert);
     }
 
     //////////////////////////////////////////////////////////////////////////////////////////
@@ -1002,6 +1410,11 @@ CImgFilterPluginHelper<Params,sourceIsOptional>::getRegionsOfInterest(const OFX:
     getRoI(rectPixel, args.renderScale, params, &srcRoIPixel);
     OFX::MergeImages2D::toCanonical(srcRoIPixel, args.renderScale, pixelaspectratio, &srcRoI);
 
+    if (needsStatistics(params)) {
+        // statistics are computed on the whole source image
+        OFX::MergeImages2D::rectBoundingBox(srcRoI, srcClip_->getRegionOfDefinition(time), &srcRoI);
+    }
+
     if (doMasking && mix != 1.) {
         // for masking or mixing, we also need the source image.
         // compute the bounding box with the default ROI
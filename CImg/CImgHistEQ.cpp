@@ -75,6 +75,8 @@
 #include <memory>
 #include <cmath>
 #include <cstring>
+#include <vector>
+#include <algorithm>
 #ifdef _WINDOWS
 #include <windows.h>
 #endif
@@ -101,7 +103,7 @@
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
 #define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
 
-#define kSupportsTiles 0 // Histogram must be computed on the whole image
+#define kSupportsTiles 1 // The histogram is computed once per frame on the whole image (see computeStatistics())
 #define kSupportsMultiResolution 1
 #define kSupportsRenderScale 1
 #define kRenderThreadSafety eRenderFullySafe
@@ -118,9 +120,30 @@
 using namespace OFX;
 
 /// HistEQ plugin
+struct CImgHistEQStatistics
+{
+    float vmin; //!< minimum brightness over the whole image
+    float vmax; //!< maximum brightness over the whole image
+    std::vector<unsigned long> histogram; //!< cumulative histogram of the brightness over the whole image
+
+    CImgHistEQStatistics() : vmin(0.), vmax(0.), histogram() {}
+};
+
 struct CImgHistEQParams
 {
     int nb_levels;
+    CImgHistEQStatistics stats;
+};
+
+struct CImgHistEQStatisticsKey
+{
+    CImgStatisticsKey key;
+    int nb_levels;
+
+    bool operator==(const CImgHistEQStatisticsKey& other) const
+    {
+        return key == other.key && nb_levels == other.nb_levels;
+    }
 };
 
 class CImgHistEQPlugin : public CImgFilterPluginHelper<CImgHistEQParams,false>
@@ -154,11 +177,10 @@ public:
     {
         // PROCESSING.
         // This is the only place where the actual processing takes place
+        // the histogram and the brightness range were computed on the whole image by computeStatistics()
         if (cimg.spectrum() < 3) {
             assert(cimg.spectrum() == 1); // Alpha image
-            float vmin, vmax;
-            vmin = cimg.min_max(vmax);
-            cimg.equalize(params.nb_levels, vmin, vmax);
+            cimgEqualize(cimg, params.stats.histogram, params.stats.vmin, params.stats.vmax);
         } else {
 #ifdef cimg_use_openmp
 #pragma omp parallel for if (cimg.size()>=1048576)
@@ -167,15 +189,55 @@ public:
                 OFX::Color::rgb_to_hsv(cimg(x,y,0,0), cimg(x,y,0,1), cimg(x,y,0,2), &cimg(x,y,0,0), &cimg(x,y,0,1), &cimg(x,y,0,2));
             }
             cimg_library::CImg<float> vchannel = cimg.get_shared_channel(2);
-            float vmin, vmax;
-            vmin = vchannel.min_max(vmax);
-            vchannel.equalize(params.nb_levels, vmin, vmax);
+            cimgEqualize(vchannel, params.stats.histogram, params.stats.vmin, params.stats.vmax);
+#ifdef cimg_use_openmp
+#pragma omp parallel for if (cimg.size()>=1048576)
+#endif
             cimg_forXY(cimg, x, y) {
                 OFX::Color::hsv_to_rgb(cimg(x,y,0,0), cimg(x,y,0,1), cimg(x,y,0,2), &cimg(x,y,0,0), &cimg(x,y,0,1), &cimg(x,y,0,2));
             }
         }
     }
 
+    virtual bool needsStatistics(const CImgHistEQParams& /*params*/) OVERRIDE FINAL
+    {
+        return true;
+    }
+
+    virtual bool getStatistics(const CImgStatisticsKey& key, CImgHistEQParams& params) OVERRIDE FINAL
+    {
+        return _statsCache.get(statisticsKey(key, params), &params.stats);
+    }
+
+    virtual void computeStatistics(const CImgStatisticsKey& key, const cimg_library::CImg<float>& cimg, CImgHistEQParams& params) OVERRIDE FINAL
+    {
+        cimg_library::CImg<float> vchannel;
+        if (cimg.spectrum() < 3) {
+            vchannel = cimg.get_shared_channel(0);
+        } else {
+            // the brightness (V in HSV) is the maximum of R, G and B
+            vchannel = cimg.get_channel(0).max(cimg.get_shared_channel(1)).max(cimg.get_shared_channel(2));
+        }
+        if (vchannel.is_empty()) {
+            params.stats = CImgHistEQStatistics();
+        } else {
+            params.stats.vmin = vchannel.min_max(params.stats.vmax);
+            cimgCumulativeHistogram(vchannel, std::max(params.nb_levels, 0), params.stats.vmin, params.stats.vmax, &params.stats.histogram);
+        }
+        _statsCache.set(statisticsKey(key, params), params.stats);
+    }
+
+    virtual void beginSequenceRender(const OFX::BeginSequenceRenderArguments &/*args*/) OVERRIDE FINAL
+    {
+        // the source may have changed
+        _statsCache.clear();
+    }
+
+    virtual void purgeCaches() OVERRIDE FINAL
+    {
+        _statsCache.clear();
+    }
+
     //virtual bool isIdentity(const OFX::IsIdentityArguments &args, const CImgHistEQParams& params) OVERRIDE FINAL
     //{
     //    return false;
@@ -183,8 +245,19 @@ public:
 
 private:
 
+    static CImgHistEQStatisticsKey
+    statisticsKey(const CImgStatisticsKey& key, const CImgHistEQParams& params)
+    {
+        CImgHistEQStatisticsKey ret;
+        ret.key = key;
+        ret.nb_levels = params.nb_levels;
+        return ret;
+    }
+
     // params
     OFX::IntParam *_nb_levels;
+
+    CImgStatisticsCache<CImgHistEQStatisticsKey, CImgHistEQStatistics> _statsCache;
 };
 
 
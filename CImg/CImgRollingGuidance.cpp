@@ -128,6 +128,11 @@
 #define kParamIterationsHint "Number of iterations of the rolling guidance filter. 1 corresponds to Gaussian smoothing. A reasonable value is 4."
 #define kParamIterationsDefault 4
 
+#define kParamTolerance "tolerance"
+#define kParamToleranceLabel "Tolerance"
+#define kParamToleranceHint "Iterations stop as soon as the mean absolute change of the guide between two iterations is below this value, in intensity units. 0 means that all iterations are always computed."
+#define kParamToleranceDefault 0.
+
 using namespace OFX;
 
 /// RollingGuidance plugin
@@ -136,6 +141,7 @@ struct CImgRollingGuidanceParams
     double sigma_s;
     double sigma_r;
     int iterations;
+    double tolerance;
 };
 
 class CImgRollingGuidancePlugin : public CImgFilterPluginHelper<CImgRollingGuidanceParams,false>
@@ -148,7 +154,8 @@ public:
         _sigma_s  = fetchDoubleParam(kParamSigmaS);
         _sigma_r  = fetchDoubleParam(kParamSigmaR);
         _iterations = fetchIntParam(kParamIterations);
-        assert(_sigma_s && _sigma_r && _iterations);
+        _tolerance = fetchDoubleParam(kParamTolerance);
+        assert(_sigma_s && _sigma_r && _iterations && _tolerance);
     }
 
     virtual void getValuesAtTime(double time, CImgRollingGuidanceParams& params) OVERRIDE FINAL
@@ -156,6 +163,7 @@ public:
         _sigma_s->getValueAtTime(time, params.sigma_s);
         _sigma_r->getValueAtTime(time, params.sigma_r);
         _iterations->getValueAtTime(time, params.iterations);
+        _tolerance->getValueAtTime(time, params.tolerance);
     }
 
     // compute the roi required to compute rect, given params. This roi is then intersected with the image rod.
@@ -186,13 +194,21 @@ public:
         }
         // first iteration is Gaussian blur (equivalent to a bilateral filter with a constant image as the guide)
         cimg_library::CImg<float> guide = cimg.get_blur(params.sigma_s * args.renderScale.x, true, true);
-        // next iterations use the bilateral filter
+        // next iterations use the bilateral filter (CImg's implementation uses a downsampled grid).
+        // The guide and the next guide are ping-ponged between two buffers, so that no image is allocated in the loop.
+        cimg_library::CImg<float> next(cimg.width(), cimg.height(), cimg.depth(), cimg.spectrum());
         for (int i = 1; i < params.iterations; ++i) {
             if (abort()) {
                 return;
             }
             // filter the original image using the updated guide
-            guide = cimg.get_blur_bilateral(guide, params.sigma_s * args.renderScale.x, params.sigma_r);
+            next = cimg; // same size, the buffer is reused
+            next.blur_bilateral(guide, params.sigma_s * args.renderScale.x, params.sigma_r);
+            guide.swap(next);
+            if (params.tolerance > 0. && meanAbsDiff(guide, next) < params.tolerance) {
+                // the guide has converged
+                break;
+            }
         }
         cimg = guide;
     }
@@ -204,10 +220,31 @@ public:
 
 private:
 
+    static double
+    meanAbsDiff(const cimg_library::CImg<float>& a, const cimg_library::CImg<float>& b)
+    {
+        assert(a.size() == b.size());
+        const long siz = (long)a.size();
+        if (siz == 0) {
+            return 0.;
+        }
+        const float *pa = a.data();
+        const float *pb = b.data();
+        double sum = 0.;
+#ifdef cimg_use_openmp
+#pragma omp parallel for reduction(+:sum) if (siz>=1048576)
+#endif
+        for (long i = 0; i < siz; ++i) {
+            sum += std::abs(pa[i] - pb[i]);
+        }
+        return sum / siz;
+    }
+
     // params
     OFX::DoubleParam *_sigma_s;
     OFX::DoubleParam *_sigma_r;
     OFX::IntParam *_iterations;
+    OFX::DoubleParam *_tolerance;
 };
 
 
@@ -278,6 +315,17 @@ void CImgRollingGuidancePluginFactory::describeInContext(OFX::ImageEffectDescrip
         param->setDefault(kParamIterationsDefault);
         page->addChild(*param);
     }
+    {
+        OFX::DoubleParamDescriptor *param = desc.defineDoubleParam(kParamTolerance);
+        param->setLabels(kParamToleranceLabel, kParamToleranceLabel, kParamToleranceLabel);
+        param->setHint(kParamToleranceHint);
+        param->setRange(0, 1.);
+        param->setDisplayRange(0, 0.01);
+        param->setDefault(kParamToleranceDefault);
+        param->setIncrement(0.0001);
+        param->setDigits(4);
+        page->addChild(*param);
+    }
 
     CImgRollingGuidancePlugin::describeInContextEnd(desc, context, page);
 }
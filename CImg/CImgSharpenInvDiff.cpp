@@ -99,9 +99,9 @@
 
 #define kPluginIdentifier    "net.sf.cimg.CImgSharpenInvDiff"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
-#define kSupportsTiles 0 // a maximum computation is done in sharpen, tiling is theoretically not possible (although gmicol uses a 24 pixel overlap)
+#define kSupportsTiles 1 // the iterations are normalized by values computed once per frame on the whole image (see computeStatistics())
 #define kSupportsMultiResolution 1
 #define kSupportsRenderScale 1
 #define kRenderThreadSafety eRenderFullySafe
@@ -127,8 +127,31 @@ struct CImgSharpenInvDiffParams
 {
     double amplitude;
     int iterations;
+    CImgSharpenNormalization norm; //!< computed on the whole image
 };
 
+// compute the inverse diffusion velocity, as in CImg<T>::sharpen(), and return its maximum absolute value
+static float
+sharpenInvDiffVelocity(const cimg_library::CImg<float>& cimg, cimg_library::CImg<float>& velocity)
+{
+    velocity.assign(cimg.width(), cimg.height(), cimg.depth(), cimg.spectrum());
+    float veloc_max = 0;
+    cimg_forC(cimg, c) {
+        float *ptrd = velocity.data(0,0,0,c);
+        CImg_3x3(I,float);
+        cimg_for3x3(cimg,x,y,0,c,I,float) {
+            const float veloc = -Ipc - Inc - Icp - Icn + 4*Icc;
+            *(ptrd++) = veloc;
+            if (veloc > veloc_max) {
+                veloc_max = veloc;
+            } else if (-veloc > veloc_max) {
+                veloc_max = -veloc;
+            }
+        }
+    }
+    return veloc_max;
+}
+
 class CImgSharpenInvDiffPlugin : public CImgFilterPluginHelper<CImgSharpenInvDiffParams,false>
 {
 public:
@@ -149,30 +172,67 @@ public:
 
     // compute the roi required to compute rect, given params. This roi is then intersected with the image rod.
     // only called if mix != 0.
-    virtual void getRoI(const OfxRectI& rect, const OfxPointD& renderScale, const CImgSharpenInvDiffParams& params, OfxRectI* roi) OVERRIDE FINAL
+    virtual void getRoI(const OfxRectI& rect, const OfxPointD& /*renderScale*/, const CImgSharpenInvDiffParams& params, OfxRectI* roi) OVERRIDE FINAL
     {
-        int delta_pix = 24; // overlap is 24 in gmicol
+        // each iteration uses a 3x3 neighborhood (gmicol uses a fixed 24 pixel overlap)
+        int delta_pix = std::max(params.iterations, 0);
         roi->x1 = rect.x1 - delta_pix;
         roi->x2 = rect.x2 + delta_pix;
         roi->y1 = rect.y1 - delta_pix;
         roi->y2 = rect.y2 + delta_pix;
     }
 
-    virtual void render(const OFX::RenderArguments &args, const CImgSharpenInvDiffParams& params, int /*x1*/, int /*y1*/, cimg_library::CImg<float>& cimg) OVERRIDE FINAL
+    virtual void render(const OFX::RenderArguments &/*args*/, const CImgSharpenInvDiffParams& params, int /*x1*/, int /*y1*/, cimg_library::CImg<float>& cimg) OVERRIDE FINAL
     {
         // PROCESSING.
         // This is the only place where the actual processing takes place
         if (params.iterations <= 0 || params.amplitude == 0.) {
             return;
         }
-        for (int i = 1; i < params.iterations; ++i) {
+        // cimg.sharpen(params.amplitude), with the normalization of the whole image
+        cimg_library::CImg<float> velocity;
+        for (int i = 0; i < params.iterations; ++i) {
             if (abort()) {
                 return;
             }
-            cimg.sharpen(params.amplitude);
+            sharpenInvDiffVelocity(cimg, velocity);
+            cimgSharpenApply(cimg, velocity, params.amplitude, params.norm);
         }
     }
 
+    virtual bool needsStatistics(const CImgSharpenInvDiffParams& params) OVERRIDE FINAL
+    {
+        return (params.iterations > 0 && params.amplitude != 0.);
+    }
+
+    virtual bool getStatistics(const CImgStatisticsKey& key, CImgSharpenInvDiffParams& params) OVERRIDE FINAL
+    {
+        return _normCache.get(key, &params.norm);
+    }
+
+    // the value range and the maximum velocity of the whole source image normalize all iterations
+    // (CImg renormalizes each iteration by its own input, which cannot be done tile by tile)
+    virtual void computeStatistics(const CImgStatisticsKey& key, const cimg_library::CImg<float>& cimg, CImgSharpenInvDiffParams& params) OVERRIDE FINAL
+    {
+        params.norm.val_min = params.norm.val_max = params.norm.veloc_max = 0.f;
+        if (!cimg.is_empty()) {
+            cimg_library::CImg<float> velocity;
+            params.norm.val_min = cimg.min_max(params.norm.val_max);
+            params.norm.veloc_max = sharpenInvDiffVelocity(cimg, velocity);
+        }
+        _normCache.set(key, params.norm);
+    }
+
+    virtual void beginSequenceRender(const OFX::BeginSequenceRenderArguments &/*args*/) OVERRIDE FINAL
+    {
+        _normCache.clear();
+    }
+
+    virtual void purgeCaches() OVERRIDE FINAL
+    {
+        _normCache.clear();
+    }
+
     virtual bool isIdentity(const OFX::IsIdentityArguments &/*args*/, const CImgSharpenInvDiffParams& params) OVERRIDE FINAL
     {
         return (params.iterations <= 0 || params.amplitude == 0.);
@@ -183,6 +243,8 @@ private:
     // params
     OFX::DoubleParam *_amplitude;
     OFX::IntParam *_iterations;
+
+    CImgStatisticsCache<CImgStatisticsKey, CImgSharpenNormalization> _normCache;
 };
 
 
@@ -99,9 +99,9 @@
 
 #define kPluginIdentifier    "net.sf.cimg.CImgSharpenShock"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
-#define kSupportsTiles 0 // a maximum computation is done in sharpen, tiling is theoretically not possible (although gmicol uses a 24 pixel overlap)
+#define kSupportsTiles 1 // the iterations are normalized by values computed once per frame on the whole image (see computeStatistics())
 #define kSupportsMultiResolution 1
 #define kSupportsRenderScale 1
 #define kRenderThreadSafety eRenderFullySafe
@@ -145,8 +145,77 @@ struct CImgSharpenShockParams
     double alpha;
     double sigma;
     int iterations;
+    CImgSharpenNormalization norm; //!< computed on the whole image
 };
 
+struct CImgSharpenShockStatisticsKey
+{
+    CImgStatisticsKey key;
+    double edge;
+    double alpha;
+    double sigma;
+
+    bool operator==(const CImgSharpenShockStatisticsKey& other) const
+    {
+        return (key == other.key && edge == other.edge && alpha == other.alpha && sigma == other.sigma);
+    }
+};
+
+// compute the shock filter velocity, as in CImg<T>::sharpen(), and return its maximum absolute value
+static float
+sharpenShockVelocity(const cimg_library::CImg<float>& cimg, float edge, float alpha, float sigma, cimg_library::CImg<float>& velocity)
+{
+    velocity.assign(cimg.width(), cimg.height(), cimg.depth(), cimg.spectrum());
+    const float nedge = edge / 2;
+    cimg_library::CImg<float> G = (alpha > 0 ? cimg.get_blur(alpha).get_structure_tensors() : cimg.get_structure_tensors());
+    if (sigma > 0) {
+        G.blur(sigma);
+    }
+    {
+        cimg_library::CImg<float> val, vec;
+        cimg_forXY(G, x, y) {
+            G.get_tensor_at(x,y).symmetric_eigen(val, vec);
+            if (val[0] < 0) {
+                val[0] = 0;
+            }
+            if (val[1] < 0) {
+                val[1] = 0;
+            }
+            G(x,y,0) = vec(0,0);
+            G(x,y,1) = vec(0,1);
+            G(x,y,2) = 1 - (float)std::pow(1 + val[0] + val[1], -nedge);
+        }
+    }
+    float veloc_max = 0;
+    cimg_forC(cimg, c) {
+        float *ptrd = velocity.data(0,0,0,c);
+        CImg_3x3(I,float);
+        cimg_for3x3(cimg,x,y,0,c,I,float) {
+            const float
+            u = G(x,y,0),
+            v = G(x,y,1),
+            amp = G(x,y,2),
+            ixx = Inc + Ipc - 2*Icc,
+            ixy = (Inn + Ipp - Inp - Ipn)/4,
+            iyy = Icn + Icp - 2*Icc,
+            ixf = Inc - Icc,
+            ixb = Icc - Ipc,
+            iyf = Icn - Icc,
+            iyb = Icc - Icp,
+            itt = u*u*ixx + v*v*iyy + 2*u*v*ixy,
+            it = u*cimg_library::cimg::minmod(ixf,ixb) + v*cimg_library::cimg::minmod(iyf,iyb),
+            veloc = -amp*cimg_library::cimg::sign(itt)*cimg_library::cimg::abs(it);
+            *(ptrd++) = veloc;
+            if (veloc > veloc_max) {
+                veloc_max = veloc;
+            } else if (-veloc > veloc_max) {
+                veloc_max = -veloc;
+            }
+        }
+    }
+    return veloc_max;
+}
+
 class CImgSharpenShockPlugin : public CImgFilterPluginHelper<CImgSharpenShockParams,false>
 {
 public:
@@ -175,7 +244,9 @@ public:
     // only called if mix != 0.
     virtual void getRoI(const OfxRectI& rect, const OfxPointD& renderScale, const CImgSharpenShockParams& params, OfxRectI* roi) OVERRIDE FINAL
     {
-        int delta_pix = 24; // overlap is 24 in gmicol
+        // each iteration uses a 3x3 neighborhood, the gradient for the structure tensor, and the gradient and tensor smoothing
+        // (gmicol uses a fixed 24 pixel overlap)
+        int delta_pix = std::max(params.iterations, 0) * (2 + (int)std::ceil(4. * (std::max(params.alpha, 0.) + std::max(params.sigma, 0.)) * renderScale.x));
         roi->x1 = rect.x1 - delta_pix;
         roi->x2 = rect.x2 + delta_pix;
         roi->y1 = rect.y1 - delta_pix;
@@ -191,14 +262,52 @@ public:
         }
         float alpha = args.renderScale.x * params.alpha;
         float sigma = args.renderScale.x * params.sigma;
-        for (int i = 1; i < params.iterations; ++i) {
+        // cimg.sharpen(params.amplitude, true, params.edge, alpha, sigma), with the normalization of the whole image
+        cimg_library::CImg<float> velocity;
+        for (int i = 0; i < params.iterations; ++i) {
             if (abort()) {
                 return;
             }
-            cimg.sharpen(params.amplitude, true, params.edge, alpha, sigma);
+            sharpenShockVelocity(cimg, params.edge, alpha, sigma, velocity);
+            cimgSharpenApply(cimg, velocity, params.amplitude, params.norm);
         }
     }
 
+    virtual bool needsStatistics(const CImgSharpenShockParams& params) OVERRIDE FINAL
+    {
+        return (params.iterations > 0 && params.amplitude != 0.);
+    }
+
+    virtual bool getStatistics(const CImgStatisticsKey& key, CImgSharpenShockParams& params) OVERRIDE FINAL
+    {
+        return _normCache.get(statisticsKey(key, params), &params.norm);
+    }
+
+    // the value range and the maximum velocity of the whole source image normalize all iterations
+    // (CImg renormalizes each iteration by its own input, which cannot be done tile by tile)
+    virtual void computeStatistics(const CImgStatisticsKey& key, const cimg_library::CImg<float>& cimg, CImgSharpenShockParams& params) OVERRIDE FINAL
+    {
+        params.norm.val_min = params.norm.val_max = params.norm.veloc_max = 0.f;
+        if (!cimg.is_empty()) {
+            float alpha = key.renderScale.x * params.alpha;
+            float sigma = key.renderScale.x * params.sigma;
+            cimg_library::CImg<float> velocity;
+            params.norm.val_min = cimg.min_max(params.norm.val_max);
+            params.norm.veloc_max = sharpenShockVelocity(cimg, params.edge, alpha, sigma, velocity);
+        }
+        _normCache.set(statisticsKey(key, params), params.norm);
+    }
+
+    virtual void beginSequenceRender(const OFX::BeginSequenceRenderArguments &/*args*/) OVERRIDE FINAL
+    {
+        _normCache.clear();
+    }
+
+    virtual void purgeCaches() OVERRIDE FINAL
+    {
+        _normCache.clear();
+    }
+
     virtual bool isIdentity(const OFX::IsIdentityArguments &/*args*/, const CImgSharpenShockParams& params) OVERRIDE FINAL
     {
         return (params.iterations <= 0 || params.amplitude == 0.);
@@ -206,12 +315,25 @@ public:
 
 private:
 
+    static CImgSharpenShockStatisticsKey
+    statisticsKey(const CImgStatisticsKey& key, const CImgSharpenShockParams& params)
+    {
+        CImgSharpenShockStatisticsKey ret;
+        ret.key = key;
+        ret.edge = params.edge;
+        ret.alpha = params.alpha;
+        ret.sigma = params.sigma;
+        return ret;
+    }
+
     // params
     OFX::DoubleParam *_amplitude;
     OFX::DoubleParam *_edge;
     OFX::DoubleParam *_alpha;
     OFX::DoubleParam *_sigma;
     OFX::IntParam *_iterations;
+
+    CImgStatisticsCache<CImgSharpenShockStatisticsKey, CImgSharpenNormalization> _normCache;
 };
 
 
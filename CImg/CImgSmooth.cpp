@@ -84,6 +84,7 @@
 #include "ofxsMacros.h"
 #include "ofxsMerging.h"
 #include "ofxsCopier.h"
+#include "ofxsMultiThread.h"
 
 #include "CImgFilter.h"
 
@@ -171,6 +172,8 @@ enum InterpEnum
 #define kParamFastApproxHint "Tells if a fast approximation of the gaussian function is used or not"
 #define kParamFastApproxDafault true
 
+#define kBandHeight 64 // rows of a band (not counting the halo). Fixed, so that the result does not depend on the number of CPUs
+
 using namespace OFX;
 
 
@@ -192,6 +195,71 @@ struct CImgSmoothParams
     bool fast_approx;
 };
 
+// Process the image by horizontal bands, in parallel.
+// Each band is cropped from the source with a halo of amplitude+alpha+sigma pixels (which is the
+// same halo as the one used for tiles, see getRoI()), so that the structure tensors and the LIC
+// streamlines are computed on each band independently.
+class CImgSmoothBandProcessor : public OFX::MultiThread::Processor
+{
+public:
+    CImgSmoothBandProcessor(const cimg_library::CImg<float>& src,
+                            cimg_library::CImg<float>& dst,
+                            const CImgSmoothParams& params,
+                            const OfxPointD& renderScale,
+                            int halo,
+                            int bandHeight)
+    : _src(src)
+    , _dst(dst)
+    , _params(params)
+    , _renderScale(renderScale)
+    , _halo(halo)
+    , _bandHeight(bandHeight)
+    , _nBands((src.height() + bandHeight - 1) / bandHeight)
+    {
+    }
+
+    virtual void multiThreadFunction(unsigned int threadID, unsigned int nThreads) OVERRIDE FINAL
+    {
+        for (int band = threadID; band < _nBands; band += nThreads) {
+            const int y1 = band * _bandHeight;
+            const int y2 = std::min(_src.height(), y1 + _bandHeight);
+            const int y1Halo = std::max(0, y1 - _halo);
+            const int y2Halo = std::min(_src.height(), y2 + _halo);
+            cimg_library::CImg<float> cimg = _src.get_crop(0, y1Halo, 0, 0, _src.width() - 1, y2Halo - 1, 0, _src.spectrum() - 1);
+            blurAnisotropic(cimg, _params, _renderScale);
+            cimg_forC(_dst, c) {
+                for (int y = y1; y < y2; ++y) {
+                    std::memcpy(_dst.data(0, y, 0, c), cimg.data(0, y - y1Halo, 0, c), _dst.width() * sizeof(float));
+                }
+            }
+        }
+    }
+
+    static void
+    blurAnisotropic(cimg_library::CImg<float>& cimg, const CImgSmoothParams& params, const OfxPointD& renderScale)
+    {
+        cimg.blur_anisotropic(params.amplitude * renderScale.x, // in pixels
+                              params.sharpness,
+                              params.anisotropy,
+                              params.alpha * renderScale.x, // in pixels
+                              params.sigma * renderScale.x, // in pixels
+                              params.dl, // in pixel, but we don't discretize more
+                              params.da,
+                              params.gprec,
+                              params.interp_i,
+                              params.fast_approx);
+    }
+
+private:
+    const cimg_library::CImg<float>& _src;
+    cimg_library::CImg<float>& _dst;
+    const CImgSmoothParams& _params;
+    const OfxPointD _renderScale;
+    const int _halo;
+    const int _bandHeight;
+    const int _nBands;
+};
+
 class CImgSmoothPlugin : public CImgFilterPluginHelper<CImgSmoothParams,false>
 {
 public:
@@ -230,7 +298,7 @@ public:
     // only called if mix != 0.
     virtual void getRoI(const OfxRectI& rect, const OfxPointD& renderScale, const CImgSmoothParams& params, OfxRectI* roi) OVERRIDE FINAL
     {
-        int delta_pix = std::ceil((params.amplitude + params.alpha + params.sigma) * renderScale.x);
+        int delta_pix = getHalo(renderScale, params);
         roi->x1 = rect.x1 - delta_pix;
         roi->x2 = rect.x2 + delta_pix;
         roi->y1 = rect.y1 - delta_pix;
@@ -241,17 +309,24 @@ public:
     {
         // PROCESSING.
         // This is the only place where the actual processing takes place
-        cimg.blur_anisotropic(params.amplitude * args.renderScale.x, // in pixels
-                              params.sharpness,
-                              params.anisotropy,
-                              params.alpha * args.renderScale.x, // in pixels
-                              params.sigma * args.renderScale.x, // in pixels
-                              params.dl, // in pixel, but we don't discretize more
-                              params.da,
-                              params.gprec,
-                              params.interp_i,
-                              params.fast_approx);
-
+#ifdef cimg_use_openmp
+        // CImg already parallelizes the LIC integration
+        const int nBands = 1;
+#else
+        const int halo = getHalo(args.renderScale, params);
+        const int bandHeight = std::max(kBandHeight, 2 * halo);
+        const int nBands = (cimg.height() + bandHeight - 1) / bandHeight;
+#endif
+        if (nBands <= 1) {
+            CImgSmoothBandProcessor::blurAnisotropic(cimg, params, args.renderScale);
+            return;
+        }
+#ifndef cimg_use_openmp
+        // the source must not be modified while bands are processed, since the halos overlap
+        const cimg_library::CImg<float> src(cimg, false);
+        CImgSmoothBandProcessor processor(src, cimg, params, args.renderScale, halo, bandHeight);
+        processor.multiThread(std::min(nBands, (int)OFX::MultiThread::getNumCPUs()));
+#endif
     }
 
     virtual bool isIdentity(const OFX::IsIdentityArguments &/*args*/, const CImgSmoothParams& params) OVERRIDE FINAL
@@ -261,6 +336,13 @@ public:
 
 private:
 
+    // the maximum streamline length plus the smoothing of the structure tensors
+    static int
+    getHalo(const OfxPointD& renderScale, const CImgSmoothParams& params)
+    {
+        return (int)std::ceil((params.amplitude + params.alpha + params.sigma) * renderScale.x);
+    }
+
     // params
     OFX::DoubleParam *_amplitude;
     OFX::DoubleParam *_sharpness;
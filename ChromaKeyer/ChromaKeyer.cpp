@@ -74,6 +74,8 @@
 
 #include <cmath>
 #include <limits>
+#include <vector>
+#include <algorithm>
 #ifdef _WINDOWS
 #include <windows.h>
 #endif
@@ -81,6 +83,8 @@
 #include "ofxsProcessing.H"
 #include "ofxsMacros.h"
 
+#include "KeyerRows.h"
+
 #define kPluginName "ChromaKeyerOFX"
 #define kPluginGrouping "Keyer"
 #define kPluginDescription "Apply chroma keying"
@@ -160,19 +164,6 @@
 #define kClipInsideMask "InM"
 #define kClipOutsidemask "OutM"
 
-enum OutputModeEnum {
-    eOutputModeIntermediate,
-    eOutputModePremultiplied,
-    eOutputModeUnpremultiplied,
-    eOutputModeComposite,
-};
-
-enum SourceAlphaEnum {
-    eSourceAlphaIgnore,
-    eSourceAlphaAddToInsideMask,
-    eSourceAlphaNormal,
-};
-
 using namespace OFX;
 
 class ChromaKeyerProcessorBase : public OFX::ImageProcessor
@@ -291,26 +282,8 @@ public:
 };
 
 
-template<class PIX, int maxValue>
-static float sampleToFloat(PIX value)
-{
-    return (maxValue == 1) ? value : (value / (float)maxValue);
-}
-
-template<class PIX, int maxValue>
-static PIX floatToSample(float value)
-{
-    if (maxValue == 1) {
-        return value;
-    }
-    if (value <= 0) {
-        return 0;
-    } else if (value >= 1.) {
-        return maxValue;
-    }
-    return value * maxValue + 0.5;
-}
-
+// Each row is loaded into float planes, and the key generator, nonadditive mix, foreground suppressor
+// and key processor are computed in a single branch-free loop over the row, which the compiler vectorizes.
 template <class PIX, int nComponents, int maxValue>
 class ChromaKeyerProcessor : public ChromaKeyerProcessorBase
 {
@@ -323,238 +296,124 @@ public:
 private:
     void multiThreadProcessImages(OfxRectI procWindow)
     {
+        // The conversion to YCbCr (see rgb2ycbcr) and the rotation of the normalized chrominance
+        // (Cb',Cr') = 2*(Cb,Cr) by the key color angle are folded into a single matrix, which gives (Y,X,Z) from (R,G,B).
+        const double cbr = -0.2627/1.8814, cbg = -0.6780/1.8814, cbb = (1.-0.0593)/1.8814;
+        const double crr = (1.-0.2627)/1.4746, crg = -0.6780/1.4746, crb = -0.0593/1.4746;
+        const float yr = 0.2627f, yg = 0.6780f, yb = 0.0593f;
+        const float xr = 2*(_cosKey*cbr + _sinKey*crr);
+        const float xg = 2*(_cosKey*cbg + _sinKey*crg);
+        const float xb = 2*(_cosKey*cbb + _sinKey*crb);
+        const float zr = 2*(-_sinKey*cbr + _cosKey*crr);
+        const float zg = 2*(-_sinKey*cbg + _cosKey*crg);
+        const float zb = 2*(-_sinKey*cbb + _cosKey*crb);
+        // back from (X,Z) to (Cb,Cr)
+        const float halfCos = _cosKey / 2;
+        const float halfSin = _sinKey / 2;
+
+        // constants of the per-pixel computations
+        const bool acceptAll = (_acceptanceAngle >= 180.);
+        const float tanAcceptance = _tan_acceptanceAngle_2;
+        const float invTanAcceptance = (_tan_acceptanceAngle_2 > 0.) ? (float)(1. / _tan_acceptanceAngle_2) : 0.f;
+        const bool suppressAll = (_suppressionAngle >= 180.);
+        const float tanSuppression = _tan_suppressionAngle_2;
+        const float ys = _ys;
+        const bool suppress = (_outputMode != eOutputModeIntermediate);
+        const bool addSourceAlpha = (_sourceAlpha == eSourceAlphaAddToInsideMask && nComponents == 4);
+        const bool useCompAlpha = (_outputMode == eOutputModeComposite && _sourceAlpha == eSourceAlphaNormal && nComponents == 4);
+        // the key processor is Kbg = keyScale * Kfg + keyOffset, clamped to [0,1],
+        // or a step function at keyThreshold if the ramp is degenerate
+        const bool keyStep = (_keyGain <= 0. || _keyLift >= 1.);
+        const float keyThreshold = (_keyGain <= 0.) ? std::numeric_limits<float>::min() : (float)(_keyGain * _xKey);
+        const float keyScale = keyStep ? 0.f : (float)(1. / (_keyGain * _xKey * (1. - _keyLift)));
+        const float keyOffset = keyStep ? 0.f : (float)(-_keyLift / (1. - _keyLift));
+
+        const int n = procWindow.x2 - procWindow.x1;
+        KeyerRowBuffer row(n);
+        float *fgr = row.fgr;
+        float *fgg = row.fgg;
+        float *fgb = row.fgb;
+        float *fga = row.fga;
+        const float *srcValid = row.srcValid;
+        const float *inMask = row.inMask;
+        const float *outMask = row.outMask;
+        float *Kbg = row.Kbg;
+
         for (int y = procWindow.y1; y < procWindow.y2; ++y) {
             if (_effect.abort()) {
                 break;
             }
 
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-            assert(dstPix);
-
-            for (int x = procWindow.x1; x < procWindow.x2; ++x, dstPix += nComponents) {
-                
-                const PIX *srcPix = (const PIX *)  (_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
-                const PIX *bgPix = (const PIX *)  (_bgImg ? _bgImg->getPixelAddress(x, y) : 0);
-                const PIX *inMaskPix = (const PIX *)  (_inMaskImg ? _inMaskImg->getPixelAddress(x, y) : 0);
-                const PIX *outMaskPix = (const PIX *)  (_outMaskImg ? _outMaskImg->getPixelAddress(x, y) : 0);
-
-                float inMask = inMaskPix ? *inMaskPix : 0.;
-                if (_sourceAlpha == eSourceAlphaAddToInsideMask && nComponents == 4 && srcPix) {
-                    // take the max of inMask and the source Alpha
-                    inMask = std::max(inMask, sampleToFloat<PIX,maxValue>(srcPix[3]));
-                }
-                float outMask = outMaskPix ? *outMaskPix : 0.;
-                float Kbg = 0.;
+            row.load<PIX,nComponents,maxValue>(_srcImg, _bgImg, _inMaskImg, _outMaskImg, procWindow.x1, y);
 
+            for (int k = 0; k < n; ++k) {
+                // take the max of inMask and the source Alpha
+                float inM = addSourceAlpha ? std::max(inMask[k], fga[k]) : inMask[k];
                 // clamp inMask and outMask in the [0,1] range
-                inMask = std::max(0.f,std::min(inMask,1.f));
-                outMask = std::max(0.f,std::min(outMask,1.f));
-
-                // output of the foreground suppressor
-                double fgr = srcPix ? sampleToFloat<PIX,maxValue>(srcPix[0]) : 0.;
-                double fgg = srcPix ? sampleToFloat<PIX,maxValue>(srcPix[1]) : 0.;
-                double fgb = srcPix ? sampleToFloat<PIX,maxValue>(srcPix[2]) : 0.;
-                double bgr = bgPix ? sampleToFloat<PIX,maxValue>(bgPix[0]) : 0.;
-                double bgg = bgPix ? sampleToFloat<PIX,maxValue>(bgPix[1]) : 0.;
-                double bgb = bgPix ? sampleToFloat<PIX,maxValue>(bgPix[2]) : 0.;
-
-                // we want to be able to play with the matte even if the background is not connected
-                if (!srcPix) {
-                    // no source, take only background
-                    Kbg = 1.;
-                    fgr = fgg = fgb = 0.;
-                } else if (outMask >= 1.) { // optimize
-                    Kbg = 1.;
-                    fgr = fgg = fgb = 0.;
-                } else {
-                    // general case: compute Kbg from [1]
-
-                    // first, we need to compute YCbCr coordinates.
-
-
-                    double fgy, fgcb, fgcr;
-                    rgb2ycbcr(fgr, fgg, fgb, &fgy, &fgcb, &fgcr);
-                    //assert(-0.5 <= fgcb && fgcb <= 0.5); // may crash on superblacks/superwhites
-                    //assert(-0.5 <= fgcr && fgcr <= 0.5);
-
-                    ///////////////////////
-                    // STEP A: Key Generator
-
-                    // First, we rotate (Cb, Cr) coordinate system by an angle defined by the key color to obtain (X,Z) coordinate system.
-
-                    // normalize fgcb and fgcr (which are in [-0.5,0.5]) to the [-1,1] interval
-                    double fgcbp = fgcb * 2;
-                    double fgcrp = fgcr * 2;
-                    //assert(-1. <= fgcbp && fgcbp <= 1.);
-                    //assert(-1. <= fgcrp && fgcrp <= 1.);
-
-                    /* Convert foreground to XZ coords where X direction is defined by
-                     the key color */
-
-                    double fgx = _cosKey * fgcbp + _sinKey * fgcrp;
-                    double fgz = -_sinKey * fgcbp + _cosKey * fgcrp;
-                    // Since Cb ́ and Cr ́ are normalized to have a range of ±1, X and Z have a range of ±1.
-
-                    // Second, we use a parameter alfa (60 to 120 degrees were used for different images) to divide the color space into two regions, one where the processing will be applied and the one where foreground will not be changed (where Kbg = 0 and blue_backing_contrubution = 0 in eq.1 above).
-                    /* WARNING: accept angle should never be set greater than "somewhat less
-                     than 90 degrees" to avoid dealing with negative/infinite tg. In reality,
-                     80 degrees should be enough if foreground is reasonable. If this seems
-                     to be a problem, go to alternative ways of checking point position
-                     (scalar product or line equations). This angle should not be too small
-                     either to avoid infinite ctg (used to suppress foreground without use of
-                     division)*/
-
-                    double Kfg;
-
-                    if (fgx <= 0 || (_acceptanceAngle >= 180. && fgx >= 0) || std::abs(fgz)/fgx > _tan_acceptanceAngle_2) {
-                        /* keep foreground Kfg = 0*/
-                        Kfg = 0.;
-                    } else {
-                        Kfg = _tan_acceptanceAngle_2 > 0 ? (fgx - std::abs(fgz)/_tan_acceptanceAngle_2) : 0.;
-                    }
-                    assert(Kfg >= 0.);
-                    double fgx_scaled = fgx;
-                    ///////////////
-                    // STEP B: Nonadditive Mix
-
-                    // nonadditive mix between the key generator and the garbage matte (outMask)
-
-                    // The garbage matte is added to the foreground key signal (KFG) using a non-additive mixer (NAM). A nonadditive mixer takes the brighter of the two pictures, on a sample-by-sample basis, to generate the key signal. Matting is ideal for any source that generates its own keying signal, such as character generators, and so on.
-
-                    // outside mask has priority over inside mask, treat inside first
-
-                    // Here, Kfg is between 0 (foreground) and _xKey (background)
-                    double Kfg_new = Kfg;
-                    if (inMask > 0. && Kfg > 1.-inMask) {
-                        Kfg_new = 1.-inMask;
-                    }
-                    if (outMask > 0. && Kfg < outMask) {
-                        Kfg_new = outMask;
-                    }
-                    if (Kfg != 0.) {
-                        // modify the fgx used for the suppression angle test
-                        fgx_scaled = Kfg_new + std::abs(fgz)/_tan_acceptanceAngle_2;
-                    }
-                    Kfg = Kfg_new;
-
-                    //////////////////////
-                    // STEP C: Foreground suppressor
-
-                    if (_outputMode != eOutputModeIntermediate) {
-                        // The foreground suppressor reduces foreground color information by implementing X = X – KFG, with the key color being clamped to the black level.
-
-                        //fgx = fgx - Kfg;
-
-                        // there seems to be an error in the book here: there should be primes (') in the formula:
-                        // CbFG =Cb–KFG cosθ
-                        // CrFG = Cr – KFG sin θ
-                        // [FD] there is an error in the paper, which doesn't take into account chrominance denormalization:
-                        // (X,Z) was computed from twice the chrominance, so subtracting Kfg from X means to
-                        // subtract Kfg/2 from (Cb,Cr).
-                        if (fgx_scaled > 0 && (_suppressionAngle >= 180. || fgx_scaled - std::abs(fgz)/_tan_suppressionAngle_2 > 0.)) {
-                            fgcb = 0;
-                            fgcr = 0;
-                        } else {
-                            fgcb = fgcb - Kfg * _cosKey / 2;
-                            fgcr = fgcr - Kfg * _sinKey / 2;
-                            fgcb = std::max(-0.5,std::min(fgcb,0.5));
-                            fgcr = std::max(-0.5,std::min(fgcr,0.5));
-                            //assert(-0.5 <= fgcb && fgcb <= 0.5);
-                            //assert(-0.5 <= fgcr && fgcr <= 0.5);
-                        }
-
-                        // Foreground luminance, after being normalized to have a range of 0–1, is suppressed by:
-                        // YFG = Y ́ – yS*KFG
-                        // YFG = 0 if yS*KFG > Y ́
-                        // [FD] the luminance is already normalized
-
-                        // Y' = Y - y*Kfg, where y is such that Y' = 0 for the key color.
-                        fgy = fgy - _ys * Kfg;
-                        if (fgy < 0) {
-                            fgy = fgr = fgg = fgb = 0;
-                        } else {
-                            // convert back to r g b
-                            // (note: r,g,b is premultiplied since it should be added to the suppressed background)
-                            ycbcr2rgb(fgy, fgcb, fgcr, &fgr, &fgg, &fgb);
-                            fgr = std::max(0.,std::min(fgr,1.));
-                            fgg = std::max(0.,std::min(fgg,1.));
-                            fgb = std::max(0.,std::min(fgb,1.));
-                        }
-                    }
-                    /////////////////////
-                    // STEP D: Key processor
-
-                    // The key processor generates the initial background key signal (K ́BG) used to remove areas of the background image where the foreground is to be visible.
-                    // [FD] we don't implement the key lift (kL), just the key gain (kG)
-                    // kG = 1/_xKey, since Kbg should be 1 at the key color
-                    // in our implementation, _keyGain is a multiplier of xKey (1 by default) and keylift is the fraction (from 0 to 1) of _keyGain*_xKey where the linear ramp begins
-                    if (_keyGain <= 0.) {
-                        if (Kfg > 0.) {
-                            Kbg = 1.;
-                        } else {
-                            Kbg = 0.;
-                        }
-                    } else if (_keyLift >= 1.) {
-                        if (Kfg >= _keyGain*_xKey) {
-                            Kbg = 1.;
-                        } else {
-                            Kbg = 0.;
-                        }
-                    } else {
-                        assert(_keyGain > 0. && 0. <= _keyLift && _keyLift < 1.);
-                        Kbg = (Kfg/(_keyGain*_xKey) -_keyLift)/ (1.-_keyLift);
-                    }
-                    //Kbg = Kfg/_xKey; // if _keyGain = 1 and _keyLift = 0
-                    if (Kbg > 1.) {
-                        Kbg = 1.;
-                    } else if (Kbg < 0.) {
-                        Kbg = 0.;
-                    }
-
-                    // Additional controls may be implemented to enable the foreground and background signals to be controlled independently. Examples are adjusting the contrast of the foreground so it matches the background or fading the fore- ground in various ways (such as fading to the background to make a foreground object van- ish or fading to black to generate a silhouette).
-                    // In the computer environment, there may be relatively slow, smooth edges—especially edges involving smooth shading. As smooth edges are easily distorted during the chroma keying process, a wide keying process is usu- ally used in these circumstances. During wide keying, the keying signal starts before the edge of the graphic object.
+                inM = std::max(0.f, std::min(inM, 1.f));
+                const float outM = std::max(0.f, std::min(outMask[k], 1.f));
+                const float r = fgr[k];
+                const float g = fgg[k];
+                const float b = fgb[k];
+
+                // YCbCr coordinates, in the (X,Z) coordinate system where the X direction is defined by the key color
+                const float fgy = yr * r + yg * g + yb * b;
+                const float fgx = xr * r + xg * g + xb * b;
+                const float fgz = zr * r + zg * g + zb * b;
+                const float absz = std::abs(fgz);
+
+                // STEP A: Key Generator
+                // Kfg is 0 outside of the acceptance angle
+                const bool accepted = !acceptAll && fgx > 0.f && absz <= tanAcceptance * fgx;
+                const float Kfg = (accepted && invTanAcceptance > 0.f) ? std::max(0.f, fgx - absz * invTanAcceptance) : 0.f;
+
+                // STEP B: Nonadditive Mix
+                // nonadditive mix between the key generator and the garbage matte (outMask)
+                // outside mask has priority over inside mask, treat inside first
+                float Kfg_new = (inM > 0.f && Kfg > 1.f - inM) ? 1.f - inM : Kfg;
+                Kfg_new = (outM > 0.f && Kfg < outM) ? outM : Kfg_new;
+                // modify the fgx used for the suppression angle test
+                const float fgx_scaled = (Kfg != 0.f) ? Kfg_new + absz * invTanAcceptance : fgx;
+
+                // STEP C: Foreground suppressor
+                // X = X - Kfg, and the chrominance inside the suppression angle is set to zero.
+                // Since (X,Z) was computed from twice the chrominance, this subtracts Kfg/2 from (Cb,Cr).
+                float outr = 0.f;
+                float outg = 0.f;
+                float outb = 0.f;
+                if (suppress) {
+                    const bool zeroChroma = fgx_scaled > 0.f && (suppressAll || fgx_scaled * tanSuppression > absz);
+                    const float x = fgx - Kfg_new;
+                    const float fgcb = zeroChroma ? 0.f : std::max(-0.5f, std::min(halfCos * x - halfSin * fgz, 0.5f));
+                    const float fgcr = zeroChroma ? 0.f : std::max(-0.5f, std::min(halfSin * x + halfCos * fgz, 0.5f));
+                    // Y' = Y - ys*Kfg, where ys is such that Y' = 0 for the key color.
+                    const float fgy_new = fgy - ys * Kfg_new;
+                    // convert back to r g b (see ycbcr2rgb)
+                    // (note: r,g,b is premultiplied since it should be added to the suppressed background)
+                    const float rr = fgcr * 1.4746f + fgy_new;
+                    const float bb = fgcb * 1.8814f + fgy_new;
+                    const float gg = (fgy_new - 0.2627f * rr - 0.0593f * bb) * (1.f / 0.6780f);
+                    const bool black = (fgy_new < 0.f);
+                    outr = black ? 0.f : std::max(0.f, std::min(rr, 1.f));
+                    outg = black ? 0.f : std::max(0.f, std::min(gg, 1.f));
+                    outb = black ? 0.f : std::max(0.f, std::min(bb, 1.f));
                 }
 
-                // At this point, we have Kbg,
-
-                // set the alpha channel to the complement of Kbg
-                double fga = 1. - Kbg;
-                //double fga = Kbg;
-                assert(fga >= 0. && fga <= 1.);
-                double compAlpha = (_outputMode == eOutputModeComposite &&
-                                    _sourceAlpha == eSourceAlphaNormal &&
-                                    srcPix) ? sampleToFloat<PIX,maxValue>(srcPix[3]) : 1.;
-                switch (_outputMode) {
-                    case eOutputModeIntermediate:
-                        for (int c = 0; c < 3; ++c) {
-                            dstPix[c] = srcPix ? srcPix[c] : 0;
-                        }
-                        break;
-                    case eOutputModePremultiplied:
-                        dstPix[0] = floatToSample<PIX,maxValue>(fgr);
-                        dstPix[1] = floatToSample<PIX,maxValue>(fgg);
-                        dstPix[2] = floatToSample<PIX,maxValue>(fgb);
-                        break;
-                    case eOutputModeUnpremultiplied:
-                        if (fga == 0.) {
-                            dstPix[0] = dstPix[1] = dstPix[2] = maxValue;
-                        } else {
-                            dstPix[0] = floatToSample<PIX,maxValue>(fgr / fga);
-                            dstPix[1] = floatToSample<PIX,maxValue>(fgg / fga);
-                            dstPix[2] = floatToSample<PIX,maxValue>(fgb / fga);
-                        }
-                        break;
-                    case eOutputModeComposite:
-                        // [FD] not sure if this is the expected way to use compAlpha
-                        dstPix[0] = floatToSample<PIX,maxValue>(compAlpha * (fgr + bgr * Kbg) + (1.-compAlpha) * bgr);
-                        dstPix[1] = floatToSample<PIX,maxValue>(compAlpha * (fgg + bgg * Kbg) + (1.-compAlpha) * bgg);
-                        dstPix[2] = floatToSample<PIX,maxValue>(compAlpha * (fgb + bgb * Kbg) + (1.-compAlpha) * bgb);
-                        break;
-                }
-                if (nComponents == 4) {
-                    dstPix[3] = floatToSample<PIX,maxValue>(fga);
-                }
+                // STEP D: Key processor
+                // in our implementation, _keyGain is a multiplier of xKey (1 by default) and keylift is the fraction (from 0 to 1) of _keyGain*_xKey where the linear ramp begins
+                const float bgKey = keyStep ? ((Kfg_new >= keyThreshold) ? 1.f : 0.f) : std::max(0.f, std::min(keyScale * Kfg_new + keyOffset, 1.f));
+
+                // we want to be able to play with the matte even if the background is not connected:
+                // with no source, or if outMask is 1, take only background
+                const bool bgOnly = (srcValid[k] == 0.f || outM >= 1.f);
+                fgr[k] = bgOnly ? 0.f : outr;
+                fgg[k] = bgOnly ? 0.f : outg;
+                fgb[k] = bgOnly ? 0.f : outb;
+                Kbg[k] = bgOnly ? 1.f : bgKey;
+                fga[k] = (useCompAlpha && srcValid[k] != 0.f) ? fga[k] : 1.f; // compAlpha
             }
+
+            row.store<PIX,nComponents,maxValue>(_dstImg, _srcImg, procWindow.x1, y, _outputMode, true);
         }
     }
 
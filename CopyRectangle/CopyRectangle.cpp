@@ -80,6 +80,8 @@
 #include "ofxsMaskMix.h"
 #include "ofxsMacros.h"
 
+#include "RectangleEdges.h"
+
 #define kPluginName "CopyRectangleOFX"
 #define kPluginGrouping "Merge"
 #define kPluginDescription "Copies a rectangle from the input A to the input B in output. It can be used to limit an effect to a rectangle of the original image by plugging the original image into the input B."
@@ -123,6 +125,7 @@ protected:
     bool   _doMasking;
     double _mix;
     bool _maskInvert;
+    RectangleEdgeTable _xEdges, _yEdges; // the separable weights of A
 
 public:
     CopyRectangleProcessorBase(OFX::ImageEffect &instance)
@@ -167,6 +170,32 @@ public:
         _mix = mix;
     }
 
+private:
+    // weight of A at index i in [r1,r2): the fade is applied only within the rectangle
+    double edgeWeight(int i, int r1, int r2) const
+    {
+        if (i < r1 || i >= r2) {
+            return 0.;
+        }
+        // distance to the nearest edge
+        int distance = std::min(i - r1, r2 - 1 - i);
+        return distance < _softness ? (double)distance / _softness : 1.;
+    }
+
+    // the weights only depend on the column or on the row: compute them once for the render window
+    virtual void preProcess() OVERRIDE FINAL
+    {
+        _xEdges.reset(_renderWindow.x1, _renderWindow.x2);
+        for (int x = _renderWindow.x1; x < _renderWindow.x2; ++x) {
+            _xEdges.set(x, edgeWeight(x, _rectangle.x1, _rectangle.x2));
+        }
+        _xEdges.finalize();
+        _yEdges.reset(_renderWindow.y1, _renderWindow.y2);
+        for (int y = _renderWindow.y1; y < _renderWindow.y2; ++y) {
+            _yEdges.set(y, edgeWeight(y, _rectangle.y1, _rectangle.y2));
+        }
+        _yEdges.finalize();
+    }
 };
 
 
@@ -185,66 +214,70 @@ private:
     void multiThreadProcessImages(OfxRectI procWindow)
     {
         assert(nComponents == 1 || nComponents == 3 || nComponents == 4);
-        double yMultiplier,xMultiplier;
         float tmpPix[nComponents];
 
-        //assert(filter == _filter);
+        // inside of the rectangle, A replaces B if all channels are processed
+        bool allProcessed = true;
+        for (int k = 0; k < nComponents; ++k) {
+            allProcessed = allProcessed && _process[(nComponents) == 1 ? 3 : k];
+        }
+        const bool copyA = allProcessed && !_doMasking && _mix == 1.;
+        // where A has no weight, B is copied, unless the pixels of the rectangle are masked or mixed,
+        // which may round them differently
+        const bool copyB = !_doMasking && _mix == 1.;
+
         for (int y = procWindow.y1; y < procWindow.y2; ++y) {
             if (_effect.abort()) {
                 break;
             }
             
             PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+            const double yMultiplier = _yEdges.weight(y);
+            const bool yInRectangle = (_rectangle.y1 <= y && y < _rectangle.y2);
 
-            // distance to the nearest rectangle area horizontal edge
-            int yDistance =  std::min(y - _rectangle.y1, _rectangle.y2 - 1 - y);
-            
-            // handle softness
-            bool yInRectangle = y >= _rectangle.y1 && y < _rectangle.y2;
-            if (yInRectangle) {
-                ///apply softness only within the rectangle
-                yMultiplier = yDistance < _softness ? (double)yDistance / _softness : 1.;
-            } else {
-                yMultiplier = 1.;
+            if (!yInRectangle || (yMultiplier <= 0. && copyB)) {
+                // outside of the rectangle (or on its edge, where A has no weight): copy B
+                rectangleEdgesCopyRow<PIX, nComponents>(_srcImgB, procWindow.x1, procWindow.x2, y, 0, 0, dstPix);
+                continue;
             }
 
-            for (int x = procWindow.x1; x < procWindow.x2; ++x, dstPix += nComponents) {
-                
-                // distance to the nearest rectangle area vertical edge
-                int xDistance =  std::min(x - _rectangle.x1, _rectangle.x2 - 1 - x);
-                // handle softness
-                bool xInRectangle = x >= _rectangle.x1 && x < _rectangle.x2;
-                
-                if (xInRectangle) {
-                    ///apply softness only within the rectangle
-                    xMultiplier = xDistance < _softness ? (double)xDistance / _softness : 1.;
+            int x = procWindow.x1;
+            while (x < procWindow.x2) {
+                double xMultiplier;
+                const int xEnd = _xEdges.getSpan(x, procWindow.x2, &xMultiplier);
+                if (xMultiplier == 0. && copyB) {
+                    rectangleEdgesCopyRow<PIX, nComponents>(_srcImgB, x, xEnd, y, 0, 0, dstPix);
+                    dstPix += (xEnd - x) * nComponents;
+                    x = xEnd;
+                } else if (xMultiplier == 1. && yMultiplier >= 1. && copyA) {
+                    rectangleEdgesCopyRow<PIX, nComponents>(_srcImgA, x, xEnd, y, 0, 0, dstPix);
+                    dstPix += (xEnd - x) * nComponents;
+                    x = xEnd;
                 } else {
-                    xMultiplier = 1.;
-                }
-                
-                const PIX *srcPixB = _srcImgB ?(const PIX*)_srcImgB->getPixelAddress(x, y) : NULL;
-
-                if (xInRectangle && yInRectangle) {
-                    const PIX *srcPixA = _srcImgA ? (const PIX*)_srcImgA->getPixelAddress(x, y) : NULL;
-
-                    double multiplier = xMultiplier * yMultiplier;
-
-                    for (int k = 0; k < nComponents; ++k) {
-                        if (!_process[(nComponents) == 1 ? 3 : k]) {
-                            tmpPix[k] = srcPixB ? srcPixB[k] : 0.;
-                        } else {
-                            PIX A = srcPixA ? srcPixA[k] : 0.;
-                            PIX B = srcPixB ? srcPixB[k] : 0.;
-                            tmpPix[k] = A *  multiplier + B * (1. - multiplier) ;
+                    for (; x < xEnd; ++x, dstPix += nComponents) {
+                        const PIX *srcPixB = _srcImgB ? (const PIX*)_srcImgB->getPixelAddress(x, y) : NULL;
+                        if (x < _rectangle.x1 || _rectangle.x2 <= x) {
+                            for (int k = 0; k < nComponents; ++k) {
+                                dstPix[k] = srcPixB ? srcPixB[k] : 0.;
+                            }
+                            continue;
                         }
-                    }
-                    ofxsMaskMixPix<PIX, nComponents, maxValue, true>(tmpPix, x, y, srcPixB, _doMasking, _maskImg, _mix, _maskInvert, dstPix);
-                } else {
-                    for (int k = 0; k < nComponents; ++k) {
-                        dstPix[k] = srcPixB ? srcPixB[k] : 0.;
+                        const PIX *srcPixA = _srcImgA ? (const PIX*)_srcImgA->getPixelAddress(x, y) : NULL;
+
+                        double multiplier = (xMultiplier < 0. ? _xEdges.weight(x) : xMultiplier) * yMultiplier;
+
+                        for (int k = 0; k < nComponents; ++k) {
+                            if (!_process[(nComponents) == 1 ? 3 : k]) {
+                                tmpPix[k] = srcPixB ? srcPixB[k] : 0.;
+                            } else {
+                                PIX A = srcPixA ? srcPixA[k] : 0.;
+                                PIX B = srcPixB ? srcPixB[k] : 0.;
+                                tmpPix[k] = A *  multiplier + B * (1. - multiplier) ;
+                            }
+                        }
+                        ofxsMaskMixPix<PIX, nComponents, maxValue, true>(tmpPix, x, y, srcPixB, _doMasking, _maskImg, _mix, _maskInvert, dstPix);
                     }
                 }
-                
             }
         }
     }
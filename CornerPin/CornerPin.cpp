@@ -76,10 +76,11 @@
    library, that action is never called by the Nuke host, so it cannot be tested.
    The code is left here for reference or for further extension.
 
-   There is also an open question about how the last plugin in a transform chain
-   may get the concatenated transform from upstream, the untransformed source image,
-   concatenate its own transform and apply the resulting transform in its render
-   action. Should the host be doing this instead?
+   If the host concatenates the transforms, the source image may come with the
+   upstream transform attached to it (kFnOfxImageEffectCanTransform). The render
+   paths that bypass the generic Transform3x3 render compose that matrix with
+   their own transform (see transformComposeSourceTransform), but no host could
+   be found that exercises this, so it is untested as well.
 */
 // Uncomment the following to enable the experimental host transform code.
 #define ENABLE_HOST_TRANSFORM
@@ -87,6 +88,7 @@
 #include "CornerPin.h"
 
 #include <cmath>
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <vector>
@@ -99,6 +101,10 @@
 
 #include "ofxsOGLTextRenderer.h"
 #include "ofxsTransform3x3.h"
+#include "ofxsFilter.h"
+#include "ofxsMaskMix.h"
+#include "ofxsProcessing.H"
+#include "TransformFastPath.h"
 
 #ifdef OFX_EXTENSIONS_NUKE
 #include "nuke/fnOfxExtensions.h"
@@ -339,14 +345,224 @@ translation_from_one_point(const OFX::Point3D &p1,
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+// Scanline fast path for the impulse and bilinear filters.
+// Along a scanline, the numerators and the denominator of the homography are
+// affine in x. The source position is computed exactly at both ends of each
+// block of pixels, and linearly interpolated in between, so that there are
+// only two divisions per block. The block is shortened until the interpolation
+// error, which is bounded by the second derivative of the mapping, is below
+// kScanlineTolerance source pixels (affine transforms are exactly linear).
+// The fast path is only used where all the filter taps fall inside the source
+// image, the rest goes through the generic Transform3x3 render.
+
+#define kScanlineBlockSize 64
+#define kScanlineTolerance 1e-3
+#define kScanlineGenericWaste 1.25 // a generic rectangle may render up to this times the pixels it is needed for...
+#define kScanlineGenericSlack 4096 // ...plus this number of pixels
+
+template <class PIX, int nComponents, int maxValue, OFX::FilterEnum filter>
+class CornerPinScanlineProcessor : public OFX::ImageProcessor
+{
+public:
+    CornerPinScanlineProcessor(OFX::ImageEffect &instance)
+    : OFX::ImageProcessor(instance)
+    , _srcImg(0)
+    , _rowX1(0)
+    , _rowX2(0)
+    {
+    }
+
+    void setSrcImg(const OFX::Image *v) {_srcImg = v;}
+
+    // H maps destination pixel coordinates to source pixel coordinates.
+    // rowX1 and rowX2 give the span of each row of the render window to be processed.
+    void setValues(const OFX::Matrix3x3& H, const int *rowX1, const int *rowX2)
+    {
+        _H = H;
+        _rowX1 = rowX1;
+        _rowX2 = rowX2;
+    }
+
+private:
+    void multiThreadProcessImages(OfxRectI procWindow)
+    {
+        const OFX::Matrix3x3& H = _H;
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if (_effect.abort()) {
+                break;
+            }
+            const int x1 = std::max(procWindow.x1, _rowX1[y - _renderWindow.y1]);
+            const int x2 = std::min(procWindow.x2, _rowX2[y - _renderWindow.y1]);
+            if (x1 >= x2) {
+                continue;
+            }
+            const double yc = y + 0.5;
+            const double P = H.b * yc + H.c;
+            const double Q = H.e * yc + H.f;
+            const double Z = H.h * yc + H.i;
+            // the second derivative of the source position along the row is 2 g K / pz^3,
+            // with K = a Z - g P for sx and K = d Z - g Q for sy
+            const double gK = std::max(std::fabs(H.g * (H.a * Z - H.g * P)), std::fabs(H.g * (H.d * Z - H.g * Q)));
+            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(x1, y);
+            assert(dstPix);
+            for (int x = x1; x < x2;) {
+                int n = std::min(kScanlineBlockSize, x2 - x);
+                const double xa = x + 0.5;
+                const double pza = H.g * xa + Z;
+                // linear interpolation over n pixels is off by at most (n-1)^2 / 8 * max|s''|
+                while (n > 2) {
+                    const double pzMin = std::min(pza, pza + H.g * (n - 1));
+                    if ((n - 1) * (n - 1) * gK <= 4. * kScanlineTolerance * pzMin * pzMin * pzMin) {
+                        break;
+                    }
+                    n /= 2;
+                }
+                double sx = (H.a * xa + P) / pza;
+                double sy = (H.d * xa + Q) / pza;
+                double dsx = 0.;
+                double dsy = 0.;
+                if (n > 1) {
+                    const double xb = xa + (n - 1);
+                    const double pzb = H.g * xb + Z;
+                    dsx = ((H.a * xb + P) / pzb - sx) / (n - 1);
+                    dsy = ((H.d * xb + Q) / pzb - sy) / (n - 1);
+                }
+                for (int k = 0; k < n; ++k, sx += dsx, sy += dsy, dstPix += nComponents) {
+                    if (filter == OFX::eFilterImpulse) {
+                        const PIX *p = (const PIX *) _srcImg->getPixelAddress((int)std::floor(sx), (int)std::floor(sy));
+                        assert(p);
+                        for (int c = 0; c < nComponents; ++c) {
+                            dstPix[c] = p[c];
+                        }
+                    } else {
+                        const double fx = sx - 0.5;
+                        const double fy = sy - 0.5;
+                        const int ix = (int)std::floor(fx);
+                        const int iy = (int)std::floor(fy);
+                        const float dx = (float)(fx - ix);
+                        const float dy = (float)(fy - iy);
+                        const PIX *p0 = (const PIX *) _srcImg->getPixelAddress(ix, iy);
+                        const PIX *p1 = (const PIX *) _srcImg->getPixelAddress(ix, iy + 1);
+                        assert(p0 && p1);
+                        for (int c = 0; c < nComponents; ++c) {
+                            const float v0 = p0[c] + dx * ((float)p0[c + nComponents] - (float)p0[c]);
+                            const float v1 = p1[c] + dx * ((float)p1[c + nComponents] - (float)p1[c]);
+                            dstPix[c] = transformFloatToPix<PIX, maxValue>(v0 + dy * (v1 - v0));
+                        }
+                    }
+                }
+                x += n;
+            }
+        }
+    }
+
+    const OFX::Image *_srcImg;
+    OFX::Matrix3x3 _H;
+    const int *_rowX1;
+    const int *_rowX2;
+};
+
+// renders the fast path spans with the processor matching the filter, see transformProcessForFormat()
+class CornerPinScanlineRenderer
+{
+public:
+    CornerPinScanlineRenderer(OFX::ImageEffect &effect, OFX::FilterEnum filter, const OFX::Image* src, OFX::Image* dst,
+                              const OfxRectI& window, const OFX::Matrix3x3& H, const int *rowX1, const int *rowX2)
+    : _effect(effect)
+    , _filter(filter)
+    , _src(src)
+    , _dst(dst)
+    , _window(window)
+    , _H(H)
+    , _rowX1(rowX1)
+    , _rowX2(rowX2)
+    {
+    }
+
+    template <class PIX, int nComponents, int maxValue>
+    void process()
+    {
+        if (_filter == OFX::eFilterImpulse) {
+            CornerPinScanlineProcessor<PIX, nComponents, maxValue, OFX::eFilterImpulse> processor(_effect);
+            setup(processor);
+            processor.process();
+        } else {
+            CornerPinScanlineProcessor<PIX, nComponents, maxValue, OFX::eFilterBilinear> processor(_effect);
+            setup(processor);
+            processor.process();
+        }
+    }
+
+private:
+    template <class Processor>
+    void setup(Processor& processor)
+    {
+        processor.setDstImg(_dst);
+        processor.setSrcImg(_src);
+        processor.setRenderWindow(_window);
+        processor.setValues(_H, _rowX1, _rowX2);
+    }
+
+    OFX::ImageEffect &_effect;
+    OFX::FilterEnum _filter;
+    const OFX::Image *_src;
+    OFX::Image *_dst;
+    OfxRectI _window;
+    OFX::Matrix3x3 _H;
+    const int *_rowX1;
+    const int *_rowX2;
+};
+
+// Intersect [*xmin,*xmax] with the solutions of alpha * x + beta >= 0
+static inline void
+intersectHalfLine(double alpha, double beta, double *xmin, double *xmax)
+{
+    if (alpha > 0.) {
+        *xmin = std::max(*xmin, -beta / alpha);
+    } else if (alpha < 0.) {
+        *xmax = std::min(*xmax, -beta / alpha);
+    } else if (beta < 0.) {
+        *xmin = 1.;
+        *xmax = 0.;
+    }
+}
+
+// Compute the pixels [*x1,*x2) of row y where the source point (mapped by H
+// from destination pixel coordinates) lies in [lo.x,hi.x)x[lo.y,hi.y) with a
+// positive denominator. The span is shrunk by one pixel on each side to be
+// robust to rounding errors.
+static void
+scanlineSpan(const OFX::Matrix3x3& H, int y, const OfxPointD& lo, const OfxPointD& hi, int *x1, int *x2)
+{
+    const double yc = y + 0.5;
+    const double P = H.b * yc + H.c;
+    const double Q = H.e * yc + H.f;
+    const double Z = H.h * yc + H.i;
+    double xmin = -1e30;
+    double xmax = 1e30;
+    intersectHalfLine(H.g, Z, &xmin, &xmax); // pz >= 0
+    intersectHalfLine(H.a - lo.x * H.g, P - lo.x * Z, &xmin, &xmax); // px >= lo.x * pz
+    intersectHalfLine(hi.x * H.g - H.a, hi.x * Z - P, &xmin, &xmax); // px <= hi.x * pz
+    intersectHalfLine(H.d - lo.y * H.g, Q - lo.y * Z, &xmin, &xmax); // py >= lo.y * pz
+    intersectHalfLine(hi.y * H.g - H.d, hi.y * Z - Q, &xmin, &xmax); // py <= hi.y * pz
+    if (xmin > xmax || (H.g == 0. && Z <= 0.)) {
+        *x1 = *x2 = 0;
+        return;
+    }
+    // pixel centers are at x + 0.5
+    *x1 = (int)std::max(-1e9, std::ceil(xmin - 0.5)) + 1;
+    *x2 = (int)std::min(1e9, std::floor(xmax - 0.5));
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
-class CornerPinPlugin : public Transform3x3Plugin
+class CornerPinPlugin : public TransformFastPathPlugin
 {
 public:
     /** @brief ctor */
     CornerPinPlugin(OfxImageEffectHandle handle, bool masked)
-    : Transform3x3Plugin(handle, masked)
+    : TransformFastPathPlugin(handle, masked)
     , _extraMatrixRow1(0)
     , _extraMatrixRow2(0)
     , _extraMatrixRow3(0)
@@ -371,9 +587,12 @@ public:
         _copyToButton = fetchPushButtonParam(kParamCopyTo);
         _copyInputButton = fetchPushButtonParam(kParamCopyInputRoD);
         assert(_copyInputButton && _copyToButton && _copyFromButton);
+
     }
 private:
-    
+    /* render using the scanline fast path. Returns false if it does not apply */
+    virtual bool renderFastPath(const OFX::RenderArguments &args) OVERRIDE FINAL;
+
     OFX::Matrix3x3 getExtraMatrix(OfxTime time) const
     {
         OFX::Matrix3x3 ret;
@@ -416,6 +635,160 @@ private:
     OFX::PushButtonParam* _copyInputButton;
 };
 
+// a band of rows [y1,y2) (relative to the render window) of the generic rendering extents
+struct CornerPinGenericBand
+{
+    int y1;
+    int y2;
+    int width;
+};
+
+// Cover the generic extents of the rows, of the given widths, with few bands: consecutive rows
+// are merged as long as the band does not render too many pixels that the fast path could do.
+// Each generic render call has a significant overhead (source fetch, processor setup).
+static void
+mergeGenericExtents(const std::vector<int>& widths, std::vector<CornerPinGenericBand>* bands)
+{
+    const int n = (int)widths.size();
+    int i = 0;
+    while (i < n) {
+        if (widths[i] <= 0) {
+            ++i;
+            continue;
+        }
+        CornerPinGenericBand band;
+        band.y1 = i;
+        band.width = widths[i];
+        double sum = widths[i];
+        int j = i + 1;
+        for (; j < n && widths[j] > 0; ++j) {
+            const int width = std::max(band.width, widths[j]);
+            if ((double)width * (j + 1 - i) > kScanlineGenericWaste * (sum + widths[j]) + kScanlineGenericSlack) {
+                break;
+            }
+            band.width = width;
+            sum += widths[j];
+        }
+        band.y2 = j;
+        bands->push_back(band);
+        i = j;
+    }
+}
+
+bool
+CornerPinPlugin::renderFastPath(const OFX::RenderArguments &args)
+{
+    const double time = args.time;
+
+    if (!canBypassGenericRender(args)) {
+        return false;
+    }
+    const OFX::FilterEnum filter = getFilter(time);
+    if (filter != OFX::eFilterImpulse && filter != OFX::eFilterBilinear) {
+        return false;
+    }
+    bool invert;
+    _invert->getValueAtTime(time, invert);
+    OFX::Matrix3x3 Hc;
+    if (!getInverseTransformCanonical(time, invert, &Hc)) {
+        return false;
+    }
+    OFX::Matrix3x3 H = transformPixelMatrix(Hc, srcClip_->getPixelAspectRatio(), dstClip_->getPixelAspectRatio(), args.renderScale);
+
+    const OfxRectI& renderWindow = args.renderWindow;
+    std::vector<OfxRectI> genericRects;
+    {
+        std::auto_ptr<const OFX::Image> src(srcClip_->fetchImage(time));
+        if (!src.get()) {
+            return false;
+        }
+        // the host may give us the untransformed upstream image, with its transform attached
+        if (!transformComposeSourceTransform(src.get(), &H)) {
+            return false;
+        }
+        std::auto_ptr<OFX::Image> dst(dstClip_->fetchImage(time));
+        if (!dst.get()) {
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+        if (dst->getRenderScale().x != args.renderScale.x ||
+            dst->getRenderScale().y != args.renderScale.y ||
+            dst->getField() != args.fieldToRender) {
+            setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+        if (src->getPixelDepth() != dst->getPixelDepth() || src->getPixelComponents() != dst->getPixelComponents()) {
+            return false;
+        }
+
+        // the region where all filter taps fall inside the source is convex: compute its span on
+        // each row, and cover the rest of the render window with a few generic rectangles
+        const OfxRectI& srcBounds = src->getBounds();
+        const double margin = (filter == OFX::eFilterImpulse) ? 0. : 0.5;
+        OfxPointD lo, hi;
+        lo.x = srcBounds.x1 + margin;
+        lo.y = srcBounds.y1 + margin;
+        hi.x = srcBounds.x2 - margin;
+        hi.y = srcBounds.y2 - margin;
+        const int height = renderWindow.y2 - renderWindow.y1;
+        std::vector<int> rowX1(height), rowX2(height);
+        for (int i = 0; i < height; ++i) {
+            int x1, x2;
+            scanlineSpan(H, renderWindow.y1 + i, lo, hi, &x1, &x2);
+            x1 = std::max(renderWindow.x1, x1);
+            x2 = std::min(renderWindow.x2, x2);
+            if (x1 >= x2) {
+                x1 = x2 = renderWindow.x2;
+            }
+            rowX1[i] = x1;
+            rowX2[i] = x2;
+        }
+
+        // left extents, then right extents: the fast path spans shrink to what the rectangles leave
+        std::vector<int> widths(height);
+        std::vector<CornerPinGenericBand> bands;
+        for (int i = 0; i < height; ++i) {
+            widths[i] = rowX1[i] - renderWindow.x1;
+        }
+        mergeGenericExtents(widths, &bands);
+        for (std::vector<CornerPinGenericBand>::const_iterator it = bands.begin(); it != bands.end(); ++it) {
+            OfxRectI r = { renderWindow.x1, renderWindow.y1 + it->y1, renderWindow.x1 + it->width, renderWindow.y1 + it->y2 };
+            genericRects.push_back(r);
+            for (int i = it->y1; i < it->y2; ++i) {
+                rowX1[i] = r.x2;
+            }
+        }
+        bands.clear();
+        for (int i = 0; i < height; ++i) {
+            widths[i] = renderWindow.x2 - std::max(rowX1[i], rowX2[i]);
+        }
+        mergeGenericExtents(widths, &bands);
+        for (std::vector<CornerPinGenericBand>::const_iterator it = bands.begin(); it != bands.end(); ++it) {
+            OfxRectI r = { renderWindow.x2 - it->width, renderWindow.y1 + it->y1, renderWindow.x2, renderWindow.y1 + it->y2 };
+            genericRects.push_back(r);
+            for (int i = it->y1; i < it->y2; ++i) {
+                rowX2[i] = r.x1;
+            }
+        }
+        bool fastPixels = false;
+        for (int i = 0; i < height && !fastPixels; ++i) {
+            fastPixels = rowX1[i] < rowX2[i];
+        }
+        if (!fastPixels) {
+            return false;
+        }
+
+        CornerPinScanlineRenderer renderer(*this, filter, src.get(), dst.get(), renderWindow, H, &rowX1[0], &rowX2[0]);
+        transformProcessForFormat(dst.get(), renderer);
+    }
+
+    OFX::RenderArguments genericArgs(args);
+    for (std::vector<OfxRectI>::const_iterator it = genericRects.begin(); it != genericRects.end(); ++it) {
+        genericArgs.renderWindow = *it;
+        Transform3x3Plugin::render(genericArgs);
+    }
+
+    return true;
+}
 
 bool CornerPinPlugin::getInverseTransformCanonical(OfxTime time, bool invert, OFX::Matrix3x3* invtransform) const
 {
@@ -1050,6 +1423,12 @@ CornerPinPluginDescribeInContext(OFX::ImageEffectDescriptor &desc, OFX::ContextE
         param->setEvaluateOnChange(false);
         page->addChild(*param);
     }
+
+    // prefilter
+    mipmapDescribeInContext(desc, page);
+
+    // adaptiveMotionBlur, shutterCurve
+    transformMotionBlurDescribeInContext(desc, page);
 }
 
 mDeclarePluginFactory(CornerPinPluginFactory, {}, {});
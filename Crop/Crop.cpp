@@ -79,6 +79,8 @@
 #include "ofxsRectangleInteract.h"
 #include "ofxsMacros.h"
 
+#include "RectangleEdges.h"
+
 #define kPluginName "CropOFX"
 #define kPluginGrouping "Transform"
 #define kPluginDescription "Removes everything outside the defined rectangle and adds black edges so everything outside is black."
@@ -127,6 +129,7 @@ protected:
     bool _blackOutside;
     OfxPointI _translation;
     OfxRectI _dstRoDPix;
+    RectangleEdgeTable _xEdges, _yEdges; // the separable weights of the soft edges
     
 public:
     CropProcessorBase(OFX::ImageEffect &instance)
@@ -170,6 +173,42 @@ public:
         }
     }
 
+private:
+    // weight of a pixel at distance d inside an edge of the crop rectangle (d <= 0 is outside)
+    double edgeWeight(double d) const
+    {
+        if (d <= 0) {
+            return 0.;
+        } else if (_softness == 0 || d >= _softness) {
+            return 1.;
+        }
+        return rampSmooth(d / _softness);
+    }
+
+    // the weights only depend on the column or on the row: compute them once for the render window
+    virtual void preProcess() OVERRIDE FINAL
+    {
+        const OfxPointD rs = _dstImg->getRenderScale();
+        const double par = _dstImg->getPixelAspectRatio();
+        OfxPointI p_pixel;
+        OfxPointD p;
+        _xEdges.reset(_renderWindow.x1, _renderWindow.x2);
+        p_pixel.y = 0;
+        for (int x = _renderWindow.x1; x < _renderWindow.x2; ++x) {
+            p_pixel.x = x + _translation.x;
+            OFX::MergeImages2D::toCanonical(p_pixel, rs, par, &p);
+            _xEdges.set(x, edgeWeight(std::min(p.x - _btmLeft.x, _btmLeft.x + _size.x - p.x)));
+        }
+        _xEdges.finalize();
+        _yEdges.reset(_renderWindow.y1, _renderWindow.y2);
+        p_pixel.x = 0;
+        for (int y = _renderWindow.y1; y < _renderWindow.y2; ++y) {
+            p_pixel.y = y + _translation.y;
+            OFX::MergeImages2D::toCanonical(p_pixel, rs, par, &p);
+            _yEdges.set(y, edgeWeight(std::min(p.y - _btmLeft.y, _btmLeft.y + _size.y - p.y)));
+        }
+        _yEdges.finalize();
+    }
 };
 
 
@@ -185,8 +224,7 @@ public:
 private:
     void multiThreadProcessImages(OfxRectI procWindow)
     {
-        
-        //assert(filter == _filter);
+        const int width = procWindow.x2 - procWindow.x1;
         for (int y = procWindow.y1; y < procWindow.y2; ++y) {
             if (_effect.abort()) {
                 break;
@@ -195,69 +233,49 @@ private:
             PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
             
             bool yblack = _blackOutside && (y == _dstRoDPix.y1 || y == (_dstRoDPix.y2 - 1));
+            const double ty = _yEdges.weight(y);
 
-            for (int x = procWindow.x1; x < procWindow.x2; ++x, dstPix += nComponents) {
-                bool xblack = _blackOutside && (x == _dstRoDPix.x1 || x == (_dstRoDPix.x2 - 1));
-                // treat the black case separately
-                if (xblack || yblack || !_srcImg) {
-                    for (int k = 0; k < nComponents; ++k) {
-                        dstPix[k] =  0.;
-                    }
+            if (yblack || !_srcImg || ty <= 0.) {
+                std::fill(dstPix, dstPix + width * nComponents, PIX(0));
+                continue;
+            }
+
+            // the spans outside of the rectangle are black, the interior is copied, and only the
+            // soft edges are weighted
+            int x = procWindow.x1;
+            while (x < procWindow.x2) {
+                double tx;
+                const int xEnd = _xEdges.getSpan(x, procWindow.x2, &tx);
+                PIX *spanPix = dstPix + (x - procWindow.x1) * nComponents;
+                if (tx == 0.) {
+                    std::fill(spanPix, spanPix + (xEnd - x) * nComponents, PIX(0));
+                } else if (tx == 1. && ty >= 1.) {
+                    rectangleEdgesCopyRow<PIX, nComponents>(_srcImg, x, xEnd, y, _translation.x, _translation.y, spanPix);
                 } else {
-                    OfxPointI p_pixel;
-                    OfxPointD p;
-                    p_pixel.x = x + _translation.x;
-                    p_pixel.y = y + _translation.y;
-                    OFX::MergeImages2D::toCanonical(p_pixel, _dstImg->getRenderScale(), _dstImg->getPixelAspectRatio(), &p);
-
-                    double dx = std::min(p.x - _btmLeft.x, _btmLeft.x + _size.x - p.x);
-                    double dy = std::min(p.y - _btmLeft.y, _btmLeft.y + _size.y - p.y);
-
-                    if (dx <=0 || dy <= 0) {
-                        // outside of the rectangle
-                        for (int k = 0; k < nComponents; ++k) {
-                            dstPix[k] =  0.;
-                        }
-                    } else {
-                        const PIX *srcPix = (const PIX*)_srcImg->getPixelAddress(p_pixel.x, p_pixel.y);
+                    for (int xx = x; xx < xEnd; ++xx, spanPix += nComponents) {
+                        const PIX *srcPix = (const PIX*)_srcImg->getPixelAddress(xx + _translation.x, y + _translation.y);
+                        const double t = (tx < 0. ? _xEdges.weight(xx) : tx) * ty;
                         if (!srcPix) {
                             for (int k = 0; k < nComponents; ++k) {
-                                dstPix[k] =  0.;
-                            }
-                        } else if (_softness == 0 || (dx >= _softness && dy >= _softness)) {
-                            // inside of the rectangle
-                            for (int k = 0; k < nComponents; ++k) {
-                                dstPix[k] =  srcPix[k];
+                                spanPix[k] =  0.;
                             }
                         } else {
-                            double tx, ty;
-                            if (dx >= _softness) {
-                                tx = 1.;
-                            } else {
-                                tx = rampSmooth(dx / _softness);
-                            }
-                            if (dy >= _softness) {
-                                ty = 1.;
-                            } else {
-                                ty = rampSmooth(dy / _softness);
-                            }
-                            double t = tx * ty;
-                            if (t >= 1) {
-                                for (int k = 0; k < nComponents; ++k) {
-                                    dstPix[k] =  srcPix[k];
-                                }
-                            } else {
-                                //if (_plinear) {
-                                //    // it seems to be the way Nuke does it... I could understand t*t, but why t*t*t?
-                                //    t = t*t*t;
-                                //}
-                                for (int k = 0; k < nComponents; ++k) {
-                                    dstPix[k] =  srcPix[k] * t;
-                                }
+                            for (int k = 0; k < nComponents; ++k) {
+                                spanPix[k] =  srcPix[k] * t;
                             }
                         }
                     }
                 }
+                x = xEnd;
+            }
+
+            if (_blackOutside) {
+                if (procWindow.x1 <= _dstRoDPix.x1 && _dstRoDPix.x1 < procWindow.x2) {
+                    std::fill(dstPix + (_dstRoDPix.x1 - procWindow.x1) * nComponents, dstPix + (_dstRoDPix.x1 - procWindow.x1 + 1) * nComponents, PIX(0));
+                }
+                if (procWindow.x1 <= _dstRoDPix.x2 - 1 && _dstRoDPix.x2 - 1 < procWindow.x2) {
+                    std::fill(dstPix + (_dstRoDPix.x2 - 1 - procWindow.x1) * nComponents, dstPix + (_dstRoDPix.x2 - procWindow.x1) * nComponents, PIX(0));
+                }
             }
         }
     }
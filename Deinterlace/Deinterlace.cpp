@@ -75,11 +75,14 @@
 #include <cstring>
 #include <cmath>
 #include <algorithm>
+#include <vector>
 #include "ofxsImageEffect.h"
 #include "ofxsMultiThread.h"
 #include "ofxsProcessing.H"
 #include "ofxsMacros.h"
 
+#include "SourceFrameCache.h"
+
 #define kPluginName          "DeinterlaceOFX"
 #define kPluginGrouping      "Time"
 #define kPluginDescription \
@@ -102,6 +105,8 @@
 #define kSupportsRenderScale 1 // are images still fielded at any renderscale?
 #define kRenderThreadSafety eRenderFullySafe
 
+#define kDeinterlaceFrameCacheFrames 3 // the previous, current and next source frames
+
 #define kParamMode "mode"
 #define kParamModeLabel "Deinterlacing Mode"
 #define kParamModeHint "Choice of the deinterlacing mode/algorithm"
@@ -156,7 +161,7 @@ enum ParityEnum {
 
 #define kParamDoubleFramerate "doubleFramerate"
 #define kParamDoubleFramerateLabel "Double Framerate"
-#define kParamDoubleFramerateHint "Each input frame produces two output frames, and the framerate is doubled."
+#define kParamDoubleFramerateHint "Each input frame produces two output frames, and the framerate is doubled. Output frame 2n is the first field of input frame n, output frame 2n+1 is its second field. Only available in the general context, on hosts that can change the output framerate."
 
 #define kParamYadifMode "yadifMode"
 #define kParamYadifModeLabel "Yadif Processing Mode"
@@ -176,12 +181,18 @@ class DeinterlacePlugin : public OFX::ImageEffect
 public:
     DeinterlacePlugin(OfxImageEffectHandle handle) : ImageEffect(handle), dstClip_(0), srcClip_(0)
     {
+        // during a sequential render, each source frame is used by three consecutive output frames:
+        // keep the last three, so that only the next one is fetched
+        _frameCache.setMaxFrames(kDeinterlaceFrameCacheFrames);
+
         dstClip_ = fetchClip(kOfxImageEffectOutputClipName);
         srcClip_ = fetchClip(kOfxImageEffectSimpleSourceClipName);
 
         mode = fetchChoiceParam("mode");
         fieldOrder = fetchChoiceParam("fieldOrder");
         parity = fetchChoiceParam("parity");
+        // only defined in the general context, if the host can set the output frame rate
+        doubleFramerate = paramExists(kParamDoubleFramerate) ? fetchBooleanParam(kParamDoubleFramerate) : 0;
     }
 
 private:
@@ -195,13 +206,67 @@ private:
 
     /* override is identity */
     virtual bool isIdentity(const OFX::IsIdentityArguments &args, OFX::Clip * &identityClip, double &identityTime) OVERRIDE FINAL;
+
+    /** Override the get frames needed action */
+    virtual void getFramesNeeded(const OFX::FramesNeededArguments &args, OFX::FramesNeededSetter &frames) OVERRIDE FINAL;
+
+    /* override the time domain action, only for the general context */
+    virtual bool getTimeDomain(OfxRangeD &range) OVERRIDE FINAL;
+
+    virtual void beginSequenceRender(const OFX::BeginSequenceRenderArguments &args) OVERRIDE FINAL;
+
+    virtual void endSequenceRender(const OFX::EndSequenceRenderArguments &args) OVERRIDE FINAL;
+
+    virtual void purgeCaches() OVERRIDE FINAL;
+
+    /* the source frame and field of an output frame. Returns true at double framerate. */
+    bool getSourceTime(double time, double *srcTime, bool *secondField);
 private:
+    /// The second field of the last source frame, computed together with its first field when rendering
+    /// at double framerate.
+    struct SecondField
+    {
+        bool valid;
+        double time;
+        OfxPointD renderScale;
+        int mode;
+        int tff;
+        OfxRectI bounds;
+        OFX::BitDepthEnum bitDepth;
+        OFX::PixelComponentEnum components;
+        int lineBytes;
+        std::vector<char> data;
+
+        SecondField() : valid(false), time(0.), mode(0), tff(0), lineBytes(0) {}
+
+        bool sameKey(const SecondField &other) const
+        {
+            return (valid && other.valid &&
+                    time == other.time &&
+                    renderScale.x == other.renderScale.x &&
+                    renderScale.y == other.renderScale.y &&
+                    mode == other.mode &&
+                    tff == other.tff &&
+                    bounds.x1 == other.bounds.x1 && bounds.y1 == other.bounds.y1 &&
+                    bounds.x2 == other.bounds.x2 && bounds.y2 == other.bounds.y2 &&
+                    bitDepth == other.bitDepth &&
+                    components == other.components);
+        }
+    };
+
+    void clearSecondField();
+
     // do not need to delete these, the ImageEffect is managing them for us
     OFX::Clip *dstClip_;
     OFX::Clip *srcClip_;
 
     OFX::ChoiceParam *fieldOrder, *mode, *parity;
-    
+    OFX::BooleanParam *doubleFramerate;
+
+    SourceFrameCache _frameCache; // ring buffer of source frames during a sequential render
+    OFX::MultiThread::Mutex _secondFieldMutex;
+    SecondField _secondField;
+
 };
 
 
@@ -375,27 +440,44 @@ inline void interpolate(float *dst, const float *cur0,  const float *cur2, int w
 }
 
 
+template<int ch,typename Comp,typename Diff>
+static void filter_line_plane(int mode, Comp *dst2,
+                              const Comp *prev0, const Comp *cur0, const Comp *next0,
+                              int refs, int w, int h, int y, int parity, int tff)
+{
+    const Comp *prev= prev0 + y*refs;
+    const Comp *cur = cur0 + y*refs;
+    const Comp *next= next0 + y*refs;
+
+    for (int c = 0; c < ch; ++c) {
+        filter_line_c<ch,Comp,Diff>(dst2 + c, prev + c, cur + c, next + c, w,
+                                    y + 1 < h ? refs : -refs,
+                                    y ? -refs : refs,
+                                    parity ^ tff, mode);
+    }
+}
+
+// If other is not NULL, it receives the other field (parity^1) of the same frame, computed in the same pass:
+// the lines interpolated in one field are the original lines of the other field.
 template<int ch,typename Comp,typename Diff>
 static void filter_plane(int mode, Comp *dst, int dst_stride,
                          const Comp *prev0, const Comp *cur0, const Comp *next0,
-                         int refs, int w, int h, int parity, int tff)
+                         int refs, int w, int h, int parity, int tff,
+                         Comp *other, int other_stride)
 {
     for (int y = 0; y < h; ++y) {
         if (((y ^ parity) & 1)) {
-            const Comp *prev= prev0 + y*refs;
-            const Comp *cur = cur0 + y*refs;
-            const Comp *next= next0 + y*refs;
-            Comp *dst2= dst + y*dst_stride;
-
-            for (int c = 0; c < ch; ++c) {
-                filter_line_c<ch,Comp,Diff>(dst2 + c, prev + c, cur + c, next + c, w,
-                                            y + 1 < h ? refs : -refs,
-                                            y ? -refs : refs,
-                                            parity ^ tff, mode);
+            filter_line_plane<ch,Comp,Diff>(mode, dst + y*dst_stride, prev0, cur0, next0, refs, w, h, y, parity, tff);
+            if (other) {
+                memcpy(&other[y * other_stride],
+                       &cur0[y * refs], w * ch * sizeof(Comp)); // copy original
             }
         } else {
             memcpy(&dst[y * dst_stride],
                    &cur0[y * refs], w * ch * sizeof(Comp)); // copy original
+            if (other) {
+                filter_line_plane<ch,Comp,Diff>(mode, other + y*other_stride, prev0, cur0, next0, refs, w, h, y, parity ^ 1, tff);
+            }
         }
     }
     
@@ -404,10 +486,11 @@ static void filter_plane(int mode, Comp *dst, int dst_stride,
 template<int ch,typename Comp,typename Diff>
 static void filter_plane_ofx(int mode,
                              OFX::Image *dst_,
-                             const OFX::Image *srcp,
-                             const OFX::Image *src,
-                             const OFX::Image *srcn,
-                             int parity, int tff)
+                             const SourceFrame *srcp,
+                             const SourceFrame *src,
+                             const SourceFrame *srcn,
+                             int parity, int tff,
+                             void *other, int other_stride)
 {
     Comp *dst = (Comp*)dst_->getPixelData(); // change this when we support renderWindow
     int dst_stride = dst_->getRowBytes() / sizeof(Comp);
@@ -420,7 +503,8 @@ static void filter_plane_ofx(int mode,
                                  prev0, cur0, next0,
                                  refs,
                                  bounds.x2 - bounds.x1, bounds.y2 - bounds.y1,
-                                 parity, tff);
+                                 parity, tff,
+                                 (Comp*)other, other_stride / (int)sizeof(Comp));
 }
 
 // =========== GNU Lesser General Public License code end =================
@@ -435,26 +519,28 @@ void DeinterlacePlugin::render(const OFX::RenderArguments &args)
     OFX::PixelComponentEnum dstComponents  = dstClip_->getPixelComponents();
 
     std::auto_ptr<OFX::Image> dst(dstClip_->fetchImage(args.time));
-
-    std::auto_ptr<const OFX::Image> src(srcClip_->fetchImage(args.time)),
-                              srcp(srcClip_->fetchImage(args.time-1.0)),
-                              srcn(srcClip_->fetchImage(args.time+1.0));
-    if (!src.get() || !dst.get() || !srcp.get() || !srcn.get()) {
+    if (!dst.get()) {
         OFX::throwSuiteStatusException(kOfxStatFailed);
     }
-    
+
     const OfxRectI rect = dst->getBounds();
 
     int width=rect.x2-rect.x1;
     int height=rect.y2-rect.y1;
 
+    // at double framerate, output frame 2n is the first field of source frame n, and 2n+1 is its second field
+    double srcTime = args.time;
+    bool secondField = false;
+    const bool doubleRate = getSourceTime(args.time, &srcTime, &secondField);
+
     int imode       = 0;
     int ifieldOrder = 2;
     int iparity     = 0;
 
-    mode->getValueAtTime(args.time,imode);
-    fieldOrder->getValueAtTime(args.time,ifieldOrder);
-    parity->getValueAtTime(args.time,iparity);
+    // both fields of a source frame use the same settings
+    mode->getValueAtTime(srcTime,imode);
+    fieldOrder->getValueAtTime(srcTime,ifieldOrder);
+    parity->getValueAtTime(srcTime,iparity);
 
     imode*=2;
 
@@ -466,12 +552,63 @@ void DeinterlacePlugin::render(const OFX::RenderArguments &args)
         }
     }
 
+    if (doubleRate) {
+        // same as libavfilter's yadif: parity = tff ^ !is_second
+        iparity = ifieldOrder ^ (secondField ? 0 : 1);
+    }
+
+    int componentBytes = 1;
+    if (dstBitDepth == OFX::eBitDepthUShort) {
+        componentBytes = 2;
+    } else if (dstBitDepth == OFX::eBitDepthFloat) {
+        componentBytes = 4;
+    }
+    SecondField key;
+    key.valid = true;
+    key.time = srcTime;
+    key.renderScale = args.renderScale;
+    key.mode = imode;
+    key.tff = ifieldOrder;
+    key.bounds = rect;
+    key.bitDepth = dstBitDepth;
+    key.components = dstComponents;
+    key.lineBytes = width * dst->getPixelComponentCount() * componentBytes;
+
+    if (secondField) {
+        // the second field may have been computed with the first one
+        OFX::MultiThread::AutoMutex lock(_secondFieldMutex);
+        if (_secondField.sameKey(key)) {
+            for (int y=0; y<height; y++) {
+                memcpy(dst->getPixelAddress(rect.x1, rect.y1 + y), &_secondField.data[(size_t)y * key.lineBytes], key.lineBytes);
+            }
+            return;
+        }
+    }
+
+    SourceFrameRef src(_frameCache, _frameCache.fetch(*srcClip_, srcTime, args.renderScale, args.fieldToRender, args.renderWindow));
+    SourceFrameRef srcp(_frameCache, _frameCache.fetch(*srcClip_, srcTime-1.0, args.renderScale, args.fieldToRender, args.renderWindow));
+    SourceFrameRef srcn(_frameCache, _frameCache.fetch(*srcClip_, srcTime+1.0, args.renderScale, args.fieldToRender, args.renderWindow));
+    if (!src.get() || !srcp.get() || !srcn.get()) {
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+
+    // during a sequential render at double framerate, the second field is rendered next: compute it
+    // in the same pass as the first field
+    std::vector<char> otherData;
+    void *other = 0;
+    int otherRowBytes = 0;
+    if (doubleRate && !secondField && width >= 3 && height >= 3 && _frameCache.inSequence()) {
+        otherData.resize((size_t)key.lineBytes * height);
+        other = &otherData[0];
+        otherRowBytes = key.lineBytes;
+    }
+
 
     if (width < 3 || height < 3) {
         // Video of less than 3 columns or lines is not supported
         // just copy sc to dst
         for (int y=0; y<height; y++) {
-            memcpy(dst->getPixelAddress(0,y),src->getPixelAddress(0,y),abs(src->getRowBytes()));
+            memcpy(dst->getPixelAddress(0,y),src.get()->getPixelAddress(0,y),abs(src.get()->getRowBytes()));
         }
     } else {
         if (dstComponents == OFX::ePixelComponentRGBA) {
@@ -480,21 +617,24 @@ void DeinterlacePlugin::render(const OFX::RenderArguments &args)
                 filter_plane_ofx<4,unsigned char,int>(imode, // mode
                                                       dst.get(),
                                                       srcp.get(), src.get(), srcn.get(),
-                                                      iparity,ifieldOrder); // parity, tff
+                                                      iparity,ifieldOrder, // parity, tff
+                                                      other, otherRowBytes);
                 break;
 
             case OFX::eBitDepthUShort:
                 filter_plane_ofx<4,unsigned short,int>(imode, // mode
                                                        dst.get(),
                                                        srcp.get(), src.get(), srcn.get(),
-                                                       iparity,ifieldOrder); // parity, tff
+                                                       iparity,ifieldOrder, // parity, tff
+                                                       other, otherRowBytes);
                     break;
                     
             case OFX::eBitDepthFloat:
                     filter_plane_ofx<4,float,float>(imode, // mode
                                                     dst.get(),
                                                     srcp.get(), src.get(), srcn.get(),
-                                                    iparity,ifieldOrder); // parity, tff
+                                                    iparity,ifieldOrder, // parity, tff
+                                                    other, otherRowBytes);
                     break;
 
             default:
@@ -506,21 +646,24 @@ void DeinterlacePlugin::render(const OFX::RenderArguments &args)
                     filter_plane_ofx<3,unsigned char,int>(imode, // mode
                                                           dst.get(),
                                                           srcp.get(), src.get(), srcn.get(),
-                                                          iparity,ifieldOrder); // parity, tff
+                                                          iparity,ifieldOrder, // parity, tff
+                                                          other, otherRowBytes);
                     break;
 
                 case OFX::eBitDepthUShort:
                     filter_plane_ofx<3,unsigned short,int>(imode, // mode
                                                            dst.get(),
                                                            srcp.get(), src.get(), srcn.get(),
-                                                           iparity,ifieldOrder); // parity, tff
+                                                           iparity,ifieldOrder, // parity, tff
+                                                           other, otherRowBytes);
                     break;
 
                 case OFX::eBitDepthFloat:
                     filter_plane_ofx<3,float,float>(imode, // mode
                                                     dst.get(),
                                                     srcp.get(), src.get(), srcn.get(),
-                                                    iparity,ifieldOrder); // parity, tff
+                                                    iparity,ifieldOrder, // parity, tff
+                                                    other, otherRowBytes);
                     break;
 
                 default:
@@ -532,21 +675,24 @@ void DeinterlacePlugin::render(const OFX::RenderArguments &args)
                     filter_plane_ofx<1,unsigned char,int>(imode, // mode
                                                           dst.get(),
                                                           srcp.get(), src.get(), srcn.get(),
-                                                          iparity,ifieldOrder); // parity, tff
+                                                          iparity,ifieldOrder, // parity, tff
+                                                          other, otherRowBytes);
                     break;
 
             case OFX::eBitDepthUShort:
                     filter_plane_ofx<1,unsigned short,int>(imode, // mode
                                                            dst.get(),
                                                            srcp.get(), src.get(), srcn.get(),
-                                                           iparity,ifieldOrder); // parity, tff
+                                                           iparity,ifieldOrder, // parity, tff
+                                                           other, otherRowBytes);
                     break;
 
             case OFX::eBitDepthFloat:
                     filter_plane_ofx<1,float,float>(imode, // mode
                                                     dst.get(),
                                                     srcp.get(), src.get(), srcn.get(),
-                                                    iparity,ifieldOrder); // parity, tff
+                                                    iparity,ifieldOrder, // parity, tff
+                                                    other, otherRowBytes);
                     break;
 
             default:
@@ -554,6 +700,12 @@ void DeinterlacePlugin::render(const OFX::RenderArguments &args)
             }
         }
     }
+
+    if (other && !abort()) {
+        OFX::MultiThread::AutoMutex lock(_secondFieldMutex);
+        _secondField = key;
+        _secondField.data.swap(otherData);
+    }
 }
 
 /* Override the clip preferences */
@@ -562,19 +714,101 @@ DeinterlacePlugin::getClipPreferences(OFX::ClipPreferencesSetter &clipPreference
 {
     // set the fielding of dstClip_
     clipPreferences.setOutputFielding(OFX::eFieldNone);
+
+    // each field becomes a frame
+    if (doubleFramerate && doubleFramerate->getValue()) {
+        clipPreferences.setOutputFrameRate(srcClip_->getFrameRate() * 2.);
+    }
 }
 
 bool
 DeinterlacePlugin::getRegionOfDefinition(const OFX::RegionOfDefinitionArguments &args,
-                                         OfxRectD &/*rod*/)
+                                         OfxRectD &rod)
 {
     if (!kSupportsRenderScale && (args.renderScale.x != 1. || args.renderScale.y != 1.)) {
         OFX::throwSuiteStatusException(kOfxStatFailed);
     }
 
+    // at double framerate, the host default would use the source at the output time
+    double srcTime;
+    bool secondField;
+    if (getSourceTime(args.time, &srcTime, &secondField)) {
+        rod = srcClip_->getRegionOfDefinition(srcTime);
+        return true;
+    }
     return false;
 }
 
+bool
+DeinterlacePlugin::getSourceTime(double time, double *srcTime, bool *secondField)
+{
+    if (!doubleFramerate || !doubleFramerate->getValue()) {
+        *srcTime = time;
+        *secondField = false;
+        return false;
+    }
+    *srcTime = std::floor(time / 2.);
+    *secondField = (time - 2. * *srcTime) >= 0.5;
+    return true;
+}
+
+void
+DeinterlacePlugin::getFramesNeeded(const OFX::FramesNeededArguments &args,
+                                   OFX::FramesNeededSetter &frames)
+{
+    double srcTime;
+    bool secondField;
+    getSourceTime(args.time, &srcTime, &secondField);
+
+    // the previous, current and next frames
+    OfxRangeD range;
+    range.min = srcTime - 1.;
+    range.max = srcTime + 1.;
+    frames.setFramesNeeded(*srcClip_, range);
+}
+
+/* override the time domain action, only for the general context */
+bool
+DeinterlacePlugin::getTimeDomain(OfxRangeD &range)
+{
+    if (!doubleFramerate || !doubleFramerate->getValue()) {
+        return false;
+    }
+    // two output frames per source frame
+    OfxRangeD srcRange = srcClip_->getFrameRange();
+    range.min = srcRange.min * 2.;
+    range.max = srcRange.max * 2. + 1.;
+    return true;
+}
+
+void
+DeinterlacePlugin::clearSecondField()
+{
+    OFX::MultiThread::AutoMutex lock(_secondFieldMutex);
+    _secondField = SecondField();
+}
+
+void
+DeinterlacePlugin::beginSequenceRender(const OFX::BeginSequenceRenderArguments &/*args*/)
+{
+    _frameCache.beginSequence();
+    clearSecondField();
+}
+
+void
+DeinterlacePlugin::endSequenceRender(const OFX::EndSequenceRenderArguments &/*args*/)
+{
+    _frameCache.endSequence();
+    clearSecondField();
+}
+
+void
+DeinterlacePlugin::purgeCaches()
+{
+    _frameCache.clear();
+    clearSecondField();
+}
+
 bool
 DeinterlacePlugin::isIdentity(const OFX::IsIdentityArguments &args,
                               OFX::Clip * &/*identityClip*/,
@@ -619,7 +853,7 @@ void DeinterlacePluginFactory::describe(OFX::ImageEffectDescriptor &desc)
 
 }
 
-void DeinterlacePluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc, OFX::ContextEnum /*context*/)
+void DeinterlacePluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc, OFX::ContextEnum context)
 {
     // Source clip only in the filter context
     // create the mandated source clip
@@ -706,11 +940,14 @@ void DeinterlacePluginFactory::describeInContext(OFX::ImageEffectDescriptor &des
         page->addChild(*param);
     }
 
-    {
+    // the time domain action is only called in the general context, and the output frame rate
+    // can only be changed if the host allows it: elsewhere, the output has the source framerate
+    if (context == eContextGeneral && getImageEffectHostDescription()->supportsSetableFrameRate) {
         BooleanParamDescriptor *param = desc.defineBooleanParam(kParamDoubleFramerate);
         param->setLabels(kParamDoubleFramerateLabel, kParamDoubleFramerateLabel, kParamDoubleFramerateLabel);
         param->setHint(kParamDoubleFramerateHint);
-        param->setIsSecret(true); // Not yet implemented!
+        param->setDefault(false);
+        param->setAnimates(false); // changes the frame rate and the time domain
         page->addChild(*param);
     }
 }
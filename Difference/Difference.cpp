@@ -73,16 +73,20 @@
 #include "Difference.h"
 
 #include <cmath>
+#include <list>
+#include <vector>
+#include <algorithm>
 #ifdef _WINDOWS
 #include <windows.h>
 #endif
 
 #include "ofxsProcessing.H"
 #include "ofxsMacros.h"
+#include "ofxsMerging.h"
 
 #define kPluginName "DifferenceOFX"
 #define kPluginGrouping "Keyer"
-#define kPluginDescription "Produce a rough matte from the difference of two input images. A is the background without the subject (clean plate). B is the subject with the background. RGB is copied from B, the difference is output to alpha, after applying offset & gain."
+#define kPluginDescription "Produce a rough matte from the difference of two input images. A is the background without the subject (clean plate). B is the subject with the background. RGB is copied from B, the difference is output to alpha, after applying offset & gain.\nOn locked-off shots, the clean plate can also be computed as the temporal median of B, in which case A is not used."
 #define kPluginIdentifier "net.sf.openfx.DifferencePlugin"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
 #define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
@@ -99,6 +103,32 @@
 #define kParamGainLabel "Gain"
 #define kParamGainHint "Multiply each pixel of the output by this value"
 
+#define kParamCleanPlate "cleanPlate"
+#define kParamCleanPlateLabel "Clean Plate"
+#define kParamCleanPlateHint "Where the clean plate (the background without the subject) comes from."
+#define kParamCleanPlateOptionA "A"
+#define kParamCleanPlateOptionAHint "The clean plate is the A input."
+#define kParamCleanPlateOptionMedian "Temporal Median of B"
+#define kParamCleanPlateOptionMedianHint "The clean plate is the per-pixel median of frames of B sampled over the clean plate frame range. This works on locked-off shots where each pixel shows the background in most frames."
+enum CleanPlateEnum {
+    eCleanPlateA,
+    eCleanPlateMedian,
+};
+#define kParamCleanPlateFirstFrame "cleanPlateFirstFrame"
+#define kParamCleanPlateFirstFrameLabel "First Frame"
+#define kParamCleanPlateFirstFrameHint "First frame of B used to compute the clean plate."
+#define kParamCleanPlateLastFrame "cleanPlateLastFrame"
+#define kParamCleanPlateLastFrameLabel "Last Frame"
+#define kParamCleanPlateLastFrameHint "Last frame of B used to compute the clean plate."
+#define kParamCleanPlateSamples "cleanPlateSamples"
+#define kParamCleanPlateSamplesLabel "Samples"
+#define kParamCleanPlateSamplesHint "Number of frames of B, evenly spaced between the first and the last frame, used to compute the clean plate."
+
+#define kCleanPlateHistogramBins 256 // number of bins of the per-pixel histograms used to compute the median
+#define kCleanPlateMaxSamples 65535 // histogram counts are unsigned short
+#define kCleanPlateHistogramMaxBytes (64*1024*1024) // memory used by the histograms, the render window is processed in strips that fit
+#define kCleanPlateCacheMaxBytes (256*1024*1024) // memory used by the clean plates cached by each instance
+
 #define kClipA "A"
 #define kClipB "B"
 
@@ -119,6 +149,9 @@ class DifferencerBase : public OFX::ImageProcessor
 protected:
     const OFX::Image *_srcImgA;
     const OFX::Image *_srcImgB;
+    bool _useCleanPlate;
+    const float *_cleanPlate;
+    OfxRectI _cleanPlateBounds;
     double _offset;
     double _gain;
 
@@ -127,13 +160,24 @@ public:
     : OFX::ImageProcessor(instance)
     , _srcImgA(0)
     , _srcImgB(0)
+    , _useCleanPlate(false)
+    , _cleanPlate(0)
     , _offset(0.)
     , _gain(1.)
     {
+        _cleanPlateBounds.x1 = _cleanPlateBounds.y1 = _cleanPlateBounds.x2 = _cleanPlateBounds.y2 = 0;
     }
 
     void setSrcImg(const OFX::Image *A, const OFX::Image *B) {_srcImgA = A; _srcImgB = B;}
 
+    // use a computed clean plate (in sample units, without the alpha channel) instead of A
+    void setCleanPlate(const float *cleanPlate, const OfxRectI& cleanPlateBounds)
+    {
+        _useCleanPlate = true;
+        _cleanPlate = cleanPlate;
+        _cleanPlateBounds = cleanPlateBounds;
+    }
+
     void setValues(double offset,
                    double gain)
     {
@@ -163,23 +207,25 @@ private:
             }
 
             PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+            const float *platePix = _cleanPlate ? (_cleanPlate + ((size_t)(y - _cleanPlateBounds.y1) * (_cleanPlateBounds.x2 - _cleanPlateBounds.x1) +
+                                                                  (procWindow.x1 - _cleanPlateBounds.x1)) * (nComponents - 1)) : 0;
 
             for (int x = procWindow.x1; x < procWindow.x2; x++) {
                 const PIX *srcPixA = (const PIX *)  (_srcImgA ? _srcImgA->getPixelAddress(x, y) : 0);
                 const PIX *srcPixB = (const PIX *)  (_srcImgB ? _srcImgB->getPixelAddress(x, y) : 0);
 
-                if (srcPixA && srcPixB) {
+                if ((srcPixA || _useCleanPlate) && srcPixB) {
                     double diff = 0.;
                     if (nComponents > 1) {
                         for (int c = 0; c < nComponents - 1; ++c) {
                             dstPix[c] = srcPixB[c];
-                            double d = srcPixB[c] - srcPixA[c];
+                            double d = srcPixB[c] - (platePix ? platePix[c] : srcPixA[c]);
                             diff += d*d;
                         }
                     }
                     diff = _gain*diff - _offset; // this seems to be the formula used in Nuke
                     dstPix[nComponents-1] = (PIX)std::max(0.,std::min(diff, (double)maxValue));
-                } else if (srcPixB && !srcPixA) {
+                } else if (srcPixB) {
                     for (int c = 0; c < nComponents; ++c) {
                         dstPix[c] = srcPixB[c];
                     }
@@ -189,8 +235,166 @@ private:
                     }
                 }
                 dstPix += nComponents;
+                if (platePix) {
+                    platePix += nComponents - 1;
+                }
+            }
+        }
+    }
+};
+
+// Computes the temporal median of a set of frames, one row strip at a time.
+// Each source frame is accumulated into per-pixel histograms (with setSrcImg()), then the median
+// is extracted from the histograms (with setSrcImg(0)), so that memory does not depend on the number of frames.
+// Values in [0,1] are binned, and the median is interpolated inside its bin. The first and last bins also
+// hold the values outside of [0,1], and the median is the mean of the values in the bin if it falls there.
+class CleanPlateBuilderBase : public OFX::ImageProcessor
+{
+protected:
+    const OFX::Image *_srcImg;
+    int _nPlateComponents;
+    std::vector<unsigned short> _histogram;
+    std::vector<float> _binSums; // sum of the values in the first and last bins
+    std::vector<unsigned short> _counts; // number of samples for each pixel
+    float *_plate; // the clean plate for the whole render window, in sample units
+    OfxRectI _plateBounds;
+
+public:
+    CleanPlateBuilderBase(OFX::ImageEffect &instance, int nPlateComponents)
+    : OFX::ImageProcessor(instance)
+    , _srcImg(0)
+    , _nPlateComponents(nPlateComponents)
+    , _histogram()
+    , _binSums()
+    , _counts()
+    , _plate(0)
+    {
+        _plateBounds.x1 = _plateBounds.y1 = _plateBounds.x2 = _plateBounds.y2 = 0;
+    }
+
+    int getNPlateComponents() const { return _nPlateComponents; }
+
+    void setPlate(float *plate, const OfxRectI& plateBounds) {_plate = plate; _plateBounds = plateBounds;}
+
+    // start a new strip, which must be inside the plate bounds
+    void startStrip(const OfxRectI& strip)
+    {
+        const size_t nPixels = (size_t)(strip.x2 - strip.x1) * (strip.y2 - strip.y1);
+        _histogram.assign(nPixels * _nPlateComponents * kCleanPlateHistogramBins, 0);
+        _binSums.assign(nPixels * _nPlateComponents * 2, 0.f);
+        _counts.assign(nPixels, 0);
+        setRenderWindow(strip);
+    }
+
+    void setSrcImg(const OFX::Image *srcImg) {_srcImg = srcImg;}
+};
+
+template <class PIX, int nComponents, int maxValue>
+class CleanPlateBuilder : public CleanPlateBuilderBase
+{
+public:
+    CleanPlateBuilder(OFX::ImageEffect &instance)
+    : CleanPlateBuilderBase(instance, nComponents > 1 ? nComponents - 1 : 0)
+    {
+    }
+
+private:
+    void multiThreadProcessImages(OfxRectI procWindow)
+    {
+        const int nPlateComponents = nComponents > 1 ? nComponents - 1 : 0;
+        const int stripWidth = _renderWindow.x2 - _renderWindow.x1;
+        for (int y = procWindow.y1; y < procWindow.y2; y++) {
+            if (_effect.abort()) {
+                break;
             }
+
+            // index of the first pixel of this row in the strip
+            const size_t i0 = (size_t)(y - _renderWindow.y1) * stripWidth + (procWindow.x1 - _renderWindow.x1);
+            if (_srcImg) {
+                accumulateRow(procWindow.x1, procWindow.x2, y, i0);
+            } else {
+                float *platePix = _plate + ((size_t)(y - _plateBounds.y1) * (_plateBounds.x2 - _plateBounds.x1) + (procWindow.x1 - _plateBounds.x1)) * nPlateComponents;
+                for (size_t i = i0; i < i0 + (procWindow.x2 - procWindow.x1); ++i, platePix += nPlateComponents) {
+                    for (int c = 0; c < nPlateComponents; ++c) {
+                        platePix[c] = median(i * nPlateComponents + c, _counts[i]) * maxValue;
+                    }
+                }
+            }
+        }
+    }
+
+    void accumulateRow(int x1, int x2, int y, size_t i0)
+    {
+        const int nPlateComponents = nComponents > 1 ? nComponents - 1 : 0;
+        for (int x = x1; x < x2; ++x) {
+            const size_t i = i0 + (x - x1);
+            const PIX *srcPix = (const PIX *) _srcImg->getPixelAddress(x, y);
+            if (!srcPix) {
+                continue;
+            }
+            for (int c = 0; c < nPlateComponents; ++c) {
+                const size_t j = i * nPlateComponents + c;
+                const float v = srcPix[c] / (float)maxValue;
+                const int bin = (int)std::max(0.f, std::min(v * kCleanPlateHistogramBins, (float)(kCleanPlateHistogramBins - 1)));
+                ++_histogram[j * kCleanPlateHistogramBins + bin];
+                if (bin == 0) {
+                    _binSums[j * 2] += v;
+                } else if (bin == kCleanPlateHistogramBins - 1) {
+                    _binSums[j * 2 + 1] += v;
+                }
+            }
+            ++_counts[i];
+        }
+    }
+
+    // the median of the values accumulated in histogram j, normalized
+    float median(size_t j, int count) const
+    {
+        if (count == 0) {
+            return 0.f;
+        }
+        const unsigned short *hist = &_histogram[j * kCleanPlateHistogramBins];
+        const float half = count * 0.5f;
+        int cumulated = 0;
+        int bin = 0;
+        while (bin < kCleanPlateHistogramBins - 1 && cumulated + hist[bin] < half) {
+            cumulated += hist[bin];
+            ++bin;
         }
+        assert(hist[bin] > 0);
+        if (bin == 0) {
+            return _binSums[j * 2] / hist[bin];
+        } else if (bin == kCleanPlateHistogramBins - 1) {
+            return _binSums[j * 2 + 1] / hist[bin];
+        }
+        // interpolate inside the bin
+        return (bin + (half - cumulated) / hist[bin]) / kCleanPlateHistogramBins;
+    }
+};
+
+// a clean plate computed over the region of definition, shared by all the render windows
+struct DifferenceCleanPlate
+{
+    int first;
+    int last;
+    int samples;
+    OfxPointD renderScale;
+    OFX::FieldEnum field;
+    OfxRectI bounds;
+    OFX::BitDepthEnum bitDepth;
+    OFX::PixelComponentEnum components;
+    std::vector<float> data;
+
+    // the clean plate only depends on these, so it is kept across sequences
+    // (changedClip() purges the cache if B changes)
+    bool sameKey(const DifferenceCleanPlate& other) const
+    {
+        return (first == other.first && last == other.last && samples == other.samples &&
+                renderScale.x == other.renderScale.x && renderScale.y == other.renderScale.y &&
+                field == other.field &&
+                bounds.x1 == other.bounds.x1 && bounds.y1 == other.bounds.y1 &&
+                bounds.x2 == other.bounds.x2 && bounds.y2 == other.bounds.y2 &&
+                bitDepth == other.bitDepth && components == other.components);
     }
 };
 
@@ -217,15 +421,36 @@ public:
         assert(_offset);
         _gain = fetchDoubleParam(kParamGain);
         assert(_gain);
+        _cleanPlate = fetchChoiceParam(kParamCleanPlate);
+        _cleanPlateFirstFrame = fetchIntParam(kParamCleanPlateFirstFrame);
+        _cleanPlateLastFrame = fetchIntParam(kParamCleanPlateLastFrame);
+        _cleanPlateSamples = fetchIntParam(kParamCleanPlateSamples);
+        assert(_cleanPlate && _cleanPlateFirstFrame && _cleanPlateLastFrame && _cleanPlateSamples);
     }
     
 private:
     /* Override the render */
     virtual void render(const OFX::RenderArguments &args) OVERRIDE FINAL;
-    
+
+    /** Override the get frames needed action */
+    virtual void getFramesNeeded(const OFX::FramesNeededArguments &args, OFX::FramesNeededSetter &frames) OVERRIDE FINAL;
+
+    virtual void purgeCaches() OVERRIDE FINAL;
+
+    virtual void changedClip(const OFX::InstanceChangedArgs &args, const std::string &clipName) OVERRIDE FINAL;
+
     /* set up and run a processor */
-    void setupAndProcess(DifferencerBase &, const OFX::RenderArguments &args);
-    
+    void setupAndProcess(DifferencerBase &, CleanPlateBuilderBase &, const OFX::RenderArguments &args);
+
+    /* compute the clean plate over its bounds, returns false if the render was aborted */
+    bool buildCleanPlate(CleanPlateBuilderBase &builder, OFX::Image *dst, DifferenceCleanPlate *plate);
+
+    /* get the part of the cached clean plate inside window, returns false if it is not cached */
+    bool getCachedCleanPlate(const DifferenceCleanPlate &plate, const OfxRectI &window, int nPlateComponents, std::vector<float> *data);
+
+    /* cache the clean plate, its data is moved to the cache */
+    void cacheCleanPlate(DifferenceCleanPlate *plate);
+
 private:
     // do not need to delete these, the ImageEffect is managing them for us
     OFX::Clip *dstClip_;
@@ -234,14 +459,180 @@ private:
 
     OFX::DoubleParam *_offset;
     OFX::DoubleParam *_gain;
+    OFX::ChoiceParam *_cleanPlate;
+    OFX::IntParam *_cleanPlateFirstFrame;
+    OFX::IntParam *_cleanPlateLastFrame;
+    OFX::IntParam *_cleanPlateSamples;
+
+    // the most recently used clean plates come first
+    std::list<DifferenceCleanPlate> _cleanPlateCache;
+    OFX::MultiThread::Mutex _cleanPlateCacheMutex;
+    OFX::MultiThread::Mutex _cleanPlateBuildMutex; // render windows wait for the clean plate being built
 };
 
+// the frames of B used to compute the clean plate
+static void
+getCleanPlateFrames(int first, int last, int samples, std::vector<int> *frames)
+{
+    frames->clear();
+    if (last < first) {
+        std::swap(first, last);
+    }
+    samples = std::max(1, std::min(samples, std::min(last - first + 1, kCleanPlateMaxSamples)));
+    for (int i = 0; i < samples; ++i) {
+        frames->push_back(samples == 1 ? first : (int)(first + (double)i * (last - first) / (samples - 1) + 0.5));
+    }
+}
+
+// copy the part of the clean plate inside window, which must be inside the plate bounds
+static void
+cropCleanPlate(const DifferenceCleanPlate &plate, const OfxRectI &window, int nPlateComponents, std::vector<float> *data)
+{
+    assert(plate.bounds.x1 <= window.x1 && window.x2 <= plate.bounds.x2 && plate.bounds.y1 <= window.y1 && window.y2 <= plate.bounds.y2);
+    const size_t rowSize = (size_t)(window.x2 - window.x1) * nPlateComponents;
+    data->resize(rowSize * (window.y2 - window.y1));
+    if (rowSize == 0 || plate.data.empty()) {
+        return;
+    }
+    for (int y = window.y1; y < window.y2; ++y) {
+        const float *src = &plate.data[((size_t)(y - plate.bounds.y1) * (plate.bounds.x2 - plate.bounds.x1) + (window.x1 - plate.bounds.x1)) * nPlateComponents];
+        std::copy(src, src + rowSize, data->begin() + (size_t)(y - window.y1) * rowSize);
+    }
+}
+
+void
+DifferencePlugin::getFramesNeeded(const OFX::FramesNeededArguments &args,
+                                  OFX::FramesNeededSetter &frames)
+{
+    OfxRangeD range;
+    range.min = args.time;
+    range.max = args.time;
+    frames.setFramesNeeded(*srcClipA_, range);
+    frames.setFramesNeeded(*srcClipB_, range);
+
+    int cleanPlate;
+    _cleanPlate->getValueAtTime(args.time, cleanPlate);
+    if (cleanPlate == eCleanPlateMedian) {
+        int first, last;
+        _cleanPlateFirstFrame->getValueAtTime(args.time, first);
+        _cleanPlateLastFrame->getValueAtTime(args.time, last);
+        range.min = std::min(first, last);
+        range.max = std::max(first, last);
+        frames.setFramesNeeded(*srcClipB_, range);
+    }
+}
+
+void
+DifferencePlugin::purgeCaches()
+{
+    OFX::MultiThread::AutoMutex lock(_cleanPlateCacheMutex);
+    _cleanPlateCache.clear();
+}
+
+void
+DifferencePlugin::changedClip(const OFX::InstanceChangedArgs &args, const std::string &clipName)
+{
+    if (clipName == kClipB) {
+        purgeCaches();
+        if (args.reason == OFX::eChangeUserEdit && srcClipB_->isConnected() &&
+            _cleanPlateFirstFrame->getValue() == _cleanPlateFirstFrame->getDefault() &&
+            _cleanPlateLastFrame->getValue() == _cleanPlateLastFrame->getDefault()) {
+            // the clean plate frame range defaults to the frame range of B
+            OfxRangeD range = srcClipB_->getFrameRange();
+            _cleanPlateFirstFrame->setValue((int)std::floor(range.min));
+            _cleanPlateLastFrame->setValue((int)std::floor(range.max));
+        }
+    }
+    ImageEffect::changedClip(args, clipName);
+}
+
+bool
+DifferencePlugin::getCachedCleanPlate(const DifferenceCleanPlate &plate, const OfxRectI &window, int nPlateComponents, std::vector<float> *data)
+{
+    OFX::MultiThread::AutoMutex lock(_cleanPlateCacheMutex);
+    for (std::list<DifferenceCleanPlate>::iterator it = _cleanPlateCache.begin(); it != _cleanPlateCache.end(); ++it) {
+        if (it->sameKey(plate)) {
+            cropCleanPlate(*it, window, nPlateComponents, data);
+            // move it to the front
+            _cleanPlateCache.splice(_cleanPlateCache.begin(), _cleanPlateCache, it);
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+DifferencePlugin::cacheCleanPlate(DifferenceCleanPlate *plate)
+{
+    OFX::MultiThread::AutoMutex lock(_cleanPlateCacheMutex);
+    std::vector<float> data;
+    data.swap(plate->data);
+    _cleanPlateCache.push_front(*plate);
+    _cleanPlateCache.front().data.swap(data);
+    // evict the least recently used clean plates, but always keep the last one
+    size_t bytes = 0;
+    std::list<DifferenceCleanPlate>::iterator it = _cleanPlateCache.begin();
+    for (; it != _cleanPlateCache.end(); ++it) {
+        bytes += it->data.size() * sizeof(float);
+        if (bytes > kCleanPlateCacheMaxBytes && it != _cleanPlateCache.begin()) {
+            break;
+        }
+    }
+    _cleanPlateCache.erase(it, _cleanPlateCache.end());
+}
+
+bool
+DifferencePlugin::buildCleanPlate(CleanPlateBuilderBase &builder, OFX::Image *dst, DifferenceCleanPlate *plate)
+{
+    const OfxRectI& window = plate->bounds;
+    const int nPlateComponents = builder.getNPlateComponents();
+    plate->data.assign((size_t)(window.x2 - window.x1) * (window.y2 - window.y1) * nPlateComponents, 0.f);
+    if (nPlateComponents == 0 || plate->data.empty()) {
+        return true;
+    }
+    std::vector<int> frames;
+    getCleanPlateFrames(plate->first, plate->last, plate->samples, &frames);
+
+    // process the plate in strips, so that the histograms fit in memory
+    const size_t rowBytes = (size_t)(window.x2 - window.x1) * (nPlateComponents * (kCleanPlateHistogramBins * sizeof(unsigned short) + 2 * sizeof(float)) + sizeof(unsigned short));
+    const int stripHeight = (int)std::max((size_t)1, kCleanPlateHistogramMaxBytes / rowBytes);
+    builder.setDstImg(dst);
+    builder.setPlate(&plate->data[0], window);
+    for (int y1 = window.y1; y1 < window.y2; y1 += stripHeight) {
+        OfxRectI strip = window;
+        strip.y1 = y1;
+        strip.y2 = std::min(y1 + stripHeight, window.y2);
+        builder.startStrip(strip);
+        // fetch only the strip of each frame, so that a single frame is held at a time
+        OfxRectD stripBounds;
+        OFX::MergeImages2D::toCanonical(strip, plate->renderScale, srcClipB_->getPixelAspectRatio(), &stripBounds);
+        for (size_t i = 0; i < frames.size(); ++i) {
+            if (abort()) {
+                return false;
+            }
+            std::auto_ptr<const OFX::Image> src(srcClipB_->fetchImage(frames[i], stripBounds));
+            if (!src.get()) {
+                continue;
+            }
+            if (src->getPixelDepth() != plate->bitDepth || src->getPixelComponents() != plate->components) {
+                OFX::throwSuiteStatusException(kOfxStatErrImageFormat);
+            }
+            builder.setSrcImg(src.get());
+            builder.process();
+        }
+        // extract the median
+        builder.setSrcImg(0);
+        builder.process();
+    }
+    return !abort();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief render for the filter */
 
 /* set up and run a processor */
 void
-DifferencePlugin::setupAndProcess(DifferencerBase &processor, const OFX::RenderArguments &args)
+DifferencePlugin::setupAndProcess(DifferencerBase &processor, CleanPlateBuilderBase &builder, const OFX::RenderArguments &args)
 {
     std::auto_ptr<OFX::Image> dst(dstClip_->fetchImage(args.time));
     if (!dst.get()) {
@@ -255,7 +646,10 @@ DifferencePlugin::setupAndProcess(DifferencerBase &processor, const OFX::RenderA
     }
     OFX::BitDepthEnum dstBitDepth       = dst->getPixelDepth();
     OFX::PixelComponentEnum dstComponents  = dst->getPixelComponents();
-    std::auto_ptr<const OFX::Image> srcA(srcClipA_->fetchImage(args.time));
+    int cleanPlate;
+    _cleanPlate->getValueAtTime(args.time, cleanPlate);
+    // A is not used if the clean plate is computed from B
+    std::auto_ptr<const OFX::Image> srcA((cleanPlate == eCleanPlateA) ? srcClipA_->fetchImage(args.time) : 0);
     std::auto_ptr<const OFX::Image> srcB(srcClipB_->fetchImage(args.time));
     if (srcA.get()) {
         OFX::BitDepthEnum    srcBitDepth      = srcA->getPixelDepth();
@@ -279,6 +673,35 @@ DifferencePlugin::setupAndProcess(DifferencerBase &processor, const OFX::RenderA
     _gain->getValueAtTime(args.time, gain);
     processor.setValues(offset, gain);
     processor.setDstImg(dst.get());
+
+    DifferenceCleanPlate plate;
+    std::vector<float> plateWindow; // the clean plate over the render window
+    if (cleanPlate == eCleanPlateMedian) {
+        // the clean plate only depends on the time through the parameters: it is computed once over
+        // the region of definition (and the render window, if the host renders outside of it)
+        _cleanPlateFirstFrame->getValueAtTime(args.time, plate.first);
+        _cleanPlateLastFrame->getValueAtTime(args.time, plate.last);
+        _cleanPlateSamples->getValueAtTime(args.time, plate.samples);
+        plate.renderScale = args.renderScale;
+        plate.field = args.fieldToRender;
+        OFX::MergeImages2D::rectBoundingBox(dst->getRegionOfDefinition(), args.renderWindow, &plate.bounds);
+        plate.bitDepth = dstBitDepth;
+        plate.components = dstComponents;
+        const int nPlateComponents = builder.getNPlateComponents();
+        if (!getCachedCleanPlate(plate, args.renderWindow, nPlateComponents, &plateWindow)) {
+            OFX::MultiThread::AutoMutex lock(_cleanPlateBuildMutex);
+            // another render window may have built it while we were waiting
+            if (!getCachedCleanPlate(plate, args.renderWindow, nPlateComponents, &plateWindow)) {
+                if (!buildCleanPlate(builder, dst.get(), &plate)) {
+                    // aborted
+                    return;
+                }
+                cropCleanPlate(plate, args.renderWindow, nPlateComponents, &plateWindow);
+                cacheCleanPlate(&plate);
+            }
+        }
+        processor.setCleanPlate(plateWindow.empty() ? 0 : &plateWindow[0], args.renderWindow);
+    }
     processor.setSrcImg(srcA.get(),srcB.get());
     processor.setRenderWindow(args.renderWindow);
     
@@ -299,17 +722,20 @@ DifferencePlugin::render(const OFX::RenderArguments &args)
         switch (dstBitDepth) {
             case OFX::eBitDepthUByte: {
                 Differencer<unsigned char, 4, 255> fred(*this);
-                setupAndProcess(fred, args);
+                CleanPlateBuilder<unsigned char, 4, 255> plate(*this);
+                setupAndProcess(fred, plate, args);
                 break;
             }
             case OFX::eBitDepthUShort: {
                 Differencer<unsigned short, 4, 65535> fred(*this);
-                setupAndProcess(fred, args);
+                CleanPlateBuilder<unsigned short, 4, 65535> plate(*this);
+                setupAndProcess(fred, plate, args);
                 break;
             }
             case OFX::eBitDepthFloat: {
                 Differencer<float, 4, 1> fred(*this);
-                setupAndProcess(fred, args);
+                CleanPlateBuilder<float, 4, 1> plate(*this);
+                setupAndProcess(fred, plate, args);
                 break;
             }
             default:
@@ -319,17 +745,20 @@ DifferencePlugin::render(const OFX::RenderArguments &args)
         switch (dstBitDepth) {
             case OFX::eBitDepthUByte: {
                 Differencer<unsigned char, 3, 255> fred(*this);
-                setupAndProcess(fred, args);
+                CleanPlateBuilder<unsigned char, 3, 255> plate(*this);
+                setupAndProcess(fred, plate, args);
                 break;
             }
             case OFX::eBitDepthUShort: {
                 Differencer<unsigned short, 3, 65535> fred(*this);
-                setupAndProcess(fred, args);
+                CleanPlateBuilder<unsigned short, 3, 65535> plate(*this);
+                setupAndProcess(fred, plate, args);
                 break;
             }
             case OFX::eBitDepthFloat: {
                 Differencer<float, 3, 1> fred(*this);
-                setupAndProcess(fred, args);
+                CleanPlateBuilder<float, 3, 1> plate(*this);
+                setupAndProcess(fred, plate, args);
                 break;
             }
             default:
@@ -340,17 +769,20 @@ DifferencePlugin::render(const OFX::RenderArguments &args)
         switch (dstBitDepth) {
             case OFX::eBitDepthUByte: {
                 Differencer<unsigned char, 1, 255> fred(*this);
-                setupAndProcess(fred, args);
+                CleanPlateBuilder<unsigned char, 1, 255> plate(*this);
+                setupAndProcess(fred, plate, args);
                 break;
             }
             case OFX::eBitDepthUShort: {
                 Differencer<unsigned short, 1, 65535> fred(*this);
-                setupAndProcess(fred, args);
+                CleanPlateBuilder<unsigned short, 1, 65535> plate(*this);
+                setupAndProcess(fred, plate, args);
                 break;
             }
             case OFX::eBitDepthFloat: {
                 Differencer<float, 1, 1> fred(*this);
-                setupAndProcess(fred, args);
+                CleanPlateBuilder<float, 1, 1> plate(*this);
+                setupAndProcess(fred, plate, args);
                 break;
             }
             default:
@@ -380,7 +812,7 @@ void DifferencePluginFactory::describe(OFX::ImageEffectDescriptor &desc)
     desc.setHostFrameThreading(false);
     desc.setSupportsMultiResolution(kSupportsMultiResolution);
     desc.setSupportsTiles(kSupportsTiles);
-    desc.setTemporalClipAccess(false);
+    desc.setTemporalClipAccess(true); // the clean plate may be computed from several frames of B
     desc.setRenderTwiceAlways(false);
     desc.setSupportsMultipleClipPARs(false);
     desc.setRenderThreadSafety(kRenderThreadSafety);
@@ -392,7 +824,7 @@ void DifferencePluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc
     srcClipB->addSupportedComponent( OFX::ePixelComponentRGBA );
     srcClipB->addSupportedComponent( OFX::ePixelComponentRGB );
     srcClipB->addSupportedComponent( OFX::ePixelComponentAlpha );
-    srcClipB->setTemporalClipAccess(false);
+    srcClipB->setTemporalClipAccess(true);
     srcClipB->setSupportsTiles(kSupportsTiles);
     srcClipB->setOptional(false);
 
@@ -402,7 +834,7 @@ void DifferencePluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc
     srcClipA->addSupportedComponent( OFX::ePixelComponentAlpha );
     srcClipA->setTemporalClipAccess(false);
     srcClipA->setSupportsTiles(kSupportsTiles);
-    srcClipA->setOptional(false);
+    srcClipA->setOptional(true); // not used if the clean plate is computed from B
 
     // create the mandated output clip
     ClipDescriptor *dstClip = desc.defineClip(kOfxImageEffectOutputClipName);
@@ -436,6 +868,52 @@ void DifferencePluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc
         param->setDoubleType(eDoubleTypeScale);
         page->addChild(*param);
     }
+
+    // clean plate
+    {
+        ChoiceParamDescriptor *param = desc.defineChoiceParam(kParamCleanPlate);
+        param->setLabels(kParamCleanPlateLabel, kParamCleanPlateLabel, kParamCleanPlateLabel);
+        param->setHint(kParamCleanPlateHint);
+        assert(param->getNOptions() == eCleanPlateA);
+        param->appendOption(kParamCleanPlateOptionA, kParamCleanPlateOptionAHint);
+        assert(param->getNOptions() == eCleanPlateMedian);
+        param->appendOption(kParamCleanPlateOptionMedian, kParamCleanPlateOptionMedianHint);
+        param->setDefault((int)eCleanPlateA);
+        param->setAnimates(false);
+        page->addChild(*param);
+    }
+
+    // clean plate first frame
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamCleanPlateFirstFrame);
+        param->setLabels(kParamCleanPlateFirstFrameLabel, kParamCleanPlateFirstFrameLabel, kParamCleanPlateFirstFrameLabel);
+        param->setHint(kParamCleanPlateFirstFrameHint);
+        param->setDefault(1);
+        param->setAnimates(false);
+        page->addChild(*param);
+    }
+
+    // clean plate last frame
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamCleanPlateLastFrame);
+        param->setLabels(kParamCleanPlateLastFrameLabel, kParamCleanPlateLastFrameLabel, kParamCleanPlateLastFrameLabel);
+        param->setHint(kParamCleanPlateLastFrameHint);
+        param->setDefault(100);
+        param->setAnimates(false);
+        page->addChild(*param);
+    }
+
+    // clean plate samples
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamCleanPlateSamples);
+        param->setLabels(kParamCleanPlateSamplesLabel, kParamCleanPlateSamplesLabel, kParamCleanPlateSamplesLabel);
+        param->setHint(kParamCleanPlateSamplesHint);
+        param->setDefault(25);
+        param->setRange(1, kCleanPlateMaxSamples);
+        param->setDisplayRange(1, 100);
+        param->setAnimates(false);
+        page->addChild(*param);
+    }
 }
 
 OFX::ImageEffect* DifferencePluginFactory::createInstance(OfxImageEffectHandle handle, OFX::ContextEnum /*context*/)
@@ -74,6 +74,8 @@
 
 #include <cmath>
 #include <limits>
+#include <vector>
+#include <algorithm>
 #ifdef _WINDOWS
 #include <windows.h>
 #endif
@@ -81,6 +83,8 @@
 #include "ofxsProcessing.H"
 #include "ofxsMacros.h"
 
+#include "KeyerRows.h"
+
 #define kPluginName "KeyerOFX"
 #define kPluginGrouping "Keyer"
 #define kPluginDescription \
@@ -187,19 +191,6 @@ enum KeyerModeEnum {
 #define kClipInsideMask "InM"
 #define kClipOutsidemask "OutM"
 
-enum OutputModeEnum {
-    eOutputModeIntermediate,
-    eOutputModePremultiplied,
-    eOutputModeUnpremultiplied,
-    eOutputModeComposite,
-};
-
-enum SourceAlphaEnum {
-    eSourceAlphaIgnore,
-    eSourceAlphaAddToInsideMask,
-    eSourceAlphaNormal,
-};
-
 using namespace OFX;
 
 // This is for Rec.709
@@ -210,6 +201,12 @@ double rgb2luminance(double r, double g, double b)
     return 0.2126 * r + 0.7152 * g + 0.0722 * b;
 }
 
+static inline
+float rgb2luminance(float r, float g, float b)
+{
+    return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
+
 class KeyerProcessorBase : public OFX::ImageProcessor
 {
 protected:
@@ -276,49 +273,13 @@ public:
         _outputMode = outputMode;
         _sourceAlpha = sourceAlpha;
     }
-
-    double key_bg(double Kfg)
-    {
-        if ((_center + _toleranceLower) <= 0. && Kfg <= 0.) { // special case: everything below 0 is 1. if center-toleranceLower<=0
-            return 1.;
-        } else if (Kfg < (_center + _toleranceLower + _softnessLower)) {
-            return 0.;
-        } else if (Kfg < (_center + _toleranceLower) && _softnessLower < 0.) {
-            return (Kfg - (_center + _toleranceLower + _softnessLower)) / -_softnessLower;
-        } else if (Kfg <= _center + _toleranceUpper) {
-            return 1.;
-        }  else if (1. <= (_center + _toleranceUpper) &&  1. <= Kfg) { // special case: everything above 1 is 1. if center+toleranceUpper>=1
-            return 1.;
-        } else if (Kfg < (_center + _toleranceUpper + _softnessUpper) && _softnessUpper > 0.) {
-            return ((_center + _toleranceUpper + _softnessUpper) - Kfg) / _softnessUpper;
-        } else {
-            return 0.;
-        }
-    }
 };
 
 
-template<class PIX, int maxValue>
-static float sampleToFloat(PIX value)
-{
-    return (maxValue == 1) ? value : (value / (float)maxValue);
-}
-
-template<class PIX, int maxValue>
-static PIX floatToSample(float value)
-{
-    if (maxValue == 1) {
-        return value;
-    }
-    if (value <= 0) {
-        return 0;
-    } else if (value >= 1.) {
-        return maxValue;
-    }
-    return value * maxValue + 0.5;
-}
-
-template <class PIX, int nComponents, int maxValue>
+// The keyer mode is a template parameter, so that the per-pixel code has no switch on the mode.
+// Each row is loaded into float planes, and the key is computed by branch-free loops over the row,
+// which the compiler vectorizes.
+template <class PIX, int nComponents, int maxValue, KeyerModeEnum keyerMode>
 class KeyerProcessor : public KeyerProcessorBase
 {
 public:
@@ -330,168 +291,128 @@ public:
 private:
     void multiThreadProcessImages(OfxRectI procWindow)
     {
+        assert(_keyerMode == keyerMode);
         // for Color and Screen modes, how much the scalar product between RGB and the keyColor must be
         // multiplied by to get the foreground key value 1, which corresponds to the maximum
         // possible value, e.g. for (R,G,B)=(1,1,1)
         // Kfg = 1 = colorKeyFactor * (1,1,1)._keyColor (where "." is the scalar product)
         const double keyColor111 = _keyColor.r + _keyColor.g + _keyColor.b;
-        // const double keyColorFactor = (keyColor111 == 0.) ? 1. : 1./keyColor111;
         // squared norm of keyColor, used for Screen mode
         const double keyColorNorm2 = (_keyColor.r*_keyColor.r) + (_keyColor.g*_keyColor.g) + (_keyColor.b*_keyColor.b);
+        const double keyColorNorm = std::sqrt(keyColorNorm2);
+
+        // constants of the per-pixel computations
+        const float kr = _keyColor.r;
+        const float kg = _keyColor.g;
+        const float kb = _keyColor.b;
+        const bool useLuminance = (keyerMode == eKeyerModeLuminance) || (keyColor111 == 0.);
+        const float inv111 = (keyColor111 == 0.) ? 0.f : (float)(1. / keyColor111);
+        const float invNorm2 = (keyColorNorm2 == 0.) ? 0.f : (float)(1. / keyColorNorm2);
+        const float invNorm = (keyColorNorm2 == 0.) ? 0.f : (float)(1. / keyColorNorm);
+        const bool doDespill = ((_despill > 0.) && (keyerMode == eKeyerModeNone || keyerMode == eKeyerModeScreen) &&
+                                _outputMode != eOutputModeIntermediate && keyColorNorm2 > 0.);
+        const float despillIn = std::min(_despill, 1.);
+        const float despillOut = std::max(0., _despill - 1);
+        const bool premultiply = (_outputMode != eOutputModeUnpremultiplied);
+        const bool addSourceAlpha = (_sourceAlpha == eSourceAlphaAddToInsideMask && nComponents == 4);
+        const bool useCompAlpha = (_outputMode == eOutputModeComposite && _sourceAlpha == eSourceAlphaNormal && nComponents == 4);
+        // the piecewise-linear function from Kfg to Kbg
+        const float lower = _center + _toleranceLower; // Kbg is 1 in [lower,upper]
+        const float upper = _center + _toleranceUpper;
+        const float lowerSoft = lower + _softnessLower; // Kbg is 0 below lowerSoft
+        const float upperSoft = upper + _softnessUpper; // Kbg is 0 above upperSoft
+        const bool lowerRamp = (_softnessLower < 0.);
+        const bool upperRamp = (_softnessUpper > 0.);
+        const float invSoftnessLower = lowerRamp ? (float)(-1. / _softnessLower) : 0.f;
+        const float invSoftnessUpper = upperRamp ? (float)(1. / _softnessUpper) : 0.f;
+        const bool belowZeroIsBg = (lower <= 0.f); // special case: everything below 0 is 1. if center-toleranceLower<=0
+        const bool aboveOneIsBg = (1.f <= upper); // special case: everything above 1 is 1. if center+toleranceUpper>=1
+
+        const int n = procWindow.x2 - procWindow.x1;
+        KeyerRowBuffer row(n);
+        float *fgr = row.fgr;
+        float *fgg = row.fgg;
+        float *fgb = row.fgb;
+        float *fga = row.fga;
+        const float *srcValid = row.srcValid;
+        const float *inMask = row.inMask;
+        const float *outMask = row.outMask;
+        float *Kbg = row.Kbg;
 
         for (int y = procWindow.y1; y < procWindow.y2; ++y) {
             if (_effect.abort()) {
                 break;
             }
 
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-            assert(dstPix);
-
-            for (int x = procWindow.x1; x < procWindow.x2; ++x, dstPix += nComponents) {
-                
-                const PIX *srcPix = (const PIX *)  (_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
-                const PIX *bgPix = (const PIX *)  (_bgImg ? _bgImg->getPixelAddress(x, y) : 0);
-                const PIX *inMaskPix = (const PIX *)  (_inMaskImg ? _inMaskImg->getPixelAddress(x, y) : 0);
-                const PIX *outMaskPix = (const PIX *)  (_outMaskImg ? _outMaskImg->getPixelAddress(x, y) : 0);
-
-                float inMask = inMaskPix ? *inMaskPix : 0.;
-                if (_sourceAlpha == eSourceAlphaAddToInsideMask && nComponents == 4 && srcPix) {
-                    // take the max of inMask and the source Alpha
-                    inMask = std::max(inMask, sampleToFloat<PIX,maxValue>(srcPix[3]));
-                }
-                float outMask = outMaskPix ? *outMaskPix : 0.;
-                double Kbg = 0.;
+            row.load<PIX,nComponents,maxValue>(_srcImg, _bgImg, _inMaskImg, _outMaskImg, procWindow.x1, y);
 
+            for (int k = 0; k < n; ++k) {
+                // take the max of inMask and the source Alpha
+                float inM = addSourceAlpha ? std::max(inMask[k], fga[k]) : inMask[k];
                 // clamp inMask and outMask in the [0,1] range
-                inMask = std::max(0.f,std::min(inMask,1.f));
-                outMask = std::max(0.f,std::min(outMask,1.f));
-
-                // output of the foreground suppressor
-                double fgr = srcPix ? sampleToFloat<PIX,maxValue>(srcPix[0]) : 0.;
-                double fgg = srcPix ? sampleToFloat<PIX,maxValue>(srcPix[1]) : 0.;
-                double fgb = srcPix ? sampleToFloat<PIX,maxValue>(srcPix[2]) : 0.;
-                double bgr = bgPix ? sampleToFloat<PIX,maxValue>(bgPix[0]) : 0.;
-                double bgg = bgPix ? sampleToFloat<PIX,maxValue>(bgPix[1]) : 0.;
-                double bgb = bgPix ? sampleToFloat<PIX,maxValue>(bgPix[2]) : 0.;
-
-                // we want to be able to play with the matte even if the background is not connected
-                if (!srcPix) {
-                    // no source, take only background
-                    Kbg = 1.;
-                    fgr = fgg = fgb = 0.;
-                } else if (outMask >= 1.) { // optimize
-                    Kbg = 1.;
-                    fgr = fgg = fgb = 0.;
-                } else {
-                    // from fgr, fgg, fgb, compute Kbg and update fgr, fgg, fgb
-
-                    double Kfg;
-                    double scalarProd = 0.;
-                    double norm2 = 0.;
-                    double d = 0.;
-                    switch (_keyerMode) {
-                        case eKeyerModeLuminance: {
-                            Kfg = rgb2luminance(fgr, fgg, fgb);
-                            break;
-                        }
-                        case eKeyerModeColor: {
-                            scalarProd = fgr * _keyColor.r + fgg * _keyColor.g + fgb * _keyColor.b;
-                            Kfg = (keyColor111 == 0) ? rgb2luminance(fgr, fgg, fgb) : (scalarProd / keyColor111);
-                            break;
-                        }
-                        case eKeyerModeScreen: {
-                            scalarProd = fgr * _keyColor.r + fgg * _keyColor.g + fgb * _keyColor.b;
-                            norm2 = fgr * fgr + fgg * fgg + fgb * fgb;
-                            d = std::sqrt(std::max(0., norm2 - ((keyColorNorm2 == 0) ? 0. : (scalarProd * scalarProd / keyColorNorm2))));
-                            Kfg = (keyColor111 == 0) ? rgb2luminance(fgr, fgg, fgb) : (scalarProd / keyColor111);
-                            Kfg -= d;
-                            break;
-                        }
-                        case eKeyerModeNone: {
-                            scalarProd = fgr * _keyColor.r + fgg * _keyColor.g + fgb * _keyColor.b;
-                            norm2 = fgr * fgr + fgg * fgg + fgb * fgb;
-                            d = std::sqrt(std::max(0., norm2 - ((keyColorNorm2 == 0) ? 0. : (scalarProd * scalarProd / keyColorNorm2))));
-                            break;
-                        }
-                    }
-
-                    // compute Kbg from Kfg
-                    if (_keyerMode == eKeyerModeNone) {
-                        Kbg = 1.;
-                    } else {
-                        Kbg = key_bg(Kfg);
-                    }
-                    // nonadditive mix between the key generator and the garbage matte (outMask)
-                    // note tha in Chromakeyer this is done before on Kfg instead of Kbg.
-                    if (inMask > 0. && Kbg > 1.-inMask) {
-                        Kbg = 1.-inMask;
-                    }
-                    if (outMask > 0. && Kbg < outMask) {
-                        Kbg = outMask;
-                    }
-
-
-                    // despill fgr, fgg, fgb
-                    if ((_despill > 0.) && (_keyerMode == eKeyerModeNone || _keyerMode == eKeyerModeScreen) && _outputMode != eOutputModeIntermediate && keyColorNorm2 > 0.) {
-                        double keyColorNorm = std::sqrt(keyColorNorm2);
-                        // color in the direction of keyColor
-                        if (scalarProd/keyColorNorm > d) {
-                            // maxdespill:
-                            // if despill in [0,1]: only outside regions are despilled
-                            // if despill in [1,2]: inside regions are despilled too
-                            double maxdespill = Kbg*std::min(_despill,1.) + (1-Kbg)*std::max(0., _despill-1);
-                            double colorshift = maxdespill*(scalarProd/keyColorNorm - d);
-                            fgr -= colorshift * _keyColor.r / keyColorNorm;
-                            fgg -= colorshift * _keyColor.g / keyColorNorm;
-                            fgb -= colorshift * _keyColor.b / keyColorNorm;
-                        }
-                    }
-
-                    // premultiply foreground
-                    if (_outputMode != eOutputModeUnpremultiplied) {
-                        fgr *= (1.-Kbg);
-                        fgg *= (1.-Kbg);
-                        fgb *= (1.-Kbg);
+                inM = std::max(0.f, std::min(inM, 1.f));
+                const float outM = std::max(0.f, std::min(outMask[k], 1.f));
+                float r = fgr[k];
+                float g = fgg[k];
+                float b = fgb[k];
+
+                // from fgr, fgg, fgb, compute Kbg and update fgr, fgg, fgb
+                const float scalarProd = r * kr + g * kg + b * kb;
+                float d = 0.f;
+                if (keyerMode == eKeyerModeScreen || keyerMode == eKeyerModeNone) {
+                    const float norm2 = r * r + g * g + b * b;
+                    d = std::sqrt(std::max(0.f, norm2 - scalarProd * scalarProd * invNorm2));
+                }
+                float bgKey = 1.f;
+                if (keyerMode != eKeyerModeNone) {
+                    float Kfg = useLuminance ? rgb2luminance(r, g, b) : (scalarProd * inv111);
+                    if (keyerMode == eKeyerModeScreen) {
+                        Kfg -= d;
                     }
-
-                    // clamp foreground color to [0,1]
-                    fgr = std::max(0.,std::min(fgr,1.));
-                    fgg = std::max(0.,std::min(fgg,1.));
-                    fgb = std::max(0.,std::min(fgb,1.));
+                    // compute Kbg from Kfg, using the piecewise linear function from the plugin description
+                    // (the lower ramp takes precedence over the upper part, even if lower > upper)
+                    const float ramp1 = (Kfg - lowerSoft) * invSoftnessLower;
+                    const float ramp2 = upperRamp ? std::max(0.f, (upperSoft - Kfg) * invSoftnessUpper) : 0.f;
+                    const float k2 = (Kfg <= upper || (aboveOneIsBg && 1.f <= Kfg)) ? 1.f : ramp2;
+                    const float k1 = (lowerRamp && Kfg < lower) ? ramp1 : k2;
+                    bgKey = (belowZeroIsBg && Kfg <= 0.f) ? 1.f : ((Kfg < lowerSoft) ? 0.f : k1);
                 }
-
-                // At this point, we have Kbg,
-
-                // set the alpha channel to the complement of Kbg
-                double fga = 1. - Kbg;
-                //double fga = Kbg;
-                assert(fga >= 0. && fga <= 1.);
-                double compAlpha = (_outputMode == eOutputModeComposite &&
-                                    _sourceAlpha == eSourceAlphaNormal &&
-                                    srcPix) ? sampleToFloat<PIX,maxValue>(srcPix[3]) : 1.;
-                switch (_outputMode) {
-                    case eOutputModeIntermediate:
-                        for (int c = 0; c < 3; ++c) {
-                            dstPix[c] = srcPix ? srcPix[c] : 0;
-                        }
-                        break;
-                    case eOutputModePremultiplied:
-                    case eOutputModeUnpremultiplied:
-                        dstPix[0] = floatToSample<PIX,maxValue>(fgr);
-                        dstPix[1] = floatToSample<PIX,maxValue>(fgg);
-                        dstPix[2] = floatToSample<PIX,maxValue>(fgb);
-                        break;
-                    case eOutputModeComposite:
-                        // [FD] not sure if this is the expected way to use compAlpha
-                        dstPix[0] = floatToSample<PIX,maxValue>(compAlpha * (fgr + bgr * Kbg) + (1.-compAlpha) * bgr);
-                        dstPix[1] = floatToSample<PIX,maxValue>(compAlpha * (fgg + bgg * Kbg) + (1.-compAlpha) * bgg);
-                        dstPix[2] = floatToSample<PIX,maxValue>(compAlpha * (fgb + bgb * Kbg) + (1.-compAlpha) * bgb);
-                        break;
+                // nonadditive mix between the key generator and the garbage matte (outMask)
+                // note tha in Chromakeyer this is done before on Kfg instead of Kbg.
+                bgKey = std::max(std::min(bgKey, 1.f - inM), outM);
+
+                // despill fgr, fgg, fgb
+                if (doDespill) {
+                    // maxdespill:
+                    // if despill in [0,1]: only outside regions are despilled
+                    // if despill in [1,2]: inside regions are despilled too
+                    const float maxdespill = bgKey * despillIn + (1.f - bgKey) * despillOut;
+                    // color in the direction of keyColor
+                    const float colorshift = maxdespill * std::max(0.f, scalarProd * invNorm - d) * invNorm;
+                    r -= colorshift * kr;
+                    g -= colorshift * kg;
+                    b -= colorshift * kb;
                 }
-                if (nComponents == 4) {
-                    dstPix[3] = floatToSample<PIX,maxValue>(fga);
+
+                // premultiply foreground
+                if (premultiply) {
+                    r *= (1.f - bgKey);
+                    g *= (1.f - bgKey);
+                    b *= (1.f - bgKey);
                 }
+
+                // we want to be able to play with the matte even if the background is not connected:
+                // with no source, or if outMask is 1, take only background
+                const bool bgOnly = (srcValid[k] == 0.f || outM >= 1.f);
+                // clamp foreground color to [0,1]
+                fgr[k] = bgOnly ? 0.f : std::max(0.f, std::min(r, 1.f));
+                fgg[k] = bgOnly ? 0.f : std::max(0.f, std::min(g, 1.f));
+                fgb[k] = bgOnly ? 0.f : std::max(0.f, std::min(b, 1.f));
+                Kbg[k] = bgOnly ? 1.f : bgKey;
+                fga[k] = (useCompAlpha && srcValid[k] != 0.f) ? fga[k] : 1.f; // compAlpha
             }
+
+            row.store<PIX,nComponents,maxValue>(_dstImg, _srcImg, procWindow.x1, y, _outputMode, false);
         }
     }
 
@@ -553,6 +474,10 @@ private:
     /** @brief get the clip preferences */
     virtual void getClipPreferences(ClipPreferencesSetter &clipPreferences) OVERRIDE FINAL;
 
+    /* instantiate the processor for the keyer mode */
+    template <class PIX, int nComponents, int maxValue>
+    void renderForBitDepth(const OFX::RenderArguments &args);
+
     /* set up and run a processor */
     void setupAndProcess(KeyerProcessorBase &, const OFX::RenderArguments &args);
 
@@ -685,6 +610,36 @@ KeyerPlugin::setupAndProcess(KeyerProcessorBase &processor, const OFX::RenderArg
     processor.process();
 }
 
+template <class PIX, int nComponents, int maxValue>
+void
+KeyerPlugin::renderForBitDepth(const OFX::RenderArguments &args)
+{
+    int keyerModeI;
+    _keyerMode->getValueAtTime(args.time, keyerModeI);
+    switch ((KeyerModeEnum)keyerModeI) {
+        case eKeyerModeLuminance: {
+            KeyerProcessor<PIX, nComponents, maxValue, eKeyerModeLuminance> fred(*this);
+            setupAndProcess(fred, args);
+            break;
+        }
+        case eKeyerModeColor: {
+            KeyerProcessor<PIX, nComponents, maxValue, eKeyerModeColor> fred(*this);
+            setupAndProcess(fred, args);
+            break;
+        }
+        case eKeyerModeScreen: {
+            KeyerProcessor<PIX, nComponents, maxValue, eKeyerModeScreen> fred(*this);
+            setupAndProcess(fred, args);
+            break;
+        }
+        case eKeyerModeNone: {
+            KeyerProcessor<PIX, nComponents, maxValue, eKeyerModeNone> fred(*this);
+            setupAndProcess(fred, args);
+            break;
+        }
+    }
+}
+
 // the overridden render function
 void
 KeyerPlugin::render(const OFX::RenderArguments &args)
@@ -698,18 +653,15 @@ KeyerPlugin::render(const OFX::RenderArguments &args)
     if (dstComponents == OFX::ePixelComponentRGBA) {
         switch (dstBitDepth) {
             //case OFX::eBitDepthUByte: {
-            //    KeyerProcessor<unsigned char, 4, 255> fred(*this);
-            //    setupAndProcess(fred, args);
+            //    renderForBitDepth<unsigned char, 4, 255>(args);
             //    break;
             //}
             case OFX::eBitDepthUShort: {
-                KeyerProcessor<unsigned short, 4, 65535> fred(*this);
-                setupAndProcess(fred, args);
+                renderForBitDepth<unsigned short, 4, 65535>(args);
                 break;
             }
             case OFX::eBitDepthFloat: {
-                KeyerProcessor<float, 4, 1> fred(*this);
-                setupAndProcess(fred, args);
+                renderForBitDepth<float, 4, 1>(args);
                 break;
             }
             default:
@@ -719,18 +671,15 @@ KeyerPlugin::render(const OFX::RenderArguments &args)
         assert(dstComponents == OFX::ePixelComponentRGB);
         switch (dstBitDepth) {
             //case OFX::eBitDepthUByte: {
-            //    KeyerProcessor<unsigned char, 3, 255> fred(*this);
-            //    setupAndProcess(fred, args);
+            //    renderForBitDepth<unsigned char, 3, 255>(args);
             //    break;
             //}
             case OFX::eBitDepthUShort: {
-                KeyerProcessor<unsigned short, 3, 65535> fred(*this);
-                setupAndProcess(fred, args);
+                renderForBitDepth<unsigned short, 3, 65535>(args);
                 break;
             }
             case OFX::eBitDepthFloat: {
-                KeyerProcessor<float, 3, 1> fred(*this);
-                setupAndProcess(fred, args);
+                renderForBitDepth<float, 3, 1>(args);
                 break;
             }
             default:
@@ -0,0 +1,224 @@
+//
+//  KeyerRows.h
+//  Misc
+//
+//  Float row planes shared by the Keyer and ChromaKeyer processors.
+//
+//  Each row of the source, background and masks is loaded into float planes,
+//  the plugin computes the key and the foreground over the planes with a
+//  branch-free loop that the compiler can vectorize, and the row is written
+//  to the destination according to the output mode.
+//
+
+#ifndef Misc_KeyerRows_h
+#define Misc_KeyerRows_h
+
+#include <cassert>
+#include <algorithm>
+#include <vector>
+
+#include "ofxsImageEffect.h"
+
+enum OutputModeEnum {
+    eOutputModeIntermediate,
+    eOutputModePremultiplied,
+    eOutputModeUnpremultiplied,
+    eOutputModeComposite,
+};
+
+enum SourceAlphaEnum {
+    eSourceAlphaIgnore,
+    eSourceAlphaAddToInsideMask,
+    eSourceAlphaNormal,
+};
+
+template<class PIX, int maxValue>
+float
+sampleToFloat(PIX value)
+{
+    return (maxValue == 1) ? value : (value / (float)maxValue);
+}
+
+template<class PIX, int maxValue>
+PIX
+floatToSample(float value)
+{
+    if (maxValue == 1) {
+        return value;
+    }
+    if (value <= 0) {
+        return 0;
+    } else if (value >= 1.) {
+        return maxValue;
+    }
+    return value * maxValue + 0.5;
+}
+
+/// Load a row of an RGB(A) image into float planes. Pixels outside of the image are black and transparent,
+/// and valid is set to 0 for those pixels. a and valid may be NULL.
+template <class PIX, int nComponents, int maxValue>
+void
+loadRowRGBA(const OFX::Image *img, int x1, int n, int y, float *r, float *g, float *b, float *a, float *valid)
+{
+    std::fill(r, r + n, 0.f);
+    std::fill(g, g + n, 0.f);
+    std::fill(b, b + n, 0.f);
+    if (a) {
+        std::fill(a, a + n, 0.f);
+    }
+    if (valid) {
+        std::fill(valid, valid + n, 0.f);
+    }
+    if (!img) {
+        return;
+    }
+    const OfxRectI& bounds = img->getBounds();
+    const int xa = std::max(x1, bounds.x1);
+    const int xb = std::min(x1 + n, bounds.x2);
+    if (y < bounds.y1 || bounds.y2 <= y || xb <= xa) {
+        return;
+    }
+    const PIX *pix = (const PIX *) img->getPixelAddress(xa, y);
+    assert(pix);
+    for (int k = xa - x1; k < xb - x1; ++k, pix += nComponents) {
+        r[k] = sampleToFloat<PIX,maxValue>(pix[0]);
+        g[k] = sampleToFloat<PIX,maxValue>(pix[1]);
+        b[k] = sampleToFloat<PIX,maxValue>(pix[2]);
+        if (a) {
+            a[k] = (nComponents == 4) ? sampleToFloat<PIX,maxValue>(pix[3]) : 0.f;
+        }
+        if (valid) {
+            valid[k] = 1.f;
+        }
+    }
+}
+
+/// Load a row of a mask image. As in the per-pixel code this replaces, mask values are not normalized.
+template <class PIX>
+void
+loadRowMask(const OFX::Image *img, int x1, int n, int y, float *m)
+{
+    std::fill(m, m + n, 0.f);
+    if (!img) {
+        return;
+    }
+    const OfxRectI& bounds = img->getBounds();
+    const int xa = std::max(x1, bounds.x1);
+    const int xb = std::min(x1 + n, bounds.x2);
+    if (y < bounds.y1 || bounds.y2 <= y || xb <= xa) {
+        return;
+    }
+    const PIX *pix = (const PIX *) img->getPixelAddress(xa, y);
+    assert(pix);
+    for (int k = xa - x1; k < xb - x1; ++k, ++pix) {
+        m[k] = *pix;
+    }
+}
+
+/// The float planes of a row of n pixels.
+///
+/// load() fills the source, background and mask planes. The plugin then replaces
+/// fgr, fgg and fgb by the foreground, Kbg by the background key, and fga by the
+/// alpha used to composite (compAlpha), and store() writes the row.
+/// Kbg shares its plane with outMask.
+class KeyerRowBuffer
+{
+public:
+    explicit KeyerRowBuffer(int n)
+    : _n(n)
+    , _buffer(n * 10)
+    {
+        fgr = &_buffer[0];
+        fgg = fgr + n;
+        fgb = fgg + n;
+        fga = fgb + n; // source alpha
+        srcValid = fga + n;
+        bgr = srcValid + n;
+        bgg = bgr + n;
+        bgb = bgg + n;
+        inMask = bgb + n;
+        outMask = inMask + n;
+        Kbg = outMask; // Kbg overwrites outMask
+    }
+
+    /// load row y, starting at x1, of the images (any of which may be NULL)
+    template <class PIX, int nComponents, int maxValue>
+    void load(const OFX::Image *srcImg, const OFX::Image *bgImg, const OFX::Image *inMaskImg, const OFX::Image *outMaskImg, int x1, int y)
+    {
+        loadRowRGBA<PIX,nComponents,maxValue>(srcImg, x1, _n, y, fgr, fgg, fgb, fga, srcValid);
+        loadRowRGBA<PIX,nComponents,maxValue>(bgImg, x1, _n, y, bgr, bgg, bgb, 0, 0);
+        loadRowMask<PIX>(inMaskImg, x1, _n, y, inMask);
+        loadRowMask<PIX>(outMaskImg, x1, _n, y, outMask);
+    }
+
+    /// write the row to row y of dstImg, starting at x1. The intermediate output copies srcImg.
+    /// If unpremultiply is true, the foreground is premultiplied and is divided by the alpha
+    /// in the unpremultiplied output, else it is written as is.
+    template <class PIX, int nComponents, int maxValue>
+    void store(OFX::Image *dstImg, const OFX::Image *srcImg, int x1, int y, OutputModeEnum outputMode, bool unpremultiply) const
+    {
+        PIX *dstPix = (PIX *) dstImg->getPixelAddress(x1, y);
+        assert(dstPix);
+        for (int k = 0; k < _n; ++k, dstPix += nComponents) {
+            // set the alpha channel to the complement of Kbg
+            const float alpha = 1.f - Kbg[k];
+            const float compAlpha = fga[k];
+            switch (outputMode) {
+                case eOutputModeIntermediate: {
+                    const PIX *srcPix = (const PIX *) (srcImg ? srcImg->getPixelAddress(x1 + k, y) : 0);
+                    for (int c = 0; c < 3; ++c) {
+                        dstPix[c] = srcPix ? srcPix[c] : 0;
+                    }
+                }   break;
+                case eOutputModeUnpremultiplied:
+                    if (unpremultiply) {
+                        if (alpha == 0.f) {
+                            dstPix[0] = dstPix[1] = dstPix[2] = maxValue;
+                        } else {
+                            dstPix[0] = floatToSample<PIX,maxValue>(fgr[k] / alpha);
+                            dstPix[1] = floatToSample<PIX,maxValue>(fgg[k] / alpha);
+                            dstPix[2] = floatToSample<PIX,maxValue>(fgb[k] / alpha);
+                        }
+                        break;
+                    }
+                    // the foreground is already unpremultiplied
+                case eOutputModePremultiplied:
+                    dstPix[0] = floatToSample<PIX,maxValue>(fgr[k]);
+                    dstPix[1] = floatToSample<PIX,maxValue>(fgg[k]);
+                    dstPix[2] = floatToSample<PIX,maxValue>(fgb[k]);
+                    break;
+                case eOutputModeComposite:
+                    // [FD] not sure if this is the expected way to use compAlpha
+                    dstPix[0] = floatToSample<PIX,maxValue>(compAlpha * (fgr[k] + bgr[k] * Kbg[k]) + (1.f - compAlpha) * bgr[k]);
+                    dstPix[1] = floatToSample<PIX,maxValue>(compAlpha * (fgg[k] + bgg[k] * Kbg[k]) + (1.f - compAlpha) * bgg[k]);
+                    dstPix[2] = floatToSample<PIX,maxValue>(compAlpha * (fgb[k] + bgb[k] * Kbg[k]) + (1.f - compAlpha) * bgb[k]);
+                    break;
+            }
+            if (nComponents == 4) {
+                dstPix[3] = floatToSample<PIX,maxValue>(alpha);
+            }
+        }
+    }
+
+    float *fgr;
+    float *fgg;
+    float *fgb;
+    float *fga;
+    float *srcValid;
+    float *bgr;
+    float *bgg;
+    float *bgb;
+    float *inMask;
+    float *outMask;
+    float *Kbg;
+
+private:
+    // the planes point into _buffer
+    KeyerRowBuffer(const KeyerRowBuffer&);
+    KeyerRowBuffer& operator=(const KeyerRowBuffer&);
+
+    int _n;
+    std::vector<float> _buffer;
+};
+
+#endif // Misc_KeyerRows_h
@@ -0,0 +1,146 @@
+//
+//  RectangleEdges.h
+//  Misc
+//
+//  Separable soft-edge weights for the rectangle-based plugins (Rectangle,
+//  Crop, CopyRectangle).
+//
+//  The weight of a pixel in a soft-edged rectangle is the product of a
+//  weight that only depends on its column and a weight that only depends on
+//  its row. Both are tabulated once per render, and each row is split into
+//  spans where the column weight is constant (0 outside of the rectangle, 1
+//  in its interior), which can be filled or copied, and soft spans along the
+//  edges, where the weights are read from the table.
+//
+
+#ifndef Misc_RectangleEdges_h
+#define Misc_RectangleEdges_h
+
+#include <cassert>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#include "ofxsImageEffect.h"
+
+/// The weights of the columns (or rows) [start,end) of the render window.
+/// The weights must increase from 0 to 1, then decrease to 0.
+class RectangleEdgeTable
+{
+public:
+    RectangleEdgeTable()
+    : _start(0)
+    , _end(0)
+    , _weights()
+    , _nonzero1(0)
+    , _inside1(0)
+    , _inside2(0)
+    , _nonzero2(0)
+    {
+    }
+
+    /// cover [start,end), with all weights 0
+    void reset(int start, int end)
+    {
+        _start = start;
+        _end = std::max(start, end);
+        _weights.assign(_end - _start, 0.);
+        _nonzero1 = _inside1 = _inside2 = _nonzero2 = _end;
+    }
+
+    void set(int i, double w)
+    {
+        assert(_start <= i && i < _end);
+        _weights[i - _start] = w;
+    }
+
+    /// find the spans of constant weight. Call once all weights are set.
+    void finalize()
+    {
+        const int n = _end - _start;
+        int i = 0;
+        while (i < n && _weights[i] <= 0.) {
+            ++i;
+        }
+        int j = n;
+        while (j > i && _weights[j - 1] <= 0.) {
+            --j;
+        }
+        _nonzero1 = _start + i;
+        _nonzero2 = _start + j;
+        while (i < j && _weights[i] < 1.) {
+            ++i;
+        }
+        while (j > i && _weights[j - 1] < 1.) {
+            --j;
+        }
+        if (i < j) {
+            _inside1 = _start + i;
+            _inside2 = _start + j;
+        } else {
+            // no interior: a single soft span
+            _inside1 = _inside2 = _nonzero2;
+        }
+    }
+
+    double weight(int i) const
+    {
+        assert(_start <= i && i < _end);
+        return _weights[i - _start];
+    }
+
+    /// Get the end of the span starting at i (and ending before end), where the weights are either
+    /// all 0, all 1, or soft. *constantWeight is set to 0 or 1 for a constant span, and -1 for a soft span.
+    int getSpan(int i, int end, double *constantWeight) const
+    {
+        if (i < _nonzero1) {
+            *constantWeight = 0.;
+            return std::min(end, _nonzero1);
+        } else if (i < _inside1) {
+            *constantWeight = -1.;
+            return std::min(end, _inside1);
+        } else if (i < _inside2) {
+            *constantWeight = 1.;
+            return std::min(end, _inside2);
+        } else if (i < _nonzero2) {
+            *constantWeight = -1.;
+            return std::min(end, _nonzero2);
+        }
+        *constantWeight = 0.;
+        return end;
+    }
+
+private:
+    int _start;
+    int _end;
+    std::vector<double> _weights;
+    int _nonzero1, _inside1, _inside2, _nonzero2; // weights are 0 before _nonzero1 and from _nonzero2, 1 in [_inside1,_inside2)
+};
+
+/// Copy the pixels [x1,x2) of row y of the output from the pixels [x1+dx,x2+dx) of row y+dy of src,
+/// with zeroes outside of the bounds of src.
+template <class PIX, int nComponents>
+void
+rectangleEdgesCopyRow(const OFX::Image *src, int x1, int x2, int y, int dx, int dy, PIX *dstPix)
+{
+    int lo = x2;
+    int hi = x2;
+    if (src) {
+        const OfxRectI &bounds = src->getBounds();
+        if (bounds.y1 <= y + dy && y + dy < bounds.y2) {
+            lo = std::max(x1, std::min(x2, bounds.x1 - dx));
+            hi = std::max(lo, std::min(x2, bounds.x2 - dx));
+        }
+    }
+    if (lo == hi) {
+        lo = hi = x2;
+    }
+    std::fill(dstPix, dstPix + (lo - x1) * nComponents, PIX(0));
+    if (lo < hi) {
+        const PIX *srcPix = (const PIX *) src->getPixelAddress(lo + dx, y + dy);
+        std::memcpy(dstPix + (lo - x1) * nComponents, srcPix, (hi - lo) * nComponents * sizeof(PIX));
+    }
+    std::fill(dstPix + (hi - x1) * nComponents, dstPix + (x2 - x1) * nComponents, PIX(0));
+}
+
+#endif
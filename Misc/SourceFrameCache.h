@@ -0,0 +1,391 @@
+//
+//  SourceFrameCache.h
+//  Misc
+//
+//  A per-instance cache of source frames for temporal plugins.
+//
+//  Temporal plugins fetch several source frames for each output frame, and
+//  the same source frames for neighbouring output frames (e.g. a 4x slowdown
+//  in Retime fetches each source frame up to eight times). Host images are
+//  only valid during the action that fetched them, so the cache keeps copies
+//  of the fetched images, and evicts the least recently used ones when its
+//  byte budget is exceeded.
+//
+//  Since the plugin is not notified when the upstream graph changes, frames
+//  are only cached during a sequential render (between beginSequence() and
+//  endSequence()). Outside of a sequential render, the host image is used
+//  directly.
+//
+
+#ifndef Misc_SourceFrameCache_h
+#define Misc_SourceFrameCache_h
+
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <algorithm>
+#include <vector>
+#include <list>
+
+#include "ofxsImageEffect.h"
+#include "ofxsMultiThread.h"
+#include "ofxsMerging.h"
+
+#define kSourceFrameCacheMaxBytes (512*1024*1024) // default byte budget of a SourceFrameCache
+
+/// A source image which is either a host image, or a copy of a host image that
+/// stays valid after the action that fetched it.
+class SourceFrame
+{
+public:
+    /// use the host image directly, which is owned (and released) by the frame
+    explicit SourceFrame(const OFX::Image* img)
+    : _img(img)
+    , _data()
+    , _pixelData(img->getPixelData())
+    , _bounds(img->getBounds())
+    , _rowBytes(img->getRowBytes())
+    , _pixelBytes(getPixelBytes(*img))
+    , _pixelDepth(img->getPixelDepth())
+    , _pixelComponents(img->getPixelComponents())
+    {
+    }
+
+    /// a copy of the host image, which the caller may release
+    static SourceFrame* copy(const OFX::Image& img)
+    {
+        return new SourceFrame(img);
+    }
+
+    const void* getPixelAddress(int x, int y) const
+    {
+        if (x < _bounds.x1 || x >= _bounds.x2 || y < _bounds.y1 || y >= _bounds.y2 || !_pixelData) {
+            return 0;
+        }
+        return (const char*)_pixelData + (ptrdiff_t)(y - _bounds.y1) * _rowBytes + (ptrdiff_t)(x - _bounds.x1) * _pixelBytes;
+    }
+
+    const void* getPixelData() const { return _pixelData; }
+    int getRowBytes() const { return _rowBytes; }
+    const OfxRectI& getBounds() const { return _bounds; }
+    OFX::BitDepthEnum getPixelDepth() const { return _pixelDepth; }
+    OFX::PixelComponentEnum getPixelComponents() const { return _pixelComponents; }
+    size_t getByteSize() const { return _data.size(); }
+
+private:
+    // see copy()
+    explicit SourceFrame(const OFX::Image& img)
+    : _img()
+    , _data()
+    , _pixelData(0)
+    , _bounds(img.getBounds())
+    , _rowBytes(0)
+    , _pixelBytes(getPixelBytes(img))
+    , _pixelDepth(img.getPixelDepth())
+    , _pixelComponents(img.getPixelComponents())
+    {
+        const int width = _bounds.x2 - _bounds.x1;
+        _rowBytes = width * _pixelBytes;
+        _data.resize((size_t)_rowBytes * std::max(0, _bounds.y2 - _bounds.y1));
+        if (_data.empty()) {
+            return;
+        }
+        _pixelData = &_data[0];
+        for (int y = _bounds.y1; y < _bounds.y2; ++y) {
+            const void* srcPix = img.getPixelAddress(_bounds.x1, y);
+            assert(srcPix);
+            std::memcpy(&_data[(size_t)(y - _bounds.y1) * _rowBytes], srcPix, _rowBytes);
+        }
+    }
+
+    static int getPixelBytes(const OFX::Image& img)
+    {
+        int componentBytes = 0;
+        switch (img.getPixelDepth()) {
+            case OFX::eBitDepthUByte:
+                componentBytes = 1;
+                break;
+            case OFX::eBitDepthUShort:
+                componentBytes = 2;
+                break;
+            case OFX::eBitDepthFloat:
+                componentBytes = 4;
+                break;
+            default:
+                OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
+        }
+        return img.getPixelComponentCount() * componentBytes;
+    }
+
+    std::auto_ptr<const OFX::Image> _img;
+    std::vector<char> _data;
+    const void* _pixelData;
+    OfxRectI _bounds;
+    int _rowBytes;
+    int _pixelBytes;
+    OFX::BitDepthEnum _pixelDepth;
+    OFX::PixelComponentEnum _pixelComponents;
+};
+
+/// Identifies a source frame.
+struct SourceFrameKey
+{
+    const OFX::Clip* clip;
+    double time;
+    OfxPointD renderScale;
+    OFX::FieldEnum field;
+
+    bool operator==(const SourceFrameKey& other) const
+    {
+        return (clip == other.clip &&
+                time == other.time &&
+                renderScale.x == other.renderScale.x &&
+                renderScale.y == other.renderScale.y &&
+                field == other.field);
+    }
+};
+
+/// A thread-safe LRU cache of source frames, with a byte budget and an optional frame count limit.
+/// Frames are reference-counted while they are used by a render, and are only
+/// deleted when they are not in use.
+class SourceFrameCache
+{
+public:
+    explicit SourceFrameCache(size_t maxBytes = kSourceFrameCacheMaxBytes)
+    : _maxBytes(maxBytes)
+    , _maxFrames(0)
+    , _bytes(0)
+    , _sequences(0)
+    , _hits(0)
+    , _misses(0)
+    {
+    }
+
+    ~SourceFrameCache()
+    {
+        clear();
+    }
+
+    void setMaxBytes(size_t maxBytes)
+    {
+        OFX::MultiThread::AutoMutex lock(_mutex);
+        _maxBytes = maxBytes;
+        prune();
+    }
+
+    /// keep at most maxFrames frames (0 means no limit). With the number of frames used by
+    /// each render, this makes the cache a ring buffer over a sequential render.
+    void setMaxFrames(size_t maxFrames)
+    {
+        OFX::MultiThread::AutoMutex lock(_mutex);
+        _maxFrames = maxFrames;
+        prune();
+    }
+
+    /// start caching frames. Call from beginSequenceRender(). Sequential renders may
+    /// overlap: the cache is only cleared when the first one starts.
+    void beginSequence()
+    {
+        OFX::MultiThread::AutoMutex lock(_mutex);
+        if (_sequences == 0) {
+            clearLocked();
+            _hits = _misses = 0;
+        }
+        ++_sequences;
+    }
+
+    /// stop caching frames. Call from endSequenceRender(). The cache is cleared when
+    /// the last sequential render ends.
+    void endSequence()
+    {
+        OFX::MultiThread::AutoMutex lock(_mutex);
+        if (_sequences > 0) {
+            --_sequences;
+            if (_sequences == 0) {
+                clearLocked();
+            }
+        }
+    }
+
+    /// true between beginSequence() and endSequence(), i.e. while frames are cached
+    bool inSequence() const
+    {
+        OFX::MultiThread::AutoMutex lock(_mutex);
+        return _sequences > 0;
+    }
+
+    /// number of fetches served from the cache since the first beginSequence()
+    unsigned long getHits() const
+    {
+        OFX::MultiThread::AutoMutex lock(_mutex);
+        return _hits;
+    }
+
+    /// number of fetches that went to the host while caching, since the first beginSequence()
+    unsigned long getMisses() const
+    {
+        OFX::MultiThread::AutoMutex lock(_mutex);
+        return _misses;
+    }
+
+    /// Get the frame of the clip at the given time, which must contain the window (in pixel coordinates)
+    /// if it is cached. Returns 0 if the host returned no image. The frame must be released with release().
+    const SourceFrame* fetch(OFX::Clip& clip, double time, const OfxPointD& renderScale, OFX::FieldEnum field, const OfxRectI& window)
+    {
+        SourceFrameKey key;
+        key.clip = &clip;
+        key.time = time;
+        key.renderScale = renderScale;
+        key.field = field;
+
+        // the host image does not extend beyond the source region of definition
+        OfxRectI rod;
+        OFX::MergeImages2D::toPixelEnclosing(clip.getRegionOfDefinition(time), renderScale, clip.getPixelAspectRatio(), &rod);
+        OfxRectI needed;
+        const bool empty = !OFX::MergeImages2D::rectIntersection(window, rod, &needed);
+
+        bool caching;
+        {
+            OFX::MultiThread::AutoMutex lock(_mutex);
+            caching = (_sequences > 0);
+            if (caching) {
+                for (std::list<Entry>::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+                    if (!it->stale && it->key == key && (empty || contains(it->frame->getBounds(), needed))) {
+                        ++it->refCount;
+                        ++_hits;
+                        // move to the front (most recently used)
+                        _entries.splice(_entries.begin(), _entries, it);
+                        return _entries.front().frame;
+                    }
+                }
+                ++_misses;
+            }
+        }
+
+        OFX::Image* img = clip.fetchImage(time);
+        if (!img) {
+            return 0;
+        }
+        if (!caching) {
+            return new SourceFrame(img);
+        }
+        SourceFrame* frame;
+        {
+            std::auto_ptr<const OFX::Image> imgHolder(img);
+            frame = SourceFrame::copy(*imgHolder);
+        }
+
+        OFX::MultiThread::AutoMutex lock(_mutex);
+        Entry entry;
+        entry.key = key;
+        entry.frame = frame;
+        entry.refCount = 1;
+        // the sequential render may have ended while the image was fetched
+        entry.stale = (_sequences == 0);
+        _entries.push_front(entry);
+        _bytes += frame->getByteSize();
+        prune();
+        return frame;
+    }
+
+    void release(const SourceFrame* frame)
+    {
+        if (!frame) {
+            return;
+        }
+        {
+            OFX::MultiThread::AutoMutex lock(_mutex);
+            for (std::list<Entry>::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+                if (it->frame == frame) {
+                    assert(it->refCount > 0);
+                    --it->refCount;
+                    prune();
+                    return;
+                }
+            }
+        }
+        // not cached
+        delete frame;
+    }
+
+    void clear()
+    {
+        OFX::MultiThread::AutoMutex lock(_mutex);
+        clearLocked();
+    }
+
+private:
+    struct Entry
+    {
+        SourceFrameKey key;
+        SourceFrame* frame;
+        int refCount;
+        bool stale;
+    };
+
+    static bool contains(const OfxRectI& bounds, const OfxRectI& rect)
+    {
+        return (bounds.x1 <= rect.x1 && rect.x2 <= bounds.x2 &&
+                bounds.y1 <= rect.y1 && rect.y2 <= bounds.y2);
+    }
+
+    // mark all the entries stale, frames still in use are deleted when released. Call with _mutex locked.
+    void clearLocked()
+    {
+        for (std::list<Entry>::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+            it->stale = true;
+        }
+        prune();
+    }
+
+    // remove the stale entries and the least recently used entries that are not in use. Call with _mutex locked.
+    void prune()
+    {
+        std::list<Entry>::iterator it = _entries.end();
+        while (it != _entries.begin()) {
+            --it;
+            if (it->refCount == 0 && (it->stale || _bytes > _maxBytes || (_maxFrames > 0 && _entries.size() > _maxFrames))) {
+                _bytes -= it->frame->getByteSize();
+                delete it->frame;
+                it = _entries.erase(it);
+            }
+        }
+    }
+
+    mutable OFX::MultiThread::Mutex _mutex;
+    size_t _maxBytes;
+    size_t _maxFrames;
+    size_t _bytes;
+    int _sequences;
+    unsigned long _hits;
+    unsigned long _misses;
+    std::list<Entry> _entries;
+};
+
+/// Releases a frame fetched from a SourceFrameCache when it goes out of scope.
+class SourceFrameRef
+{
+public:
+    SourceFrameRef(SourceFrameCache& cache, const SourceFrame* frame)
+    : _cache(cache)
+    , _frame(frame)
+    {
+    }
+
+    ~SourceFrameRef()
+    {
+        _cache.release(_frame);
+    }
+
+    const SourceFrame* get() const { return _frame; }
+
+private:
+    // noncopyable
+    SourceFrameRef(const SourceFrameRef&);
+    SourceFrameRef& operator=(const SourceFrameRef&);
+
+    SourceFrameCache& _cache;
+    const SourceFrame* _frame;
+};
+
+#endif
@@ -0,0 +1,269 @@
+//
+//  TransformFastPath.h
+//  Misc
+//
+//  Render paths that bypass the generic Transform3x3 render, shared by the
+//  Transform3x3-based plugins (Transform, CornerPin).
+//
+//  TransformFastPathPlugin renders with adaptive motion blur (see
+//  TransformMotionBlur.h), with the prefiltered pyramid (see TransformMipmap.h),
+//  or with the plugin's own fast path when the parameters allow it, and with
+//  the generic Transform3x3 render otherwise. Masking, mixing, field rendering
+//  and directional blur always go through the generic render.
+//
+
+#ifndef Misc_TransformFastPath_h
+#define Misc_TransformFastPath_h
+
+#include <vector>
+
+#include "ofxsImageEffect.h"
+#include "ofxsTransform3x3.h"
+#include "ofxsFilter.h"
+#include "ofxsMaskMix.h"
+#include "ofxsMerging.h"
+#include "TransformMipmap.h"
+#include "TransformMotionBlur.h"
+
+template <class Renderer, int nComponents>
+void
+transformProcessForDepth(OFX::BitDepthEnum depth, Renderer& renderer)
+{
+    switch (depth) {
+        case OFX::eBitDepthUByte:
+            renderer.template process<unsigned char, nComponents, 255>();
+            break;
+        case OFX::eBitDepthUShort:
+            renderer.template process<unsigned short, nComponents, 65535>();
+            break;
+        case OFX::eBitDepthFloat:
+            renderer.template process<float, nComponents, 1>();
+            break;
+        default:
+            OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
+    }
+}
+
+/// Call renderer.template process<PIX, nComponents, maxValue>() for the pixel format of img.
+template <class Renderer>
+void
+transformProcessForFormat(const OFX::Image* img, Renderer& renderer)
+{
+    switch (img->getPixelComponents()) {
+        case OFX::ePixelComponentRGBA:
+            transformProcessForDepth<Renderer, 4>(img->getPixelDepth(), renderer);
+            break;
+        case OFX::ePixelComponentRGB:
+            transformProcessForDepth<Renderer, 3>(img->getPixelDepth(), renderer);
+            break;
+        case OFX::ePixelComponentAlpha:
+            transformProcessForDepth<Renderer, 1>(img->getPixelDepth(), renderer);
+            break;
+        default:
+            OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
+    }
+}
+
+class TransformFastPathPlugin : public Transform3x3Plugin
+{
+public:
+    TransformFastPathPlugin(OfxImageEffectHandle handle, bool masked)
+    : Transform3x3Plugin(handle, masked)
+    , _invert(0)
+    , _filter(0)
+    , _masked(masked)
+    , _motionblur(0)
+    , _directionalBlur(0)
+    , _mix(0)
+    , _prefilter(0)
+    , _adaptiveMotionBlur(0)
+    , _shutterCurve(0)
+    , _shutter(0)
+    , _shutterOffset(0)
+    , _shutterCustomOffset(0)
+    {
+        // GENERIC params used to decide whether the generic render can be bypassed
+        _invert = fetchBooleanParam(kParamTransform3x3Invert);
+        _filter = fetchChoiceParam(kParamFilterType);
+        _motionblur = fetchDoubleParam(kParamTransform3x3MotionBlur);
+        _directionalBlur = fetchBooleanParam(kParamTransform3x3DirectionalBlur);
+        if (paramExists(kParamMix)) {
+            _mix = fetchDoubleParam(kParamMix);
+        }
+        _prefilter = fetchBooleanParam(kParamTransformPrefilter);
+        _adaptiveMotionBlur = fetchBooleanParam(kParamTransformAdaptiveMotionBlur);
+        _shutterCurve = fetchChoiceParam(kParamTransformShutterCurve);
+        _shutter = fetchDoubleParam(kParamTransform3x3Shutter);
+        _shutterOffset = fetchChoiceParam(kParamTransform3x3ShutterOffset);
+        _shutterCustomOffset = fetchDoubleParam(kParamTransform3x3ShutterCustomOffset);
+    }
+
+protected:
+    /* render using the plugin's fast path. Returns false if it does not apply, in
+       which case nothing was rendered */
+    virtual bool renderFastPath(const OFX::RenderArguments &args) = 0;
+
+    /* true if the render can bypass the generic Transform3x3 code (no mask, mix, field or directional blur,
+       and no motion blur unless motionBlur is true) */
+    bool canBypassGenericRender(const OFX::RenderArguments &args, bool motionBlur = false)
+    {
+        if (args.fieldToRender == OFX::eFieldLower || args.fieldToRender == OFX::eFieldUpper) {
+            return false;
+        }
+        return canBypassGenericRender(args.time, motionBlur);
+    }
+
+    /* same as above, without the field check (for the actions that have no field) */
+    bool canBypassGenericRender(double time, bool motionBlur = false)
+    {
+        // motion blur, masking and mixing are left to the generic code
+        double motionblur;
+        _motionblur->getValueAtTime(time, motionblur);
+        bool directionalBlur;
+        _directionalBlur->getValueAtTime(time, directionalBlur);
+        if ((motionblur != 0. && !motionBlur) || directionalBlur) {
+            return false;
+        }
+        if (_mix) {
+            double mix;
+            _mix->getValueAtTime(time, mix);
+            if (mix != 1.) {
+                return false;
+            }
+        }
+        if (_masked && getContext() != OFX::eContextFilter && maskClip_ && maskClip_->isConnected()) {
+            return false;
+        }
+        return true;
+    }
+
+    OFX::FilterEnum getFilter(double time) const
+    {
+        int filter;
+        _filter->getValueAtTime(time, filter);
+        return (OFX::FilterEnum)filter;
+    }
+
+    OFX::BooleanParam* _invert;
+
+private:
+    /* Override the render, to use the adaptive motion blur, the prefiltered render or the fast path */
+    virtual void render(const OFX::RenderArguments &args) OVERRIDE FINAL
+    {
+        if (_adaptiveMotionBlur->getValueAtTime(args.time) && canBypassGenericRender(args, true) &&
+            getFilter(args.time) == OFX::eFilterBilinear) {
+            // the adaptive motion blur samples bilinearly: other filters use the generic motion blur
+            double motionblur;
+            _motionblur->getValueAtTime(args.time, motionblur);
+            if (motionblur > 0. && renderAdaptiveMotionBlur(args, motionblur)) {
+                return;
+            }
+        }
+        OFX::Matrix3x3 H;
+        if (canBypassGenericRender(args) && getPrefilterTransform(args.time, &H)) {
+            mipmapRender(*this, _mipmapCache, srcClip_, dstClip_, args, H);
+            return;
+        }
+        if (!renderFastPath(args)) {
+            Transform3x3Plugin::render(args);
+        }
+    }
+
+    /* override the roi call, the prefiltered render needs the whole source */
+    virtual void getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args, OFX::RegionOfInterestSetter &rois) OVERRIDE FINAL
+    {
+        OFX::Matrix3x3 H;
+        if (canBypassGenericRender(args.time) && getPrefilterTransform(args.time, &H)) {
+            // the pyramid is built once for the whole source and shared by all tiles
+            rois.setRegionOfInterest(*srcClip_, srcClip_->getRegionOfDefinition(args.time));
+        } else {
+            Transform3x3Plugin::getRegionsOfInterest(args, rois);
+        }
+    }
+
+    virtual void beginSequenceRender(const OFX::BeginSequenceRenderArguments &args) OVERRIDE FINAL
+    {
+        // the source may have changed since the last sequence
+        _mipmapCache.clear();
+        Transform3x3Plugin::beginSequenceRender(args);
+    }
+
+    virtual void purgeCaches(void) OVERRIDE FINAL
+    {
+        _mipmapCache.clear();
+    }
+
+    /* true if the prefiltered render is used at the given time (if the generic render can be
+       bypassed), and get its inverse transform */
+    bool getPrefilterTransform(double time, OFX::Matrix3x3* H)
+    {
+        if (!_prefilter->getValueAtTime(time)) {
+            return false;
+        }
+        bool invert;
+        _invert->getValueAtTime(time, invert);
+        return getInverseTransformCanonical(time, invert, H);
+    }
+
+    /* render with adaptive motion blur. Returns false if it does not apply */
+    bool renderAdaptiveMotionBlur(const OFX::RenderArguments &args, double amount)
+    {
+        const double time = args.time;
+        bool invert;
+        _invert->getValueAtTime(time, invert);
+        double shutter;
+        _shutter->getValueAtTime(time, shutter);
+        int shutterOffset;
+        _shutterOffset->getValueAtTime(time, shutterOffset);
+        double shutterCustomOffset;
+        _shutterCustomOffset->getValueAtTime(time, shutterCustomOffset);
+        int shutterCurve;
+        _shutterCurve->getValueAtTime(time, shutterCurve);
+
+        // probe the motion of the corners of the output region of definition to get the number of samples
+        // needed, so that all the tiles of a frame use the same number of samples
+        std::vector<double> times, weights;
+        transformShutterTimes(time, shutter, (OFX::ShutterOffsetEnum)shutterOffset, shutterCustomOffset, (TransformShutterCurveEnum)shutterCurve,
+                              kTransformMotionBlurProbeSamples, &times, &weights);
+        std::vector<OFX::Matrix3x3> H(times.size());
+        const double srcPar = srcClip_->getPixelAspectRatio();
+        const double dstPar = dstClip_->getPixelAspectRatio();
+        for (size_t k = 0; k < times.size(); ++k) {
+            OFX::Matrix3x3 Hc;
+            if (!getInverseTransformCanonical(times[k], invert, &Hc)) {
+                return false;
+            }
+            H[k] = transformPixelMatrix(Hc, srcPar, dstPar, args.renderScale);
+        }
+        OfxRectI dstRoD;
+        OFX::MergeImages2D::toPixelEnclosing(dstClip_->getRegionOfDefinition(time), args.renderScale, dstPar, &dstRoD);
+        const int n = transformMotionBlurSampleCount(amount, transformMotionExtent(H, dstRoD), kTransformMotionBlurMaxSamples);
+
+        transformShutterTimes(time, shutter, (OFX::ShutterOffsetEnum)shutterOffset, shutterCustomOffset, (TransformShutterCurveEnum)shutterCurve,
+                              n, &times, &weights);
+        H.resize(n);
+        for (int k = 0; k < n; ++k) {
+            if (!getInverseTransformCanonical(times[k], invert, &H[k])) {
+                return false;
+            }
+        }
+        transformMotionBlurRender(*this, srcClip_, dstClip_, args, H, weights);
+
+        return true;
+    }
+
+    OFX::ChoiceParam* _filter;
+    bool _masked;
+    OFX::DoubleParam* _motionblur;
+    OFX::BooleanParam* _directionalBlur;
+    OFX::DoubleParam* _mix;
+    OFX::BooleanParam* _prefilter;
+    MipmapCache _mipmapCache;
+    OFX::BooleanParam* _adaptiveMotionBlur;
+    OFX::ChoiceParam* _shutterCurve;
+    OFX::DoubleParam* _shutter;
+    OFX::ChoiceParam* _shutterOffset;
+    OFX::DoubleParam* _shutterCustomOffset;
+};
+
+#endif // Misc_TransformFastPath_h
@@ -0,0 +1,606 @@
+//
+//  TransformMipmap.h
+//  Misc
+//
+//  Prefiltered (mipmap) sampling for the Transform3x3-based plugins.
+//
+//  When a transform minifies the source strongly, point-sampling the source
+//  aliases, and a filter footprint large enough to avoid it makes the render
+//  time grow with the minification factor. Instead, a box-filtered pyramid of
+//  the source is built once per source image, and each destination pixel is
+//  sampled trilinearly from the two levels that bracket its footprint, so the
+//  per-pixel cost is constant.
+//
+
+#ifndef Misc_TransformMipmap_h
+#define Misc_TransformMipmap_h
+
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <algorithm>
+#include <vector>
+#include <list>
+#include <string>
+
+#include "ofxsImageEffect.h"
+#include "ofxsMultiThread.h"
+#include "ofxsProcessing.H"
+#include "ofxsMatrix2D.h"
+
+#define kParamTransformPrefilter "prefilter"
+#define kParamTransformPrefilterLabel "Prefilter"
+#define kParamTransformPrefilterHint "When the transform reduces the size of the image, sample a prefiltered pyramid (mipmap) of the source trilinearly. " \
+"This avoids aliasing and shimmering on strong downscales, and the render time does not depend on the amount of minification. " \
+"The filter and black outside parameters are not used in this mode, and the image is black outside of the source."
+#define kParamTransformPrefilterDefault false
+
+#define kMipmapMaxLevels 16
+#define kMipmapCacheSize 2
+
+/// Convert a filtered value to the destination pixel type, rounding and clamping integer types.
+template <class PIX, int maxValue>
+inline PIX
+transformFloatToPix(float v)
+{
+    if (maxValue == 1) {
+        return PIX(v);
+    }
+    return PIX(std::floor(std::min(std::max(v, 0.f), (float)maxValue) + 0.5f));
+}
+
+/// A box-filtered image pyramid with float components.
+/// Level k pixel (x,y) covers the level 0 pixels [x*2^k,(x+1)*2^k)x[y*2^k,(y+1)*2^k),
+/// and pixels outside of the source bounds are black and transparent.
+class Mipmap
+{
+public:
+    Mipmap()
+    : _nComponents(0)
+    {
+    }
+
+    template <class PIX, int maxValue>
+    void build(const OFX::Image* src, int nComponents)
+    {
+        allocate(src->getBounds(), nComponents);
+        // level 0 is the source converted to float, and each coarser level is
+        // the 2x2 box filter of the previous one. The rows of each level are
+        // processed in parallel.
+        Level0Builder<PIX, maxValue> level0Builder(src, &_levels[0], nComponents);
+        level0Builder.multiThread();
+        for (size_t l = 1; l < _levels.size(); ++l) {
+            LevelBuilder levelBuilder(_levels[l - 1], &_levels[l], nComponents);
+            levelBuilder.multiThread();
+        }
+    }
+
+    int getNumLevels() const { return (int)_levels.size(); }
+
+    /// sample with footprint 2^lod, at (x,y) in level 0 pixel coordinates (pixel centers are at +0.5)
+    void sampleTrilinear(double x, double y, double lod, float *out) const
+    {
+        if (lod <= 0.) {
+            sampleBilinear(0, x, y, out);
+            return;
+        }
+        const int maxLevel = (int)_levels.size() - 1;
+        if (lod >= maxLevel) {
+            sampleBilinear(maxLevel, x, y, out);
+            return;
+        }
+        const int l = (int)lod;
+        const float t = (float)(lod - l);
+        float tmp[4];
+        sampleBilinear(l, x, y, out);
+        sampleBilinear(l + 1, x, y, tmp);
+        for (int c = 0; c < _nComponents; ++c) {
+            out[c] += t * (tmp[c] - out[c]);
+        }
+    }
+
+private:
+    struct Level
+    {
+        OfxRectI bounds;
+        std::vector<float> data;
+
+        const float* pixel(int x, int y, int nComponents) const
+        {
+            if (x < bounds.x1 || bounds.x2 <= x || y < bounds.y1 || bounds.y2 <= y) {
+                return 0;
+            }
+            return &data[((size_t)(y - bounds.y1) * (bounds.x2 - bounds.x1) + (x - bounds.x1)) * nComponents];
+        }
+    };
+
+    static int floorDiv2(int v) { return (v >= 0) ? (v / 2) : -((1 - v) / 2); }
+
+    // rows [*y1,*y2) of the rows [by1,by2) to be processed by thread threadID
+    static void threadRows(int by1, int by2, unsigned int threadID, unsigned int nThreads, int *y1, int *y2)
+    {
+        const int chunk = (by2 - by1 + (int)nThreads - 1) / (int)nThreads;
+        *y1 = std::min(by2, by1 + (int)threadID * chunk);
+        *y2 = std::min(by2, *y1 + chunk);
+    }
+
+    // set the bounds of all levels and allocate them
+    void allocate(const OfxRectI& bounds, int nComponents)
+    {
+        _nComponents = nComponents;
+        _levels.clear();
+        _levels.reserve(kMipmapMaxLevels);
+        _levels.resize(1);
+        _levels[0].bounds = bounds;
+        while ((int)_levels.size() < kMipmapMaxLevels) {
+            const OfxRectI fine = _levels.back().bounds;
+            if (fine.x2 - fine.x1 <= 1 && fine.y2 - fine.y1 <= 1) {
+                break;
+            }
+            Level coarse;
+            coarse.bounds.x1 = floorDiv2(fine.x1);
+            coarse.bounds.y1 = floorDiv2(fine.y1);
+            coarse.bounds.x2 = -floorDiv2(-fine.x2);
+            coarse.bounds.y2 = -floorDiv2(-fine.y2);
+            _levels.push_back(coarse);
+        }
+        for (size_t l = 0; l < _levels.size(); ++l) {
+            const OfxRectI& b = _levels[l].bounds;
+            _levels[l].data.resize((size_t)(b.x2 - b.x1) * (b.y2 - b.y1) * nComponents);
+        }
+    }
+
+    // converts the source image to level 0
+    template <class PIX, int maxValue>
+    class Level0Builder : public OFX::MultiThread::Processor
+    {
+    public:
+        Level0Builder(const OFX::Image* src, Level* level, int nComponents)
+        : _src(src)
+        , _level(level)
+        , _nComponents(nComponents)
+        {
+        }
+
+    private:
+        virtual void multiThreadFunction(unsigned int threadID, unsigned int nThreads)
+        {
+            const OfxRectI& b = _level->bounds;
+            const int w = b.x2 - b.x1;
+            int y1, y2;
+            threadRows(b.y1, b.y2, threadID, nThreads, &y1, &y2);
+            for (int y = y1; y < y2; ++y) {
+                const PIX *srcPix = (const PIX *) _src->getPixelAddress(b.x1, y);
+                float *p = &_level->data[(size_t)(y - b.y1) * w * _nComponents];
+                for (int i = 0; i < w * _nComponents; ++i) {
+                    p[i] = (float)srcPix[i] / maxValue;
+                }
+            }
+        }
+
+        const OFX::Image* _src;
+        Level* _level;
+        int _nComponents;
+    };
+
+    // computes a level by 2x2 box filtering the finer one
+    class LevelBuilder : public OFX::MultiThread::Processor
+    {
+    public:
+        LevelBuilder(const Level& fine, Level* coarse, int nComponents)
+        : _fine(fine)
+        , _coarse(coarse)
+        , _nComponents(nComponents)
+        {
+        }
+
+    private:
+        virtual void multiThreadFunction(unsigned int threadID, unsigned int nThreads)
+        {
+            const OfxRectI& b = _coarse->bounds;
+            const int w = b.x2 - b.x1;
+            int y1, y2;
+            threadRows(b.y1, b.y2, threadID, nThreads, &y1, &y2);
+            for (int y = y1; y < y2; ++y) {
+                float *p = &_coarse->data[(size_t)(y - b.y1) * w * _nComponents];
+                for (int x = b.x1; x < b.x2; ++x, p += _nComponents) {
+                    const float *q00 = _fine.pixel(2*x, 2*y, _nComponents);
+                    const float *q10 = _fine.pixel(2*x+1, 2*y, _nComponents);
+                    const float *q01 = _fine.pixel(2*x, 2*y+1, _nComponents);
+                    const float *q11 = _fine.pixel(2*x+1, 2*y+1, _nComponents);
+                    for (int c = 0; c < _nComponents; ++c) {
+                        p[c] = 0.25f * ((q00 ? q00[c] : 0.f) + (q10 ? q10[c] : 0.f) +
+                                        (q01 ? q01[c] : 0.f) + (q11 ? q11[c] : 0.f));
+                    }
+                }
+            }
+        }
+
+        const Level& _fine;
+        Level* _coarse;
+        int _nComponents;
+    };
+
+    void sampleBilinear(int level, double x, double y, float *out) const
+    {
+        const Level& l = _levels[level];
+        const double scale = 1. / (1 << level);
+        const double fx = x * scale - 0.5;
+        const double fy = y * scale - 0.5;
+        const int ix = (int)std::floor(fx);
+        const int iy = (int)std::floor(fy);
+        const float dx = (float)(fx - ix);
+        const float dy = (float)(fy - iy);
+        const float *p00 = l.pixel(ix, iy, _nComponents);
+        const float *p10 = l.pixel(ix + 1, iy, _nComponents);
+        const float *p01 = l.pixel(ix, iy + 1, _nComponents);
+        const float *p11 = l.pixel(ix + 1, iy + 1, _nComponents);
+        for (int c = 0; c < _nComponents; ++c) {
+            const float v0 = (p00 ? p00[c] : 0.f) + dx * ((p10 ? p10[c] : 0.f) - (p00 ? p00[c] : 0.f));
+            const float v1 = (p01 ? p01[c] : 0.f) + dx * ((p11 ? p11[c] : 0.f) - (p01 ? p01[c] : 0.f));
+            out[c] = v0 + dy * (v1 - v0);
+        }
+    }
+
+    int _nComponents;
+    std::vector<Level> _levels;
+};
+
+/// Identifies the source image a pyramid was built from.
+struct MipmapKey
+{
+    std::string uniqueIdentifier;
+    double time;
+    OfxPointD renderScale;
+    OfxRectI bounds;
+    OFX::BitDepthEnum pixelDepth;
+    OFX::PixelComponentEnum pixelComponents;
+
+    bool operator==(const MipmapKey& other) const
+    {
+        return (uniqueIdentifier == other.uniqueIdentifier &&
+                time == other.time &&
+                renderScale.x == other.renderScale.x &&
+                renderScale.y == other.renderScale.y &&
+                bounds.x1 == other.bounds.x1 && bounds.y1 == other.bounds.y1 &&
+                bounds.x2 == other.bounds.x2 && bounds.y2 == other.bounds.y2 &&
+                pixelDepth == other.pixelDepth &&
+                pixelComponents == other.pixelComponents);
+    }
+};
+
+/// A small thread-safe LRU cache of pyramids, one per source frame and render scale.
+/// Pyramids are reference-counted while they are used by a render, and are only
+/// deleted when they are not in use. Each pyramid is built by the first render
+/// that needs it, while the renders that need the same pyramid wait for it and
+/// the renders that need other pyramids proceed.
+class MipmapCache
+{
+public:
+    MipmapCache() {}
+
+    ~MipmapCache()
+    {
+        clear();
+    }
+
+    /// get the pyramid for the source image, building it if necessary. Must be released with release().
+    Mipmap* acquire(const OFX::Image* src, double time, int nComponents)
+    {
+        MipmapKey key;
+        key.uniqueIdentifier = src->getUniqueIdentifier();
+        key.time = time;
+        key.renderScale = src->getRenderScale();
+        key.bounds = src->getBounds();
+        key.pixelDepth = src->getPixelDepth();
+        key.pixelComponents = src->getPixelComponents();
+
+        Entry* entry = 0;
+        {
+            OFX::MultiThread::AutoMutex lock(_mutex);
+            for (std::list<Entry>::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+                if (!it->stale && it->key == key) {
+                    // move to the front (most recently used)
+                    _entries.splice(_entries.begin(), _entries, it);
+                    entry = &_entries.front();
+                    break;
+                }
+            }
+            if (!entry) {
+                _entries.push_front(Entry());
+                entry = &_entries.front();
+                entry->key = key;
+                entry->mipmap = new Mipmap;
+                entry->buildMutex = new OFX::MultiThread::Mutex;
+            }
+            // the entry is not deleted while it is referenced
+            ++entry->refCount;
+        }
+
+        // wait for the pyramid if another render is building it, or build it
+        try {
+            OFX::MultiThread::AutoMutex buildLock(*entry->buildMutex);
+            if (!entry->built) {
+                switch (key.pixelDepth) {
+                    case OFX::eBitDepthUByte:
+                        entry->mipmap->build<unsigned char, 255>(src, nComponents);
+                        break;
+                    case OFX::eBitDepthUShort:
+                        entry->mipmap->build<unsigned short, 65535>(src, nComponents);
+                        break;
+                    case OFX::eBitDepthFloat:
+                        entry->mipmap->build<float, 1>(src, nComponents);
+                        break;
+                    default:
+                        OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
+                }
+                entry->built = true;
+            }
+        } catch (...) {
+            release(entry->mipmap);
+            throw;
+        }
+        return entry->mipmap;
+    }
+
+    void release(Mipmap* mipmap)
+    {
+        OFX::MultiThread::AutoMutex lock(_mutex);
+        for (std::list<Entry>::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+            if (it->mipmap == mipmap) {
+                assert(it->refCount > 0);
+                --it->refCount;
+                break;
+            }
+        }
+        prune();
+    }
+
+    /// remove all pyramids. Those that are in use are deleted when they are released.
+    void clear()
+    {
+        OFX::MultiThread::AutoMutex lock(_mutex);
+        for (std::list<Entry>::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+            it->stale = true;
+        }
+        prune();
+    }
+
+private:
+    struct Entry
+    {
+        Entry()
+        : mipmap(0)
+        , buildMutex(0)
+        , refCount(0)
+        , built(false)
+        , stale(false)
+        {
+        }
+
+        MipmapKey key;
+        Mipmap* mipmap;
+        OFX::MultiThread::Mutex* buildMutex; // held while the pyramid is built
+        int refCount;
+        bool built;
+        bool stale; // removed from the cache, deleted as soon as it is not in use
+    };
+
+    // remove the stale entries and the least recently used entries that are not in use. Call with _mutex locked.
+    void prune()
+    {
+        std::list<Entry>::iterator it = _entries.end();
+        while (it != _entries.begin()) {
+            --it;
+            if (it->refCount == 0 && (it->stale || !it->built || _entries.size() > kMipmapCacheSize)) {
+                delete it->mipmap;
+                delete it->buildMutex;
+                it = _entries.erase(it);
+            }
+        }
+    }
+
+    OFX::MultiThread::Mutex _mutex;
+    std::list<Entry> _entries;
+};
+
+/// Renders a projective transform by sampling a Mipmap.
+/// The matrix maps destination pixel coordinates to source pixel coordinates.
+template <class PIX, int nComponents, int maxValue>
+class MipmapTransformProcessor : public OFX::ImageProcessor
+{
+public:
+    MipmapTransformProcessor(OFX::ImageEffect &instance)
+    : OFX::ImageProcessor(instance)
+    , _mipmap(0)
+    {
+    }
+
+    void setValues(const Mipmap* mipmap, const OFX::Matrix3x3& H)
+    {
+        _mipmap = mipmap;
+        _H = H;
+    }
+
+private:
+    void multiThreadProcessImages(OfxRectI procWindow)
+    {
+        const OFX::Matrix3x3& H = _H;
+        float tmpPix[4];
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if (_effect.abort()) {
+                break;
+            }
+            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+            const double yc = y + 0.5;
+            const double x1c = procWindow.x1 + 0.5;
+            // along the scanline, the homogeneous coordinates are forward-differenced
+            double px = H.a * x1c + H.b * yc + H.c;
+            double py = H.d * x1c + H.e * yc + H.f;
+            double pz = H.g * x1c + H.h * yc + H.i;
+            for (int x = procWindow.x1; x < procWindow.x2; ++x, dstPix += nComponents, px += H.a, py += H.d, pz += H.g) {
+                if (pz <= 0.) {
+                    // point at infinity or behind the camera
+                    for (int c = 0; c < nComponents; ++c) {
+                        dstPix[c] = 0;
+                    }
+                    continue;
+                }
+                const double sx = px / pz;
+                const double sy = py / pz;
+                // Jacobian of the mapping: its largest column gives the footprint of the pixel in the source
+                const double dxdx = (H.a - sx * H.g) / pz;
+                const double dydx = (H.d - sy * H.g) / pz;
+                const double dxdy = (H.b - sx * H.h) / pz;
+                const double dydy = (H.e - sy * H.h) / pz;
+                const double footprint2 = std::max(dxdx * dxdx + dydx * dydx, dxdy * dxdy + dydy * dydy);
+                const double lod = (footprint2 > 1.) ? std::log(footprint2) / (2. * std::log(2.)) : 0.;
+                _mipmap->sampleTrilinear(sx, sy, lod, tmpPix);
+                for (int c = 0; c < nComponents; ++c) {
+                    if (maxValue == 1) {
+                        dstPix[c] = PIX(tmpPix[c]);
+                    } else {
+                        dstPix[c] = PIX(std::floor(std::min(std::max(tmpPix[c], 0.f), 1.f) * maxValue + 0.5f));
+                    }
+                }
+            }
+        }
+    }
+
+    const Mipmap* _mipmap;
+    OFX::Matrix3x3 _H;
+};
+
+/// Convert an inverse transform in canonical coordinates to a mapping from
+/// destination pixel coordinates to source pixel coordinates.
+inline OFX::Matrix3x3
+transformPixelMatrix(const OFX::Matrix3x3& Hc, double srcPar, double dstPar, const OfxPointD& renderScale)
+{
+    const double sxs = renderScale.x / srcPar;
+    const double sys = renderScale.y;
+    const double sxd = renderScale.x / dstPar;
+    const double syd = renderScale.y;
+    OFX::Matrix3x3 H;
+    H.a = sxs * Hc.a / sxd; H.b = sxs * Hc.b / syd; H.c = sxs * Hc.c;
+    H.d = sys * Hc.d / sxd; H.e = sys * Hc.e / syd; H.f = sys * Hc.f;
+    H.g = Hc.g / sxd;       H.h = Hc.h / syd;       H.i = Hc.i;
+    return H;
+}
+
+/// Compose the mapping H from destination pixels to source pixels with the
+/// transform the host may have attached to the source image.
+/// When transforms are concatenated (kFnOfxImageEffectCanTransform), the host
+/// skips the upstream transform nodes and gives the untransformed image, with the
+/// matrix (in pixel coordinates) that maps it to the image we expect: composing
+/// with its inverse resamples the original source only once.
+/// Returns false if the attached transform cannot be inverted.
+inline bool
+transformComposeSourceTransform(const OFX::Image* src, OFX::Matrix3x3* H)
+{
+#ifdef OFX_EXTENSIONS_NUKE
+    if (!src || src->getTransformIsIdentity()) {
+        return true;
+    }
+    double t[9];
+    src->getTransform(t);
+    OFX::Matrix3x3 M;
+    M.a = t[0]; M.b = t[1]; M.c = t[2];
+    M.d = t[3]; M.e = t[4]; M.f = t[5];
+    M.g = t[6]; M.h = t[7]; M.i = t[8];
+    const double det = OFX::ofxsMatDeterminant(M);
+    if (det == 0.) {
+        return false;
+    }
+    *H = OFX::ofxsMatInverse(M, det) * (*H);
+#else
+    (void)src;
+    (void)H;
+#endif
+    return true;
+}
+
+/// Render args.renderWindow of dstClip by sampling the mipmap of srcClip with the
+/// inverse transform Hc (in canonical coordinates).
+inline void
+mipmapRender(OFX::ImageEffect &effect, MipmapCache &cache, OFX::Clip *srcClip, OFX::Clip *dstClip,
+             const OFX::RenderArguments &args, const OFX::Matrix3x3& Hc)
+{
+    std::auto_ptr<OFX::Image> dst(dstClip->fetchImage(args.time));
+    if (!dst.get()) {
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    if (dst->getRenderScale().x != args.renderScale.x ||
+        dst->getRenderScale().y != args.renderScale.y ||
+        dst->getField() != args.fieldToRender) {
+        effect.setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    std::auto_ptr<const OFX::Image> src(srcClip->fetchImage(args.time));
+    if (src.get()) {
+        if (src->getPixelDepth() != dst->getPixelDepth() || src->getPixelComponents() != dst->getPixelComponents()) {
+            OFX::throwSuiteStatusException(kOfxStatErrImageFormat);
+        }
+    }
+    const OFX::BitDepthEnum dstBitDepth = dst->getPixelDepth();
+    const OFX::PixelComponentEnum dstComponents = dst->getPixelComponents();
+    const int nComponents = (dstComponents == OFX::ePixelComponentRGBA) ? 4 : (dstComponents == OFX::ePixelComponentRGB) ? 3 : 1;
+
+    if (!src.get()) {
+        // no source: black and transparent
+        const size_t pixelBytes = dst->getPixelBytes();
+        for (int y = args.renderWindow.y1; y < args.renderWindow.y2; ++y) {
+            void *dstPix = dst->getPixelAddress(args.renderWindow.x1, y);
+            std::memset(dstPix, 0, pixelBytes * (args.renderWindow.x2 - args.renderWindow.x1));
+        }
+        return;
+    }
+
+    OFX::Matrix3x3 H = transformPixelMatrix(Hc, srcClip->getPixelAspectRatio(), dstClip->getPixelAspectRatio(), args.renderScale);
+    if (!transformComposeSourceTransform(src.get(), &H)) {
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    Mipmap *mipmap = cache.acquire(src.get(), args.time, nComponents);
+    try {
+#define MIPMAP_PROCESS(PIX, n, maxValue) { \
+            MipmapTransformProcessor<PIX, n, maxValue> processor(effect); \
+            processor.setDstImg(dst.get()); \
+            processor.setRenderWindow(args.renderWindow); \
+            processor.setValues(mipmap, H); \
+            processor.process(); \
+        }
+#define MIPMAP_PROCESS_DEPTH(n) \
+        switch (dstBitDepth) { \
+            case OFX::eBitDepthUByte: MIPMAP_PROCESS(unsigned char, n, 255); break; \
+            case OFX::eBitDepthUShort: MIPMAP_PROCESS(unsigned short, n, 65535); break; \
+            case OFX::eBitDepthFloat: MIPMAP_PROCESS(float, n, 1); break; \
+            default: OFX::throwSuiteStatusException(kOfxStatErrUnsupported); \
+        }
+        if (nComponents == 4) {
+            MIPMAP_PROCESS_DEPTH(4);
+        } else if (nComponents == 3) {
+            MIPMAP_PROCESS_DEPTH(3);
+        } else {
+            MIPMAP_PROCESS_DEPTH(1);
+        }
+#undef MIPMAP_PROCESS_DEPTH
+#undef MIPMAP_PROCESS
+    } catch (...) {
+        cache.release(mipmap);
+        throw;
+    }
+    cache.release(mipmap);
+}
+
+/// Define the prefilter parameter, for plugins that support mipmap rendering.
+inline void
+mipmapDescribeInContext(OFX::ImageEffectDescriptor &desc, OFX::PageParamDescriptor *page)
+{
+    OFX::BooleanParamDescriptor* param = desc.defineBooleanParam(kParamTransformPrefilter);
+    param->setLabels(kParamTransformPrefilterLabel, kParamTransformPrefilterLabel, kParamTransformPrefilterLabel);
+    param->setHint(kParamTransformPrefilterHint);
+    param->setDefault(kParamTransformPrefilterDefault);
+    param->setAnimates(false);
+    page->addChild(*param);
+}
+
+#endif // Misc_TransformMipmap_h
@@ -0,0 +1,320 @@
+//
+//  TransformMotionBlur.h
+//  Misc
+//
+//  Adaptive motion blur for the Transform3x3-based plugins.
+//
+//  The transform is sampled at several times over the shutter interval, and
+//  the number of time samples is chosen for each render window from the
+//  distance travelled by its corners during the shutter: a static image gets
+//  a single sample, and a fast-moving one gets as many as the motion blur
+//  amount requires. All the pixels of the render window use the same samples,
+//  so that there are no seams between regions with different sample counts.
+//
+
+#ifndef Misc_TransformMotionBlur_h
+#define Misc_TransformMotionBlur_h
+
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <algorithm>
+#include <vector>
+
+#include "ofxsImageEffect.h"
+#include "ofxsProcessing.H"
+#include "ofxsMatrix2D.h"
+#include "ofxsTransform3x3.h"
+#include "TransformMipmap.h"
+
+#define kParamTransformAdaptiveMotionBlur "adaptiveMotionBlur"
+#define kParamTransformAdaptiveMotionBlurLabel "Adaptive Motion Blur"
+#define kParamTransformAdaptiveMotionBlurHint "Choose the number of motion blur samples of each frame depending on how much the image moves during the shutter interval, instead of always using the largest number of samples. " \
+"Frames without motion are rendered with a single sample. This mode is only used with the Bilinear filter and without directional blur, and the image is black outside of the source."
+#define kParamTransformAdaptiveMotionBlurDefault false
+
+#define kParamTransformShutterCurve "shutterCurve"
+#define kParamTransformShutterCurveLabel "Shutter Curve"
+#define kParamTransformShutterCurveHint "Weight of the time samples over the shutter interval, when using adaptive motion blur."
+#define kParamTransformShutterCurveOptionBox "Box"
+#define kParamTransformShutterCurveOptionBoxHint "All the time samples have the same weight (ideal shutter)."
+#define kParamTransformShutterCurveOptionTriangle "Triangle"
+#define kParamTransformShutterCurveOptionTriangleHint "The weight increases linearly until the middle of the shutter interval, and then decreases (shutter with opening and closing times)."
+#define kParamTransformShutterCurveDefault eTransformShutterCurveBox
+
+enum TransformShutterCurveEnum {
+    eTransformShutterCurveBox = 0,
+    eTransformShutterCurveTriangle
+};
+
+#define kTransformMotionBlurMaxSamples 256
+#define kTransformMotionBlurProbeSamples 9
+
+/// Compute n stratified sample times over the shutter interval, and their weights along the shutter curve.
+inline void
+transformShutterTimes(double time, double shutter, OFX::ShutterOffsetEnum shutterOffset, double shutterCustomOffset, TransformShutterCurveEnum curve,
+                      int n, std::vector<double>* times, std::vector<double>* weights)
+{
+    double t0;
+    switch (shutterOffset) {
+        case OFX::eShutterOffsetStart:
+            t0 = time;
+            break;
+        case OFX::eShutterOffsetEnd:
+            t0 = time - shutter;
+            break;
+        case OFX::eShutterOffsetCustom:
+            t0 = time + shutterCustomOffset;
+            break;
+        case OFX::eShutterOffsetCentered:
+        default:
+            t0 = time - shutter / 2;
+            break;
+    }
+    times->resize(n);
+    weights->resize(n);
+    for (int k = 0; k < n; ++k) {
+        const double u = (k + 0.5) / n;
+        (*times)[k] = t0 + u * shutter;
+        (*weights)[k] = (curve == eTransformShutterCurveTriangle) ? (1. - std::fabs(2. * u - 1.)) : 1.;
+    }
+}
+
+/// Distance travelled by the source point of (x,y) along the sequence of mappings H.
+inline double
+transformMotionExtent(const std::vector<OFX::Matrix3x3>& H, double x, double y)
+{
+    double extent = 0.;
+    double px = 0., py = 0.;
+    bool prevValid = false;
+    for (size_t k = 0; k < H.size(); ++k) {
+        const double z = H[k].g * x + H[k].h * y + H[k].i;
+        if (z <= 0.) {
+            // behind the camera: the motion cannot be measured, so use as many samples as possible
+            return 1e30;
+        }
+        const double sx = (H[k].a * x + H[k].b * y + H[k].c) / z;
+        const double sy = (H[k].d * x + H[k].e * y + H[k].f) / z;
+        if (prevValid) {
+            extent += std::sqrt((sx - px) * (sx - px) + (sy - py) * (sy - py));
+        }
+        px = sx;
+        py = sy;
+        prevValid = true;
+    }
+    return extent;
+}
+
+/// Largest motion extent over the corners and the center of a rectangle.
+inline double
+transformMotionExtent(const std::vector<OFX::Matrix3x3>& H, const OfxRectI& rect)
+{
+    double extent = transformMotionExtent(H, (rect.x1 + rect.x2) / 2., (rect.y1 + rect.y2) / 2.);
+    extent = std::max(extent, transformMotionExtent(H, rect.x1, rect.y1));
+    extent = std::max(extent, transformMotionExtent(H, rect.x2, rect.y1));
+    extent = std::max(extent, transformMotionExtent(H, rect.x1, rect.y2));
+    extent = std::max(extent, transformMotionExtent(H, rect.x2, rect.y2));
+    return extent;
+}
+
+/// Number of samples needed to render a motion of the given extent.
+inline int
+transformMotionBlurSampleCount(double amount, double extent, int maxSamples)
+{
+    const double n = std::ceil(amount * extent);
+    if (n <= 1.) {
+        return 1;
+    }
+    return (n >= maxSamples) ? maxSamples : (int)n;
+}
+
+template <class PIX, int nComponents, int maxValue>
+class TransformMotionBlurProcessor : public OFX::ImageProcessor
+{
+public:
+    TransformMotionBlurProcessor(OFX::ImageEffect &instance)
+    : OFX::ImageProcessor(instance)
+    , _srcImg(0)
+    , _H(0)
+    , _weights(0)
+    {
+    }
+
+    void setSrcImg(const OFX::Image *v) {_srcImg = v;}
+
+    // H are the mappings from destination pixels to source pixels at each time sample,
+    // and weights are the normalized shutter curve values at each sample
+    void setValues(const std::vector<OFX::Matrix3x3>* H, const std::vector<float>* weights)
+    {
+        _H = H;
+        _weights = weights;
+    }
+
+private:
+    void multiThreadProcessImages(OfxRectI procWindow)
+    {
+        const int n = (int)_H->size();
+        float acc[nComponents];
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if (_effect.abort()) {
+                break;
+            }
+            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+            assert(dstPix);
+            const double yc = y + 0.5;
+            for (int x = procWindow.x1; x < procWindow.x2; ++x, dstPix += nComponents) {
+                const double xc = x + 0.5;
+                for (int c = 0; c < nComponents; ++c) {
+                    acc[c] = 0.f;
+                }
+                for (int j = 0; j < n; ++j) {
+                    const OFX::Matrix3x3& H = (*_H)[j];
+                    const double z = H.g * xc + H.h * yc + H.i;
+                    if (z <= 0.) {
+                        continue;
+                    }
+                    addBilinear((H.a * xc + H.b * yc + H.c) / z, (H.d * xc + H.e * yc + H.f) / z, (*_weights)[j], acc);
+                }
+                for (int c = 0; c < nComponents; ++c) {
+                    dstPix[c] = transformFloatToPix<PIX, maxValue>(acc[c]);
+                }
+            }
+        }
+    }
+
+    // accumulate w times the bilinear sample at (sx,sy), black outside of the source image
+    void addBilinear(double sx, double sy, float w, float *acc) const
+    {
+        const double fx = sx - 0.5;
+        const double fy = sy - 0.5;
+        const int ix = (int)std::floor(fx);
+        const int iy = (int)std::floor(fy);
+        const float dx = (float)(fx - ix);
+        const float dy = (float)(fy - iy);
+        const PIX *p00 = (const PIX *) _srcImg->getPixelAddress(ix, iy);
+        const PIX *p10 = (const PIX *) _srcImg->getPixelAddress(ix + 1, iy);
+        const PIX *p01 = (const PIX *) _srcImg->getPixelAddress(ix, iy + 1);
+        const PIX *p11 = (const PIX *) _srcImg->getPixelAddress(ix + 1, iy + 1);
+        const float w00 = w * (1.f - dx) * (1.f - dy);
+        const float w10 = w * dx * (1.f - dy);
+        const float w01 = w * (1.f - dx) * dy;
+        const float w11 = w * dx * dy;
+        for (int c = 0; c < nComponents; ++c) {
+            acc[c] += ((p00 ? w00 * p00[c] : 0.f) + (p10 ? w10 * p10[c] : 0.f) +
+                       (p01 ? w01 * p01[c] : 0.f) + (p11 ? w11 * p11[c] : 0.f));
+        }
+    }
+
+    const OFX::Image *_srcImg;
+    const std::vector<OFX::Matrix3x3>* _H;
+    const std::vector<float>* _weights;
+};
+
+/// Render args.renderWindow of dstClip with motion blur. Hc are the inverse
+/// transforms (in canonical coordinates) at the sample times, and weights the shutter
+/// curve at these times.
+inline void
+transformMotionBlurRender(OFX::ImageEffect &effect, OFX::Clip *srcClip, OFX::Clip *dstClip,
+                          const OFX::RenderArguments &args, const std::vector<OFX::Matrix3x3>& Hc,
+                          const std::vector<double>& weights)
+{
+    std::auto_ptr<OFX::Image> dst(dstClip->fetchImage(args.time));
+    if (!dst.get()) {
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    if (dst->getRenderScale().x != args.renderScale.x ||
+        dst->getRenderScale().y != args.renderScale.y ||
+        dst->getField() != args.fieldToRender) {
+        effect.setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    std::auto_ptr<const OFX::Image> src(srcClip->fetchImage(args.time));
+    if (src.get()) {
+        if (src->getPixelDepth() != dst->getPixelDepth() || src->getPixelComponents() != dst->getPixelComponents()) {
+            OFX::throwSuiteStatusException(kOfxStatErrImageFormat);
+        }
+    }
+    if (!src.get()) {
+        // no source: black and transparent
+        const size_t pixelBytes = dst->getPixelBytes();
+        for (int y = args.renderWindow.y1; y < args.renderWindow.y2; ++y) {
+            void *dstPix = dst->getPixelAddress(args.renderWindow.x1, y);
+            std::memset(dstPix, 0, pixelBytes * (args.renderWindow.x2 - args.renderWindow.x1));
+        }
+        return;
+    }
+
+    std::vector<OFX::Matrix3x3> H(Hc.size());
+    const double srcPar = srcClip->getPixelAspectRatio();
+    const double dstPar = dstClip->getPixelAspectRatio();
+    for (size_t k = 0; k < Hc.size(); ++k) {
+        H[k] = transformPixelMatrix(Hc[k], srcPar, dstPar, args.renderScale);
+        if (!transformComposeSourceTransform(src.get(), &H[k])) {
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+    }
+    double sum = 0.;
+    for (size_t k = 0; k < weights.size(); ++k) {
+        sum += weights[k];
+    }
+    std::vector<float> normalizedWeights(weights.size());
+    for (size_t k = 0; k < weights.size(); ++k) {
+        normalizedWeights[k] = (sum > 0.) ? (float)(weights[k] / sum) : 1.f / weights.size();
+    }
+
+    const OFX::BitDepthEnum dstBitDepth = dst->getPixelDepth();
+    const OFX::PixelComponentEnum dstComponents = dst->getPixelComponents();
+#define MOTIONBLUR_PROCESS(PIX, n, maxValue) { \
+        TransformMotionBlurProcessor<PIX, n, maxValue> processor(effect); \
+        processor.setDstImg(dst.get()); \
+        processor.setSrcImg(src.get()); \
+        processor.setRenderWindow(args.renderWindow); \
+        processor.setValues(&H, &normalizedWeights); \
+        processor.process(); \
+    }
+#define MOTIONBLUR_PROCESS_DEPTH(n) \
+    switch (dstBitDepth) { \
+        case OFX::eBitDepthUByte: MOTIONBLUR_PROCESS(unsigned char, n, 255); break; \
+        case OFX::eBitDepthUShort: MOTIONBLUR_PROCESS(unsigned short, n, 65535); break; \
+        case OFX::eBitDepthFloat: MOTIONBLUR_PROCESS(float, n, 1); break; \
+        default: OFX::throwSuiteStatusException(kOfxStatErrUnsupported); \
+    }
+    if (dstComponents == OFX::ePixelComponentRGBA) {
+        MOTIONBLUR_PROCESS_DEPTH(4);
+    } else if (dstComponents == OFX::ePixelComponentRGB) {
+        MOTIONBLUR_PROCESS_DEPTH(3);
+    } else {
+        MOTIONBLUR_PROCESS_DEPTH(1);
+    }
+#undef MOTIONBLUR_PROCESS_DEPTH
+#undef MOTIONBLUR_PROCESS
+}
+
+/// Define the adaptive motion blur parameters.
+inline void
+transformMotionBlurDescribeInContext(OFX::ImageEffectDescriptor &desc, OFX::PageParamDescriptor *page)
+{
+    {
+        OFX::BooleanParamDescriptor* param = desc.defineBooleanParam(kParamTransformAdaptiveMotionBlur);
+        param->setLabels(kParamTransformAdaptiveMotionBlurLabel, kParamTransformAdaptiveMotionBlurLabel, kParamTransformAdaptiveMotionBlurLabel);
+        param->setHint(kParamTransformAdaptiveMotionBlurHint);
+        param->setDefault(kParamTransformAdaptiveMotionBlurDefault);
+        param->setAnimates(false);
+        param->setLayoutHint(OFX::eLayoutHintNoNewLine);
+        page->addChild(*param);
+    }
+    {
+        OFX::ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamTransformShutterCurve);
+        param->setLabels(kParamTransformShutterCurveLabel, kParamTransformShutterCurveLabel, kParamTransformShutterCurveLabel);
+        param->setHint(kParamTransformShutterCurveHint);
+        assert(param->getNOptions() == eTransformShutterCurveBox);
+        param->appendOption(kParamTransformShutterCurveOptionBox, kParamTransformShutterCurveOptionBoxHint);
+        assert(param->getNOptions() == eTransformShutterCurveTriangle);
+        param->appendOption(kParamTransformShutterCurveOptionTriangle, kParamTransformShutterCurveOptionTriangleHint);
+        param->setDefault(kParamTransformShutterCurveDefault);
+        param->setAnimates(false);
+        page->addChild(*param);
+    }
+}
+
+#endif // Misc_TransformMotionBlur_h
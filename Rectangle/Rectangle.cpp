@@ -81,6 +81,8 @@
 #include "ofxsRectangleInteract.h"
 #include "ofxsMacros.h"
 
+#include "RectangleEdges.h"
+
 #ifdef __APPLE__
 #include <OpenGL/gl.h>
 #else
@@ -170,6 +172,7 @@ protected:
     OfxPointD _btmLeft, _size;
     double _softness;
     RGBAValues _color0, _color1;
+    RectangleEdgeTable _xEdges, _yEdges; // the separable weights of the soft edges
 
 public:
     RectangleProcessorBase(OFX::ImageEffect &instance)
@@ -228,6 +231,69 @@ public:
         _processB = processB;
         _processA = processA;
     }
+
+protected:
+    /// the rectangle color at weight t (color0 outside, color1 inside)
+    void getColor(double t, float color[4]) const
+    {
+        if (t <= 0.) {
+            color[0] = _color0.r;
+            color[1] = _color0.g;
+            color[2] = _color0.b;
+            color[3] = _color0.a;
+        } else if (t >= 1.) {
+            color[0] = _color1.r;
+            color[1] = _color1.g;
+            color[2] = _color1.b;
+            color[3] = _color1.a;
+        } else {
+            //if (_plinear) {
+            //    // it seems to be the way Nuke does it... I could understand t*t, but why t*t*t?
+            //    t = t*t*t;
+            //}
+            color[0] = _color0.r * (1 - t) + _color1.r * t;
+            color[1] = _color0.g * (1 - t) + _color1.g * t;
+            color[2] = _color0.b * (1 - t) + _color1.b * t;
+            color[3] = _color0.a * (1 - t) + _color1.a * t;
+        }
+    }
+
+private:
+    // weight of a pixel at distance d inside an edge of the rectangle (d <= 0 is outside)
+    double edgeWeight(double d) const
+    {
+        if (d <= 0) {
+            return 0.;
+        } else if (_softness == 0 || d >= _softness) {
+            return 1.;
+        }
+        return rampSmooth(d / _softness);
+    }
+
+    // the weights only depend on the column or on the row: compute them once for the render window
+    virtual void preProcess() OVERRIDE FINAL
+    {
+        const OfxPointD rs = _dstImg->getRenderScale();
+        const double par = _dstImg->getPixelAspectRatio();
+        OfxPointI p_pixel;
+        OfxPointD p;
+        _xEdges.reset(_renderWindow.x1, _renderWindow.x2);
+        p_pixel.y = 0;
+        for (int x = _renderWindow.x1; x < _renderWindow.x2; ++x) {
+            p_pixel.x = x;
+            OFX::MergeImages2D::toCanonical(p_pixel, rs, par, &p);
+            _xEdges.set(x, edgeWeight(std::min(p.x - _btmLeft.x, _btmLeft.x + _size.x - p.x)));
+        }
+        _xEdges.finalize();
+        _yEdges.reset(_renderWindow.y1, _renderWindow.y2);
+        p_pixel.x = 0;
+        for (int y = _renderWindow.y1; y < _renderWindow.y2; ++y) {
+            p_pixel.y = y;
+            OFX::MergeImages2D::toCanonical(p_pixel, rs, par, &p);
+            _yEdges.set(y, edgeWeight(std::min(p.y - _btmLeft.y, _btmLeft.y + _size.y - p.y)));
+        }
+        _yEdges.finalize();
+    }
  };
 
 
@@ -340,7 +406,11 @@ private:
         assert((!processR && !processG && !processB) || (nComponents == 3 || nComponents == 4));
         assert(!processA || (nComponents == 1 || nComponents == 4));
 
-        float tmpPix[4];
+        // the source does not show through an opaque color if all channels are processed
+        const bool allProcessed = ((nComponents == 1 && processA) ||
+                                   (nComponents == 3 && processR && processG && processB) ||
+                                   (nComponents == 4 && processR && processG && processB && processA));
+        float color[4];
 
         for (int y = procWindow.y1; y < procWindow.y2; ++y) {
             if (_effect.abort()) {
@@ -348,102 +418,86 @@ private:
             }
             
             PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-            
-            for (int x = procWindow.x1; x < procWindow.x2; ++x, dstPix += nComponents) {
-                const PIX *srcPix = (const PIX *)  (_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
-                OfxPointI p_pixel;
-                OfxPointD p;
-                p_pixel.x = x;
-                p_pixel.y = y;
-                OFX::MergeImages2D::toCanonical(p_pixel, _dstImg->getRenderScale(), _dstImg->getPixelAspectRatio(), &p);
-
-                double dx = std::min(p.x - _btmLeft.x, _btmLeft.x + _size.x - p.x);
-                double dy = std::min(p.y - _btmLeft.y, _btmLeft.y + _size.y - p.y);
-
-                if (dx <=0 || dy <= 0) {
-                    // outside of the rectangle
-                    tmpPix[0] = _color0.r;
-                    tmpPix[1] = _color0.g;
-                    tmpPix[2] = _color0.b;
-                    tmpPix[3] = _color0.a;
-                } else if (_softness == 0 || (dx >= _softness && dy >= _softness)) {
-                    // inside of the rectangle
-                    tmpPix[0] = _color1.r;
-                    tmpPix[1] = _color1.g;
-                    tmpPix[2] = _color1.b;
-                    tmpPix[3] = _color1.a;
-                } else {
-                    double tx, ty;
-                    if (dx >= _softness) {
-                        tx = 1.;
-                    } else {
-                        tx = rampSmooth(dx / _softness);
+            const double ty = _yEdges.weight(y);
+
+            int x = procWindow.x1;
+            while (x < procWindow.x2) {
+                double tx = 0.;
+                const int xEnd = (ty <= 0.) ? procWindow.x2 : _xEdges.getSpan(x, procWindow.x2, &tx);
+                if (tx < 0.) {
+                    // soft edge
+                    for (; x < xEnd; ++x, dstPix += nComponents) {
+                        getColor(_xEdges.weight(x) * ty, color);
+                        compositePix<processR, processG, processB, processA>(color, x, y, dstPix);
                     }
-                    if (dy >= _softness) {
-                        ty = 1.;
-                    } else {
-                        ty = rampSmooth(dy / _softness);
-                    }
-                    double t = tx * ty;
-                    if (t >= 1) {
-                        tmpPix[0] = _color1.r;
-                        tmpPix[1] = _color1.g;
-                        tmpPix[2] = _color1.b;
-                        tmpPix[3] = _color1.a;
+                } else {
+                    // outside or inside of the rectangle
+                    getColor(tx * ty, color);
+                    if (!_doMasking && (!_srcImg || (_mix == 1. && color[3] >= 1.f && allProcessed))) {
+                        // the output does not depend on the source: fill the span with the first pixel
+                        compositePix<processR, processG, processB, processA>(color, x, y, dstPix);
+                        for (int xx = x + 1; xx < xEnd; ++xx) {
+                            std::copy(dstPix, dstPix + nComponents, dstPix + (xx - x) * nComponents);
+                        }
+                        dstPix += (xEnd - x) * nComponents;
+                        x = xEnd;
                     } else {
-                        //if (_plinear) {
-                        //    // it seems to be the way Nuke does it... I could understand t*t, but why t*t*t?
-                        //    t = t*t*t;
-                        //}
-                        tmpPix[0] = _color0.r * (1 - t) + _color1.r * t;
-                        tmpPix[1] = _color0.g * (1 - t) + _color1.g * t;
-                        tmpPix[2] = _color0.b * (1 - t) + _color1.b * t;
-                        tmpPix[3] = _color0.a * (1 - t) + _color1.a * t;
+                        for (; x < xEnd; ++x, dstPix += nComponents) {
+                            compositePix<processR, processG, processB, processA>(color, x, y, dstPix);
+                        }
                     }
                 }
-                double a = tmpPix[3];
-
-                // ofxsMaskMixPix takes non-normalized values
-                tmpPix[0] *= maxValue;
-                tmpPix[1] *= maxValue;
-                tmpPix[2] *= maxValue;
-                tmpPix[3] *= maxValue;
-                float srcPixRGBA[4] = {0, 0, 0, 0};
-                if (srcPix) {
-                    if (nComponents >= 3) {
-                        srcPixRGBA[0] = srcPix[0];
-                        srcPixRGBA[1] = srcPix[1];
-                        srcPixRGBA[2] = srcPix[2];
-                    }
-                    if (nComponents == 1 || nComponents == 4) {
-                        srcPixRGBA[3] = srcPix[nComponents-1];
-                    }
-                }
-                if (processR) {
-                    tmpPix[0] = tmpPix[0] + srcPixRGBA[0]*(1.-a);
-                } else {
-                    tmpPix[0] = srcPixRGBA[0];
-                }
-                if (processG) {
-                    tmpPix[1] = tmpPix[1] + srcPixRGBA[1]*(1.-a);
-                } else {
-                    tmpPix[1] = srcPixRGBA[1];
-                }
-                if (processB) {
-                    tmpPix[2] = tmpPix[2] + srcPixRGBA[2]*(1.-a);
-                } else {
-                    tmpPix[2] = srcPixRGBA[2];
-                }
-                if (processA) {
-                    tmpPix[3] = tmpPix[3] + srcPixRGBA[3]*(1.-a);
-                } else {
-                    tmpPix[3] = srcPixRGBA[3];
-                }
-                ofxsMaskMixPix<PIX, nComponents, maxValue, true>(tmpPix, x, y, srcPix, _doMasking, _maskImg, _mix, _maskInvert, dstPix);
             }
         }
     }
 
+    // composite the rectangle color over the source pixel
+    template<bool processR, bool processG, bool processB, bool processA>
+    void compositePix(const float color[4], int x, int y, PIX *dstPix)
+    {
+        const PIX *srcPix = (const PIX *)  (_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
+        float tmpPix[4] = {color[0], color[1], color[2], color[3]};
+        double a = tmpPix[3];
+
+        // ofxsMaskMixPix takes non-normalized values
+        tmpPix[0] *= maxValue;
+        tmpPix[1] *= maxValue;
+        tmpPix[2] *= maxValue;
+        tmpPix[3] *= maxValue;
+        float srcPixRGBA[4] = {0, 0, 0, 0};
+        if (srcPix) {
+            if (nComponents >= 3) {
+                srcPixRGBA[0] = srcPix[0];
+                srcPixRGBA[1] = srcPix[1];
+                srcPixRGBA[2] = srcPix[2];
+            }
+            if (nComponents == 1 || nComponents == 4) {
+                srcPixRGBA[3] = srcPix[nComponents-1];
+            }
+        }
+        if (processR) {
+            tmpPix[0] = tmpPix[0] + srcPixRGBA[0]*(1.-a);
+        } else {
+            tmpPix[0] = srcPixRGBA[0];
+        }
+        if (processG) {
+            tmpPix[1] = tmpPix[1] + srcPixRGBA[1]*(1.-a);
+        } else {
+            tmpPix[1] = srcPixRGBA[1];
+        }
+        if (processB) {
+            tmpPix[2] = tmpPix[2] + srcPixRGBA[2]*(1.-a);
+        } else {
+            tmpPix[2] = srcPixRGBA[2];
+        }
+        if (processA) {
+            tmpPix[3] = tmpPix[3] + srcPixRGBA[3]*(1.-a);
+        } else {
+            tmpPix[3] = srcPixRGBA[3];
+        }
+        ofxsMaskMixPix<PIX, nComponents, maxValue, true>(tmpPix, x, y, srcPix, _doMasking, _maskImg, _mix, _maskInvert, dstPix);
+    }
+
 };
 
 
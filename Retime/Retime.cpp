@@ -90,13 +90,19 @@
 #include <cmath> // for floor
 #include <cfloat> // for FLT_MAX
 #include <cassert>
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+#include <list>
 
 #include "ofxsImageEffect.h"
 #include "ofxsMultiThread.h"
 
 #include "ofxsProcessing.H"
-#include "ofxsImageBlender.H"
 #include "ofxsMacros.h"
+#include "ofxsMerging.h"
+
+#include "SourceFrameCache.h"
 
 #define kPluginName "RetimeOFX"
 #define kPluginGrouping "Time"
@@ -118,9 +124,607 @@
 #define kParamDurationLabel "Duration"
 #define kParamDurationHint "How long the output clip should be, as a proportion of the input clip's length."
 
+#define kParamInterpolation "interpolation"
+#define kParamInterpolationLabel "Interpolation"
+#define kParamInterpolationHint "How the frames between two source frames are computed."
+#define kParamInterpolationOptionBlend "Blend"
+#define kParamInterpolationOptionBlendHint "Blend linearly between the two source frames. Moving objects are doubled."
+#define kParamInterpolationOptionMotion "Motion Compensated"
+#define kParamInterpolationOptionMotionHint "Estimate the motion between the two source frames by block matching, and move both frames along the motion vectors before blending them. The motion is estimated once for each pair of source frames during a sequential render."
+
+enum InterpolationEnum
+{
+    eInterpolationBlend = 0,
+    eInterpolationMotion,
+};
+
+#define kParamBlockSize "blockSize"
+#define kParamBlockSizeLabel "Block Size"
+#define kParamBlockSizeHint "Size in pixels of the blocks used for motion estimation. Small blocks follow the motion more closely, but give noisier vectors. Only used by the Motion Compensated interpolation."
+
+#define kParamSearchRange "searchRange"
+#define kParamSearchRangeLabel "Search Range"
+#define kParamSearchRangeHint "Largest motion in pixels between two source frames that can be found by motion estimation. Only used by the Motion Compensated interpolation."
+
+#define kRetimeMotionMinBlockSize 4 // smallest block size in pixels, after render scale and at each level of the pyramid
+#define kRetimeMotionMaxLevels 6 // maximum number of levels of the motion estimation pyramid
+#define kRetimeMotionCoarsestSize 16 // the coarsest level of the pyramid is not smaller than this (in pixels)
+#define kRetimeMotionRefineRadius 1 // search radius at each level finer than the coarsest one
+#define kRetimeMotionCacheSize 4 // number of motion fields kept by each instance during a sequential render
+#define kRetimeFrameCacheMaxBytes kSourceFrameCacheMaxBytes // byte budget of the source frame cache
+
 namespace OFX {
     extern ImageEffectHostDescription gHostDescription;
 }
+
+/// The motion between two source frames, estimated by block matching on a grid of blocks
+/// covering the source region of definition. It is estimated once for the whole grid, and
+/// shared by all the render windows. Vectors are in pixels at the render scale.
+struct RetimeMotionField
+{
+    // what the motion was estimated for
+    double fromTime;
+    double toTime;
+    OfxPointD renderScale;
+    OFX::FieldEnum field;
+    int blockSize;
+    int searchRange;
+    OfxRectI grid;                  // the source region of definition, rounded up to whole blocks, in pixel coordinates
+
+    int nx, ny;                     // number of blocks
+    std::vector<float> forward;     // motion of the blocks of the "from" frame towards the "to" frame, (x,y) per block
+    std::vector<float> backward;    // motion of the blocks of the "to" frame towards the "from" frame
+
+    /// is this field estimated for the same pair of source frames as the other one?
+    bool sameKey(const RetimeMotionField &other) const
+    {
+        return (fromTime == other.fromTime &&
+                toTime == other.toTime &&
+                renderScale.x == other.renderScale.x &&
+                renderScale.y == other.renderScale.y &&
+                field == other.field &&
+                blockSize == other.blockSize &&
+                searchRange == other.searchRange &&
+                grid.x1 == other.grid.x1 && grid.x2 == other.grid.x2 &&
+                grid.y1 == other.grid.y1 && grid.y2 == other.grid.y2);
+    }
+
+    /// interpolate the vectors bilinearly between the block centers
+    void sample(const std::vector<float> &vectors, double x, double y, float *mx, float *my) const
+    {
+        double bx = (x - grid.x1) / blockSize - 0.5;
+        double by = (y - grid.y1) / blockSize - 0.5;
+        bx = std::max(0., std::min(bx, (double)(nx - 1)));
+        by = std::max(0., std::min(by, (double)(ny - 1)));
+        const int i0 = (int)bx;
+        const int j0 = (int)by;
+        const int i1 = std::min(i0 + 1, nx - 1);
+        const int j1 = std::min(j0 + 1, ny - 1);
+        const float fx = (float)(bx - i0);
+        const float fy = (float)(by - j0);
+        const float *v00 = &vectors[2 * (j0 * nx + i0)];
+        const float *v10 = &vectors[2 * (j0 * nx + i1)];
+        const float *v01 = &vectors[2 * (j1 * nx + i0)];
+        const float *v11 = &vectors[2 * (j1 * nx + i1)];
+        for (int c = 0; c < 2; ++c) {
+            const float v0 = v00[c] + (v10[c] - v00[c]) * fx;
+            const float v1 = v01[c] + (v11[c] - v01[c]) * fx;
+            (c == 0 ? *mx : *my) = v0 + (v1 - v0) * fy;
+        }
+    }
+};
+
+/// The motion field of a pair of source frames, shared by the render windows which use it.
+/// The first render window which needs it estimates it while holding the entry mutex, and
+/// the others wait for it instead of estimating it again.
+struct RetimeMotionEntry
+{
+    RetimeMotionField motion;
+    bool estimated;
+    int users;                      // render windows holding the entry, which is not deleted before they release it
+    bool cached;                    // is the entry in the cache?
+    OFX::MultiThread::Mutex mutex;  // held while the motion is estimated
+
+    explicit RetimeMotionEntry(const RetimeMotionField &key)
+    : motion(key)
+    , estimated(false)
+    , users(0)
+    , cached(true)
+    , mutex()
+    {
+    }
+};
+
+/// The motion fields of the pairs of source frames used by the current render windows, and
+/// during a sequential render, of the most recently used pairs.
+class RetimeMotionCache
+{
+public:
+    RetimeMotionCache()
+    : _mutex()
+    , _entries()
+    {
+    }
+
+    ~RetimeMotionCache()
+    {
+        for (std::list<RetimeMotionEntry*>::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+            delete *it;
+        }
+    }
+
+    /// get the entry for the pair of source frames of key, which must be released with release()
+    RetimeMotionEntry* acquire(const RetimeMotionField &key)
+    {
+        OFX::MultiThread::AutoMutex lock(_mutex);
+        RetimeMotionEntry* entry = 0;
+        for (std::list<RetimeMotionEntry*>::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+            if ((*it)->motion.sameKey(key)) {
+                entry = *it;
+                _entries.splice(_entries.begin(), _entries, it);
+                break;
+            }
+        }
+        if (!entry) {
+            entry = new RetimeMotionEntry(key);
+            _entries.push_front(entry);
+            // evict the least recently used entries which are not in use
+            std::list<RetimeMotionEntry*>::iterator it = _entries.end();
+            while (_entries.size() > kRetimeMotionCacheSize && it != _entries.begin()) {
+                --it;
+                if ((*it)->users == 0) {
+                    delete *it;
+                    it = _entries.erase(it);
+                }
+            }
+        }
+        ++entry->users;
+        return entry;
+    }
+
+    /// release an entry returned by acquire(). Unless keep is true, it is deleted when it is not used anymore.
+    void release(RetimeMotionEntry* entry, bool keep)
+    {
+        if (!entry) {
+            return;
+        }
+        OFX::MultiThread::AutoMutex lock(_mutex);
+        assert(entry->users > 0);
+        if (--entry->users > 0) {
+            return;
+        }
+        if (!keep && entry->cached) {
+            _entries.remove(entry);
+            entry->cached = false;
+        }
+        if (!entry->cached) {
+            delete entry;
+        }
+    }
+
+    void clear()
+    {
+        OFX::MultiThread::AutoMutex lock(_mutex);
+        for (std::list<RetimeMotionEntry*>::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+            if ((*it)->users == 0) {
+                delete *it;
+            } else {
+                // deleted by release()
+                (*it)->cached = false;
+            }
+        }
+        _entries.clear();
+    }
+
+private:
+    // noncopyable
+    RetimeMotionCache(const RetimeMotionCache&);
+    RetimeMotionCache& operator=(const RetimeMotionCache&);
+
+    OFX::MultiThread::Mutex _mutex;
+    std::list<RetimeMotionEntry*> _entries; // most recently used first
+};
+
+/// Releases an entry acquired from a RetimeMotionCache when it goes out of scope.
+class RetimeMotionRef
+{
+public:
+    RetimeMotionRef(RetimeMotionCache& cache, RetimeMotionEntry* entry, bool keep)
+    : _cache(cache)
+    , _entry(entry)
+    , _keep(keep)
+    {
+    }
+
+    ~RetimeMotionRef()
+    {
+        _cache.release(_entry, _keep);
+    }
+
+    RetimeMotionEntry* get() const { return _entry; }
+
+private:
+    // noncopyable
+    RetimeMotionRef(const RetimeMotionRef&);
+    RetimeMotionRef& operator=(const RetimeMotionRef&);
+
+    RetimeMotionCache& _cache;
+    RetimeMotionEntry* _entry;
+    bool _keep;
+};
+
+/// One level of the luminance pyramid used for motion estimation.
+struct RetimePyramidLevel
+{
+    int width;
+    int height;
+    std::vector<float> data;
+};
+
+// halve the resolution with a 2x2 box filter, repeating the last row and column of odd sizes
+static void
+retimeDownsample(const RetimePyramidLevel &src, RetimePyramidLevel *dst)
+{
+    dst->width = (src.width + 1) / 2;
+    dst->height = (src.height + 1) / 2;
+    dst->data.resize((size_t)dst->width * dst->height);
+    for (int y = 0; y < dst->height; ++y) {
+        const float *row0 = &src.data[(size_t)(2 * y) * src.width];
+        const float *row1 = &src.data[(size_t)std::min(2 * y + 1, src.height - 1) * src.width];
+        float *dstRow = &dst->data[(size_t)y * dst->width];
+        for (int x = 0; x < dst->width; ++x) {
+            const int x0 = 2 * x;
+            const int x1 = std::min(2 * x + 1, src.width - 1);
+            dstRow[x] = 0.25f * (row0[x0] + row0[x1] + row1[x0] + row1[x1]);
+        }
+    }
+}
+
+// sum of absolute differences between two blocks of the same pyramid level
+static inline float
+retimeBlockSAD(const float *a, const float *b, int rowStride, int width, int height)
+{
+    float sad = 0.f;
+    for (int y = 0; y < height; ++y, a += rowStride, b += rowStride) {
+        float rowSad = 0.f;
+        for (int x = 0; x < width; ++x) {
+            rowSad += std::abs(a[x] - b[x]);
+        }
+        sad += rowSad;
+    }
+    return sad;
+}
+
+/// Estimates the forward and backward motion of each block by hierarchical block matching:
+/// a full search at the coarsest level of the pyramids, refined at each finer level, with a
+/// sub-pixel parabola fit at full resolution. The render window is in block units.
+class RetimeMotionEstimator : public OFX::ImageProcessor
+{
+    const std::vector<RetimePyramidLevel> *_from;
+    const std::vector<RetimePyramidLevel> *_to;
+    OfxPointI _origin;      // position of the first block in the level 0 images
+    int _coarseRadius;      // search radius at the coarsest level
+    RetimeMotionField *_motion;
+
+public:
+    RetimeMotionEstimator(OFX::ImageEffect &instance)
+    : OFX::ImageProcessor(instance)
+    , _from(0)
+    , _to(0)
+    , _coarseRadius(0)
+    , _motion(0)
+    {
+        _origin.x = _origin.y = 0;
+    }
+
+    void setValues(const std::vector<RetimePyramidLevel> *from,
+                   const std::vector<RetimePyramidLevel> *to,
+                   const OfxPointI &origin,
+                   int coarseRadius,
+                   RetimeMotionField *motion)
+    {
+        _from = from;
+        _to = to;
+        _origin = origin;
+        _coarseRadius = coarseRadius;
+        _motion = motion;
+    }
+
+private:
+    void multiThreadProcessImages(OfxRectI procWindow)
+    {
+        for (int j = procWindow.y1; j < procWindow.y2; ++j) {
+            if (_effect.abort()) {
+                break;
+            }
+            for (int i = procWindow.x1; i < procWindow.x2; ++i) {
+                const size_t b = 2 * ((size_t)j * _motion->nx + i);
+                estimateBlock(*_from, *_to, i, j, &_motion->forward[b]);
+                estimateBlock(*_to, *_from, i, j, &_motion->backward[b]);
+            }
+        }
+    }
+
+    // SAD of the block at (x0,y0) of level a with the block displaced by (vx,vy) in level b,
+    // or FLT_MAX if the displaced block is not inside the level
+    static float blockSAD(const RetimePyramidLevel &a, const RetimePyramidLevel &b,
+                          int x0, int y0, int w, int h, int vx, int vy)
+    {
+        if (x0 + vx < 0 || x0 + vx + w > b.width || y0 + vy < 0 || y0 + vy + h > b.height) {
+            return FLT_MAX;
+        }
+        return retimeBlockSAD(&a.data[(size_t)y0 * a.width + x0],
+                              &b.data[(size_t)(y0 + vy) * b.width + x0 + vx],
+                              a.width, w, h);
+    }
+
+    // keep the best candidate, preferring the shortest vectors in case of a tie
+    static void tryCandidate(const RetimePyramidLevel &a, const RetimePyramidLevel &b,
+                             int x0, int y0, int w, int h, int vx, int vy,
+                             float *best, int *bestX, int *bestY)
+    {
+        const float sad = blockSAD(a, b, x0, y0, w, h, vx, vy);
+        if (sad < *best || (sad == *best && sad != FLT_MAX && std::abs(vx) + std::abs(vy) < std::abs(*bestX) + std::abs(*bestY))) {
+            *best = sad;
+            *bestX = vx;
+            *bestY = vy;
+        }
+    }
+
+    void estimateBlock(const std::vector<RetimePyramidLevel> &a,
+                       const std::vector<RetimePyramidLevel> &b,
+                       int i, int j,
+                       float *v) const
+    {
+        const int nLevels = (int)a.size();
+        const int blockSize = _motion->blockSize;
+        const int ox = _origin.x + i * blockSize;
+        const int oy = _origin.y + j * blockSize;
+        int dx = 0;
+        int dy = 0;
+        for (int l = nLevels - 1; l >= 0; --l) {
+            const RetimePyramidLevel &la = a[l];
+            const RetimePyramidLevel &lb = b[l];
+            // at coarse levels, the block is enlarged around its center so that it keeps enough texture
+            const int size = std::max(blockSize >> l, kRetimeMotionMinBlockSize);
+            const int w = std::min(size, la.width);
+            const int h = std::min(size, la.height);
+            const int x0 = std::max(0, std::min(((ox + blockSize / 2) >> l) - w / 2, la.width - w));
+            const int y0 = std::max(0, std::min(((oy + blockSize / 2) >> l) - h / 2, la.height - h));
+            int cx = 0;
+            int cy = 0;
+            int radius = _coarseRadius;
+            if (l < nLevels - 1) {
+                cx = 2 * dx;
+                cy = 2 * dy;
+                radius = kRetimeMotionRefineRadius;
+            }
+            dx = cx;
+            dy = cy;
+            if (w <= 0 || h <= 0) {
+                continue;
+            }
+            float best = FLT_MAX;
+            int bestX = cx;
+            int bestY = cy;
+            for (int vy = cy - radius; vy <= cy + radius; ++vy) {
+                for (int vx = cx - radius; vx <= cx + radius; ++vx) {
+                    tryCandidate(la, lb, x0, y0, w, h, vx, vy, &best, &bestX, &bestY);
+                }
+            }
+            // static areas are common: also try the zero vector
+            if (std::abs(cx) > radius || std::abs(cy) > radius) {
+                tryCandidate(la, lb, x0, y0, w, h, 0, 0, &best, &bestX, &bestY);
+            }
+            if (best == FLT_MAX) {
+                // no displaced block fits in the level
+                bestX = bestY = 0;
+            }
+            dx = bestX;
+            dy = bestY;
+        }
+
+        // sub-pixel refinement: fit a parabola to the SAD around the best vector in each direction
+        float sx = (float)dx;
+        float sy = (float)dy;
+        const RetimePyramidLevel &la = a[0];
+        const RetimePyramidLevel &lb = b[0];
+        const int w = std::min(blockSize, la.width - ox);
+        const int h = std::min(blockSize, la.height - oy);
+        if (w > 0 && h > 0) {
+            const float s0 = blockSAD(la, lb, ox, oy, w, h, dx, dy);
+            const float sxm = blockSAD(la, lb, ox, oy, w, h, dx - 1, dy);
+            const float sxp = blockSAD(la, lb, ox, oy, w, h, dx + 1, dy);
+            const float sym = blockSAD(la, lb, ox, oy, w, h, dx, dy - 1);
+            const float syp = blockSAD(la, lb, ox, oy, w, h, dx, dy + 1);
+            if (s0 != FLT_MAX && sxm != FLT_MAX && sxp != FLT_MAX) {
+                const float d = sxm - 2.f * s0 + sxp;
+                if (d > 0.f) {
+                    sx += std::max(-0.5f, std::min(0.5f, 0.5f * (sxm - sxp) / d));
+                }
+            }
+            if (s0 != FLT_MAX && sym != FLT_MAX && syp != FLT_MAX) {
+                const float d = sym - 2.f * s0 + syp;
+                if (d > 0.f) {
+                    sy += std::max(-0.5f, std::min(0.5f, 0.5f * (sym - syp) / d));
+                }
+            }
+        }
+        v[0] = sx;
+        v[1] = sy;
+    }
+};
+
+/// Blends linearly between two source frames, which may come from the source frame cache.
+/// If a motion field is set, both frames are first moved along the motion vectors to the
+/// intermediate time.
+class RetimeBlenderBase : public OFX::ImageProcessor
+{
+protected:
+    const SourceFrame *_fromImg;
+    const SourceFrame *_toImg;
+    float _blend;
+    const RetimeMotionField *_motion;
+
+public:
+    RetimeBlenderBase(OFX::ImageEffect &instance)
+    : OFX::ImageProcessor(instance)
+    , _fromImg(0)
+    , _toImg(0)
+    , _blend(0.5f)
+    , _motion(0)
+    {
+    }
+
+    void setFromImg(const SourceFrame *v) {_fromImg = v;}
+
+    void setToImg(const SourceFrame *v) {_toImg = v;}
+
+    void setBlend(float v) {_blend = v;}
+
+    void setMotion(const RetimeMotionField *v) {_motion = v;}
+
+    /// fill level with the luminance of src over rect, repeating the edge pixels of src outside of its bounds
+    virtual void getLuminance(const SourceFrame &src, const OfxRectI &rect, RetimePyramidLevel *level) const = 0;
+};
+
+template <class PIX, int nComponents>
+class RetimeBlender : public RetimeBlenderBase
+{
+public:
+    RetimeBlender(OFX::ImageEffect &instance)
+    : RetimeBlenderBase(instance)
+    {
+    }
+
+    virtual void getLuminance(const SourceFrame &src, const OfxRectI &rect, RetimePyramidLevel *level) const OVERRIDE FINAL
+    {
+        level->width = rect.x2 - rect.x1;
+        level->height = rect.y2 - rect.y1;
+        level->data.assign((size_t)level->width * level->height, 0.f);
+        const OfxRectI &bounds = src.getBounds();
+        if (bounds.x1 >= bounds.x2 || bounds.y1 >= bounds.y2) {
+            return;
+        }
+        for (int y = rect.y1; y < rect.y2; ++y) {
+            const int sy = std::max(bounds.y1, std::min(y, bounds.y2 - 1));
+            const PIX *srcRow = (const PIX *) src.getPixelAddress(bounds.x1, sy);
+            float *dst = &level->data[(size_t)(y - rect.y1) * level->width];
+            for (int x = rect.x1; x < rect.x2; ++x, ++dst) {
+                const int sx = std::max(bounds.x1, std::min(x, bounds.x2 - 1));
+                const PIX *srcPix = srcRow + (sx - bounds.x1) * nComponents;
+                if (nComponents == 1) {
+                    *dst = (float)srcPix[0];
+                } else {
+                    *dst = 0.2126f * srcPix[0] + 0.7152f * srcPix[1] + 0.0722f * srcPix[2];
+                }
+            }
+        }
+    }
+
+private:
+    // bilinear interpolation at (x,y), where pixel (i,j) is centered on (i+0.5,j+0.5), repeating the edge pixels
+    static void sampleBilinear(const SourceFrame &img, double x, double y, float *pix)
+    {
+        const OfxRectI &bounds = img.getBounds();
+        x -= 0.5;
+        y -= 0.5;
+        const int fx = (int)std::floor(x);
+        const int fy = (int)std::floor(y);
+        const float dx = (float)(x - fx);
+        const float dy = (float)(y - fy);
+        const int x0 = std::max(bounds.x1, std::min(fx, bounds.x2 - 1));
+        const int x1 = std::max(bounds.x1, std::min(fx + 1, bounds.x2 - 1));
+        const int y0 = std::max(bounds.y1, std::min(fy, bounds.y2 - 1));
+        const int y1 = std::max(bounds.y1, std::min(fy + 1, bounds.y2 - 1));
+        const PIX *p00 = (const PIX *) img.getPixelAddress(x0, y0);
+        const PIX *p10 = (const PIX *) img.getPixelAddress(x1, y0);
+        const PIX *p01 = (const PIX *) img.getPixelAddress(x0, y1);
+        const PIX *p11 = (const PIX *) img.getPixelAddress(x1, y1);
+        for (int c = 0; c < nComponents; ++c) {
+            const float v0 = p00[c] + (p10[c] - (float)p00[c]) * dx;
+            const float v1 = p01[c] + (p11[c] - (float)p01[c]) * dx;
+            pix[c] = v0 + (v1 - v0) * dy;
+        }
+    }
+
+    // sample both frames along the motion vector (mx,my) from the "from" frame to the "to" frame,
+    // and return the difference between the two samples
+    float warp(double x, double y, float mx, float my, float *fromPix, float *toPix) const
+    {
+        sampleBilinear(*_fromImg, x - _blend * mx, y - _blend * my, fromPix);
+        sampleBilinear(*_toImg, x + (1.f - _blend) * mx, y + (1.f - _blend) * my, toPix);
+        float err = 0.f;
+        for (int c = 0; c < nComponents; ++c) {
+            err += std::abs(fromPix[c] - toPix[c]);
+        }
+        return err;
+    }
+
+    void multiThreadProcessImages(OfxRectI procWindow)
+    {
+        const float blendComp = 1.0f - _blend;
+        const bool compensate = _motion && _fromImg && _toImg &&
+                                _fromImg->getBounds().x1 < _fromImg->getBounds().x2 && _fromImg->getBounds().y1 < _fromImg->getBounds().y2 &&
+                                _toImg->getBounds().x1 < _toImg->getBounds().x2 && _toImg->getBounds().y1 < _toImg->getBounds().y2;
+
+        for (int y = procWindow.y1; y < procWindow.y2; y++) {
+            if (_effect.abort()) {
+                break;
+            }
+
+            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+
+            if (compensate) {
+                float fromPix[nComponents], toPix[nComponents];
+                float fromPix2[nComponents], toPix2[nComponents];
+                for (int x = procWindow.x1; x < procWindow.x2; x++) {
+                    const double px = x + 0.5;
+                    const double py = y + 0.5;
+                    // two candidate vectors: the forward motion, and the opposite of the backward motion.
+                    // Keep the one along which both frames match best (the other one may come from
+                    // an occluded or uncovered area).
+                    float mx, my;
+                    _motion->sample(_motion->forward, px, py, &mx, &my);
+                    const float err = warp(px, py, mx, my, fromPix, toPix);
+                    _motion->sample(_motion->backward, px, py, &mx, &my);
+                    const float err2 = warp(px, py, -mx, -my, fromPix2, toPix2);
+                    const float *a = (err2 < err) ? fromPix2 : fromPix;
+                    const float *b = (err2 < err) ? toPix2 : toPix;
+                    for (int c = 0; c < nComponents; c++) {
+                        dstPix[c] = PIX(a[c] * blendComp + b[c] * _blend);
+                    }
+                    dstPix += nComponents;
+                }
+                continue;
+            }
+
+            for (int x = procWindow.x1; x < procWindow.x2; x++) {
+                const PIX *fromPix = (const PIX *) (_fromImg ? _fromImg->getPixelAddress(x, y) : 0);
+                const PIX *toPix = (const PIX *) (_toImg ? _toImg->getPixelAddress(x, y) : 0);
+
+                if (fromPix && toPix) {
+                    for (int c = 0; c < nComponents; c++) {
+                        dstPix[c] = PIX(fromPix[c] * blendComp + toPix[c] * _blend);
+                    }
+                } else if (fromPix) {
+                    for (int c = 0; c < nComponents; c++) {
+                        dstPix[c] = PIX(fromPix[c] * blendComp);
+                    }
+                } else if (toPix) {
+                    for (int c = 0; c < nComponents; c++) {
+                        dstPix[c] = PIX(toPix[c] * _blend);
+                    }
+                } else {
+                    for (int c = 0; c < nComponents; c++) {
+                        dstPix[c] = PIX(0);
+                    }
+                }
+                dstPix += nComponents;
+            }
+        }
+    }
+};
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
 class RetimePlugin : public OFX::ImageEffect
@@ -133,6 +737,12 @@ protected:
     OFX::DoubleParam  *sourceTime_; /**< @brief mandated parameter, only used in the retimer context. */
     OFX::DoubleParam  *speed_;      /**< @brief only used in the filter context. */
     OFX::DoubleParam  *duration_;   /**< @brief how long the output should be as a proportion of input. General context only  */
+    OFX::ChoiceParam  *interpolation_;
+    OFX::IntParam     *blockSize_;
+    OFX::IntParam     *searchRange_;
+
+    SourceFrameCache _frameCache;   /**< @brief source frames fetched during a sequential render */
+    RetimeMotionCache _motionCache; /**< @brief motion estimated for the pairs of source frames */
 
 public:
     /** @brief ctor */
@@ -143,6 +753,11 @@ public:
     , sourceTime_(0)
     , speed_(0)
     , duration_(0)
+    , interpolation_(0)
+    , blockSize_(0)
+    , searchRange_(0)
+    , _frameCache(kRetimeFrameCacheMaxBytes)
+    , _motionCache()
     {
         dstClip_ = fetchClip(kOfxImageEffectOutputClipName);
         srcClip_ = fetchClip(kOfxImageEffectSimpleSourceClipName);
@@ -162,19 +777,45 @@ public:
             duration_ = fetchDoubleParam(kParamDuration);
             assert(duration_);
         }
+        interpolation_ = fetchChoiceParam(kParamInterpolation);
+        blockSize_ = fetchIntParam(kParamBlockSize);
+        searchRange_ = fetchIntParam(kParamSearchRange);
+        assert(interpolation_ && blockSize_ && searchRange_);
     }
 
     /* Override the render */
     virtual void render(const OFX::RenderArguments &args) OVERRIDE FINAL;
 
+    /** Override the get RoI action */
+    virtual void getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args, OFX::RegionOfInterestSetter &rois) OVERRIDE FINAL;
+
     /** Override the get frames needed action */
     virtual void getFramesNeeded(const OFX::FramesNeededArguments &args, OFX::FramesNeededSetter &frames) OVERRIDE FINAL;
 
     /* override the time domain action, only for the general context */
     virtual bool getTimeDomain(OfxRangeD &range) OVERRIDE FINAL;
 
+    virtual void beginSequenceRender(const OFX::BeginSequenceRenderArguments &args) OVERRIDE FINAL;
+
+    virtual void endSequenceRender(const OFX::EndSequenceRenderArguments &args) OVERRIDE FINAL;
+
+    virtual void purgeCaches() OVERRIDE FINAL;
+
     /* set up and run a processor */
-    void setupAndProcess(OFX::ImageBlenderBase &, const OFX::RenderArguments &args);
+    void setupAndProcess(RetimeBlenderBase &, const OFX::RenderArguments &args);
+
+private:
+    /* the source time rendered at the given output time */
+    double getSourceTime(double time);
+
+    /* the block size and search range in pixels at the given render scale */
+    void getMotionParams(double time, const OfxPointD &renderScale, int *blockSize, int *searchRange);
+
+    /* the grid of motion blocks, anchored to the source region of definition at both times. Returns false if it is empty */
+    bool getMotionGrid(double fromTime, double toTime, const OfxPointD &renderScale, int blockSize, OfxRectI *grid);
+
+    /* estimate the motion of the entry over the whole grid, unless another render window did it. Returns false if aborted */
+    bool getMotionField(RetimeBlenderBase &processor, const SourceFrame &fromImg, const SourceFrame &toImg, OFX::Image *dst, RetimeMotionEntry *entry);
 };
 
 
@@ -186,7 +827,7 @@ public:
 
 // make sure components are sane
 static void
-checkComponents(const OFX::Image &src,
+checkComponents(const SourceFrame &src,
                 OFX::BitDepthEnum dstBitDepth,
                 OFX::PixelComponentEnum dstComponents)
 {
@@ -230,9 +871,21 @@ static void framesNeeded(double sourceTime, OFX::FieldEnum fieldToRender, double
     *blendp = blend;
 }
 
+double
+RetimePlugin::getSourceTime(double time)
+{
+    if (getContext() == OFX::eContextRetimer) {
+        // the host is specifying it, so fetch it from the kOfxImageEffectRetimerParamName pseudo-param
+        return sourceTime_->getValueAtTime(time);
+    } else {
+        // we have our own param, which is a speed, so we integrate it to get the time we want
+        return speed_->integrate(0, time);
+    }
+}
+
 /* set up and run a processor */
 void
-RetimePlugin::setupAndProcess(OFX::ImageBlenderBase &processor, const OFX::RenderArguments &args)
+RetimePlugin::setupAndProcess(RetimeBlenderBase &processor, const OFX::RenderArguments &args)
 {
     // get a dst image
     std::auto_ptr<OFX::Image>  dst(dstClip_->fetchImage(args.time));
@@ -240,31 +893,52 @@ RetimePlugin::setupAndProcess(OFX::ImageBlenderBase &processor, const OFX::Rende
     OFX::PixelComponentEnum    dstComponents  = dst->getPixelComponents();
 
     // figure the frame we should be retiming from
-    double sourceTime;
-
-    if (getContext() == OFX::eContextRetimer) {
-        // the host is specifying it, so fetch it from the kOfxImageEffectRetimerParamName pseudo-param
-        sourceTime = sourceTime_->getValueAtTime(args.time);
-    } else {
-        // we have our own param, which is a speed, so we integrate it to get the time we want
-        sourceTime = speed_->integrate(0, args.time);
-    }
+    const double sourceTime = getSourceTime(args.time);
 
     // figure the two images we are blending between
     double fromTime, toTime;
     double blend;
     framesNeeded(sourceTime, args.fieldToRender, &fromTime, &toTime, &blend);
 
-    // fetch the two source images
-    std::auto_ptr<OFX::Image> fromImg(srcClip_->fetchImage(fromTime));
-    std::auto_ptr<OFX::Image> toImg(srcClip_->fetchImage(toTime));
+    // motion estimation needs the source frames around the render window
+    int interpolation_i;
+    interpolation_->getValueAtTime(args.time, interpolation_i);
+    bool compensate = ((InterpolationEnum)interpolation_i == eInterpolationMotion && blend > 0.);
+    RetimeMotionField motion;
+    OfxRectI srcWindow = args.renderWindow;
+    if (compensate) {
+        motion.fromTime = fromTime;
+        motion.toTime = toTime;
+        motion.renderScale = args.renderScale;
+        motion.field = args.fieldToRender;
+        getMotionParams(args.time, args.renderScale, &motion.blockSize, &motion.searchRange);
+        if (getMotionGrid(fromTime, toTime, args.renderScale, motion.blockSize, &motion.grid)) {
+            // the motion is estimated once for the whole grid, and shared by all the render windows
+            const OfxRectI &grid = motion.grid;
+            motion.nx = (grid.x2 - grid.x1) / motion.blockSize;
+            motion.ny = (grid.y2 - grid.y1) / motion.blockSize;
+            // the pyramids cover the whole grid, plus the search range
+            srcWindow.x1 = grid.x1 - motion.searchRange;
+            srcWindow.y1 = grid.y1 - motion.searchRange;
+            srcWindow.x2 = grid.x2 + motion.searchRange;
+            srcWindow.y2 = grid.y2 + motion.searchRange;
+        } else {
+            // empty source
+            compensate = false;
+        }
+    }
+
+    // fetch the two source images. When slowing down, neighbouring output frames use the same source frames,
+    // which are kept in the cache during a sequential render.
+    SourceFrameRef fromImg(_frameCache, _frameCache.fetch(*srcClip_, fromTime, args.renderScale, args.fieldToRender, srcWindow));
+    SourceFrameRef toImg(_frameCache, _frameCache.fetch(*srcClip_, toTime, args.renderScale, args.fieldToRender, srcWindow));
 
     // make sure bit depths are sane
     if (fromImg.get()) {
-        checkComponents(*fromImg, dstBitDepth, dstComponents);
+        checkComponents(*fromImg.get(), dstBitDepth, dstComponents);
     }
     if (toImg.get()) {
-        checkComponents(*toImg, dstBitDepth, dstComponents);
+        checkComponents(*toImg.get(), dstBitDepth, dstComponents);
     }
 
     // set the images
@@ -278,10 +952,137 @@ RetimePlugin::setupAndProcess(OFX::ImageBlenderBase &processor, const OFX::Rende
     // set the blend between
     processor.setBlend((float)blend);
 
+    // estimate the motion between the two source frames, or wait for the render window which estimates it.
+    // During a sequential render, each pair of source frames is used by several output frames.
+    RetimeMotionRef motionRef(_motionCache, (compensate && fromImg.get() && toImg.get()) ? _motionCache.acquire(motion) : 0, _frameCache.inSequence());
+    if (motionRef.get()) {
+        if (!getMotionField(processor, *fromImg.get(), *toImg.get(), dst.get(), motionRef.get())) {
+            // aborted
+            return;
+        }
+        processor.setMotion(&motionRef.get()->motion);
+    }
+
     // Call the base class process member, this will call the derived templated process code
     processor.process();
 }
 
+void
+RetimePlugin::getMotionParams(double time, const OfxPointD &renderScale, int *blockSize, int *searchRange)
+{
+    int blockSize_i, searchRange_i;
+    blockSize_->getValueAtTime(time, blockSize_i);
+    searchRange_->getValueAtTime(time, searchRange_i);
+    const double scale = std::max(renderScale.x, renderScale.y);
+    *blockSize = std::max(kRetimeMotionMinBlockSize, (int)std::ceil(blockSize_i * scale));
+    *searchRange = std::max(0, (int)std::ceil(searchRange_i * scale));
+}
+
+bool
+RetimePlugin::getMotionGrid(double fromTime, double toTime, const OfxPointD &renderScale, int blockSize, OfxRectI *grid)
+{
+    const double par = srcClip_->getPixelAspectRatio();
+    OfxRectI fromRoD, toRoD;
+    OFX::MergeImages2D::toPixelEnclosing(srcClip_->getRegionOfDefinition(fromTime), renderScale, par, &fromRoD);
+    OFX::MergeImages2D::toPixelEnclosing(srcClip_->getRegionOfDefinition(toTime), renderScale, par, &toRoD);
+    OFX::MergeImages2D::rectBoundingBox(fromRoD, toRoD, grid);
+    if (grid->x1 >= grid->x2 || grid->y1 >= grid->y2) {
+        return false;
+    }
+    // round up to whole blocks
+    grid->x2 = grid->x1 + ((grid->x2 - grid->x1 + blockSize - 1) / blockSize) * blockSize;
+    grid->y2 = grid->y1 + ((grid->y2 - grid->y1 + blockSize - 1) / blockSize) * blockSize;
+    return true;
+}
+
+bool
+RetimePlugin::getMotionField(RetimeBlenderBase &processor,
+                             const SourceFrame &fromImg,
+                             const SourceFrame &toImg,
+                             OFX::Image *dst,
+                             RetimeMotionEntry *entry)
+{
+    OFX::MultiThread::AutoMutex lock(entry->mutex);
+    if (entry->estimated) {
+        return true;
+    }
+    RetimeMotionField *motion = &entry->motion;
+
+    // build the luminance pyramids of the whole grid, plus the search range
+    const int searchRange = motion->searchRange;
+    OfxRectI rect = motion->grid;
+    rect.x1 -= searchRange;
+    rect.y1 -= searchRange;
+    rect.x2 += searchRange;
+    rect.y2 += searchRange;
+    int nLevels = 1;
+    while (nLevels < kRetimeMotionMaxLevels &&
+           (searchRange >> (nLevels - 1)) > 2 * kRetimeMotionRefineRadius &&
+           ((rect.x2 - rect.x1) >> nLevels) >= kRetimeMotionCoarsestSize &&
+           ((rect.y2 - rect.y1) >> nLevels) >= kRetimeMotionCoarsestSize) {
+        ++nLevels;
+    }
+    std::vector<RetimePyramidLevel> fromPyramid(nLevels);
+    std::vector<RetimePyramidLevel> toPyramid(nLevels);
+    processor.getLuminance(fromImg, rect, &fromPyramid[0]);
+    processor.getLuminance(toImg, rect, &toPyramid[0]);
+    for (int l = 1; l < nLevels; ++l) {
+        retimeDownsample(fromPyramid[l - 1], &fromPyramid[l]);
+        retimeDownsample(toPyramid[l - 1], &toPyramid[l]);
+    }
+
+    // estimate the motion of each block, in parallel
+    motion->forward.resize(2 * (size_t)motion->nx * motion->ny);
+    motion->backward.resize(motion->forward.size());
+    OfxPointI origin;
+    origin.x = searchRange;
+    origin.y = searchRange;
+    const int coarseRadius = (searchRange + (1 << (nLevels - 1)) - 1) >> (nLevels - 1);
+    RetimeMotionEstimator estimator(*this);
+    estimator.setDstImg(dst);
+    OfxRectI blocks;
+    blocks.x1 = blocks.y1 = 0;
+    blocks.x2 = motion->nx;
+    blocks.y2 = motion->ny;
+    estimator.setRenderWindow(blocks);
+    estimator.setValues(&fromPyramid, &toPyramid, origin, coarseRadius, motion);
+    estimator.process();
+    // if aborted, the next render window which needs it estimates it again
+    entry->estimated = !abort();
+    return entry->estimated;
+}
+
+void
+RetimePlugin::getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args, OFX::RegionOfInterestSetter &rois)
+{
+    int interpolation_i;
+    interpolation_->getValueAtTime(args.time, interpolation_i);
+    if ((InterpolationEnum)interpolation_i != eInterpolationMotion) {
+        rois.setRegionOfInterest(*srcClip_, args.regionOfInterest);
+        return;
+    }
+    // the motion is estimated on pyramids covering the whole source, plus the search range (in canonical coordinates)
+    OfxPointD renderScale;
+    renderScale.x = renderScale.y = 1.;
+    int blockSize, searchRange;
+    getMotionParams(args.time, renderScale, &blockSize, &searchRange);
+    double fromTime, toTime;
+    double blend;
+    // the frames of both fields are covered by the whole frames
+    framesNeeded(getSourceTime(args.time), OFX::eFieldNone, &fromTime, &toTime, &blend);
+    const double par = srcClip_->getPixelAspectRatio();
+    const double margin = blockSize + searchRange;
+    OfxRectD srcRoD;
+    OFX::MergeImages2D::rectBoundingBox(srcClip_->getRegionOfDefinition(fromTime), srcClip_->getRegionOfDefinition(toTime), &srcRoD);
+    OfxRectD roi;
+    OFX::MergeImages2D::rectBoundingBox(srcRoD, args.regionOfInterest, &roi);
+    roi.x1 -= margin * par;
+    roi.x2 += margin * par;
+    roi.y1 -= margin;
+    roi.y2 += margin;
+    rois.setRegionOfInterest(*srcClip_, roi);
+}
+
 void
 RetimePlugin::getFramesNeeded(const OFX::FramesNeededArguments &args,
                                OFX::FramesNeededSetter &frames)
@@ -297,6 +1098,27 @@ RetimePlugin::getFramesNeeded(const OFX::FramesNeededArguments &args,
     frames.setFramesNeeded(*srcClip_, range);
 }
 
+void
+RetimePlugin::beginSequenceRender(const OFX::BeginSequenceRenderArguments &/*args*/)
+{
+    _frameCache.beginSequence();
+    _motionCache.clear();
+}
+
+void
+RetimePlugin::endSequenceRender(const OFX::EndSequenceRenderArguments &/*args*/)
+{
+    _frameCache.endSequence();
+    _motionCache.clear();
+}
+
+void
+RetimePlugin::purgeCaches()
+{
+    _frameCache.clear();
+    _motionCache.clear();
+}
+
 /* override the time domain action, only for the general context */
 bool
 RetimePlugin::getTimeDomain(OfxRangeD &range)
@@ -331,17 +1153,17 @@ RetimePlugin::render(const OFX::RenderArguments &args)
     if (dstComponents == OFX::ePixelComponentRGBA) {
         switch (dstBitDepth) {
             case OFX::eBitDepthUByte: {
-                OFX::ImageBlender<unsigned char, 4> fred(*this);
+                RetimeBlender<unsigned char, 4> fred(*this);
                 setupAndProcess(fred, args);
             }   break;
 
             case OFX::eBitDepthUShort: {
-                OFX::ImageBlender<unsigned short, 4> fred(*this);
+                RetimeBlender<unsigned short, 4> fred(*this);
                 setupAndProcess(fred, args);
             }   break;
 
             case OFX::eBitDepthFloat: {
-                OFX::ImageBlender<float, 4> fred(*this);
+                RetimeBlender<float, 4> fred(*this);
                 setupAndProcess(fred, args);
             }   break;
             default:
@@ -350,17 +1172,17 @@ RetimePlugin::render(const OFX::RenderArguments &args)
     } else if (dstComponents == OFX::ePixelComponentRGB) {
         switch (dstBitDepth) {
             case OFX::eBitDepthUByte: {
-                OFX::ImageBlender<unsigned char, 3> fred(*this);
+                RetimeBlender<unsigned char, 3> fred(*this);
                 setupAndProcess(fred, args);
             }   break;
 
             case OFX::eBitDepthUShort: {
-                OFX::ImageBlender<unsigned short, 3> fred(*this);
+                RetimeBlender<unsigned short, 3> fred(*this);
                 setupAndProcess(fred, args);
             }   break;
 
             case OFX::eBitDepthFloat: {
-                OFX::ImageBlender<float, 3> fred(*this);
+                RetimeBlender<float, 3> fred(*this);
                 setupAndProcess(fred, args);
             }   break;
             default:
@@ -370,17 +1192,17 @@ RetimePlugin::render(const OFX::RenderArguments &args)
         assert(dstComponents == OFX::ePixelComponentAlpha);
         switch(dstBitDepth) {
             case OFX::eBitDepthUByte: {
-                OFX::ImageBlender<unsigned char, 1> fred(*this);
+                RetimeBlender<unsigned char, 1> fred(*this);
                 setupAndProcess(fred, args);
             }   break;
 
             case OFX::eBitDepthUShort: {
-                OFX::ImageBlender<unsigned short, 1> fred(*this);
+                RetimeBlender<unsigned short, 1> fred(*this);
                 setupAndProcess(fred, args);
             }   break;
 
             case OFX::eBitDepthFloat: {
-                OFX::ImageBlender<float, 1> fred(*this);
+                RetimeBlender<float, 1> fred(*this);
                 setupAndProcess(fred, args);
             }   break;
             default:
@@ -454,6 +1276,9 @@ void RetimePluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc, Co
     dstClip->setFieldExtraction(eFieldExtractDoubled); // which is the default anyway
     dstClip->setSupportsTiles(kSupportsTiles);
 
+    // make a page of controls
+    PageParamDescriptor *page = desc.definePageParam("Controls");
+
     // what param we have is dependant on the host
     if (context == OFX::eContextRetimer) {
         // Define the mandated kOfxImageEffectRetimerParamName param, note that we don't do anything with this other than.
@@ -473,10 +1298,7 @@ void RetimePluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc, Co
         param->setAnimates(true); // can animate
         param->setDoubleType(eDoubleTypeScale);
 
-        // make a page to put it in
-        PageParamDescriptor *page = desc.definePageParam("Controls");
-
-        // add our speed param into it
+        // add our speed param into the page
         page->addChild(*param);
 
         // If we are a general context, we can change the duration of the effect, so have a param to do that
@@ -498,6 +1320,40 @@ void RetimePluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc, Co
             page->addChild(*param);
         }
     }
+
+    // interpolation
+    {
+        ChoiceParamDescriptor *param = desc.defineChoiceParam(kParamInterpolation);
+        param->setLabels(kParamInterpolationLabel, kParamInterpolationLabel, kParamInterpolationLabel);
+        param->setHint(kParamInterpolationHint);
+        assert(param->getNOptions() == eInterpolationBlend);
+        param->appendOption(kParamInterpolationOptionBlend, kParamInterpolationOptionBlendHint);
+        assert(param->getNOptions() == eInterpolationMotion);
+        param->appendOption(kParamInterpolationOptionMotion, kParamInterpolationOptionMotionHint);
+        param->setDefault((int)eInterpolationBlend);
+        param->setAnimates(true);
+        page->addChild(*param);
+    }
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamBlockSize);
+        param->setLabels(kParamBlockSizeLabel, kParamBlockSizeLabel, kParamBlockSizeLabel);
+        param->setHint(kParamBlockSizeHint);
+        param->setDefault(16);
+        param->setRange(kRetimeMotionMinBlockSize, 256);
+        param->setDisplayRange(kRetimeMotionMinBlockSize, 64);
+        param->setAnimates(true);
+        page->addChild(*param);
+    }
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamSearchRange);
+        param->setLabels(kParamSearchRangeLabel, kParamSearchRangeLabel, kParamSearchRangeLabel);
+        param->setHint(kParamSearchRangeHint);
+        param->setDefault(32);
+        param->setRange(0, 1024);
+        param->setDisplayRange(0, 128);
+        param->setAnimates(true);
+        page->addChild(*param);
+    }
 }
 
 /** @brief The create instance function, the plugin must return an object derived from the \ref OFX::ImageEffect class */
@@ -74,11 +74,18 @@
 #include <cmath>
 #include <map>
 #include <limits>
+#include <vector>
+#include <complex>
+#include <algorithm>
 
 #include "ofxsProcessing.H"
 #include "ofxsTracking.h"
 #include "ofxsMerging.h"
 
+#ifndef M_PI
+#define M_PI        3.14159265358979323846264338327950288   /* pi             */
+#endif
+
 #define kPluginName "TrackerPM"
 #define kPluginGrouping "Transform"
 #define kPluginDescription \
@@ -109,6 +116,28 @@
 #define kParamScoreOptionZNCC "ZNCC"
 #define kParamScoreOptionZNCCHint "Zero-mean Normalized Cross-Correlation, less sensitive to illumination changes"
 
+#define kParamCoarseToFine "coarseToFine"
+#define kParamCoarseToFineLabel "Coarse-to-Fine"
+#define kParamCoarseToFineHint "Search the pattern on a Gaussian pyramid of the pattern and the search area: the exhaustive search is only done at the coarsest resolution, and the match is refined in a small neighbourhood at each finer resolution. This is much faster for large search areas, but the track may be lost if the pattern has little low-frequency content."
+
+#define kParamMotionModel "motionModel"
+#define kParamMotionModelLabel "Motion Model"
+#define kParamMotionModelHint "Motion model used to predict the position of the pattern in the next frame when tracking a range of frames. When the motion is predicted, the search area is centered on the predicted position and shrunk, and the full search area is only used if the best match is on the border of the shrunk area."
+#define kParamMotionModelOptionNone "None"
+#define kParamMotionModelOptionNoneHint "Search the full search area around the previous position."
+#define kParamMotionModelOptionConstantVelocity "Constant Velocity"
+#define kParamMotionModelOptionConstantVelocityHint "Predict the position from the displacement at the previous frame."
+
+#define kTrackerPredictiveSearchScale 0.25 // size of the predicted search area, relative to the search area margins
+#define kTrackerPredictiveMinMargin 4. // minimum margin around the pattern in the predicted search area
+
+#define kTrackerPyramidMaxLevels 5 // maximum number of coarser levels
+#define kTrackerPyramidMinPatternSize 4 // the pattern must be at least that many pixels wide and high at the coarsest level
+#define kTrackerPyramidRefineRadius 2 // half-size of the neighbourhood searched at finer levels
+
+#define kTrackerFFTCostFactor 8. // relative cost of one FFT butterfly versus one direct score term
+#define kTrackerFFTMaxSize (1 << 22) // maximum number of FFT samples (64Mb per complex buffer)
+
 using namespace OFX;
 
 enum TrackerScoreEnum
@@ -119,6 +148,236 @@ enum TrackerScoreEnum
     eTrackerZNCC
 };
 
+enum TrackerMotionModelEnum
+{
+    eTrackerMotionModelNone = 0,
+    eTrackerMotionModelConstantVelocity
+};
+
+// one level of the Gaussian pyramid used by the coarse-to-fine search.
+// Pixels are stored as interleaved floats, with scoreComps values per pixel.
+struct TrackerPyramidLevel
+{
+    int width;
+    int height;
+    std::vector<float> data;
+    std::vector<float> weight; //< empty if the weight is uniform
+};
+
+// Build the next (half-resolution) pyramid level, using a [1 3 3 1]/8 binomial filter.
+// Pixels are averaged using their weights, so that pixels outside the mask do not bleed into the pattern.
+static void
+trackerPyramidDownsample(const TrackerPyramidLevel& src, int nComps, TrackerPyramidLevel* dst)
+{
+    static const float kernel[4] = { 1.f, 3.f, 3.f, 1.f };
+    const bool weighted = !src.weight.empty();
+
+    dst->width = (src.width + 1) / 2;
+    dst->height = (src.height + 1) / 2;
+    dst->data.assign(dst->width * dst->height * nComps, 0.f);
+    if (weighted) {
+        dst->weight.assign(dst->width * dst->height, 0.f);
+    } else {
+        dst->weight.clear();
+    }
+    float *dstPix = &dst->data[0];
+    for (int y = 0; y < dst->height; ++y) {
+        for (int x = 0; x < dst->width; ++x, dstPix += nComps) {
+            float acc[3] = { 0.f, 0.f, 0.f };
+            float wsum = 0.f;
+            float ksum = 0.f;
+            for (int i = 0; i < 4; ++i) {
+                const int sy = std::max(0, std::min(2 * y - 1 + i, src.height - 1));
+                for (int j = 0; j < 4; ++j) {
+                    const int sx = std::max(0, std::min(2 * x - 1 + j, src.width - 1));
+                    const float k = kernel[i] * kernel[j];
+                    const float w = weighted ? k * src.weight[sy * src.width + sx] : k;
+                    const float *srcPix = &src.data[(sy * src.width + sx) * nComps];
+                    for (int c = 0; c < nComps; ++c) {
+                        acc[c] += w * srcPix[c];
+                    }
+                    wsum += w;
+                    ksum += k;
+                }
+            }
+            if (wsum > 0.f) {
+                for (int c = 0; c < nComps; ++c) {
+                    dstPix[c] = acc[c] / wsum;
+                }
+            }
+            if (weighted) {
+                dst->weight[y * dst->width + x] = wsum / ksum;
+            }
+        }
+    }
+}
+
+// Score of the pattern at offset (u,v) in the search region. This is the same
+// score as TrackerPMProcessor::computeScore(), computed on pyramid levels.
+template<enum TrackerScoreEnum scoreType>
+static double
+trackerPyramidScore(const TrackerPyramidLevel& pattern,
+                    const TrackerPyramidLevel& region,
+                    int nComps,
+                    const double patternMean[3],
+                    double weightTotal,
+                    int u,
+                    int v)
+{
+    double otherMean[3] = { 0., 0., 0. };
+    if (scoreType == eTrackerZNCC) {
+        const float *weightPtr = &pattern.weight[0];
+        for (int i = 0; i < pattern.height; ++i) {
+            const int ry = std::min(v + i, region.height - 1);
+            for (int j = 0; j < pattern.width; ++j, ++weightPtr) {
+                const int rx = std::min(u + j, region.width - 1);
+                const float *otherPix = &region.data[(ry * region.width + rx) * nComps];
+                for (int c = 0; c < nComps; ++c) {
+                    otherMean[c] += *weightPtr * otherPix[c];
+                }
+            }
+        }
+        for (int c = 0; c < nComps; ++c) {
+            otherMean[c] /= weightTotal;
+        }
+    }
+
+    double score = 0.;
+    double otherSsq = 0.;
+    const float *patternPtr = &pattern.data[0];
+    const float *weightPtr = &pattern.weight[0];
+    for (int i = 0; i < pattern.height; ++i) {
+        // take nearest pixel in the search region
+        const int ry = std::min(v + i, region.height - 1);
+        for (int j = 0; j < pattern.width; ++j, ++weightPtr, patternPtr += nComps) {
+            const int rx = std::min(u + j, region.width - 1);
+            const float *otherPix = &region.data[(ry * region.width + rx) * nComps];
+            const double weight = *weightPtr;
+            for (int c = 0; c < nComps; ++c) {
+                switch (scoreType) {
+                    case eTrackerSSD: {
+                        const double d = (double)patternPtr[c] - otherPix[c];
+                        score += weight * weight * d * d;
+                    }   break;
+                    case eTrackerSAD:
+                        score += weight * std::abs((double)patternPtr[c] - otherPix[c]);
+                        break;
+                    case eTrackerNCC:
+                        score -= weight * patternPtr[c] * otherPix[c];
+                        otherSsq += weight * otherPix[c] * otherPix[c];
+                        break;
+                    case eTrackerZNCC: {
+                        const double o = otherPix[c] - otherMean[c];
+                        score -= weight * (patternPtr[c] - patternMean[c]) * o;
+                        otherSsq += weight * o * o;
+                    }   break;
+                }
+            }
+        }
+    }
+    if (scoreType == eTrackerNCC || scoreType == eTrackerZNCC) {
+        double sdev = std::sqrt(otherSsq);
+        if (sdev != 0.) {
+            score /= sdev;
+        } else {
+            score = std::numeric_limits<double>::infinity();
+        }
+    }
+    return score;
+}
+
+// In-place radix-2 complex FFT of n (a power of two) samples spaced by stride.
+// The inverse transform is not normalized.
+static void
+trackerFFT(std::complex<double>* data, int n, int stride, bool inverse)
+{
+    // bit-reversal permutation
+    for (int i = 1, j = 0; i < n; ++i) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            std::swap(data[i * stride], data[j * stride]);
+        }
+    }
+    // butterflies
+    for (int len = 2; len <= n; len <<= 1) {
+        const double angle = (inverse ? 2. : -2.) * M_PI / len;
+        for (int k = 0; k < len / 2; ++k) {
+            const std::complex<double> w(std::cos(angle * k), std::sin(angle * k));
+            for (int i = k; i < n; i += len) {
+                std::complex<double>& a = data[i * stride];
+                std::complex<double>& b = data[(i + len / 2) * stride];
+                const std::complex<double> t = b * w;
+                b = a - t;
+                a += t;
+            }
+        }
+    }
+}
+
+// 2D FFT of a w x h buffer (both powers of two), stored by rows
+static void
+trackerFFT2D(std::vector<std::complex<double> >& data, int w, int h, bool inverse)
+{
+    for (int y = 0; y < h; ++y) {
+        trackerFFT(&data[y * w], w, 1, inverse);
+    }
+    for (int x = 0; x < w; ++x) {
+        trackerFFT(&data[x], h, w, inverse);
+    }
+}
+
+// Cross-correlation of the image which spectrum is imgSpectrum with the w x h kernel,
+// for all offsets (u,v) in [0,mapWidth)x[0,mapHeight):
+// map(u,v) += scale * sum_{j,i} kernel(j,i) img(u+j,v+i)
+// (no wrap-around happens as long as the image fits in the FFT buffer).
+static void
+trackerFFTCorrelate(const std::vector<std::complex<double> >& imgSpectrum,
+                    const std::vector<double>& kernel,
+                    int kernelWidth,
+                    int kernelHeight,
+                    int fftWidth,
+                    int fftHeight,
+                    int mapWidth,
+                    int mapHeight,
+                    double scale,
+                    std::vector<std::complex<double> >& tmp,
+                    double* map)
+{
+    tmp.assign(fftWidth * fftHeight, std::complex<double>());
+    for (int i = 0; i < kernelHeight; ++i) {
+        for (int j = 0; j < kernelWidth; ++j) {
+            tmp[i * fftWidth + j] = kernel[i * kernelWidth + j];
+        }
+    }
+    trackerFFT2D(tmp, fftWidth, fftHeight, false);
+    for (size_t k = 0; k < tmp.size(); ++k) {
+        tmp[k] = imgSpectrum[k] * std::conj(tmp[k]);
+    }
+    trackerFFT2D(tmp, fftWidth, fftHeight, true);
+    scale /= (double)fftWidth * fftHeight;
+    for (int v = 0; v < mapHeight; ++v) {
+        for (int u = 0; u < mapWidth; ++u) {
+            map[v * mapWidth + u] += scale * tmp[v * fftWidth + u].real();
+        }
+    }
+}
+
+// A reference pattern extracted by the processor. When the predicted search fails, the full
+// search area is searched again with the same pattern, so that it is not extracted again.
+struct TrackerPMPattern
+{
+    int nComponents;
+    OfxRectI refRectPixel;
+    OfxPointI refCenterI;
+    std::vector<float> data; //< nComponents values per pixel
+    std::vector<float> weight;
+    double weightTotal;
+};
+
 class TrackerPMProcessorBase;
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
@@ -129,11 +388,15 @@ public:
     TrackerPMPlugin(OfxImageEffectHandle handle)
     : GenericTrackerPlugin(handle)
     , _score(0)
+    , _coarseToFine(0)
+    , _motionModel(0)
     {
         maskClip_ = getContext() == OFX::eContextFilter ? NULL : fetchClip(getContext() == OFX::eContextPaint ? "Brush" : "Mask");
         assert(!maskClip_ || maskClip_->getPixelComponents() == ePixelComponentAlpha);
         _score = fetchChoiceParam(kParamScore);
-        assert(_score);
+        _coarseToFine = fetchBooleanParam(kParamCoarseToFine);
+        _motionModel = fetchChoiceParam(kParamMotionModel);
+        assert(_score && _coarseToFine && _motionModel);
     }
     
     
@@ -146,32 +409,55 @@ private:
      **/
     virtual void trackRange(const OFX::TrackArguments& args);
     
+    /**
+     * @brief Track from refTime to otherTime. Returns true if the pattern was found.
+     * @param motion If not NULL, the predicted displacement of the pattern: the search area is
+     * centered on the predicted position and shrunk, and the full search area is only searched
+     * if the best match is on the border of the shrunk area.
+     * @param prevImg If it holds the image at refTime and covers the pattern, it is used as
+     * the reference image instead of fetching it. On return, it holds the image at otherTime,
+     * which is the reference image of the next step of trackRange().
+     **/
     template <int nComponents>
-    void trackInternal(OfxTime refTime, OfxTime otherTime);
+    bool trackInternal(OfxTime refTime, OfxTime otherTime, const OfxPointD* motion, std::auto_ptr<const OFX::Image>& prevImg, OfxTime& prevTime);
 
     template <class PIX, int nComponents, int maxValue>
-    void trackInternalForDepth(OfxTime refTime,
+    bool trackInternalForDepth(OfxTime refTime,
                                const OfxRectD& refBounds,
                                const OfxPointD& refCenter,
                                const OFX::Image* refImg,
                                const OFX::Image* maskImg,
+                               const TrackerPMPattern* refPattern,
+                               TrackerPMPattern* extractedPattern,
                                OfxTime otherTime,
                                const OfxRectD& trackSearchBounds,
-                               const OFX::Image* otherImg);
+                               const OFX::Image* otherImg,
+                               bool predicted,
+                               bool* onBorder);
 
-    /* set up and run a processor */
-    void setupAndProcess(TrackerPMProcessorBase &processor,
+    /**
+     * @brief Set up and run a processor. If refPattern is not NULL, it is used instead of
+     * extracting the pattern from refImg. Otherwise, if extractedPattern is not NULL, it
+     * receives the pattern extracted from refImg.
+     **/
+    bool setupAndProcess(TrackerPMProcessorBase &processor,
                          OfxTime refTime,
                          const OfxRectD& refBounds,
                          const OfxPointD& refCenter,
                          const OFX::Image* refImg,
                          const OFX::Image* maskImg,
+                         const TrackerPMPattern* refPattern,
+                         TrackerPMPattern* extractedPattern,
                          OfxTime otherTime,
                          const OfxRectD& trackSearchBounds,
-                         const OFX::Image* otherImg);
+                         const OFX::Image* otherImg,
+                         bool predicted,
+                         bool* onBorder);
 
     OFX::Clip *maskClip_;
     ChoiceParam* _score;
+    BooleanParam* _coarseToFine;
+    ChoiceParam* _motionModel;
 };
 
 
@@ -203,6 +489,20 @@ public:
     virtual bool setValues(const OFX::Image *ref, const OFX::Image *other, const OFX::Image *mask,
                            const OfxRectI& pattern, const OfxPointI& centeri) = 0;
 
+    /** @brief same as setValues(), but with a pattern previously returned by getPattern(). */
+    virtual bool setPattern(const TrackerPMPattern& pattern, const OFX::Image *other) = 0;
+
+    /** @brief get the pattern extracted by setValues(), to search again without extracting it. */
+    virtual void getPattern(TrackerPMPattern* pattern) const = 0;
+
+    /**
+     * @brief Coarse-to-fine search: find the best match on a Gaussian pyramid and return in window
+     * the small neighbourhood of searchWindow that should be searched at full resolution.
+     * Returns false if the pattern is too small for a pyramid, in which case the whole searchWindow
+     * should be searched. Must be called after setValues().
+     **/
+    virtual bool coarseToFineWindow(const OfxRectI& searchWindow, OfxRectI* window) = 0;
+
     /**
      * @brief Retrieves the results of the track. Must be called once process() returns so it is thread safe.
      **/
@@ -211,17 +511,37 @@ public:
 };
 
 
+// The type in which computeRowScores() accumulates a pattern row: 16-bit squared differences
+// do not fit in the 24-bit mantissa of a float.
+template <class PIX>
+struct TrackerPMRowAccumulator
+{
+    typedef float type;
+};
+
+template <>
+struct TrackerPMRowAccumulator<unsigned short>
+{
+    typedef double type;
+};
+
 // The "masked", "filter" and "clamp" template parameters allow filter-specific optimization
 // by the compiler, using the same generic code for all filters.
 template <class PIX, int nComponents, int maxValue, TrackerScoreEnum scoreType>
 class TrackerPMProcessor : public TrackerPMProcessorBase
 {
 protected:
+    typedef typename TrackerPMRowAccumulator<PIX>::type Acc;
+
     std::auto_ptr<OFX::ImageMemory> _patternImg;
     PIX *_patternData;
     std::auto_ptr<OFX::ImageMemory> _weightImg;
     float *_weightData;
     double _weightTotal;
+    std::vector<double> _scoreMap; //< NCC/ZNCC scores for the whole render window, if computed by preProcess()
+    std::vector<Acc> _patternPlanar; //< SSD/SAD: the pattern as Acc, one plane per score component
+    std::vector<Acc> _kernelWeight; //< SSD/SAD: the weight of each pattern pixel in the score (squared for SSD)
+    double _refMean[3]; //< ZNCC: the weighted mean of the pattern
 public:
     TrackerPMProcessor(OFX::ImageEffect &instance)
     : TrackerPMProcessorBase(instance)
@@ -230,7 +550,11 @@ public:
     , _weightImg(0)
     , _weightData(0)
     , _weightTotal(0.)
+    , _scoreMap()
+    , _patternPlanar()
+    , _kernelWeight()
     {
+        _refMean[0] = _refMean[1] = _refMean[2] = 0.;
     }
 
     ~TrackerPMProcessor()
@@ -294,9 +618,372 @@ private:
                 _weightTotal += *weightPtr;
             }
         }
+
+        return preparePattern();
+    }
+
+    virtual bool setPattern(const TrackerPMPattern& pattern, const OFX::Image *other)
+    {
+        size_t nPix = (size_t)(pattern.refRectPixel.x2 - pattern.refRectPixel.x1) * (pattern.refRectPixel.y2 - pattern.refRectPixel.y1);
+        if (nPix == 0 || pattern.nComponents != nComponents ||
+            pattern.data.size() != nPix * nComponents || pattern.weight.size() != nPix) {
+            return false;
+        }
+
+        _patternImg.reset(new ImageMemory(sizeof(PIX) * nComponents * nPix, &_effect));
+        _weightImg.reset(new ImageMemory(sizeof(float) * nPix, &_effect));
+        _otherImg = other;
+        _refRectPixel = pattern.refRectPixel;
+        _refCenterI = pattern.refCenterI;
+
+        _patternData = (PIX*)_patternImg->lock();
+        _weightData = (float*)_weightImg->lock();
+        for (size_t k = 0; k < nPix * nComponents; ++k) {
+            _patternData[k] = (PIX)pattern.data[k];
+        }
+        std::copy(pattern.weight.begin(), pattern.weight.end(), _weightData);
+        _weightTotal = pattern.weightTotal;
+
+        return preparePattern();
+    }
+
+    virtual void getPattern(TrackerPMPattern* pattern) const
+    {
+        assert(_patternData && _weightData);
+        size_t nPix = (size_t)(_refRectPixel.x2 - _refRectPixel.x1) * (_refRectPixel.y2 - _refRectPixel.y1);
+        pattern->nComponents = nComponents;
+        pattern->refRectPixel = _refRectPixel;
+        pattern->refCenterI = _refCenterI;
+        pattern->data.assign(_patternData, _patternData + nPix * nComponents);
+        pattern->weight.assign(_weightData, _weightData + nPix);
+        pattern->weightTotal = _weightTotal;
+    }
+
+    /** @brief precompute the data derived from the pattern. return false if processing cannot be done. */
+    bool preparePattern()
+    {
+        const size_t nPix = (size_t)(_refRectPixel.x2 - _refRectPixel.x1) * (_refRectPixel.y2 - _refRectPixel.y1);
+        const int scoreComps = std::min(nComponents, 3);
+        if (scoreType == eTrackerZNCC && _weightTotal > 0.) {
+            _refMean[0] = _refMean[1] = _refMean[2] = 0.;
+            for (size_t k = 0; k < nPix; ++k) {
+                for (int c = 0; c < scoreComps; ++c) {
+                    _refMean[c] += _weightData[k] * _patternData[k * nComponents + c];
+                }
+            }
+            for (int c = 0; c < scoreComps; ++c) {
+                _refMean[c] /= _weightTotal;
+            }
+        }
+        if (scoreType == eTrackerSSD || scoreType == eTrackerSAD) {
+            // precompute the Acc pattern and weights used by computeRowScores()
+            _patternPlanar.resize(scoreComps * nPix);
+            _kernelWeight.resize(nPix);
+            for (size_t k = 0; k < nPix; ++k) {
+                for (int c = 0; c < scoreComps; ++c) {
+                    _patternPlanar[c * nPix + k] = _patternData[k * nComponents + c];
+                }
+                // reference is squared in SSD, so is the weight
+                _kernelWeight[k] = (scoreType == eTrackerSSD) ? ((Acc)_weightData[k] * _weightData[k]) : _weightData[k];
+            }
+        }
         return (_weightTotal > 0);
     }
 
+    virtual bool coarseToFineWindow(const OfxRectI& searchWindow, OfxRectI* window)
+    {
+        assert(_patternData && _weightData && _otherImg && _weightTotal > 0.);
+        const int scoreComps = std::min(nComponents, 3);
+        const int pw = _refRectPixel.x2 - _refRectPixel.x1;
+        const int ph = _refRectPixel.y2 - _refRectPixel.y1;
+        const int ww = searchWindow.x2 - searchWindow.x1;
+        const int wh = searchWindow.y2 - searchWindow.y1;
+
+        // add levels while the pattern is still big enough, and the search window at the
+        // current level is larger than the neighbourhood searched during refinement
+        int nLevels = 0;
+        while (nLevels < kTrackerPyramidMaxLevels &&
+               (pw >> (nLevels + 1)) >= kTrackerPyramidMinPatternSize &&
+               (ph >> (nLevels + 1)) >= kTrackerPyramidMinPatternSize &&
+               ((ww >> nLevels) > 2 * kTrackerPyramidRefineRadius + 1 ||
+                (wh >> nLevels) > 2 * kTrackerPyramidRefineRadius + 1)) {
+            ++nLevels;
+        }
+        if (nLevels == 0) {
+            return false;
+        }
+
+        // level 0 of the pattern and of the search region.
+        // Offset (u,v) in the region corresponds to position (searchWindow.x1+u,searchWindow.y1+v).
+        std::vector<TrackerPyramidLevel> pattern(nLevels + 1);
+        std::vector<TrackerPyramidLevel> region(nLevels + 1);
+        pattern[0].width = pw;
+        pattern[0].height = ph;
+        pattern[0].data.resize(pw * ph * scoreComps);
+        pattern[0].weight.assign(_weightData, _weightData + pw * ph);
+        for (int k = 0; k < pw * ph; ++k) {
+            for (int c = 0; c < scoreComps; ++c) {
+                pattern[0].data[k * scoreComps + c] = _patternData[k * nComponents + c];
+            }
+        }
+        region[0].width = ww + pw - 1;
+        region[0].height = wh + ph - 1;
+        region[0].data.resize(region[0].width * region[0].height * scoreComps);
+        const OfxRectI& otherBounds = _otherImg->getBounds();
+        float *regionPtr = &region[0].data[0];
+        for (int v = 0; v < region[0].height; ++v) {
+            // take nearest pixel in other image (more chance to get a track than with black)
+            const int othery = std::max(otherBounds.y1, std::min(searchWindow.y1 + _refRectPixel.y1 + v, otherBounds.y2 - 1));
+            for (int u = 0; u < region[0].width; ++u, regionPtr += scoreComps) {
+                const int otherx = std::max(otherBounds.x1, std::min(searchWindow.x1 + _refRectPixel.x1 + u, otherBounds.x2 - 1));
+                const PIX *otherPix = (const PIX *) _otherImg->getPixelAddress(otherx, othery);
+                for (int c = 0; c < scoreComps; ++c) {
+                    regionPtr[c] = otherPix ? (float)otherPix[c] : 0.f;
+                }
+            }
+        }
+        for (int l = 1; l <= nLevels; ++l) {
+            if (_effect.abort()) {
+                return false;
+            }
+            trackerPyramidDownsample(pattern[l - 1], scoreComps, &pattern[l]);
+            trackerPyramidDownsample(region[l - 1], scoreComps, &region[l]);
+        }
+
+        // exhaustive search at the coarsest level, then refine down to level 1
+        OfxPointI best = { -1, -1 };
+        for (int l = nLevels; l >= 1; --l) {
+            const int lw = (ww + (1 << l) - 1) >> l;
+            const int lh = (wh + (1 << l) - 1) >> l;
+            OfxRectI candidates;
+            if (l == nLevels) {
+                candidates.x1 = 0;
+                candidates.y1 = 0;
+                candidates.x2 = lw;
+                candidates.y2 = lh;
+            } else {
+                candidates.x1 = std::max(0, 2 * best.x - kTrackerPyramidRefineRadius);
+                candidates.y1 = std::max(0, 2 * best.y - kTrackerPyramidRefineRadius);
+                candidates.x2 = std::min(lw, 2 * best.x + kTrackerPyramidRefineRadius + 1);
+                candidates.y2 = std::min(lh, 2 * best.y + kTrackerPyramidRefineRadius + 1);
+            }
+
+            double weightTotal = 0.;
+            double patternMean[3] = { 0., 0., 0. };
+            for (int k = 0; k < pattern[l].width * pattern[l].height; ++k) {
+                weightTotal += pattern[l].weight[k];
+                for (int c = 0; c < scoreComps; ++c) {
+                    patternMean[c] += pattern[l].weight[k] * pattern[l].data[k * scoreComps + c];
+                }
+            }
+            if (weightTotal <= 0.) {
+                return false;
+            }
+            for (int c = 0; c < scoreComps; ++c) {
+                patternMean[c] /= weightTotal;
+            }
+
+            double bestScore = std::numeric_limits<double>::infinity();
+            OfxPointI levelBest = { -1, -1 };
+            for (int v = candidates.y1; v < candidates.y2; ++v) {
+                if (_effect.abort()) {
+                    return false;
+                }
+                for (int u = candidates.x1; u < candidates.x2; ++u) {
+                    double score = trackerPyramidScore<scoreType>(pattern[l], region[l], scoreComps, patternMean, weightTotal, u, v);
+                    if (score < bestScore) {
+                        bestScore = score;
+                        levelBest.x = u;
+                        levelBest.y = v;
+                    }
+                }
+            }
+            if (bestScore == std::numeric_limits<double>::infinity()) {
+                // no valid match at this level, fall back to the exhaustive search
+                return false;
+            }
+            best = levelBest;
+        }
+
+        // the full resolution search is done by the processor, in the neighbourhood of the best match
+        window->x1 = std::max(searchWindow.x1, searchWindow.x1 + 2 * best.x - kTrackerPyramidRefineRadius);
+        window->y1 = std::max(searchWindow.y1, searchWindow.y1 + 2 * best.y - kTrackerPyramidRefineRadius);
+        window->x2 = std::min(searchWindow.x2, searchWindow.x1 + 2 * best.x + kTrackerPyramidRefineRadius + 1);
+        window->y2 = std::min(searchWindow.y2, searchWindow.y1 + 2 * best.y + kTrackerPyramidRefineRadius + 1);
+        return window->x1 < window->x2 && window->y1 < window->y2;
+    }
+
+    /**
+     * @brief For NCC and ZNCC, compute the scores for the whole render window at once.
+     *
+     * The correlation of the (zero-mean for ZNCC) weighted pattern with the search region
+     * is computed for all offsets using FFTs. The normalisation terms are computed using
+     * summed-area tables of the search region and its square if the weight is uniform,
+     * or by correlating the weight with them otherwise.
+     * This is only done if it is cheaper than the direct computation.
+     **/
+    virtual void preProcess()
+    {
+        _scoreMap.clear();
+        if ((scoreType != eTrackerNCC && scoreType != eTrackerZNCC) || !_patternData || !_otherImg || _weightTotal <= 0.) {
+            return;
+        }
+        const int scoreComps = std::min(nComponents, 3);
+        const int pw = _refRectPixel.x2 - _refRectPixel.x1;
+        const int ph = _refRectPixel.y2 - _refRectPixel.y1;
+        const int ww = _renderWindow.x2 - _renderWindow.x1;
+        const int wh = _renderWindow.y2 - _renderWindow.y1;
+        const int rw = ww + pw - 1;
+        const int rh = wh + ph - 1;
+        if (ww <= 0 || wh <= 0) {
+            return;
+        }
+        int fftWidth = 1;
+        while (fftWidth < rw) {
+            fftWidth <<= 1;
+        }
+        int fftHeight = 1;
+        while (fftHeight < rh) {
+            fftHeight <<= 1;
+        }
+        if ((double)fftWidth * fftHeight > kTrackerFFTMaxSize) {
+            return;
+        }
+        bool uniform = true;
+        for (int k = 1; k < pw * ph && uniform; ++k) {
+            uniform = (_weightData[k] == _weightData[0]);
+        }
+        // each correlation costs two FFTs, the spectrum of the search region is computed once per component
+        const double nFFT = 3 * scoreComps + (uniform ? 0 : (scoreType == eTrackerZNCC ? 2 * scoreComps : 0) + 3);
+        const double fftCost = kTrackerFFTCostFactor * nFFT * fftWidth * fftHeight * std::log((double)fftWidth * fftHeight);
+        const double directCost = (double)ww * wh * pw * ph * scoreComps;
+        if (directCost <= fftCost) {
+            return;
+        }
+
+        // the search region, with the nearest pixel in other image outside of its bounds
+        const OfxRectI& otherBounds = _otherImg->getBounds();
+        std::vector<double> region(rw * rh * scoreComps);
+        for (int v = 0; v < rh; ++v) {
+            const int othery = std::max(otherBounds.y1, std::min(_renderWindow.y1 + _refRectPixel.y1 + v, otherBounds.y2 - 1));
+            for (int u = 0; u < rw; ++u) {
+                const int otherx = std::max(otherBounds.x1, std::min(_renderWindow.x1 + _refRectPixel.x1 + u, otherBounds.x2 - 1));
+                const PIX *otherPix = (const PIX *) _otherImg->getPixelAddress(otherx, othery);
+                for (int c = 0; c < scoreComps; ++c) {
+                    region[(v * rw + u) * scoreComps + c] = otherPix ? (double)otherPix[c] : 0.;
+                }
+            }
+        }
+
+        const double *refMean = _refMean;
+
+        // numerator: sum_c sum w (p_c - refMean_c) o_c (the otherMean term vanishes for ZNCC),
+        // sum of the weighted other and of its square
+        std::vector<double> num(ww * wh, 0.);
+        std::vector<double> otherSum(ww * wh * scoreComps, 0.);
+        std::vector<double> otherSsq(ww * wh, 0.);
+        std::vector<std::complex<double> > spectrum;
+        std::vector<std::complex<double> > tmp;
+        std::vector<double> kernel(pw * ph);
+        std::vector<double> weight(_weightData, _weightData + pw * ph);
+        for (int c = 0; c < scoreComps; ++c) {
+            if (_effect.abort()) {
+                return;
+            }
+            spectrum.assign(fftWidth * fftHeight, std::complex<double>());
+            for (int v = 0; v < rh; ++v) {
+                for (int u = 0; u < rw; ++u) {
+                    spectrum[v * fftWidth + u] = region[(v * rw + u) * scoreComps + c];
+                }
+            }
+            trackerFFT2D(spectrum, fftWidth, fftHeight, false);
+            for (int k = 0; k < pw * ph; ++k) {
+                kernel[k] = _weightData[k] * (_patternData[k * nComponents + c] - refMean[c]);
+            }
+            trackerFFTCorrelate(spectrum, kernel, pw, ph, fftWidth, fftHeight, ww, wh, 1., tmp, &num[0]);
+            if (!uniform && scoreType == eTrackerZNCC) {
+                std::vector<double> sum(ww * wh, 0.);
+                trackerFFTCorrelate(spectrum, weight, pw, ph, fftWidth, fftHeight, ww, wh, 1., tmp, &sum[0]);
+                for (int k = 0; k < ww * wh; ++k) {
+                    otherSum[k * scoreComps + c] = sum[k];
+                }
+            }
+        }
+        if (uniform) {
+            // summed-area tables of the search region and of its square
+            const int sw = rw + 1;
+            std::vector<double> sat((rh + 1) * sw * scoreComps, 0.);
+            std::vector<double> sat2((rh + 1) * sw, 0.);
+            for (int v = 0; v < rh; ++v) {
+                for (int u = 0; u < rw; ++u) {
+                    double sq = 0.;
+                    for (int c = 0; c < scoreComps; ++c) {
+                        const double o = region[(v * rw + u) * scoreComps + c];
+                        sat[((v + 1) * sw + u + 1) * scoreComps + c] = o + sat[(v * sw + u + 1) * scoreComps + c] + sat[((v + 1) * sw + u) * scoreComps + c] - sat[(v * sw + u) * scoreComps + c];
+                        sq += o * o;
+                    }
+                    sat2[(v + 1) * sw + u + 1] = sq + sat2[v * sw + u + 1] + sat2[(v + 1) * sw + u] - sat2[v * sw + u];
+                }
+            }
+            const double w0 = _weightData[0];
+            for (int v = 0; v < wh; ++v) {
+                for (int u = 0; u < ww; ++u) {
+                    const int k = v * ww + u;
+                    for (int c = 0; c < scoreComps; ++c) {
+                        otherSum[k * scoreComps + c] = w0 * (sat[((v + ph) * sw + u + pw) * scoreComps + c] - sat[(v * sw + u + pw) * scoreComps + c] - sat[((v + ph) * sw + u) * scoreComps + c] + sat[(v * sw + u) * scoreComps + c]);
+                    }
+                    otherSsq[k] = w0 * (sat2[(v + ph) * sw + u + pw] - sat2[v * sw + u + pw] - sat2[(v + ph) * sw + u] + sat2[v * sw + u]);
+                }
+            }
+        } else {
+            spectrum.assign(fftWidth * fftHeight, std::complex<double>());
+            for (int v = 0; v < rh; ++v) {
+                for (int u = 0; u < rw; ++u) {
+                    double sq = 0.;
+                    for (int c = 0; c < scoreComps; ++c) {
+                        const double o = region[(v * rw + u) * scoreComps + c];
+                        sq += o * o;
+                    }
+                    spectrum[v * fftWidth + u] = sq;
+                }
+            }
+            trackerFFT2D(spectrum, fftWidth, fftHeight, false);
+            trackerFFTCorrelate(spectrum, weight, pw, ph, fftWidth, fftHeight, ww, wh, 1., tmp, &otherSsq[0]);
+        }
+
+        // scores. Values that are zero up to rounding errors are considered as zero.
+        double ssqMax = 0.;
+        for (int k = 0; k < ww * wh; ++k) {
+            ssqMax = std::max(ssqMax, otherSsq[k]);
+        }
+        _scoreMap.resize(ww * wh);
+        for (int k = 0; k < ww * wh; ++k) {
+            double ssq = otherSsq[k];
+            if (scoreType == eTrackerZNCC) {
+                for (int c = 0; c < scoreComps; ++c) {
+                    ssq -= otherSum[k * scoreComps + c] * otherSum[k * scoreComps + c] / _weightTotal;
+                }
+            }
+            if (ssq <= 1e-10 * ssqMax) {
+                _scoreMap[k] = std::numeric_limits<double>::infinity();
+            } else {
+                _scoreMap[k] = -num[k] / std::sqrt(ssq);
+            }
+        }
+    }
+
+    // the score at (x,y), from the score map if it was computed
+    template<enum TrackerScoreEnum scoreTypeE>
+    double getScore(int x, int y, const double refMean[3])
+    {
+        if (!_scoreMap.empty() &&
+            _renderWindow.x1 <= x && x < _renderWindow.x2 &&
+            _renderWindow.y1 <= y && y < _renderWindow.y2) {
+            return _scoreMap[(y - _renderWindow.y1) * (_renderWindow.x2 - _renderWindow.x1) + (x - _renderWindow.x1)];
+        }
+        return computeScore<scoreTypeE>(x, y, refMean);
+    }
+
     void multiThreadProcessImages(OfxRectI procWindow) {
         switch (scoreType) {
             case eTrackerSSD:
@@ -397,6 +1084,65 @@ private:
         return score;
     }
 
+    /**
+     * @brief SSD/SAD scores for positions [xa,xb) of row y, which must have all their
+     * pattern pixels inside the other image.
+     *
+     * The pattern is traversed in the outer loops and the candidate positions in the inner loop,
+     * on rows of the other image converted to Acc, so that the compiler can vectorize the inner
+     * loop and evaluate several positions at once. Each pattern row is accumulated in Acc (float,
+     * or double for 16-bit images), and the rows are summed in double.
+     **/
+    template<enum TrackerScoreEnum scoreTypeE>
+    void computeRowScores(int y, int xa, int xb, std::vector<Acc>& otherRow, std::vector<Acc>& rowAcc, double* scores)
+    {
+        const int scoreComps = std::min(nComponents, 3);
+        const int pw = _refRectPixel.x2 - _refRectPixel.x1;
+        const int ph = _refRectPixel.y2 - _refRectPixel.y1;
+        const int n = xb - xa;
+        const int span = n + pw - 1;
+        otherRow.resize(span);
+        rowAcc.resize(n);
+        for (int k = 0; k < n; ++k) {
+            scores[k] = 0.;
+        }
+        for (int i = 0; i < ph; ++i) {
+            const PIX *otherPix = (const PIX *) _otherImg->getPixelAddress(xa + _refRectPixel.x1, y + _refRectPixel.y1 + i);
+            assert(otherPix);
+            const Acc *weightRow = &_kernelWeight[i * pw];
+            for (int c = 0; c < scoreComps; ++c) {
+                Acc *o = &otherRow[0];
+                for (int k = 0; k < span; ++k) {
+                    o[k] = otherPix[k * nComponents + c];
+                }
+                Acc *acc = &rowAcc[0];
+                std::fill(acc, acc + n, Acc(0));
+                const Acc *patternRow = &_patternPlanar[(c * ph + i) * pw];
+                for (int j = 0; j < pw; ++j) {
+                    const Acc w = weightRow[j];
+                    if (w == 0) {
+                        continue;
+                    }
+                    const Acc p = patternRow[j];
+                    const Acc *oj = o + j;
+                    if (scoreTypeE == eTrackerSSD) {
+                        for (int k = 0; k < n; ++k) {
+                            const Acc d = p - oj[k];
+                            acc[k] += w * d * d;
+                        }
+                    } else {
+                        for (int k = 0; k < n; ++k) {
+                            acc[k] += w * std::fabs(p - oj[k]);
+                        }
+                    }
+                }
+                for (int k = 0; k < n; ++k) {
+                    scores[k] += acc[k];
+                }
+            }
+        }
+    }
+
     template<enum TrackerScoreEnum scoreTypeE>
     void multiThreadProcessImagesForScore(const OfxRectI& procWindow)
     {
@@ -411,30 +1157,19 @@ private:
         ///that minimize the sum of squared differences between the pattern in the ref image
         ///and the pattern in the other image.
 
-        const int scoreComps = std::min(nComponents,3);
-        double refMean[3];
-        if (scoreTypeE == eTrackerZNCC) {
-            for (int c = 0; c < 3; ++c) {
-                refMean[c] = 0;
-            }
-        }
-        if (scoreTypeE == eTrackerZNCC) {
-            // sliding pointers
-            long patternIdx = 0; // sliding index
-            const PIX *patternPtr = _patternData;
-            float *weightPtr = _weightData;
-            for (int i = _refRectPixel.y1; i < _refRectPixel.y2; ++i) {
-                for (int j = _refRectPixel.x1; j < _refRectPixel.x2; ++j, ++weightPtr, patternPtr += nComponents, ++patternIdx) {
-                    assert(patternIdx == ((i - _refRectPixel.y1) * (_refRectPixel.x2 - _refRectPixel.x1) + (j - _refRectPixel.x1)));
-                    const PIX *refPix = patternPtr;
-                    for (int c = 0; c < scoreComps; ++c) {
-                        refMean[c] += *weightPtr * refPix[c];
-                    }
-                }
-            }
-            for (int c = 0; c < scoreComps; ++c) {
-                refMean[c] /= _weightTotal;
-            }
+        // the pattern mean is computed once by preparePattern()
+        const double *refMean = _refMean;
+
+        // SSD/SAD positions which pattern is fully inside the other image are computed a row at a time
+        const bool rowKernel = (scoreTypeE == eTrackerSSD || scoreTypeE == eTrackerSAD);
+        const OfxRectI& otherBounds = _otherImg->getBounds();
+        const int rowxa = std::max(procWindow.x1, otherBounds.x1 - _refRectPixel.x1);
+        const int rowxb = std::min(procWindow.x2, otherBounds.x2 - _refRectPixel.x2 + 1);
+        std::vector<double> rowScores;
+        std::vector<Acc> otherRow;
+        std::vector<Acc> rowAcc;
+        if (rowKernel && rowxa < rowxb) {
+            rowScores.resize(rowxb - rowxa);
         }
 
         ///we're not interested in the alpha channel for RGBA images
@@ -442,9 +1177,18 @@ private:
             if (_effect.abort()) {
                 break;
             }
+
+            int xa = procWindow.x1;
+            int xb = procWindow.x1;
+            if (rowKernel && rowxa < rowxb &&
+                otherBounds.y1 <= y + _refRectPixel.y1 && y + _refRectPixel.y2 <= otherBounds.y2) {
+                xa = rowxa;
+                xb = rowxb;
+                computeRowScores<scoreTypeE>(y, xa, xb, otherRow, rowAcc, &rowScores[0]);
+            }
             
             for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                double score = computeScore<scoreTypeE>(x, y, refMean);
+                double score = (xa <= x && x < xb) ? rowScores[x - xa] : getScore<scoreTypeE>(x, y, refMean);
                 if (score < bestScore) {
                     bestScore = score;
                     point.x = x;
@@ -452,6 +1196,10 @@ private:
                 }
             }
         }
+        if (rowKernel && bestScore < std::numeric_limits<double>::infinity()) {
+            // the sub-pixel refinement compares with scores computed in double precision
+            bestScore = computeScore<scoreTypeE>(point.x, point.y, refMean);
+        }
         
         // do the subpixel refinement, only if the score is a possible winner
         // TODO: only do this for the best match
@@ -465,8 +1213,8 @@ private:
             // don't block other threads
             _bestMatchMutex.unlock();
             // compute subpixel position.
-            double scorepc = computeScore<scoreTypeE>(point.x - 1, point.y, refMean);
-            double scorenc = computeScore<scoreTypeE>(point.x + 1, point.y, refMean);
+            double scorepc = getScore<scoreTypeE>(point.x - 1, point.y, refMean);
+            double scorenc = getScore<scoreTypeE>(point.x + 1, point.y, refMean);
             if (bestScore < scorepc && bestScore <= scorenc) {
                 // don't simplify the denominator in the following expression,
                 // 2*bestScore - scorenc - scorepc may cause an underflow.
@@ -476,8 +1224,8 @@ private:
                     assert(-0.5 < dx && dx <= 0.5);
                 }
             }
-            double scorecp = computeScore<scoreTypeE>(point.x, point.y - 1, refMean);
-            double scorecn = computeScore<scoreTypeE>(point.x, point.y + 1, refMean);
+            double scorecp = getScore<scoreTypeE>(point.x, point.y - 1, refMean);
+            double scorecn = getScore<scoreTypeE>(point.x, point.y + 1, refMean);
             if (bestScore < scorecp && bestScore <= scorecn) {
                 // don't simplify the denominator in the following expression,
                 // 2*bestScore - scorenc - scorepc may cause an underflow.
@@ -544,6 +1292,17 @@ TrackerPMPlugin::trackRange(const OFX::TrackArguments& args)
         progressStart(name);
     }
 
+    // the image searched at each step is the reference image of the next step
+    std::auto_ptr<const OFX::Image> prevImg;
+    OfxTime prevTime = t;
+
+    int motionModelI;
+    _motionModel->getValueAtTime(t, motionModelI);
+    const TrackerMotionModelEnum motionModel = (TrackerMotionModelEnum)motionModelI;
+    // the displacement at the previous step, valid only if the previous step was tracked
+    OfxPointD motion = {0., 0.};
+    bool hasMotion = false;
+
     while (args.forward ? (t <= args.last) : (t >= args.last)) {
         OfxTime other = args.forward ? (t + 1) : (t - 1);
         
@@ -551,13 +1310,24 @@ TrackerPMPlugin::trackRange(const OFX::TrackArguments& args)
         assert(srcComponents == OFX::ePixelComponentRGB || srcComponents == OFX::ePixelComponentRGBA ||
                srcComponents == OFX::ePixelComponentAlpha);
         
+        const OfxPointD* predictedMotion = (motionModel == eTrackerMotionModelConstantVelocity && hasMotion) ? &motion : 0;
+        bool tracked;
         if (srcComponents == OFX::ePixelComponentRGBA) {
-            trackInternal<4>(t,other);
+            tracked = trackInternal<4>(t, other, predictedMotion, prevImg, prevTime);
         } else if (srcComponents == OFX::ePixelComponentRGB) {
-            trackInternal<3>(t,other);
+            tracked = trackInternal<3>(t, other, predictedMotion, prevImg, prevTime);
         } else {
             assert(srcComponents == OFX::ePixelComponentAlpha);
-            trackInternal<1>(t,other);
+            tracked = trackInternal<1>(t, other, predictedMotion, prevImg, prevTime);
+        }
+        hasMotion = tracked;
+        if (tracked) {
+            OfxPointD refCenter;
+            OfxPointD otherCenter;
+            _center->getValueAtTime(t, refCenter.x, refCenter.y);
+            _center->getValueAtTime(other, otherCenter.x, otherCenter.y);
+            motion.x = otherCenter.x - refCenter.x;
+            motion.y = otherCenter.y - refCenter.y;
         }
         if (args.forward) {
             ++t;
@@ -647,17 +1417,22 @@ getOtherBounds(const OfxPointD &refCenter, const OfxRectD& searchRect, OfxRectD
 }
 
 /* set up and run a processor */
-void
+bool
 TrackerPMPlugin::setupAndProcess(TrackerPMProcessorBase &processor,
                                  OfxTime refTime,
                                  const OfxRectD& refBounds,
                                  const OfxPointD& refCenter,
                                  const OFX::Image* refImg,
                                  const OFX::Image* maskImg,
+                                 const TrackerPMPattern* refPattern,
+                                 TrackerPMPattern* extractedPattern,
                                  OfxTime otherTime,
                                  const OfxRectD& trackSearchBounds,
-                                 const OFX::Image* otherImg)
+                                 const OFX::Image* otherImg,
+                                 bool predicted,
+                                 bool* onBorder)
 {
+    *onBorder = false;
     const double par = srcClip_->getPixelAspectRatio();
     const OfxPointD rsOne = {1., 1.};
     OfxRectI trackSearchBoundsPixel;
@@ -673,22 +1448,43 @@ TrackerPMPlugin::setupAndProcess(TrackerPMProcessorBase &processor,
     OFX::MergeImages2D::toPixel(refCenter, rsOne, par, &refCenterI);
     OFX::MergeImages2D::toPixelSub(refCenter, rsOne, par, &refCenterPixelSub);
 
-    //Clip the refRectPixel to the bounds of the ref image
-    MergeImages2D::rectIntersection(refRectPixel, refImg->getBounds(), &refRectPixel);
-    
-    refRectPixel.x1 -= refCenterI.x;
-    refRectPixel.x2 -= refCenterI.x;
-    refRectPixel.y1 -= refCenterI.y;
-    refRectPixel.y2 -= refCenterI.y;
-
     // set the render window
     processor.setRenderWindow(trackSearchBoundsPixel);
-    
-    bool canProcess = processor.setValues(refImg, otherImg, maskImg, refRectPixel, refCenterI);
+
+    bool canProcess;
+    if (refPattern) {
+        assert(!refImg && refPattern->refCenterI.x == refCenterI.x && refPattern->refCenterI.y == refCenterI.y);
+        canProcess = processor.setPattern(*refPattern, otherImg);
+    } else {
+        assert(refImg);
+        //Clip the refRectPixel to the bounds of the ref image
+        MergeImages2D::rectIntersection(refRectPixel, refImg->getBounds(), &refRectPixel);
+
+        refRectPixel.x1 -= refCenterI.x;
+        refRectPixel.x2 -= refCenterI.x;
+        refRectPixel.y1 -= refCenterI.y;
+        refRectPixel.y2 -= refCenterI.y;
+
+        canProcess = processor.setValues(refImg, otherImg, maskImg, refRectPixel, refCenterI);
+        if (canProcess && extractedPattern) {
+            processor.getPattern(extractedPattern);
+        }
+    }
+
+    bool coarseToFine;
+    _coarseToFine->getValueAtTime(refTime, coarseToFine);
+    if (canProcess && coarseToFine) {
+        // only search the neighbourhood of the coarse match at full resolution
+        OfxRectI fineWindow;
+        if (processor.coarseToFineWindow(trackSearchBoundsPixel, &fineWindow)) {
+            processor.setRenderWindow(fineWindow);
+        }
+    }
     
     if (!canProcess) {
         // can't track: erase any existing track
         _center->deleteKeyAtTime(otherTime);
+        return false;
     } else {
         // Call the base class process member, this will call the derived templated process code
         processor.process();
@@ -697,14 +1493,28 @@ TrackerPMPlugin::setupAndProcess(TrackerPMProcessorBase &processor,
         // TODO: subpixel interpolation //
         //////////////////////////////////
 
+        const OfxPointD& bestMatch = processor.getBestMatch();
+        if (predicted) {
+            // the pattern may be outside of the predicted search area if the best match
+            // is on its border: the caller should search the full area
+            const int bestx = (int)std::floor(bestMatch.x + 0.5);
+            const int besty = (int)std::floor(bestMatch.y + 0.5);
+            if (processor.getBestScore() == std::numeric_limits<double>::infinity() ||
+                bestx <= trackSearchBoundsPixel.x1 || bestx >= trackSearchBoundsPixel.x2 - 1 ||
+                besty <= trackSearchBoundsPixel.y1 || besty >= trackSearchBoundsPixel.y2 - 1) {
+                *onBorder = true;
+                return false;
+            }
+        }
+
         ///ok the score is now computed, update the center
         if (processor.getBestScore() == std::numeric_limits<double>::infinity()) {
             // can't track: erase any existing track
             _center->deleteKeyAtTime(otherTime);
+            return false;
         } else {
             OfxPointD newCenterPixelSub;
             OfxPointD newCenter;
-            const OfxPointD& bestMatch = processor.getBestMatch();
 
             newCenterPixelSub.x = refCenterPixelSub.x + bestMatch.x - refCenterI.x;
             newCenterPixelSub.y = refCenterPixelSub.y + bestMatch.y - refCenterI.y;
@@ -715,20 +1525,25 @@ TrackerPMPlugin::setupAndProcess(TrackerPMProcessorBase &processor,
             // create a keyframe at end point
             _center->setValueAtTime(otherTime, newCenter.x, newCenter.y);
             endEdit();
+            return true;
         }
     }
 }
 
 template <class PIX, int nComponents, int maxValue>
-void
+bool
 TrackerPMPlugin::trackInternalForDepth(OfxTime refTime,
                                        const OfxRectD& refBounds,
                                        const OfxPointD& refCenter,
                                        const OFX::Image* refImg,
                                        const OFX::Image* maskImg,
+                                       const TrackerPMPattern* refPattern,
+                                       TrackerPMPattern* extractedPattern,
                                        OfxTime otherTime,
                                        const OfxRectD& trackSearchBounds,
-                                       const OFX::Image* otherImg)
+                                       const OFX::Image* otherImg,
+                                       bool predicted,
+                                       bool* onBorder)
 {
     int scoreI;
     _score->getValueAtTime(refTime, scoreI);
@@ -737,28 +1552,29 @@ TrackerPMPlugin::trackInternalForDepth(OfxTime refTime,
     switch (typeE) {
         case eTrackerSSD: {
             TrackerPMProcessor<PIX, nComponents, maxValue, eTrackerSSD> fred(*this);
-            setupAndProcess(fred, refTime, refBounds, refCenter, refImg, maskImg, otherTime, trackSearchBounds, otherImg);
-        }   break;
+            return setupAndProcess(fred, refTime, refBounds, refCenter, refImg, maskImg, refPattern, extractedPattern, otherTime, trackSearchBounds, otherImg, predicted, onBorder);
+        }
         case eTrackerSAD: {
             TrackerPMProcessor<PIX, nComponents, maxValue, eTrackerSAD> fred(*this);
-            setupAndProcess(fred, refTime, refBounds, refCenter, refImg, maskImg, otherTime, trackSearchBounds, otherImg);
-        }   break;
+            return setupAndProcess(fred, refTime, refBounds, refCenter, refImg, maskImg, refPattern, extractedPattern, otherTime, trackSearchBounds, otherImg, predicted, onBorder);
+        }
         case eTrackerNCC: {
             TrackerPMProcessor<PIX, nComponents, maxValue, eTrackerNCC> fred(*this);
-            setupAndProcess(fred, refTime, refBounds, refCenter, refImg, maskImg, otherTime, trackSearchBounds, otherImg);
-        }   break;
+            return setupAndProcess(fred, refTime, refBounds, refCenter, refImg, maskImg, refPattern, extractedPattern, otherTime, trackSearchBounds, otherImg, predicted, onBorder);
+        }
         case eTrackerZNCC: {
             TrackerPMProcessor<PIX, nComponents, maxValue, eTrackerZNCC> fred(*this);
-            setupAndProcess(fred, refTime, refBounds, refCenter, refImg, maskImg, otherTime, trackSearchBounds, otherImg);
-        }   break;
+            return setupAndProcess(fred, refTime, refBounds, refCenter, refImg, maskImg, refPattern, extractedPattern, otherTime, trackSearchBounds, otherImg, predicted, onBorder);
+        }
     }
+    return false;
 }
 
 
 // the internal render function
 template <int nComponents>
-void
-TrackerPMPlugin::trackInternal(OfxTime refTime, OfxTime otherTime)
+bool
+TrackerPMPlugin::trackInternal(OfxTime refTime, OfxTime otherTime, const OfxPointD* motion, std::auto_ptr<const OFX::Image>& prevImg, OfxTime& prevTime)
 {
     OfxRectD refRect;
     _innerBtmLeft->getValueAtTime(refTime, refRect.x1, refRect.y1);
@@ -772,42 +1588,104 @@ TrackerPMPlugin::trackInternal(OfxTime refTime, OfxTime otherTime)
     OfxRectD refBounds;
     getRefBounds(refRect, refCenter, &refBounds);
 
-    OfxRectD otherBounds;
-    getOtherBounds(refCenter, searchRect, &otherBounds);
+    bool predicted = (motion != 0);
+    const OfxRectD fullSearchRect = searchRect;
+    if (predicted) {
+        // center the search area on the predicted position, and shrink its margins around the pattern
+        const double mx1 = std::min(refRect.x1 - searchRect.x1, std::max(kTrackerPredictiveMinMargin, (refRect.x1 - searchRect.x1) * kTrackerPredictiveSearchScale));
+        const double mx2 = std::min(searchRect.x2 - refRect.x2, std::max(kTrackerPredictiveMinMargin, (searchRect.x2 - refRect.x2) * kTrackerPredictiveSearchScale));
+        const double my1 = std::min(refRect.y1 - searchRect.y1, std::max(kTrackerPredictiveMinMargin, (refRect.y1 - searchRect.y1) * kTrackerPredictiveSearchScale));
+        const double my2 = std::min(searchRect.y2 - refRect.y2, std::max(kTrackerPredictiveMinMargin, (searchRect.y2 - refRect.y2) * kTrackerPredictiveSearchScale));
+        searchRect.x1 = motion->x + refRect.x1 - mx1;
+        searchRect.x2 = motion->x + refRect.x2 + mx2;
+        searchRect.y1 = motion->y + refRect.y1 - my1;
+        searchRect.y2 = motion->y + refRect.y2 + my2;
+    }
 
-    std::auto_ptr<const OFX::Image> srcRef(srcClip_->fetchImage(refTime, refBounds));
-    std::auto_ptr<const OFX::Image> srcOther(srcClip_->fetchImage(otherTime, otherBounds));
-    if (!srcRef.get() || !srcOther.get()) {
-        return;
+    // the pattern extracted by the predicted search, for the full search if the prediction fails
+    TrackerPMPattern pattern;
+    const TrackerPMPattern* refPattern = 0;
+
+    std::auto_ptr<const OFX::Image> srcRef;
+    if (prevImg.get() && prevTime == refTime) {
+        // reuse the image searched at the previous step if it contains the pattern
+        // (or the part of the pattern that is inside the image)
+        OfxRectI refBoundsPixel;
+        const OfxPointD rsOne = {1., 1.};
+        OFX::MergeImages2D::toPixelEnclosing(refBounds, rsOne, srcClip_->getPixelAspectRatio(), &refBoundsPixel);
+        OFX::MergeImages2D::rectIntersection(refBoundsPixel, prevImg->getRegionOfDefinition(), &refBoundsPixel);
+        const OfxRectI& prevBounds = prevImg->getBounds();
+        if (prevBounds.x1 <= refBoundsPixel.x1 && refBoundsPixel.x2 <= prevBounds.x2 &&
+            prevBounds.y1 <= refBoundsPixel.y1 && refBoundsPixel.y2 <= prevBounds.y2) {
+            srcRef = prevImg;
+        }
     }
-    // renderScale should never be something else than 1 when called from ActionInstanceChanged
-    if ((srcRef->getPixelDepth() != srcOther->getPixelDepth()) ||
-        (srcRef->getPixelComponents() != srcOther->getPixelComponents()) ||
-        srcRef->getRenderScale().x != 1. || srcRef->getRenderScale().y != 1 ||
-        srcOther->getRenderScale().x != 1. || srcOther->getRenderScale().y != 1) {
-        OFX::throwSuiteStatusException(kOfxStatErrImageFormat);
+    prevImg.reset(0);
+    if (!srcRef.get()) {
+        srcRef.reset(srcClip_->fetchImage(refTime, refBounds));
+        if (!srcRef.get()) {
+            return false;
+        }
     }
 
-    OFX::BitDepthEnum srcBitDepth = srcRef->getPixelDepth();
-    
     // auto ptr for the mask.
     std::auto_ptr<OFX::Image> mask((getContext() != OFX::eContextFilter) ? maskClip_->fetchImage(refTime) : 0);
 
-    OfxRectD trackSearchBounds;
-    getTrackSearchBounds(refRect, refCenter, searchRect, &trackSearchBounds);
-
-    switch (srcBitDepth) {
-        case OFX::eBitDepthUByte: {
-            trackInternalForDepth<unsigned char, nComponents, 255>(refTime, refBounds, refCenter, srcRef.get(), mask.get(), otherTime, trackSearchBounds, srcOther.get());
-        }   break;
-        case OFX::eBitDepthUShort: {
-            trackInternalForDepth<unsigned short, nComponents, 65535>(refTime, refBounds, refCenter, srcRef.get(), mask.get(), otherTime, trackSearchBounds, srcOther.get());
-        }   break;
-        case OFX::eBitDepthFloat: {
-            trackInternalForDepth<float, nComponents, 1>(refTime, refBounds, refCenter, srcRef.get(), mask.get(), otherTime, trackSearchBounds, srcOther.get());
-        }   break;
-        default:
-            OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
+    for (;;) {
+        OfxRectD otherBounds;
+        getOtherBounds(refCenter, searchRect, &otherBounds);
+
+        std::auto_ptr<const OFX::Image> srcOther(srcClip_->fetchImage(otherTime, otherBounds));
+        if (!srcOther.get()) {
+            return false;
+        }
+        // renderScale should never be something else than 1 when called from ActionInstanceChanged
+        if ((srcRef.get() && ((srcRef->getPixelDepth() != srcOther->getPixelDepth()) ||
+                              (srcRef->getPixelComponents() != srcOther->getPixelComponents()) ||
+                              srcRef->getRenderScale().x != 1. || srcRef->getRenderScale().y != 1)) ||
+            srcOther->getRenderScale().x != 1. || srcOther->getRenderScale().y != 1) {
+            OFX::throwSuiteStatusException(kOfxStatErrImageFormat);
+        }
+
+        OFX::BitDepthEnum srcBitDepth = srcOther->getPixelDepth();
+
+        OfxRectD trackSearchBounds;
+        getTrackSearchBounds(refRect, refCenter, searchRect, &trackSearchBounds);
+
+        bool tracked = false;
+        bool onBorder = false;
+        switch (srcBitDepth) {
+            case OFX::eBitDepthUByte: {
+                tracked = trackInternalForDepth<unsigned char, nComponents, 255>(refTime, refBounds, refCenter, srcRef.get(), mask.get(), refPattern, predicted ? &pattern : 0, otherTime, trackSearchBounds, srcOther.get(), predicted, &onBorder);
+            }   break;
+            case OFX::eBitDepthUShort: {
+                tracked = trackInternalForDepth<unsigned short, nComponents, 65535>(refTime, refBounds, refCenter, srcRef.get(), mask.get(), refPattern, predicted ? &pattern : 0, otherTime, trackSearchBounds, srcOther.get(), predicted, &onBorder);
+            }   break;
+            case OFX::eBitDepthFloat: {
+                tracked = trackInternalForDepth<float, nComponents, 1>(refTime, refBounds, refCenter, srcRef.get(), mask.get(), refPattern, predicted ? &pattern : 0, otherTime, trackSearchBounds, srcOther.get(), predicted, &onBorder);
+            }   break;
+            default:
+                OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
+        }
+
+        if (onBorder && !abort()) {
+            // the prediction failed, search the full area around the previous position
+            assert(predicted);
+            predicted = false;
+            searchRect = fullSearchRect;
+            // the first search extracted the pattern, since it was processed
+            if (!refPattern) {
+                refPattern = &pattern;
+                srcRef.reset(0);
+                mask.reset(0);
+            }
+            continue;
+        }
+
+        // keep the searched image for the next step
+        prevImg = srcOther;
+        prevTime = otherTime;
+        return tracked;
     }
 }
 
@@ -878,6 +1756,28 @@ void TrackerPMPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
         param->setDefault((int)eTrackerSAD);
         page->addChild(*param);
     }
+
+    // coarseToFine
+    {
+        BooleanParamDescriptor* param = desc.defineBooleanParam(kParamCoarseToFine);
+        param->setLabels(kParamCoarseToFineLabel, kParamCoarseToFineLabel, kParamCoarseToFineLabel);
+        param->setHint(kParamCoarseToFineHint);
+        param->setDefault(false);
+        page->addChild(*param);
+    }
+
+    // motionModel
+    {
+        ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamMotionModel);
+        param->setLabels(kParamMotionModelLabel, kParamMotionModelLabel, kParamMotionModelLabel);
+        param->setHint(kParamMotionModelHint);
+        assert(param->getNOptions() == eTrackerMotionModelNone);
+        param->appendOption(kParamMotionModelOptionNone, kParamMotionModelOptionNoneHint);
+        assert(param->getNOptions() == eTrackerMotionModelConstantVelocity);
+        param->appendOption(kParamMotionModelOptionConstantVelocity, kParamMotionModelOptionConstantVelocityHint);
+        param->setDefault((int)eTrackerMotionModelNone);
+        page->addChild(*param);
+    }
 }
 
 
@@ -76,18 +76,26 @@
    library, that action is never called by the Nuke host, so it cannot be tested.
    The code is left here for reference or for further extension.
 
-   There is also an open question about how the last plugin in a transform chain
-   may get the concatenated transform from upstream, the untransformed source image,
-   concatenate its own transform and apply the resulting transform in its render
-   action. Should the host be doing this instead?
+   If the host concatenates the transforms, the source image may come with the
+   upstream transform attached to it (kFnOfxImageEffectCanTransform). The render
+   paths that bypass the generic Transform3x3 render compose that matrix with
+   their own transform (see transformComposeSourceTransform), but no host could
+   be found that exercises this, so it is untested as well.
 */
 // Uncomment the following to enable the experimental host transform code.
 #define ENABLE_HOST_TRANSFORM
 
 #include "Transform.h"
 #include "ofxsTransform3x3.h"
+#include "ofxsFilter.h"
+#include "ofxsMaskMix.h"
+#include "ofxsProcessing.H"
+#include "TransformFastPath.h"
 
 #include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <vector>
 #include <iostream>
 #ifdef _WINDOWS
 #include <windows.h>
@@ -158,17 +166,304 @@ static double fround(double val, double pscale)
     return pscale10 * std::floor(val/pscale10 + 0.5);
 }
 
+// Fast paths for axis-aligned transforms (rotate=0, skew=0), which are by far
+// the most common use of Transform (reformat, repositioning).
+// The filter taps that fall outside of the source image are handled like the
+// generic resampler does: they are black if blackOutside is set, and clamped
+// to the source bounds otherwise.
 
+// the source taps of each destination column (or row) of the render window.
+// Taps are clamped to the source bounds, and a tap that falls outside of the
+// source has a zero weight if the image is black outside.
+struct TransformFastPathTable
+{
+    std::vector<int> src0;
+    std::vector<int> src1;
+    std::vector<float> weight0;
+    std::vector<float> weight1;
+};
+
+class TransformFastPathProcessorBase : public OFX::ImageProcessor
+{
+protected:
+    const OFX::Image *_srcImg;
+    // tables indexed from the render window origin
+    const TransformFastPathTable *_tableX;
+    const TransformFastPathTable *_tableY;
+    // the part of the render window where all the filter taps fall inside the source
+    OfxRectI _inside;
+
+public:
+    TransformFastPathProcessorBase(OFX::ImageEffect &instance)
+    : OFX::ImageProcessor(instance)
+    , _srcImg(0)
+    , _tableX(0)
+    , _tableY(0)
+    {
+        _inside.x1 = _inside.y1 = _inside.x2 = _inside.y2 = 0;
+    }
+
+    void setSrcImg(const OFX::Image *v) {_srcImg = v;}
+
+    void setTables(const TransformFastPathTable* tableX, const TransformFastPathTable* tableY, const OfxRectI& inside)
+    {
+        _tableX = tableX;
+        _tableY = tableY;
+        _inside = inside;
+    }
+};
+
+// integer translation: the result is an exact copy of the source rows
+template <class PIX, int nComponents>
+class TransformTranslateProcessor : public TransformFastPathProcessorBase
+{
+public:
+    TransformTranslateProcessor(OFX::ImageEffect &instance)
+    : TransformFastPathProcessorBase(instance)
+    {}
+
+private:
+    void multiThreadProcessImages(OfxRectI procWindow)
+    {
+        // [x1,x2) is copied with a single memcpy, the columns on each side pixel by pixel
+        const int x1 = std::max(procWindow.x1, std::min(_inside.x1, procWindow.x2));
+        const int x2 = std::max(x1, std::min(_inside.x2, procWindow.x2));
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if (_effect.abort()) {
+                break;
+            }
+            const int j = y - _renderWindow.y1;
+            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+            assert(dstPix);
+            if (_tableY->weight0[j] == 0.f) {
+                std::memset(dstPix, 0, (procWindow.x2 - procWindow.x1) * nComponents * sizeof(PIX));
+                continue;
+            }
+            const int sy = _tableY->src0[j];
+            for (int x = procWindow.x1; x < x1; ++x, dstPix += nComponents) {
+                copyPixel(x, sy, dstPix);
+            }
+            if (x1 < x2) {
+                const PIX *srcPix = (const PIX *) _srcImg->getPixelAddress(_tableX->src0[x1 - _renderWindow.x1], sy);
+                assert(srcPix);
+                std::memcpy(dstPix, srcPix, (x2 - x1) * nComponents * sizeof(PIX));
+                dstPix += (x2 - x1) * nComponents;
+            }
+            for (int x = x2; x < procWindow.x2; ++x, dstPix += nComponents) {
+                copyPixel(x, sy, dstPix);
+            }
+        }
+    }
+
+    void copyPixel(int x, int sy, PIX *dstPix)
+    {
+        const int i = x - _renderWindow.x1;
+        if (_tableX->weight0[i] == 0.f) {
+            for (int c = 0; c < nComponents; ++c) {
+                dstPix[c] = 0;
+            }
+            return;
+        }
+        const PIX *srcPix = (const PIX *) _srcImg->getPixelAddress(_tableX->src0[i], sy);
+        assert(srcPix);
+        for (int c = 0; c < nComponents; ++c) {
+            dstPix[c] = srcPix[c];
+        }
+    }
+};
+
+// scale + translate: separable two-pass resampling with precomputed weights.
+// filter is eFilterImpulse or eFilterBilinear, which are exactly separable.
+template <class PIX, int nComponents, int maxValue, OFX::FilterEnum filter>
+class TransformSeparableProcessor : public TransformFastPathProcessorBase
+{
+public:
+    TransformSeparableProcessor(OFX::ImageEffect &instance)
+    : TransformFastPathProcessorBase(instance)
+    {}
+
+private:
+    void multiThreadProcessImages(OfxRectI procWindow)
+    {
+        const int width = procWindow.x2 - procWindow.x1;
+        const int height = procWindow.y2 - procWindow.y1;
+        const int i0 = procWindow.x1 - _renderWindow.x1;
+        const int j0 = procWindow.y1 - _renderWindow.y1;
+        const int *srcX0 = &_tableX->src0[i0];
+        const int *srcX1 = &_tableX->src1[i0];
+        const float *weightX0 = &_tableX->weight0[i0];
+        const float *weightX1 = &_tableX->weight1[i0];
+        const int *srcY0 = &_tableY->src0[j0];
+        const int *srcY1 = &_tableY->src1[j0];
+        const float *weightY0 = &_tableY->weight0[j0];
+        const float *weightY1 = &_tableY->weight1[j0];
+
+        // the source rows read by the second pass (the row mapping may be flipped, and
+        // scaling down skips rows). rowIndex gives their position in tmp, or -1.
+        int sy1 = srcY0[0];
+        int sy2 = srcY0[0];
+        for (int j = 0; j < height; ++j) {
+            sy1 = std::min(sy1, std::min(srcY0[j], srcY1[j]));
+            sy2 = std::max(sy2, std::max(srcY0[j], srcY1[j]));
+        }
+        ++sy2;
+        std::vector<int> rowIndex(sy2 - sy1, -1);
+        int nRows = 0;
+        for (int j = 0; j < height; ++j) {
+            if (weightY0[j] != 0.f && rowIndex[srcY0[j] - sy1] < 0) {
+                rowIndex[srcY0[j] - sy1] = nRows++;
+            }
+            if (weightY1[j] != 0.f && rowIndex[srcY1[j] - sy1] < 0) {
+                rowIndex[srcY1[j] - sy1] = nRows++;
+            }
+        }
+
+        // first pass: resample the needed source rows horizontally
+        std::vector<float> tmp((size_t)nRows * width * nComponents);
+        const OfxRectI& srcBounds = _srcImg->getBounds();
+        for (int sy = sy1; sy < sy2; ++sy) {
+            if (_effect.abort()) {
+                return;
+            }
+            if (rowIndex[sy - sy1] < 0) {
+                continue;
+            }
+            const PIX *srcRow = (const PIX *) _srcImg->getPixelAddress(srcBounds.x1, sy);
+            assert(srcRow);
+            float *tmpPix = &tmp[(size_t)rowIndex[sy - sy1] * width * nComponents];
+            for (int i = 0; i < width; ++i, tmpPix += nComponents) {
+                const PIX *p0 = srcRow + (srcX0[i] - srcBounds.x1) * nComponents;
+                const float w0 = weightX0[i];
+                if (filter == OFX::eFilterImpulse) {
+                    for (int c = 0; c < nComponents; ++c) {
+                        tmpPix[c] = w0 * p0[c];
+                    }
+                } else {
+                    const PIX *p1 = srcRow + (srcX1[i] - srcBounds.x1) * nComponents;
+                    const float w1 = weightX1[i];
+                    for (int c = 0; c < nComponents; ++c) {
+                        tmpPix[c] = w0 * p0[c] + w1 * p1[c];
+                    }
+                }
+            }
+        }
 
+        // second pass: resample vertically into the destination
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if (_effect.abort()) {
+                return;
+            }
+            const int j = y - procWindow.y1;
+            const float w0 = weightY0[j];
+            const float w1 = weightY1[j];
+            const float *t0 = (w0 != 0.f) ? &tmp[(size_t)rowIndex[srcY0[j] - sy1] * width * nComponents] : 0;
+            const float *t1 = (w1 != 0.f) ? &tmp[(size_t)rowIndex[srcY1[j] - sy1] * width * nComponents] : 0;
+            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+            assert(dstPix);
+            for (int i = 0; i < width * nComponents; ++i) {
+                dstPix[i] = transformFloatToPix<PIX, maxValue>((t0 ? w0 * t0[i] : 0.f) + (t1 ? w1 * t1[i] : 0.f));
+            }
+        }
+    }
+};
+
+// compute the source taps of an axis-aligned mapping s = scale * (d + 0.5) + offset
+// over [d1,d2), clamped to [b1,b2), and return the sub-range [*inside1,*inside2) where
+// all taps are in [b1,b2).
+static void
+computeFastPathTable(int d1, int d2, double scale, double offset, OFX::FilterEnum filter, int b1, int b2, bool blackOutside,
+                     TransformFastPathTable* table, int* inside1, int* inside2)
+{
+    table->src0.resize(d2 - d1);
+    table->src1.resize(d2 - d1);
+    table->weight0.resize(d2 - d1);
+    table->weight1.resize(d2 - d1);
+    *inside1 = d2;
+    *inside2 = d1;
+    for (int d = d1; d < d2; ++d) {
+        double s = scale * (d + 0.5) + offset;
+        int s0;
+        float w1;
+        if (filter == OFX::eFilterImpulse) {
+            s0 = (int)std::floor(s);
+            w1 = 0.f;
+        } else {
+            s -= 0.5;
+            s0 = (int)std::floor(s);
+            w1 = (float)(s - s0);
+        }
+        const int s1 = (filter == OFX::eFilterImpulse) ? s0 : s0 + 1;
+        const bool in0 = (b1 <= s0 && s0 < b2);
+        const bool in1 = (b1 <= s1 && s1 < b2);
+        table->src0[d - d1] = std::max(b1, std::min(s0, b2 - 1));
+        table->src1[d - d1] = std::max(b1, std::min(s1, b2 - 1));
+        table->weight0[d - d1] = (in0 || !blackOutside) ? 1.f - w1 : 0.f;
+        table->weight1[d - d1] = (in1 || !blackOutside) ? w1 : 0.f;
+        if (in0 && in1) {
+            // the mapping is monotonic, so the inside range is contiguous
+            *inside1 = std::min(*inside1, d);
+            *inside2 = std::max(*inside2, d + 1);
+        }
+    }
+}
+
+// renders the render window with the processor matching the transform, see transformProcessForFormat()
+class TransformFastPathRenderer
+{
+public:
+    TransformFastPathRenderer(OFX::ImageEffect &effect, bool translate, OFX::FilterEnum filter,
+                              const OFX::Image* src, OFX::Image* dst, const OfxRectI& renderWindow,
+                              const TransformFastPathTable* tableX, const TransformFastPathTable* tableY, const OfxRectI& inside)
+    : _effect(effect)
+    , _translate(translate)
+    , _filter(filter)
+    , _src(src)
+    , _dst(dst)
+    , _renderWindow(renderWindow)
+    , _tableX(tableX)
+    , _tableY(tableY)
+    , _inside(inside)
+    {
+    }
+
+    template <class PIX, int nComponents, int maxValue>
+    void process()
+    {
+        std::auto_ptr<TransformFastPathProcessorBase> processor;
+        if (_translate) {
+            processor.reset(new TransformTranslateProcessor<PIX, nComponents>(_effect));
+        } else if (_filter == OFX::eFilterImpulse) {
+            processor.reset(new TransformSeparableProcessor<PIX, nComponents, maxValue, OFX::eFilterImpulse>(_effect));
+        } else {
+            processor.reset(new TransformSeparableProcessor<PIX, nComponents, maxValue, OFX::eFilterBilinear>(_effect));
+        }
+        processor->setDstImg(_dst);
+        processor->setSrcImg(_src);
+        processor->setTables(_tableX, _tableY, _inside);
+        processor->setRenderWindow(_renderWindow);
+        processor->process();
+    }
+
+private:
+    OFX::ImageEffect &_effect;
+    bool _translate;
+    OFX::FilterEnum _filter;
+    const OFX::Image *_src;
+    OFX::Image *_dst;
+    OfxRectI _renderWindow;
+    const TransformFastPathTable *_tableX;
+    const TransformFastPathTable *_tableY;
+    OfxRectI _inside;
+};
 
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
-class TransformPlugin : public Transform3x3Plugin
+class TransformPlugin : public TransformFastPathPlugin
 {
 public:
     /** @brief ctor */
     TransformPlugin(OfxImageEffectHandle handle, bool masked)
-    : Transform3x3Plugin(handle, masked)
+    : TransformFastPathPlugin(handle, masked)
     , _translate(0)
     , _rotate(0)
     , _scale(0)
@@ -177,6 +472,7 @@ public:
     , _skewY(0)
     , _skewOrder(0)
     , _center(0)
+    , _blackOutside(0)
     {
         // NON-GENERIC
         _translate = fetchDouble2DParam(kParamTranslate);
@@ -187,9 +483,16 @@ public:
         _skewY = fetchDoubleParam(kParamSkewY);
         _skewOrder = fetchChoiceParam(kParamSkewOrder);
         _center = fetchDouble2DParam(kParamCenter);
+
+        // GENERIC param used by the axis-aligned fast path
+        _blackOutside = fetchBooleanParam(kParamFilterBlackOutside);
+
     }
 
 private:
+    /* render using the axis-aligned fast path. Returns false if it does not apply */
+    virtual bool renderFastPath(const OFX::RenderArguments &args) OVERRIDE FINAL;
+
     virtual bool isIdentity(double time) OVERRIDE FINAL;
 
     virtual bool getInverseTransformCanonical(double time, bool invert, OFX::Matrix3x3* invtransform) const OVERRIDE FINAL;
@@ -210,8 +513,103 @@ private:
     OFX::DoubleParam* _skewY;
     OFX::ChoiceParam* _skewOrder;
     OFX::Double2DParam* _center;
+
+    // GENERIC
+    OFX::BooleanParam* _blackOutside;
 };
 
+bool
+TransformPlugin::renderFastPath(const OFX::RenderArguments &args)
+{
+    const double time = args.time;
+
+    if (!canBypassGenericRender(args)) {
+        return false;
+    }
+
+    OFX::FilterEnum filter = getFilter(time);
+    if (filter > OFX::eFilterRifman) {
+        // smoothing filters do not interpolate, even at integer positions
+        return false;
+    }
+
+    bool invert;
+    _invert->getValueAtTime(time, invert);
+    OFX::Matrix3x3 Hc;
+    if (!getInverseTransformCanonical(time, invert, &Hc)) {
+        return false;
+    }
+    // mapping from dst pixels to src pixels
+    OFX::Matrix3x3 H = transformPixelMatrix(Hc, srcClip_->getPixelAspectRatio(), dstClip_->getPixelAspectRatio(), args.renderScale);
+
+    const OfxRectI& renderWindow = args.renderWindow;
+    {
+        std::auto_ptr<const OFX::Image> src(srcClip_->fetchImage(time));
+        if (!src.get()) {
+            return false;
+        }
+        // the host may give us the untransformed upstream image, with its transform attached
+        if (!transformComposeSourceTransform(src.get(), &H)) {
+            return false;
+        }
+        if (H.b != 0. || H.d != 0. || H.g != 0. || H.h != 0. || H.i == 0.) {
+            return false;
+        }
+
+        // the axis-aligned mapping from dst pixels to src pixels, with pixel centers at +0.5:
+        // src = scale * (dst + 0.5) + offset
+        const double scaleX = H.a / H.i;
+        const double scaleY = H.e / H.i;
+        const double offsetX = H.c / H.i;
+        const double offsetY = H.f / H.i;
+
+        const double eps = 1e-6;
+        const bool translate = (std::fabs(scaleX - 1.) < eps && std::fabs(scaleY - 1.) < eps &&
+                                std::fabs(offsetX - std::floor(offsetX + 0.5)) < eps &&
+                                std::fabs(offsetY - std::floor(offsetY + 0.5)) < eps);
+        if (!translate) {
+            if (filter != OFX::eFilterImpulse && filter != OFX::eFilterBilinear) {
+                return false;
+            }
+        } else {
+            // at integer positions, all interpolating filters reduce to the impulse filter
+            filter = OFX::eFilterImpulse;
+        }
+
+        std::auto_ptr<OFX::Image> dst(dstClip_->fetchImage(time));
+        if (!dst.get()) {
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+        if (dst->getRenderScale().x != args.renderScale.x ||
+            dst->getRenderScale().y != args.renderScale.y ||
+            dst->getField() != args.fieldToRender) {
+            setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+        if (src->getPixelDepth() != dst->getPixelDepth() || src->getPixelComponents() != dst->getPixelComponents()) {
+            return false;
+        }
+
+        const OfxRectI& srcBounds = src->getBounds();
+        if (srcBounds.x1 >= srcBounds.x2 || srcBounds.y1 >= srcBounds.y2) {
+            return false;
+        }
+        bool blackOutside;
+        _blackOutside->getValueAtTime(time, blackOutside);
+        TransformFastPathTable tableX, tableY;
+        OfxRectI inside;
+        computeFastPathTable(renderWindow.x1, renderWindow.x2, translate ? 1. : scaleX, offsetX, filter,
+                             srcBounds.x1, srcBounds.x2, blackOutside, &tableX, &inside.x1, &inside.x2);
+        computeFastPathTable(renderWindow.y1, renderWindow.y2, translate ? 1. : scaleY, offsetY, filter,
+                             srcBounds.y1, srcBounds.y2, blackOutside, &tableY, &inside.y1, &inside.y2);
+
+        TransformFastPathRenderer renderer(*this, translate, filter, src.get(), dst.get(), renderWindow, &tableX, &tableY, inside);
+        transformProcessForFormat(dst.get(), renderer);
+    }
+
+    return true;
+}
+
 // overridden is identity
 bool
 TransformPlugin::isIdentity(double time)
@@ -1535,6 +1933,12 @@ void TransformPluginDescribeInContext(OFX::ImageEffectDescriptor &desc, OFX::Con
         param->setHint(kParamResetCenterHint);
         page->addChild(*param);
     }
+
+    // prefilter
+    mipmapDescribeInContext(desc, page);
+
+    // adaptiveMotionBlur, shutterCurve
+    transformMotionBlurDescribeInContext(desc, page);
 }
 
 void TransformPluginFactory::describe(OFX::ImageEffectDescriptor &desc)